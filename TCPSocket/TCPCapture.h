@@ -0,0 +1,45 @@
+/*
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2018
+ *
+ * Capture of a TCPSocket's traffic, for replaying it offline with
+ * tcpsocket_replay (see TCPSocket::setCapture()).
+ *
+ * A capture starts with a tcp_capture_hdr_t, followed by a record for each
+ * read from or write to a client and each connect and disconnect, in the
+ * order they happened.  A read or write record is followed by the bytes that
+ * were read or written, so the capture holds the frames exactly as they were
+ * on the wire, split the way the socket saw them.
+ */
+
+#ifndef TCPCAPTURE_H
+#define TCPCAPTURE_H
+
+#include <Arduino.h>
+
+#define TCPCAPTURE_START (uint32_t)0x43504354 // "TCPC"
+#define TCPCAPTURE_VERSION 1
+typedef struct __attribute__((__packed__)) {
+  uint32_t start;          // 4B
+  byte     version;        // 1B
+  byte     recordSize;     // 1B, size of each record header
+  uint16_t address;        // 2B, socket address of the capturing socket
+  uint16_t recvBufferSize; // 2B, its receive buffer size
+  uint16_t reserved;       // 2B
+} tcp_capture_hdr_t;  // Total: 12B
+
+/* Record types */
+#define TCPCAPTURE_RECV       0 // Data read from the client
+#define TCPCAPTURE_SEND       1 // Data written to the client
+#define TCPCAPTURE_CONNECT    2 // Client accepted, no data
+#define TCPCAPTURE_DISCONNECT 3 // Client released, no data
+
+typedef struct __attribute__((__packed__)) {
+  uint32_t micros;   // 4B
+  byte     client;   // 1B, connection slot
+  byte     type;     // 1B
+  uint16_t length;   // 2B, bytes of data that follow
+} tcp_capture_record_t;  // Total: 8B
+
+#endif // TCPCAPTURE_H
@@ -0,0 +1,223 @@
+/*
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2018
+ */
+
+#include "TCPCompact.h"
+
+static uint8_t encodeAddress(socket_addr_t address, uint8_t *out) {
+  uint8_t len = 0;
+  while (address >= 0x80) {
+    out[len++] = (address & 0x7F) | 0x80;
+    address >>= 7;
+  }
+  out[len++] = address;
+  return len;
+}
+
+static int decodeAddress(const uint8_t *in, uint16_t len,
+                         socket_addr_t *address) {
+  uint32_t value = 0;
+  for (uint8_t i = 0; (i < len) && (i < 3); i++) {
+    value |= (uint32_t)(in[i] & 0x7F) << (7 * i);
+    if ((in[i] & 0x80) == 0) {
+      if (value > 0xFFFF) {
+        return -1;
+      }
+      *address = value;
+      return i + 1;
+    }
+  }
+  return -1;
+}
+
+/**
+ * Write the control byte and the header fields that differ from the previous
+ * frame, and update the state to this frame.
+ *
+ * @return Number of bytes written, at most TCPCOMPACT_MAX_HDR
+ */
+uint8_t TCPCompact::encodeHeader(tcp_compact_state_t *state, byte ID,
+                                 byte flags, socket_addr_t source,
+                                 socket_addr_t address, uint8_t *out) {
+  uint8_t control = TCPCOMPACT_MARK;
+  uint8_t len = 1;
+
+  if (ID != (byte)(state->ID + 1)) {
+    control |= TCPCOMPACT_ID;
+    out[len++] = ID;
+  }
+  if (flags != 0) {
+    control |= TCPCOMPACT_FLAGS;
+    out[len++] = flags;
+  }
+  if (source != state->source) {
+    control |= TCPCOMPACT_SOURCE;
+    len += encodeAddress(source, &out[len]);
+  }
+  if (address != state->address) {
+    control |= TCPCOMPACT_ADDRESS;
+    len += encodeAddress(address, &out[len]);
+  }
+  out[0] = control;
+
+  state->ID = ID;
+  state->source = source;
+  state->address = address;
+  return len;
+}
+
+/**
+ * Read the header of a decoded frame, updating the state to the frame's
+ * fields.  The state is unchanged if the header is invalid.
+ *
+ * @return Size of the header, or -1 if it is invalid
+ */
+int TCPCompact::decodeHeader(tcp_compact_state_t *state, const uint8_t *in,
+                             uint16_t len, byte *flags) {
+  tcp_compact_state_t next;
+  uint16_t pos = 1;
+  int result;
+
+  if ((len < 1) || ((in[0] & TCPCOMPACT_MARK_MASK) != TCPCOMPACT_MARK)) {
+    return -1;
+  }
+  uint8_t control = in[0];
+
+  next.ID = state->ID + 1;
+  if (control & TCPCOMPACT_ID) {
+    if (pos >= len) {
+      return -1;
+    }
+    next.ID = in[pos++];
+  }
+
+  *flags = 0;
+  if (control & TCPCOMPACT_FLAGS) {
+    if (pos >= len) {
+      return -1;
+    }
+    *flags = in[pos++];
+  }
+
+  next.source = state->source;
+  if (control & TCPCOMPACT_SOURCE) {
+    result = decodeAddress(&in[pos], len - pos, &next.source);
+    if (result < 0) {
+      return -1;
+    }
+    pos += result;
+  }
+
+  next.address = state->address;
+  if (control & TCPCOMPACT_ADDRESS) {
+    result = decodeAddress(&in[pos], len - pos, &next.address);
+    if (result < 0) {
+      return -1;
+    }
+    pos += result;
+  }
+
+  *state = next;
+  return pos;
+}
+
+/**
+ * Byte stuff a header and data, followed by the frame delimiter.  The output
+ * must have room for maxEncoded(hdrLen + len) + 1 bytes.
+ *
+ * @return Number of bytes written
+ */
+uint16_t TCPCompact::encode(const uint8_t *hdr, uint8_t hdrLen,
+                            const uint8_t *data, uint16_t len, uint8_t *out) {
+  uint16_t codePos = 0;
+  uint16_t pos = 1;
+  uint8_t code = 1;
+
+  for (uint32_t i = 0; i < (uint32_t)hdrLen + len; i++) {
+    uint8_t value = (i < hdrLen) ? hdr[i] : data[i - hdrLen];
+    if (value == 0) {
+      out[codePos] = code;
+      codePos = pos++;
+      code = 1;
+      continue;
+    }
+
+    out[pos++] = value;
+    if (++code == 0xFF) {
+      out[codePos] = code;
+      codePos = pos++;
+      code = 1;
+    }
+  }
+
+  out[codePos] = code;
+  out[pos++] = TCPCOMPACT_DELIMITER;
+  return pos;
+}
+
+void TCPCompact::beginDecode(uint8_t *out, uint16_t max) {
+  decoded = out;
+  decodedMax = max;
+  decodedLen = 0;
+  code = 0;
+  remaining = 0;
+}
+
+/**
+ * Decode the next piece of a frame
+ *
+ * @return false if the data is invalid or too large for the output
+ */
+bool TCPCompact::decode(const uint8_t *in, uint16_t len) {
+  if (decoded == nullptr) {
+    return false;
+  }
+
+  uint16_t i = 0;
+  while (i < len) {
+    if (remaining == 0) {
+      /* Start of a block, which follows a zero unless the last was full */
+      if (in[i] == TCPCOMPACT_DELIMITER) {
+        goto INVALID;
+      }
+      if ((code != 0) && (code != 0xFF)) {
+        if (decodedLen >= decodedMax) {
+          goto INVALID;
+        }
+        decoded[decodedLen++] = 0;
+      }
+      code = in[i++];
+      remaining = code - 1;
+      continue;
+    }
+
+    uint16_t run = len - i;
+    if (run > remaining) {
+      run = remaining;
+    }
+    if (decodedLen + run > decodedMax) {
+      goto INVALID;
+    }
+    memcpy(&decoded[decodedLen], &in[i], run);
+    decodedLen += run;
+    remaining -= run;
+    i += run;
+  }
+  return true;
+
+INVALID:
+  decoded = nullptr;
+  return false;
+}
+
+/**
+ * @return Length of the decoded frame, or -1 if it was invalid or incomplete
+ */
+int TCPCompact::endDecode() {
+  if ((decoded == nullptr) || (code == 0) || (remaining != 0)) {
+    return -1;
+  }
+  return decodedLen;
+}
@@ -0,0 +1,85 @@
+/*
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2018
+ *
+ * Compact framing for TCPSocket, used in place of the fixed headers once both
+ * ends of a connection have agreed to it.
+ *
+ * A compact frame is a control byte, the header fields that differ from those
+ * expected, and the message data.  Each frame is byte stuffed using COBS
+ * (Consistent Overhead Byte Stuffing) so that it contains no zero bytes, and
+ * is followed by a zero delimiter.  Any data can therefore be resynchronized
+ * by skipping to the next zero, and the length of a frame is implied by the
+ * position of its delimiter rather than sent.
+ *
+ * Fields left out of a frame take their values from the previous frame in the
+ * same direction: the same source and address, and the next ID.  Flags are 0
+ * unless present.  Addresses are sent as variable-length integers of 7 bits
+ * per byte, so those below 128 take a single byte.
+ *
+ * A two-byte message sent to the same address as the previous one is 5 bytes
+ * on the wire, compared to 14 with a version 1 header.
+ */
+
+#ifndef TCPCOMPACT_H
+#define TCPCOMPACT_H
+
+#include <Arduino.h>
+
+#include "Socket.h"
+
+#define TCPCOMPACT_DELIMITER 0x00
+
+/* Control byte */
+#define TCPCOMPACT_ID       0x01 // ID is present
+#define TCPCOMPACT_FLAGS    0x02 // Flags are present
+#define TCPCOMPACT_SOURCE   0x04 // Source address is present
+#define TCPCOMPACT_ADDRESS  0x08 // Destination address is present
+#define TCPCOMPACT_MARK     0x80 // Upper bits are always this value
+#define TCPCOMPACT_MARK_MASK 0xF0
+
+/* Largest control byte and header fields */
+#define TCPCOMPACT_MAX_HDR (1 + 1 + 1 + 3 + 3)
+
+/* Header fields of the previous frame in one direction */
+typedef struct {
+  byte          ID;
+  socket_addr_t source;
+  socket_addr_t address;
+} tcp_compact_state_t;
+
+class TCPCompact {
+public:
+  /* Header fields */
+  static uint8_t encodeHeader(tcp_compact_state_t *state, byte ID, byte flags,
+                              socket_addr_t source, socket_addr_t address,
+                              uint8_t *out);
+  static int decodeHeader(tcp_compact_state_t *state, const uint8_t *in,
+                          uint16_t len, byte *flags);
+
+  /* Byte stuffed size of len bytes, excluding the delimiter */
+  static constexpr uint16_t maxEncoded(uint16_t len) {
+    return len + len / 254 + 1;
+  }
+
+  static uint16_t encode(const uint8_t *hdr, uint8_t hdrLen,
+                         const uint8_t *data, uint16_t len, uint8_t *out);
+
+  /*
+   * Decoding of a byte stuffed frame, which may be passed in pieces.  The
+   * frame's delimiter must not be included.
+   */
+  void beginDecode(uint8_t *out, uint16_t max);
+  bool decode(const uint8_t *in, uint16_t len);
+  int endDecode();
+
+private:
+  uint8_t *decoded;
+  uint16_t decodedMax;
+  uint16_t decodedLen;
+  uint8_t code;      // Code of the current block
+  uint8_t remaining; // Bytes of the current block not yet decoded
+};
+
+#endif // TCPCOMPACT_H
@@ -0,0 +1,207 @@
+/*
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2018
+ */
+
+#include "TCPCompress.h"
+
+#define MAX_LITERAL 32
+#define LONG_MATCH  7
+
+/* Decoder states, for tokens split across pieces */
+#define STATE_CONTROL 0
+#define STATE_LITERAL 1
+#define STATE_LENGTH  2
+#define STATE_OFFSET  3
+#define STATE_ERROR   4
+
+static inline uint16_t hashPosition(const uint8_t *p) {
+  uint32_t value = ((uint32_t)p[0] << 16) | ((uint32_t)p[1] << 8) | p[2];
+  return (value * 2654435761u) >> (32 - TCPCOMPRESS_TABLE_BITS);
+}
+
+/* Write a run of literals, as many tokens as needed */
+static bool writeLiterals(const uint8_t *in, uint16_t len, uint8_t *out,
+                          uint16_t *pos, uint16_t max) {
+  while (len > 0) {
+    uint16_t run = (len > MAX_LITERAL) ? MAX_LITERAL : len;
+    if (*pos + 1 + run > max) {
+      return false;
+    }
+    out[(*pos)++] = run - 1;
+    memcpy(&out[*pos], in, run);
+    *pos += run;
+    in += run;
+    len -= run;
+  }
+  return true;
+}
+
+/**
+ * Compress data, finding repeats by looking up the previous position of each
+ * three byte sequence in the table.
+ *
+ * @return Compressed length, or 0 if it would be larger than max
+ */
+uint16_t TCPCompress::compress(const uint8_t *in, uint16_t len, uint8_t *out,
+                               uint16_t max, uint16_t *table) {
+  uint16_t pos = 0;
+  uint16_t literal = 0; // Start of the literals not yet written
+  uint16_t i = 0;
+
+  /* Entries are the position plus one, so that 0 is empty */
+  memset(table, 0, TCPCOMPRESS_TABLE_SIZE * sizeof (uint16_t));
+
+  while (i + 2 < len) {
+    uint16_t hash = hashPosition(&in[i]);
+    uint16_t ref = table[hash];
+    table[hash] = i + 1;
+
+    if ((ref == 0) || (i - (ref - 1) > MAX_OFFSET)) {
+      i++;
+      continue;
+    }
+    ref--;
+    if ((in[ref] != in[i]) || (in[ref + 1] != in[i + 1]) ||
+        (in[ref + 2] != in[i + 2])) {
+      i++;
+      continue;
+    }
+
+    uint16_t limit = len - i;
+    if (limit > MAX_MATCH) {
+      limit = MAX_MATCH;
+    }
+    uint16_t match = 3;
+    while ((match < limit) && (in[ref + match] == in[i + match])) {
+      match++;
+    }
+
+    if (!writeLiterals(&in[literal], i - literal, out, &pos, max) ||
+        (pos + 3 > max)) {
+      return 0;
+    }
+
+    uint16_t offset = i - ref - 1;
+    uint16_t length = match - 2;
+    if (length < LONG_MATCH) {
+      out[pos++] = (length << 5) | (offset >> 8);
+    } else {
+      out[pos++] = (LONG_MATCH << 5) | (offset >> 8);
+      out[pos++] = length - LONG_MATCH;
+    }
+    out[pos++] = offset & 0xFF;
+
+    /* Record the positions within the match for later references */
+    uint16_t end = i + match;
+    for (i++; (i < end) && (i + 2 < len); i++) {
+      table[hashPosition(&in[i])] = i + 1;
+    }
+    i = end;
+    literal = end;
+  }
+
+  if (!writeLiterals(&in[literal], len - literal, out, &pos, max)) {
+    return 0;
+  }
+  return pos;
+}
+
+/**
+ * Start decompressing into a buffer of max bytes
+ */
+void TCPCompress::beginDecompress(uint8_t *out, uint16_t max) {
+  decompressed = out;
+  decompressedMax = max;
+  decompressedLen = 0;
+  state = STATE_CONTROL;
+}
+
+/**
+ * Decompress the next piece of the compressed data
+ *
+ * @return false if the data is invalid or decompresses to more than the
+ *         buffer holds
+ */
+bool TCPCompress::decompress(const uint8_t *in, uint16_t len) {
+  uint16_t pos = 0;
+
+  while (pos < len) {
+    switch (state) {
+      case STATE_CONTROL: {
+        control = in[pos++];
+        if (control < MAX_LITERAL) {
+          remaining = control + 1;
+          state = STATE_LITERAL;
+        } else {
+          remaining = (control >> 5) + 2;
+          state = ((control >> 5) == LONG_MATCH) ? STATE_LENGTH : STATE_OFFSET;
+        }
+        break;
+      }
+
+      case STATE_LITERAL: {
+        uint16_t run = len - pos;
+        if (run > remaining) {
+          run = remaining;
+        }
+        if (decompressedLen + run > decompressedMax) {
+          state = STATE_ERROR;
+          return false;
+        }
+        memcpy(&decompressed[decompressedLen], &in[pos], run);
+        decompressedLen += run;
+        pos += run;
+        remaining -= run;
+        if (remaining == 0) {
+          state = STATE_CONTROL;
+        }
+        break;
+      }
+
+      case STATE_LENGTH: {
+        remaining += in[pos++];
+        state = STATE_OFFSET;
+        break;
+      }
+
+      case STATE_OFFSET: {
+        uint16_t offset = (((control & 0x1F) << 8) | in[pos++]) + 1;
+        if ((offset > decompressedLen) ||
+            (decompressedLen + remaining > decompressedMax)) {
+          state = STATE_ERROR;
+          return false;
+        }
+
+        /* Copied a byte at a time, as the reference may overlap the output */
+        uint8_t *dst = &decompressed[decompressedLen];
+        const uint8_t *src = dst - offset;
+        for (uint16_t i = 0; i < remaining; i++) {
+          dst[i] = src[i];
+        }
+        decompressedLen += remaining;
+        state = STATE_CONTROL;
+        break;
+      }
+
+      default:
+        return false;
+    }
+  }
+
+  return true;
+}
+
+/**
+ * Finish decompression
+ *
+ * @return Length of the decompressed data, or -1 if it was invalid or ended
+ *         part way through a token
+ */
+int TCPCompress::endDecompress() {
+  if (state != STATE_CONTROL) {
+    return -1;
+  }
+  return decompressedLen;
+}
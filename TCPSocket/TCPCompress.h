@@ -0,0 +1,64 @@
+/*
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2018
+ *
+ * Compression of TCPSocket message data, for payloads such as pixel data and
+ * configuration that are highly repetitive.
+ *
+ * This is an LZ77 variant in the style of LZF, which needs no allocation and
+ * little state on either end.  Compressed data is a series of tokens, each
+ * starting with a control byte:
+ *
+ *   000nnnnn                    - Literal run, followed by n + 1 bytes
+ *   lllooooo [extra] oooooooo   - Back reference to data already output.
+ *                                 The length is l + 2, or extra + 9 when l
+ *                                 is 7, and the offset is o + 1, up to 8KB.
+ *
+ * A back reference may overlap the data it produces, so that a run of a
+ * repeated byte or pattern is a single token.
+ */
+
+#ifndef TCPCOMPRESS_H
+#define TCPCOMPRESS_H
+
+#include <Arduino.h>
+
+/* Size of the compressor's table of previous positions, as a power of two */
+#ifndef TCPCOMPRESS_TABLE_BITS
+  #define TCPCOMPRESS_TABLE_BITS 8
+#endif
+#define TCPCOMPRESS_TABLE_SIZE (1 << TCPCOMPRESS_TABLE_BITS)
+
+class TCPCompress {
+public:
+  /*
+   * Compress data using a table of TCPCOMPRESS_TABLE_SIZE entries provided by
+   * the caller, returning 0 if the result would exceed max bytes
+   */
+  static uint16_t compress(const uint8_t *in, uint16_t len, uint8_t *out,
+                           uint16_t max, uint16_t *table);
+
+  /*
+   * Decompression of data which may be passed in pieces, such as the
+   * segments of a ring buffer
+   */
+  void beginDecompress(uint8_t *out, uint16_t max);
+  bool decompress(const uint8_t *in, uint16_t len);
+  int endDecompress();
+
+  static const uint16_t MAX_OFFSET = 0x2000;
+  static const uint16_t MAX_MATCH = 7 + 0xFF + 2;
+
+private:
+  uint8_t *decompressed;
+  uint16_t decompressedMax;
+  uint16_t decompressedLen;
+
+  /* Token being decoded when a piece ends part way through it */
+  uint8_t state;
+  uint8_t control;
+  uint16_t remaining; // Literal bytes still to be copied, or match length
+};
+
+#endif // TCPCOMPRESS_H
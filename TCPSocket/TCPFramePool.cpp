@@ -0,0 +1,141 @@
+/*
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2018
+ */
+
+#include "TCPFramePool.h"
+
+TCPFramePool::TCPFramePool() {
+  storage = nullptr;
+  ownsStorage = false;
+  numFrames = 0;
+  size = 0;
+  for (uint16_t i = 0; i < MAP_WORDS; i++) {
+    freeMap[i] = 0;
+  }
+  freeFrames = 0;
+  minFree = 0;
+}
+
+TCPFramePool::~TCPFramePool() {
+  freeStorage();
+}
+
+void TCPFramePool::freeStorage() {
+  if (ownsStorage) {
+    free(storage);
+    ownsStorage = false;
+  }
+  storage = nullptr;
+  numFrames = 0;
+}
+
+/**
+ * Setup the pool's frames, which must not be in use
+ *
+ * @param frames    Number of frames, at most TCPFRAMEPOOL_MAX_FRAMES
+ * @param frameSize Size of each frame, as TCP_BUFFER_TOTAL(max data size)
+ * @param storage   Buffer of frames * frameSize bytes, or nullptr to allocate
+ *                  one
+ * @return false if the sizes are invalid or the frames could not be allocated
+ */
+bool TCPFramePool::init(uint16_t frames, uint16_t frameSize,
+                        uint8_t *_storage) {
+  if ((frames == 0) || (frames > TCPFRAMEPOOL_MAX_FRAMES) ||
+      (frameSize <= TCPSOCKET_MAX_HDR)) {
+    return false;
+  }
+
+  freeStorage();
+
+  if (_storage == nullptr) {
+    _storage = (uint8_t *)malloc((uint32_t)frames * frameSize);
+    if (_storage == nullptr) {
+      return false;
+    }
+    ownsStorage = true;
+  }
+
+  storage = _storage;
+  numFrames = frames;
+  size = frameSize;
+
+  for (uint16_t i = 0; i < MAP_WORDS; i++) {
+    uint16_t first = i * 32;
+    uint32_t bits = 0;
+    if (first + 32 <= frames) {
+      bits = 0xFFFFFFFF;
+    } else if (first < frames) {
+      bits = ((uint32_t)1 << (frames - first)) - 1;
+    }
+    freeMap[i].store(bits);
+  }
+  freeFrames.store(frames);
+  minFree.store(frames);
+  return true;
+}
+
+/**
+ * Take a frame from the pool
+ *
+ * @return nullptr if every frame is in use
+ */
+uint8_t *TCPFramePool::allocFrame() {
+  for (uint16_t i = 0; i < MAP_WORDS; i++) {
+    uint32_t bits = freeMap[i].load(std::memory_order_relaxed);
+    while (bits != 0) {
+      uint32_t bit = bits & (~bits + 1);
+      if (freeMap[i].compare_exchange_weak(bits, bits & ~bit,
+                                           std::memory_order_acquire,
+                                           std::memory_order_relaxed)) {
+        uint32_t remaining =
+          freeFrames.fetch_sub(1, std::memory_order_relaxed) - 1;
+        if (remaining < minFree.load(std::memory_order_relaxed)) {
+          minFree.store(remaining, std::memory_order_relaxed);
+        }
+
+        uint16_t index = i * 32 + __builtin_ctz(bit);
+        return &storage[(uint32_t)index * size];
+      }
+    }
+  }
+  return nullptr;
+}
+
+/**
+ * Take a frame from the pool for a message to be sent
+ *
+ * @return Data portion of the frame, with dataSize() bytes available
+ */
+byte *TCPFramePool::allocMsg() {
+  uint8_t *frame = allocFrame();
+  if (frame == nullptr) {
+    return nullptr;
+  }
+  return frame + TCPSOCKET_MAX_HDR;
+}
+
+/**
+ * Return a frame to the pool.  Any pointer within the frame may be given, so
+ * that either the frame or its message data can be released.
+ *
+ * @return false if ptr is not in an allocated frame of this pool
+ */
+bool TCPFramePool::release(const void *ptr) {
+  const uint8_t *p = (const uint8_t *)ptr;
+  if ((p < storage) || (p >= storage + (uint32_t)numFrames * size)) {
+    return false;
+  }
+
+  uint16_t index = (p - storage) / size;
+  uint32_t bit = (uint32_t)1 << (index % 32);
+  uint32_t previous = freeMap[index / 32].fetch_or(bit,
+                                                   std::memory_order_release);
+  if (previous & bit) {
+    /* The frame was already free */
+    return false;
+  }
+  freeFrames.fetch_add(1, std::memory_order_relaxed);
+  return true;
+}
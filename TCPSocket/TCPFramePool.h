@@ -0,0 +1,87 @@
+/*
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2018
+ *
+ * Fixed size message frames shared between sockets.  Rather than every socket
+ * and caller keeping buffers sized for its own worst case, frames are
+ * borrowed from a pool sized at startup for the total load and returned
+ * when done with.
+ *
+ * Each frame is a TCP_BUFFER_TOTAL() sized buffer, and allocMsg() returns its
+ * data with the header room reserved as initBuffer() does, so that it can be
+ * passed directly to sendMsg().  Free frames are tracked in a bitmap updated
+ * with atomic operations, so frames may be allocated and released from
+ * multiple tasks without locking.
+ */
+
+#ifndef TCPFRAMEPOOL_H
+#define TCPFRAMEPOOL_H
+
+#include <atomic>
+
+#include "TCPSocket.h"
+
+/* Maximum number of frames in a pool */
+#ifndef TCPFRAMEPOOL_MAX_FRAMES
+  #define TCPFRAMEPOOL_MAX_FRAMES 64
+#endif
+
+class TCPFramePool {
+public:
+  TCPFramePool();
+  ~TCPFramePool();
+
+  bool init(uint16_t frames, uint16_t frameSize, uint8_t *storage = nullptr);
+
+  /* Entire frame, or its data following room for any header */
+  uint8_t *allocFrame();
+  byte *allocMsg();
+
+  /* Return the frame containing ptr to the pool */
+  bool release(const void *ptr);
+
+  uint16_t frameSize() { return size; }
+  uint16_t dataSize() { return TCP_DATA_LENGTH(size); }
+  uint16_t frames() { return numFrames; }
+  uint16_t available() { return freeFrames.load(std::memory_order_relaxed); }
+
+  /* Fewest frames that have been available, for sizing the pool */
+  uint16_t lowWater() { return minFree.load(std::memory_order_relaxed); }
+
+private:
+  static const uint16_t MAP_WORDS = (TCPFRAMEPOOL_MAX_FRAMES + 31) / 32;
+
+  uint8_t *storage;
+  bool ownsStorage;
+  uint16_t numFrames;
+  uint16_t size;
+
+  std::atomic<uint32_t> freeMap[MAP_WORDS]; // Set bits are free frames
+  std::atomic<uint32_t> freeFrames;
+  std::atomic<uint32_t> minFree;
+
+  void freeStorage();
+};
+
+/*
+ * TCPFramePool with its frames as members
+ *
+ *   Frames   - Number of frames in the pool
+ *   DataSize - Maximum message data length of each frame
+ */
+template <uint16_t Frames, uint16_t DataSize>
+class TCPFramePoolT : public TCPFramePool {
+public:
+  TCPFramePoolT() {
+    init(Frames, TCP_BUFFER_TOTAL(DataSize), &frameStorage[0][0]);
+  }
+
+private:
+  static_assert((Frames > 0) && (Frames <= TCPFRAMEPOOL_MAX_FRAMES),
+                "TCPFramePoolT frames exceeds TCPFRAMEPOOL_MAX_FRAMES");
+
+  uint8_t frameStorage[Frames][TCP_BUFFER_TOTAL(DataSize)];
+};
+
+#endif // TCPFRAMEPOOL_H
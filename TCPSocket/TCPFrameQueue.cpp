@@ -0,0 +1,91 @@
+/*
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2018
+ */
+
+#include "TCPFrameQueue.h"
+
+TCPFrameQueue::TCPFrameQueue() {
+  frames = nullptr;
+  data = nullptr;
+  mask = 0;
+  dataSize = 0;
+  head = 0;
+  tail = 0;
+}
+
+/**
+ * Use the provided frames and slotSize bytes of data per slot for the queue,
+ * where the number of slots must be a power of two
+ */
+bool TCPFrameQueue::init(tcp_socket_frame_t *_frames, uint8_t *_data,
+                         uint16_t slots, uint16_t slotSize) {
+  if ((slots == 0) || ((slots & (slots - 1)) != 0) || (slots > 0x8000)) {
+    return false;
+  }
+
+  frames = _frames;
+  data = _data;
+  mask = slots - 1;
+  dataSize = slotSize;
+  head = 0;
+  tail = 0;
+
+  for (uint16_t i = 0; i < slots; i++) {
+    frames[i].data = &data[(uint32_t)i * dataSize];
+  }
+  return true;
+}
+
+/**
+ * Copy a frame into the queue, returning false if the queue is full or the
+ * data doesn't fit in a slot
+ */
+bool TCPFrameQueue::push(const tcp_socket_frame_t *frame) {
+  if ((frame->length > dataSize) || (space() == 0)) {
+    return false;
+  }
+
+  uint16_t position = tail.load(std::memory_order_relaxed);
+  tcp_socket_frame_t *slot = &frames[position & mask];
+  memcpy((byte *)slot->data, frame->data, frame->length);
+  slot->length = frame->length;
+  slot->version = frame->version;
+  slot->ID = frame->ID;
+  slot->flags = frame->flags;
+  slot->source = frame->source;
+  slot->address = frame->address;
+
+  /* Publish the slot only once its contents are written */
+  tail.store(position + 1, std::memory_order_release);
+  return true;
+}
+
+uint16_t TCPFrameQueue::space() {
+  uint16_t used = tail.load(std::memory_order_relaxed) -
+                  head.load(std::memory_order_acquire);
+  return (mask + 1) - used;
+}
+
+const tcp_socket_frame_t *TCPFrameQueue::front() {
+  if (available() == 0) {
+    return nullptr;
+  }
+  return &frames[head.load(std::memory_order_relaxed) & mask];
+}
+
+void TCPFrameQueue::pop() {
+  if (available() == 0) {
+    return;
+  }
+
+  /* The producer may reuse the slot once the head has moved past it */
+  head.store(head.load(std::memory_order_relaxed) + 1,
+             std::memory_order_release);
+}
+
+uint16_t TCPFrameQueue::available() {
+  return (uint16_t)(tail.load(std::memory_order_acquire) -
+                    head.load(std::memory_order_relaxed));
+}
@@ -0,0 +1,73 @@
+/*
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2018
+ *
+ * Lock-free single-producer/single-consumer queue of received TCPSocket
+ * messages, used to hand messages from a receive task to the application.
+ *
+ * Each slot holds a frame and a copy of its data.  The producer fills the slot
+ * at the tail and then publishes it, and the consumer reads the slot at the
+ * head in place before popping it, so neither side ever waits on the other.
+ * The number of slots is a power of two so that positions can be tracked with
+ * free-running counters.
+ */
+
+#ifndef TCPFRAMEQUEUE_H
+#define TCPFRAMEQUEUE_H
+
+#include <atomic>
+
+#include "TCPSocket.h"
+
+class TCPFrameQueue {
+public:
+  TCPFrameQueue();
+
+  bool init(tcp_socket_frame_t *frames, uint8_t *data, uint16_t slots,
+            uint16_t slotSize);
+
+  /* Producer */
+  bool push(const tcp_socket_frame_t *frame);
+  uint16_t space();
+
+  /* Consumer, the frame returned by front() is valid until pop() */
+  const tcp_socket_frame_t *front();
+  void pop();
+  uint16_t available();
+
+  uint16_t slotSize() { return dataSize; }
+
+private:
+  tcp_socket_frame_t *frames;
+  uint8_t *data;
+  uint16_t mask;
+  uint16_t dataSize;
+
+  std::atomic<uint16_t> head; // Free-running position of the next to pop
+  std::atomic<uint16_t> tail; // Free-running position of the next to push
+};
+
+/*
+ * TCPFrameQueue with its slots as members
+ *
+ *   Slots    - Number of messages that can be queued, a power of two
+ *   DataSize - Maximum message data length
+ */
+template <uint16_t Slots, uint16_t DataSize>
+class TCPFrameQueueT : public TCPFrameQueue {
+public:
+  TCPFrameQueueT() {
+    init(frameStorage, &dataStorage[0][0], Slots, DataSize);
+  }
+
+private:
+  static_assert((Slots > 0) && ((Slots & (Slots - 1)) == 0) &&
+                (Slots <= 0x8000),
+                "TCPFrameQueueT slots must be a power of two");
+
+  tcp_socket_frame_t frameStorage[Slots];
+  uint8_t dataStorage[Slots][DataSize];
+};
+
+#endif // TCPFRAMEQUEUE_H
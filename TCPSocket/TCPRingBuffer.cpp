@@ -0,0 +1,226 @@
+/*
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2018
+ */
+
+#include "TCPRingBuffer.h"
+
+TCPRingBuffer::TCPRingBuffer() {
+  buffer = nullptr;
+  owned = false;
+  mask = 0;
+  head = tail = base = 0;
+}
+
+TCPRingBuffer::~TCPRingBuffer() {
+  if (owned) {
+    free(buffer);
+  }
+}
+
+/**
+ * Allocate the buffer, rounding the capacity up to a power of two
+ */
+bool TCPRingBuffer::init(uint32_t minCapacity) {
+  if (minCapacity > MAX_CAPACITY) {
+    return false;
+  }
+
+  uint16_t size = capacityFor(minCapacity);
+  uint8_t *storage = (uint8_t *)malloc(size);
+  if (storage == nullptr) {
+    return false;
+  }
+
+  init(storage, size);
+  owned = true;
+  return true;
+}
+
+/**
+ * Use caller provided storage, whose size must be a power of two
+ */
+bool TCPRingBuffer::init(uint8_t *storage, uint16_t capacity) {
+  if ((capacity == 0) || (capacity & (capacity - 1))) {
+    return false;
+  }
+
+  if (owned) {
+    free(buffer);
+  }
+  buffer = storage;
+  owned = false;
+  mask = capacity - 1;
+  clear();
+  return true;
+}
+
+/**
+ * Return the largest contiguous free region that data can be written into
+ */
+uint8_t *TCPRingBuffer::writePtr(uint16_t *len) {
+  uint16_t offset = head & mask;
+  uint16_t toEnd = capacity() - offset;
+  uint16_t free = space();
+  *len = (free < toEnd) ? free : toEnd;
+  return &buffer[offset];
+}
+
+void TCPRingBuffer::commit(uint16_t len) {
+  head += len;
+}
+
+/**
+ * Copy buffered data starting at an offset from the read position, handling
+ * the wrap at the end of the buffer.
+ */
+void TCPRingBuffer::copyOut(uint16_t offset, void *dst, uint16_t len) {
+  uint16_t start = (tail + offset) & mask;
+  uint16_t toEnd = capacity() - start;
+  if (len <= toEnd) {
+    memcpy(dst, &buffer[start], len);
+  } else {
+    memcpy(dst, &buffer[start], toEnd);
+    memcpy((uint8_t *)dst + toEnd, buffer, len - toEnd);
+  }
+}
+
+/**
+ * Return a pointer to buffered data if the requested range does not wrap,
+ * otherwise nullptr.
+ */
+const uint8_t *TCPRingBuffer::contiguous(uint16_t offset, uint16_t len) {
+  uint16_t start = (tail + offset) & mask;
+  if (start + len > capacity()) {
+    return nullptr;
+  }
+  return &buffer[start];
+}
+
+/**
+ * Return a pointer to buffered data at an offset, reducing len to the data
+ * available before the end of the buffer.
+ */
+const uint8_t *TCPRingBuffer::segment(uint16_t offset, uint16_t *len) {
+  uint16_t start = (tail + offset) & mask;
+  uint16_t toEnd = capacity() - start;
+  if (*len > toEnd) {
+    *len = toEnd;
+  }
+  return &buffer[start];
+}
+
+/**
+ * Advance the read position, freeing the consumed data unless it is to be held
+ * or earlier data is already being held.
+ */
+void TCPRingBuffer::consume(uint16_t len, bool hold) {
+  bool free = !hold && !holding();
+  tail += len;
+  if (free) {
+    base = tail;
+  }
+}
+
+/**
+ * Find a 32bit word (in memory byte order) in the buffered data.
+ *
+ * @return Offset of the word from the read position, or -1 if not present
+ */
+int TCPRingBuffer::find(uint32_t word) {
+  const uint8_t *wordbytes = (const uint8_t *)&word;
+  uint16_t avail = used();
+  uint16_t offset = 0;
+
+  while (offset + sizeof (word) <= avail) {
+    /* Scan for the first byte of the word within a contiguous region */
+    uint16_t start = (tail + offset) & mask;
+    uint16_t toEnd = capacity() - start;
+    uint16_t len = avail - offset;
+    if (len > toEnd) {
+      len = toEnd;
+    }
+
+    int found = scanByte(&buffer[start], len, wordbytes[0]);
+    if (found < 0) {
+      offset += len;
+      continue;
+    }
+    offset += found;
+
+    if (offset + sizeof (word) > avail) {
+      break;
+    }
+
+    byte i;
+    for (i = 1; i < sizeof (word); i++) {
+      if (peek(offset + i) != wordbytes[i]) {
+        break;
+      }
+    }
+    if (i == sizeof (word)) {
+      return offset;
+    }
+    offset++;
+  }
+
+  return -1;
+}
+
+/**
+ * Find a byte value in the buffered data.
+ *
+ * @return Offset of the byte from the read position, or -1 if not present
+ */
+int TCPRingBuffer::findByte(uint8_t value) {
+  uint16_t avail = used();
+  uint16_t offset = 0;
+
+  while (offset < avail) {
+    uint16_t len = avail - offset;
+    const uint8_t *data = segment(offset, &len);
+    int found = scanByte(data, len, value);
+    if (found >= 0) {
+      return offset + found;
+    }
+    offset += len;
+  }
+
+  return -1;
+}
+
+/**
+ * Search for a byte value a word at a time, returning its index or -1
+ */
+int TCPRingBuffer::scanByte(const uint8_t *data, uint16_t len, uint8_t value) {
+  const uint32_t ONES = 0x01010101UL;
+  const uint32_t HIGHS = 0x80808080UL;
+  const uint32_t pattern = ONES * value;
+  uint16_t i = 0;
+
+  /* Check single bytes until word aligned */
+  while ((i < len) && ((uintptr_t)(data + i) & (sizeof (uint32_t) - 1))) {
+    if (data[i] == value) {
+      return i;
+    }
+    i++;
+  }
+
+  /* Skip whole words that cannot contain the value */
+  while (i + sizeof (uint32_t) <= len) {
+    uint32_t word = *(const uint32_t *)(data + i) ^ pattern;
+    if ((word - ONES) & ~word & HIGHS) {
+      break;
+    }
+    i += sizeof (uint32_t);
+  }
+
+  for (; i < len; i++) {
+    if (data[i] == value) {
+      return i;
+    }
+  }
+
+  return -1;
+}
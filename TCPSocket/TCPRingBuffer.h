@@ -0,0 +1,76 @@
+/*
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2018
+ *
+ * Circular receive buffer used by TCPSocket.  Data is read from the network
+ * in bulk into the free space of the buffer, and frames are then located and
+ * parsed directly out of the buffered data.
+ *
+ * The capacity is always a power of two so that positions can be tracked with
+ * free-running counters and wrapped with a mask.
+ *
+ * Consumed data normally frees its space immediately, but it may instead be
+ * held so that pointers into the buffer remain valid.  Held space is freed by
+ * releasing it up to a position, in the order it was consumed.
+ */
+
+#ifndef TCPRINGBUFFER_H
+#define TCPRINGBUFFER_H
+
+#include <Arduino.h>
+
+class TCPRingBuffer {
+public:
+  TCPRingBuffer();
+  ~TCPRingBuffer();
+
+  bool init(uint32_t minCapacity);
+  bool init(uint8_t *storage, uint16_t capacity);
+
+  static const uint16_t MAX_CAPACITY = 0x8000;
+
+  /* Capacity of a buffer that can hold at least minCapacity bytes */
+  static constexpr uint32_t capacityFor(uint32_t minCapacity,
+                                        uint32_t size = 1) {
+    return (size >= minCapacity) ? size : capacityFor(minCapacity, size << 1);
+  }
+
+  uint16_t capacity() { return mask + 1; }
+  uint16_t used() { return (uint16_t)(head - tail); }
+  uint16_t space() { return capacity() - (uint16_t)(head - base); }
+  void clear() { head = tail = base = 0; }
+  void discard() { consume(used()); }
+
+  /* Contiguous free region for a bulk write, and commit of data written */
+  uint8_t *writePtr(uint16_t *len);
+  void commit(uint16_t len);
+
+  uint8_t peek(uint16_t offset) { return buffer[(tail + offset) & mask]; }
+  void copyOut(uint16_t offset, void *dst, uint16_t len);
+  const uint8_t *contiguous(uint16_t offset, uint16_t len);
+  void consume(uint16_t len, bool hold = false);
+
+  /* Held data, from a position returned by position() */
+  uint16_t position() { return tail; }
+  void release(uint16_t position) { base = position; }
+  bool holding() { return base != tail; }
+
+  int find(uint32_t word);
+  int findByte(uint8_t value);
+
+  /* Contiguous buffered data at an offset, with len reduced to fit */
+  const uint8_t *segment(uint16_t offset, uint16_t *len);
+
+  static int scanByte(const uint8_t *data, uint16_t len, uint8_t value);
+
+private:
+  uint8_t *buffer;
+  bool owned; // Buffer was allocated by init()
+  uint16_t mask;
+  uint16_t head; // Free-running write position
+  uint16_t tail; // Free-running read position
+  uint16_t base; // Free-running position of the oldest held data
+};
+
+#endif // TCPRINGBUFFER_H
@@ -6,6 +6,14 @@
 
 #include <WiFi.h>
 #include <WiFiServer.h>
+#if defined(ESP32)
+  #include <lwip/sockets.h>
+#elif defined(TCPSOCKET_HOST)
+  #include <errno.h>
+  #include <netinet/in.h>
+  #include <netinet/tcp.h>
+  #include <sys/socket.h>
+#endif
 
 #ifdef DEBUG_LEVEL_TCPSOCKET
   #define DEBUG_LEVEL DEBUG_LEVEL_TCPSOCKET
@@ -17,46 +25,192 @@
 
 #include <Socket.h>
 #include "TCPSocket.h"
+#include "TCPFramePool.h"
 
 TCPSocket::TCPSocket() {
   tcpServer = nullptr;
-  tcpClient = WiFiClient();
+  connections = nullptr;
+  maxClients = 0;
+  ownsStorage = false;
+  peers = nullptr;
+  maxPeers = 0;
+  reassemblyStorage = nullptr;
+  framePool = nullptr;
+  compressStorage = nullptr;
+  rateSources = nullptr;
+  maxRateSources = 0;
+  clearHandlers();
+  resetStats();
 }
 
 TCPSocket::~TCPSocket() {
-  tcpClient.stop();
-  tcpServer->stop();
-  free(recvBuffer);
+  shutdown();
 }
 
 TCPSocket::TCPSocket(socket_addr_t _address,
                      uint16_t _port,
-                     byte _recvBufferSize) {
-  init(_address, _port, _recvBufferSize);
+                     uint16_t _recvBufferSize,
+                     byte _maxClients) {
+  tcpServer = nullptr;
+  connections = nullptr;
+  maxClients = 0;
+  ownsStorage = false;
+  peers = nullptr;
+  maxPeers = 0;
+  reassemblyStorage = nullptr;
+  framePool = nullptr;
+  compressStorage = nullptr;
+  rateSources = nullptr;
+  maxRateSources = 0;
+  clearHandlers();
+  resetStats();
+  init(_address, _port, _recvBufferSize, _maxClients);
 }
 
 /**
- * Allocate the receive buffer and setup the WiFi server
+ * Allocate the connection table and receive buffers and setup the WiFi server
+ *
+ * @return false if the receive buffer size is larger than the receive ring
+ *         supports or the buffers could not be allocated, in which case the
+ *         socket is left uninitialized
  */
-void TCPSocket::init(socket_addr_t _address,
+bool TCPSocket::init(socket_addr_t _address,
                      uint16_t _port,
-                     byte _recvBufferSize) {
+                     uint16_t _recvBufferSize,
+                     byte _maxClients) {
+  if ((_recvBufferSize <= TCPSOCKET_MAX_HDR) ||
+      (RING_BUFFER_FRAMES * (uint32_t)_recvBufferSize >
+       TCPRingBuffer::MAX_CAPACITY)) {
+    DEBUG_ERR("TCPS: Invalid recv buf size");
+    return false;
+  }
+
+  tcp_socket_conn_t *conns = new tcp_socket_conn_t[_maxClients];
+  bool allocated = true;
+  for (byte i = 0; i < _maxClients; i++) {
+    conns[i].sendQueue = (uint8_t *)malloc(DEFAULT_SEND_BUFFER);
+    conns[i].recvBuffer = (uint8_t *)malloc(_recvBufferSize);
+    if ((conns[i].sendQueue == nullptr) || (conns[i].recvBuffer == nullptr) ||
+        !conns[i].ring.init(RING_BUFFER_FRAMES * (uint32_t)_recvBufferSize)) {
+      allocated = false;
+    }
+  }
+  if (!allocated) {
+    DEBUG_ERR("TCPS: Failed to alloc client bufs");
+    for (byte i = 0; i < _maxClients; i++) {
+      free(conns[i].sendQueue);
+      free(conns[i].recvBuffer);
+    }
+    delete[] conns;
+    return false;
+  }
+
+  initStorage(_address, _port, _recvBufferSize, DEFAULT_SEND_BUFFER,
+              conns, _maxClients, new WiFiServer(_port, _maxClients));
+  ownsStorage = true;
+  return true;
+}
+
+/**
+ * Setup the socket with a connection table whose buffers have been provided by
+ * the caller.
+ */
+void TCPSocket::initStorage(socket_addr_t _address,
+                            uint16_t _port,
+                            uint16_t _recvBufferSize,
+                            uint16_t _sendBufferSize,
+                            tcp_socket_conn_t *_connections,
+                            byte _maxClients,
+                            WiFiServer *_server) {
   sourceAddress = _address;
   currentMsgID = 0;
   lastRecvSize = 0;
 
   recvBufferSize = _recvBufferSize;
-  recvBuffer = (uint8_t *)malloc(recvBufferSize);
-  partialRecv = false;
+
+  maxClients = _maxClients;
+  nextClient = 0;
+  lastClient = 0;
+  sendBufferSize = _sendBufferSize;
+  sendFlushMicros = 0;
+  compactEnabled = false;
+  fragmentSize = 0;
+  reassemblySize = 0;
+  framePool = nullptr;
+  compressThreshold = 0;
+  compressTable = nullptr;
+  timestampsEnabled = false;
+  TCPTokenBucket::setLimit(&connRate, 0, 0);
+  TCPTokenBucket::setLimit(&sourceRate, 0, 0);
+  captureOut = nullptr;
+  idleTimeoutMs = 0;
+  takeoverMs = 0;
+  keepAliveIdle = 0;
+  keepAliveInterval = 0;
+  keepAliveCount = 0;
+  ownsStorage = false;
+  connections = _connections;
+  for (byte i = 0; i < maxClients; i++) {
+    connections[i].viewFirst = 0;
+    connections[i].viewCount = 0;
+    connections[i].recvBufferHeld = false;
+    connections[i].fragBuffer = nullptr;
+    connections[i].fragHeld = false;
+    resetConnection(&connections[i]);
+  }
 
   DEBUG3_VALUE("TCPS: Listinging on ", WiFi.localIP().toString());
-  DEBUG3_VALUELN(":", _port);
-  tcpServer = new WiFiServer(_port, 1 /* max clients */);
-  tcpClient = WiFiClient();
+  DEBUG3_VALUE(":", _port);
+  DEBUG3_VALUELN(" clients:", maxClients);
+  tcpServer = _server;
+}
+
+/**
+ * Disconnect all clients, stop the server, and free any allocated storage
+ */
+void TCPSocket::shutdown() {
+  clearReliable();
+  clearRateSources();
+  free(reassemblyStorage);
+  reassemblyStorage = nullptr;
+  free(compressStorage);
+  compressStorage = nullptr;
+  compressThreshold = 0;
+  for (byte i = 0; i < maxClients; i++) {
+    connections[i].client.stop();
+    if (framePool != nullptr) {
+      if (connections[i].recvBuffer != nullptr) {
+        framePool->release(connections[i].recvBuffer);
+      }
+    } else if (ownsStorage) {
+      free(connections[i].recvBuffer);
+    }
+    if (ownsStorage) {
+      free(connections[i].sendQueue);
+    }
+  }
+  if (ownsStorage) {
+    delete[] connections;
+  }
+  connections = nullptr;
+  maxClients = 0;
 
+  if (tcpServer != nullptr) {
+    tcpServer->stop();
+    if (ownsStorage) {
+      delete tcpServer;
+    } else {
+      tcpServer->~WiFiServer();
+    }
+    tcpServer = nullptr;
+  }
 }
 
 void TCPSocket::setup() {
+  if (tcpServer == nullptr) {
+    DEBUG_ERR("TCPS: Setup of uninitialized socket");
+    return;
+  }
   tcpServer->begin();
 }
 
@@ -66,29 +220,278 @@ boolean TCPSocket::initialized() {
 
 /**
  * Setup the send buffer, which takes an input buffer and sets the buffer
- * for data to allow for the initial packet header.
+ * for data to allow for the initial packet header of any protocol version.
+ * The Socket API's send_data_size holds at most 255, so is limited to that
+ * for larger buffers, whose full size remains available to sendMsg().
+ *
+ * @return The data portion of the buffer, nullptr if the buffer is too small
+ *         for a header
  */
 byte *TCPSocket::initBuffer(byte *data, uint16_t data_size) {
-  send_data_size = data_size - sizeof (tcp_socket_hdr_t);
-  send_buffer = data + sizeof (tcp_socket_hdr_t);
+  if (data_size < TCPSOCKET_MAX_HDR) {
+    DEBUG_ERR("TCPS: Send buf smaller than hdr");
+    send_data_size = 0;
+    send_buffer = nullptr;
+    return nullptr;
+  }
+
+  uint16_t size = TCP_DATA_LENGTH(data_size);
+  send_data_size = (size > 0xFF) ? 0xFF : size;
+  send_buffer = data + TCPSOCKET_MAX_HDR;
   return send_buffer;
 }
 
 /**
- * Check if the current client is connected and if not see if there is a
- * connected one available;
+ * Clear the receive state of a connection slot
+ */
+void TCPSocket::resetConnection(tcp_socket_conn_t *conn) {
+  if ((captureOut != nullptr) && conn->active) {
+    captureData(conn, TCPCAPTURE_DISCONNECT, nullptr, 0);
+  }
+  conn->client = WiFiClient();
+  conn->active = false;
+  conn->peerAddress = SOCKET_ADDR_ANY;
+  conn->peerVersion = TCPSOCKET_VERSION;
+  conn->peerCompact = false;
+  conn->peerCompress = false;
+  conn->recvCompact = false;
+  conn->sendCompact = false;
+  conn->ring.discard();
+  conn->sendQueued = 0;
+  conn->sendBlocked = false;
+  conn->sendFragData = nullptr;
+  conn->fragActive = false;
+  conn->peerTimestamps = false;
+  conn->echoMicros = 0;
+  memset(&conn->latency, 0, sizeof (conn->latency));
+  conn->rateBucket.fill(&connRate, millis());
+  conn->rateLimited = false;
+  conn->weight = TCPSOCKET_DEFAULT_WEIGHT;
+  conn->turnMsgs = 0;
+  releaseCopyBuffer(conn);
+
+  /*
+   * Reliable messages are resent once the peer connects again, and peers with
+   * nothing left to acknowledge are forgotten
+   */
+  for (byte i = 0; i < maxPeers; i++) {
+    if (peers[i].conn == conn - connections) {
+      peers[i].conn = TCPSOCKET_NO_CONN;
+      if ((peers[i].ackedSeq == peers[i].nextSeq) && !peers[i].ackPending) {
+        peers[i].address = SOCKET_ADDR_INVALID;
+      }
+    }
+  }
+}
+
+/**
+ * Release any clients that have disconnected or gone idle and accept waiting
+ * clients into free connection slots.  If every slot is in use, a waiting
+ * client takes over the slot of the client that has been idle longest once
+ * it has been idle for the takeover time.
  *
- * @return if a connected client is present
+ * @return if any connected client is present
  */
 bool TCPSocket::checkClient() {
-  if (tcpClient) {
-    return true;
+  bool haveClient = false;
+  bool accepting = true;
+  unsigned long now = millis();
+  tcp_socket_conn_t *stalest = nullptr;
+
+  for (byte i = 0; i < maxClients; i++) {
+    tcp_socket_conn_t *conn = &connections[i];
+
+    if (conn->active && !conn->client) {
+      DEBUG3_VALUELN("TCPS: Disconnected client ", i);
+      TRACELOG(TCPS_TRACE_DISCONNECT, i, 0);
+      stats.disconnects++;
+      conn->client.stop();
+      resetConnection(conn);
+    }
+
+    if (conn->active && (idleTimeoutMs > 0) &&
+        (now - conn->lastRecvMillis >= idleTimeoutMs)) {
+      DEBUG3_VALUELN("TCPS: Idle client ", i);
+      TRACELOG(TCPS_TRACE_IDLE, i, now - conn->lastRecvMillis);
+      stats.idleDisconnects++;
+      conn->client.stop();
+      resetConnection(conn);
+    }
+
+    if (!conn->active) {
+      if (!accepting) {
+        continue;
+      }
+      WiFiClient client = tcpServer->available();
+      if (!client) {
+        /* No clients are waiting, don't check again for other free slots */
+        accepting = false;
+        continue;
+      }
+      acceptClient(conn, client);
+    } else if ((stalest == nullptr) ||
+               (now - conn->lastRecvMillis > now - stalest->lastRecvMillis)) {
+      stalest = conn;
+    }
+
+    haveClient = true;
+  }
+
+  if (accepting && (takeoverMs > 0) && (stalest != nullptr) &&
+      (now - stalest->lastRecvMillis >= takeoverMs)) {
+    WiFiClient client = tcpServer->available();
+    if (client) {
+      DEBUG3_VALUELN("TCPS: Takeover of client ", stalest - connections);
+      TRACELOG(TCPS_TRACE_TAKEOVER, stalest - connections,
+               now - stalest->lastRecvMillis);
+      stats.takeovers++;
+      stalest->client.stop();
+      resetConnection(stalest);
+      acceptClient(stalest, client);
+    }
+  }
+
+  return haveClient;
+}
+
+/**
+ * Start receiving from a newly connected client
+ */
+void TCPSocket::acceptClient(tcp_socket_conn_t *conn, WiFiClient client) {
+  conn->client = client;
+  conn->active = true;
+  conn->lastRecvMillis = millis();
+  if (captureOut != nullptr) {
+    captureData(conn, TCPCAPTURE_CONNECT, nullptr, 0);
+  }
+  applyKeepAlive(conn);
+  stats.connects++;
+  TRACELOG(TCPS_TRACE_CONNECT, conn - connections, 0);
+  DEBUG3_VALUE("TCPS: Connection from ", conn->client.remoteIP().toString());
+  DEBUG3_VALUELN(" client ", conn - connections);
+}
+
+/**
+ * Enable TCP keepalive probes on client connections, so that the network
+ * stack detects a client that vanished without closing its connection even
+ * when nothing is being sent to it.  Applies to current and future clients.
+ *
+ * @param idleSecs     Time without traffic before the first probe, 0 to
+ *                     disable keepalive
+ * @param intervalSecs Time between unanswered probes
+ * @param count        Unanswered probes before the connection is dropped
+ */
+void TCPSocket::setKeepAlive(uint16_t idleSecs, uint16_t intervalSecs,
+                             byte count) {
+  keepAliveIdle = idleSecs;
+  keepAliveInterval = intervalSecs;
+  keepAliveCount = count;
+
+  for (byte i = 0; i < maxClients; i++) {
+    if (connections[i].active) {
+      applyKeepAlive(&connections[i]);
+    }
+  }
+}
+
+void TCPSocket::applyKeepAlive(tcp_socket_conn_t *conn) {
+#if defined(ESP32) || defined(TCPSOCKET_HOST)
+  int fd = conn->client.fd();
+  if (fd < 0) {
+    return;
+  }
+
+  int enable = (keepAliveIdle > 0);
+  int idle = keepAliveIdle;
+  int interval = keepAliveInterval;
+  int count = keepAliveCount;
+  if ((setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &enable,
+                  sizeof (enable)) < 0) ||
+      (enable &&
+       ((setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle,
+                    sizeof (idle)) < 0) ||
+        (setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval,
+                    sizeof (interval)) < 0) ||
+        (setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &count,
+                    sizeof (count)) < 0)))) {
+    DEBUG2_VALUELN("TCPS: Failed to set keepalive ", errno);
+  }
+#endif
+}
+
+/**
+ * Find the connection a message for an address should be sent on.  Addresses
+ * are learned from the source of messages received on each connection, any
+ * other address goes to the client that most recently sent a message.
+ */
+tcp_socket_conn_t *TCPSocket::routeConnection(socket_addr_t address) {
+  if (address != SOCKET_ADDR_ANY) {
+    for (byte i = 0; i < maxClients; i++) {
+      if (connections[i].active && (connections[i].peerAddress == address)) {
+        return &connections[i];
+      }
+    }
+  }
+
+  if (connections[lastClient].active) {
+    return &connections[lastClient];
+  }
+
+  for (byte i = 0; i < maxClients; i++) {
+    if (connections[i].active) {
+      return &connections[i];
+    }
+  }
+
+  return nullptr;
+}
+
+#if defined(TCPSOCKET_HOST)
+/**
+ * Wait for a client to connect or send data, or until buffered sends should
+ * be retried or acknowledgements sent.
+ *
+ * @param timeoutMs Maximum time to wait, -1 to wait indefinitely
+ * @return true if there may be data to receive
+ */
+bool TCPSocket::wait(int timeoutMs) {
+  bool pending = false;
+  for (byte i = 0; i < maxClients; i++) {
+    if (connections[i].sendQueued > 0) {
+      pending = true;
+      break;
+    }
+  }
+  for (byte i = 0; i < maxPeers; i++) {
+    if (peers[i].ackPending && (peers[i].conn != TCPSOCKET_NO_CONN)) {
+      pending = true;
+      break;
+    }
+  }
+  if (pending && ((timeoutMs < 0) || (timeoutMs > 1))) {
+    /* Don't sleep past the next send retry, flush deadline, or ack */
+    timeoutMs = 1;
   }
-  tcpClient = tcpServer->available();
-  if (tcpClient) {
-    DEBUG3_VALUELN("TCPS: Connection from ", tcpClient.remoteIP().toString());
+  return waitRecv(timeoutMs);
+}
+
+/**
+ * Wait for received data without touching any connection state, so that this
+ * may be called by a receive task concurrently with sends from another thread
+ */
+bool TCPSocket::waitRecv(int timeoutMs) {
+  return tcpServer->wait(timeoutMs);
+}
+#endif
+
+byte TCPSocket::numClients() {
+  byte count = 0;
+  for (byte i = 0; i < maxClients; i++) {
+    if (connections[i].active) {
+      count++;
+    }
   }
-  return tcpClient;
+  return count;
 }
 
 /**
@@ -99,209 +502,1592 @@ bool TCPSocket::validateHeader(tcp_socket_hdr_t *hdr) {
     DEBUG3_HEXVALLN("TCPS: bad start ", hdr->start);
     return false;
   }
-  if (hdr->version != TCPSOCKET_VERSION) {
+  if ((hdr->version != TCPSOCKET_VERSION) &&
+      (hdr->version != TCPSOCKET_VERSION_2) &&
+      (hdr->version != TCPSOCKET_VERSION_COMPACT)) {
     DEBUG3_VALUELN("TCPS: bad version ", hdr->version);
     return false;
   }
+  if ((hdr->version == TCPSOCKET_VERSION_COMPACT) && (hdr->length != 0)) {
+    DEBUG3_VALUELN("TCPS: bad compact start len ", hdr->length);
+    return false;
+  }
 
   return true;
 }
 
 /**
- * Transmit a message
+ * Start interpreting the flags of a client's messages, once it has shown that
+ * it implements this protocol by sending a version 2 or compact start header,
+ * and let it know which optional features it may use
+ */
+void TCPSocket::negotiatePeer(tcp_socket_conn_t *conn) {
+  if (negotiated(conn)) {
+    return;
+  }
+  DEBUG4_VALUELN("TCPS: Negotiated v2 with client ", conn - connections);
+  conn->peerVersion = TCPSOCKET_VERSION_2;
+  advertiseCompression(conn);
+  if (timestampsEnabled) {
+    sendTimestamp(conn, TCPSOCKET_TIMESTAMP_PROBE | TCPSOCKET_TIMESTAMP_ONLY);
+  }
+}
+
+/**
+ * Size of the header for a protocol version
+ */
+uint16_t TCPSocket::headerSize(byte version) {
+  if (version == TCPSOCKET_VERSION_2) {
+    return sizeof (tcp_socket_hdr_v2_t);
+  }
+  return sizeof (tcp_socket_hdr_t);
+}
+
+/**
+ * Transmit a message to the client connected for the address
  */
 void TCPSocket::sendMsgTo(socket_addr_t address,
                           const byte *data,
                           const byte datalength)
 {
+  int result = sendMsg(address, data, datalength);
+  if (result != TCPSOCKET_SEND_OK) {
+    DEBUG3_VALUELN("TCPS: send failed ", result);
+  }
+}
+
+/**
+ * Transmit a message without blocking.  Data that cannot be written
+ * immediately is kept in the client's send buffer and written by later calls,
+ * a message is only accepted if it can be completely sent or buffered.
+ * Messages too large for a single frame are sent as fragments to clients that
+ * have negotiated version 2 (see negotiatePeer()).  If the client stops
+ * accepting fragments part way through, the rest must be sent with
+ * continueSend() before the data is changed.  Sending another message to the
+ * client instead abandons the fragmented message, which the client discards.
+ *
+ * @return TCPSOCKET_SEND_OK if the message was sent or buffered,
+ *         TCPSOCKET_WOULD_BLOCK if the client's send buffer is too full to
+ *         accept the message, TCPSOCKET_SEND_PARTIAL if only some of its
+ *         fragments were accepted, otherwise an error
+ */
+int TCPSocket::sendMsg(socket_addr_t address,
+                       const byte *data,
+                       uint16_t datalength)
+{
+  uint32_t start = timingStart();
+  int result;
+
+  checkFlush();
+
   if (!checkClient()) {
     DEBUG3_PRINTLN("TCPS: send without connection");
-    return;
+    result = TCPSOCKET_NO_CLIENT;
+  } else {
+    tcp_socket_conn_t *conn = routeConnection(address);
+
+    if (conn->sendFragData != nullptr) {
+      DEBUG3_VALUELN("TCPS: Abandoned fragments at ", conn->sendFragOffset);
+      conn->sendFragData = nullptr;
+    }
+
+    /* Clients that haven't negotiated flags can't reassemble fragments */
+    uint16_t fragment = maxFragment(conn);
+    if ((datalength > fragment) && negotiated(conn)) {
+      DEBUG4_VALUE("TCPS: Fragmenting ", datalength);
+      DEBUG4_VALUELN(" by ", fragment);
+      conn->sendFragData = data;
+      conn->sendFragLength = datalength;
+      conn->sendFragOffset = 0;
+      conn->sendFragAddress = address;
+      result = sendFragments(conn, fragment);
+    } else {
+      result = sendFrame(conn, address, currentMsgID, 0, data, datalength);
+      if (result == TCPSOCKET_SEND_OK) {
+        currentMsgID++;
+      }
+    }
+  }
+
+  switch (result) {
+    case TCPSOCKET_SEND_OK: stats.msgsSent++; break;
+    case TCPSOCKET_WOULD_BLOCK: stats.sendBlocked++; break;
+    case TCPSOCKET_SEND_PARTIAL: break; // Counted once continued
+    default: stats.sendErrors++; break;
+  }
+  timingEnd(&stats.sendTiming, start);
+  return result;
+}
+
+/**
+ * Send a message on a connection with the given header fields.  As with
+ * sendMsg(), the data must be preceded by TCPSOCKET_MAX_HDR bytes of space for
+ * the header.
+ */
+int TCPSocket::sendFrame(tcp_socket_conn_t *conn, socket_addr_t address,
+                         byte ID, byte flags, const byte *data,
+                         uint16_t datalength) {
+  if (conn->sendCompact || (compactEnabled && conn->peerCompact)) {
+    return sendCompactMsg(conn, address, ID, flags, data, datalength);
   }
 
-  tcp_socket_msg_t *msg = (tcp_socket_msg_t *)headerFromData(data);
+  /* Only negotiated clients send timestamps, so they accept version 2 */
+  uint16_t trailer_len = sendsTimestamps(conn) ?
+                         sizeof (tcp_socket_timestamp_t) : 0;
 
-  unsigned int msg_len = sizeof (tcp_socket_hdr_t) + datalength;
+  /*
+   * Messages are sent with the version 1 header unless they are too large for
+   * it, which requires that the client has indicated version 2 support.
+   */
+  byte version = TCPSOCKET_VERSION;
+  if (datalength + trailer_len > TCPSOCKET_MAX_DATA_V1) {
+    if (conn->peerVersion < TCPSOCKET_VERSION_2) {
+      DEBUG3_VALUELN("TCPS: msg too large for v1 client ", datalength);
+      return TCPSOCKET_SEND_ERROR;
+    }
+    version = TCPSOCKET_VERSION_2;
+  }
+
+  TRACELOG(TCPS_TRACE_SEND, datalength,
+           address | ((uint32_t)ID << 16) | ((uint32_t)flags << 24));
+
+  uint16_t hdr_len = headerSize(version);
+  uint16_t msg_len = hdr_len + datalength;
+  uint8_t *msg = (uint8_t *)data - hdr_len;
+
+  if (msg_len > sendBufferSize) {
+    DEBUG3_VALUELN("TCPS: msg > send buf ", msg_len);
+    return TCPSOCKET_SEND_ERROR;
+  }
+  if (msg_len + trailer_len > sendBufferSize) {
+    trailer_len = 0;
+  }
+
+  if (!reserveSend(conn, msg_len + trailer_len)) {
+    return TCPSOCKET_WOULD_BLOCK;
+  }
 
-  msg->hdr.start = TCPSOCKET_START;
-  msg->hdr.version = TCPSOCKET_VERSION;
-  msg->hdr.ID = currentMsgID++;
-  msg->hdr.length = datalength;
-  msg->hdr.source = sourceAddress;
-  msg->hdr.address = address;
-  msg->hdr.flags = 0;
+  if ((flags == 0) && (compressThreshold != 0) &&
+      (datalength >= compressThreshold) && conn->peerCompress) {
+    uint16_t packed_len = compressFrame(conn, version, address, ID, data,
+                                        datalength, trailer_len != 0);
+    if (packed_len != 0) {
+      commitSend(conn, packed_len);
+      return TCPSOCKET_SEND_OK;
+    }
+  }
 
-  size_t result = tcpClient.write((uint8_t *)msg, msg_len);
-  if (result != msg_len) {
-    DEBUG3_VALUE("TCPS: under sent ", result);
-    DEBUG3_VALUELN("<", msg_len);
+  if (trailer_len != 0) {
+    /* Built in the send buffer, as the trailer follows the caller's data */
+    uint8_t *dst = conn->sendQueue + conn->sendQueued;
+    fillHeader(dst, version, address, ID, flags | TCPSOCKET_FLAG_TIMESTAMP,
+               datalength + trailer_len);
+    memcpy(dst + hdr_len, data, datalength);
+    fillTimestamp(conn, dst + msg_len, 0);
+    commitSend(conn, msg_len + trailer_len);
+    return TCPSOCKET_SEND_OK;
   }
+
+  fillHeader(msg, version, address, ID, flags, datalength);
+  queueSend(conn, msg, msg_len);
+  return TCPSOCKET_SEND_OK;
 }
 
-const byte *TCPSocket::getMsg(unsigned int *retlen) {
-  return getMsg(sourceAddress, retlen);
+/**
+ * Write the header in front of a message's data
+ */
+void TCPSocket::fillHeader(uint8_t *msg, byte version, socket_addr_t address,
+                           byte ID, byte flags, uint16_t datalength) {
+  if (version == TCPSOCKET_VERSION_2) {
+    tcp_socket_hdr_v2_t *hdr = (tcp_socket_hdr_v2_t *)msg;
+    hdr->start = TCPSOCKET_START;
+    hdr->version = TCPSOCKET_VERSION_2;
+    hdr->ID = ID;
+    hdr->flags = flags;
+    if (compactEnabled) {
+      hdr->flags |= TCPSOCKET_FLAG_COMPACT;
+    }
+    hdr->reserved = 0;
+    hdr->length = datalength;
+    hdr->source = sourceAddress;
+    hdr->address = address;
+  } else {
+    tcp_socket_hdr_t *hdr = (tcp_socket_hdr_t *)msg;
+    hdr->start = TCPSOCKET_START;
+    hdr->version = TCPSOCKET_VERSION;
+    hdr->ID = ID;
+    hdr->length = datalength;
+    hdr->source = sourceAddress;
+    hdr->address = address;
+    /* Advertise that larger messages may be sent with version 2 headers */
+    hdr->flags = flags | TCPSOCKET_FLAG_VERSION_2;
+    if (compactEnabled) {
+      hdr->flags |= TCPSOCKET_FLAG_COMPACT;
+    }
+  }
 }
 
 /**
- * Read data from a connected TCP client
+ * Make room in a client's send buffer for a message, writing out previously
+ * buffered data if needed
  *
- * @param address Socket address (not IP) to accept data for
- * @param retlen  Data size returned
- * @return        Pointer to the data portion of the message
+ * @return false if the client has not accepted enough data for it to fit
  */
-const byte *TCPSocket::getMsg(socket_addr_t address, unsigned int *retlen) {
-  int result;
-  tcp_socket_msg_t *msg = (tcp_socket_msg_t *)recvBuffer;
-  tcp_socket_hdr_t *hdr = &(msg->hdr);
+bool TCPSocket::reserveSend(tcp_socket_conn_t *conn, uint16_t length) {
+  if (conn->sendQueued + length > sendBufferSize) {
+    flushConnection(conn);
+    if (conn->sendQueued + length > sendBufferSize) {
+      DEBUG4_VALUELN("TCPS: send blocked ", conn->sendQueued);
+      TRACELOG(TCPS_TRACE_BLOCKED, conn - connections, conn->sendQueued);
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * Write a framed message to a client, or add it to the client's send buffer
+ * when coalescing or earlier data is still waiting.  The caller must have
+ * reserved space for it.
+ */
+void TCPSocket::queueSend(tcp_socket_conn_t *conn, const uint8_t *msg,
+                          uint16_t msg_len) {
+  if ((conn->sendQueued == 0) && (sendFlushMicros == 0)) {
+    /* Write directly, buffering only what could not be sent */
+    uint16_t result = writeClient(conn, msg, msg_len);
+    if (result < msg_len) {
+      DEBUG4_VALUE("TCPS: under sent ", result);
+      DEBUG4_VALUELN("<", msg_len);
+      TRACELOG(TCPS_TRACE_UNDER_SENT, result, msg_len);
+      memcpy(conn->sendQueue, msg + result, msg_len - result);
+      conn->sendQueued = msg_len - result;
+      conn->sendBlocked = true;
+    }
+    return;
+  }
 
-  uint32_t start;
-  uint8_t *startbytes;
+  memcpy(conn->sendQueue + conn->sendQueued, msg, msg_len);
+  commitSend(conn, msg_len);
+}
 
-  if (!checkClient()) {
-    /* No currently connected client */
-    goto NO_RESULT;
+/**
+ * Add a message that has been written into the free space of a client's send
+ * buffer, writing it out unless coalescing
+ */
+void TCPSocket::commitSend(tcp_socket_conn_t *conn, uint16_t length) {
+  if (conn->sendQueued == 0) {
+    conn->sendQueuedMicros = micros();
   }
+  conn->sendQueued += length;
 
-  if (partialRecv) {
-    /*
-     * If the previous getMsg() call got a header but there was insufficient
-     * data for the complete message then restart from the existing header.
-     */
-    DEBUG5_PRINTLN("TCPS: continuing recv");
-    goto HAVE_HEADER;
+  if ((sendFlushMicros == 0) ||
+      (conn->sendQueued + sizeof (tcp_socket_hdr_t) > sendBufferSize)) {
+    /* Not coalescing, or no further message could be added */
+    flushConnection(conn);
   }
+}
 
-START_VALUE:
-  /* Read available data until we run out or find a start value */
-  if (tcpClient.available() < sizeof (tcp_socket_hdr_t)) {
-    goto NO_RESULT;
+/**
+ * Send a message to every connected client.  The message is framed once and
+ * the same bytes are written to each client.  A client whose send buffer
+ * can't accept the message misses it rather than delaying the others, so the
+ * send buffer bounds how far behind a slow client can fall.  Clients that
+ * receive compact frames are each sent their own encoding, as compact headers
+ * depend on the frames previously sent to the client.  When compressed, the
+ * message is compressed once into the send buffer of the first client that
+ * accepts it and copied from there to the others.  Broadcast messages are not
+ * timestamped, as each client is echoed its own timestamps.
+ *
+ * As with sendMsg(), the data must be preceded by TCPSOCKET_MAX_HDR bytes of
+ * space for the header, and the message must fit in a single frame.
+ *
+ * @return Number of clients the message was sent or buffered for
+ */
+byte TCPSocket::broadcastMsg(const byte *data, uint16_t datalength) {
+  uint32_t start = timingStart();
+  byte sent = 0;
+  byte clients = 0;
+
+  checkFlush();
+  checkClient();
+
+  byte version = (datalength > TCPSOCKET_MAX_DATA_V1) ?
+                 TCPSOCKET_VERSION_2 : TCPSOCKET_VERSION;
+  uint16_t hdr_len = headerSize(version);
+  uint16_t msg_len = hdr_len + datalength;
+  uint8_t *msg = (uint8_t *)data - hdr_len;
+
+  if ((msg_len > sendBufferSize) ||
+      ((fragmentSize != 0) && (datalength > fragmentSize))) {
+    DEBUG3_VALUELN("TCPS: broadcast > frame ", datalength);
+    stats.sendErrors++;
+    return 0;
   }
+  fillHeader(msg, version, SOCKET_ADDR_ANY, currentMsgID, 0, datalength);
 
-  DEBUG5_VALUELN("TCPS: Have avail: ", tcpClient.available());
+  bool compress = (compressThreshold != 0) && (datalength >= compressThreshold);
+  tcp_socket_conn_t *packed_conn = nullptr;
+  const uint8_t *packed = nullptr;
+  uint16_t packed_len = 0;
 
-  /* Read bytes until the full start value is found */
-  start = TCPSOCKET_START;
-  startbytes = (uint8_t *)&start;
-  for (byte i = 0; i < sizeof (hdr->start); i++) {
-    uint8_t *val = (uint8_t *)&(hdr->start) + i;
-    *val = (uint8_t)tcpClient.read();
-    if (*val != startbytes[i]) {
-      /* Didn't get the right start byte, restart */
-      DEBUG5_HEXVAL("TCPS: Not start byte ", *val);
-      DEBUG5_HEXVALLN("!", startbytes[i]);
-      goto START_VALUE;
+  for (byte i = 0; i < maxClients; i++) {
+    tcp_socket_conn_t *conn = &connections[i];
+    if (!conn->active) {
+      continue;
     }
-  }
+    clients++;
 
-  if (hdr->start != TCPSOCKET_START) {
-    DEBUG_ERR("TCPS: Should not reach");
-    goto ERROR_OUT;
-  }
+    int result;
+    if (conn->sendCompact || (compactEnabled && conn->peerCompact)) {
+      result = sendCompactMsg(conn, SOCKET_ADDR_ANY, currentMsgID, 0, data,
+                              datalength);
+    } else if (conn->peerVersion < version) {
+      DEBUG3_VALUELN("TCPS: msg too large for v1 client ", datalength);
+      result = TCPSOCKET_SEND_ERROR;
+    } else if (!reserveSend(conn, msg_len)) {
+      result = TCPSOCKET_WOULD_BLOCK;
+    } else {
+      if (compress && conn->peerCompress && (packed_conn == nullptr)) {
+        packed = conn->sendQueue + conn->sendQueued;
+        packed_len = compressFrame(conn, version, SOCKET_ADDR_ANY,
+                                   currentMsgID, data, datalength, false);
+        if (packed_len != 0) {
+          packed_conn = conn;
+        } else {
+          /* Not worth compressing for any client */
+          compress = false;
+        }
+      }
 
-  /* A start value has been read, get the remainder of the header */
-  result = tcpClient.read((uint8_t *)hdr + sizeof (hdr->start),
-                          sizeof (tcp_socket_hdr_t) - sizeof (hdr->start));
-  if (result + sizeof (hdr->start) < sizeof (tcp_socket_hdr_t)) {
-    DEBUG4_VALUELN("TCPS: recv < hdr sz:", result);
-    goto ERROR_OUT;
+      if (conn == packed_conn) {
+        /* Sent once the others have their copy */
+      } else if (compress && conn->peerCompress) {
+        queueSend(conn, packed, packed_len);
+      } else {
+        queueSend(conn, msg, msg_len);
+      }
+      result = TCPSOCKET_SEND_OK;
+    }
+
+    if (result == TCPSOCKET_SEND_OK) {
+      sent++;
+    } else {
+      stats.broadcastMissed++;
+    }
   }
+  currentMsgID++;
 
-HAVE_HEADER:
-  /*
-   * The full header has been received, validate it before receiving the message
-   * data.
-   */
-  DEBUG5_COMMAND(
-          printHeader(hdr);
-  );
+  if (packed_conn != nullptr) {
+    commitSend(packed_conn, packed_len);
+  }
 
-  if (!validateHeader(hdr)) {
-    DEBUG4_PRINTLN("TCPS: Recv invalid hdr");
-    goto ERROR_OUT;
+  TRACELOG(TCPS_TRACE_BROADCAST, datalength, sent | ((uint32_t)clients << 8));
+  if (sent > 0) {
+    stats.msgsSent++;
   }
+  timingEnd(&stats.sendTiming, start);
+  return sent;
+}
+
+/**
+ * Queue a message to a client as a compact frame, preceded by the header that
+ * switches the connection to compact frames if this is the first.
+ */
+int TCPSocket::sendCompactMsg(tcp_socket_conn_t *conn, socket_addr_t address,
+                              byte ID, byte flags, const byte *data,
+                              uint16_t datalength) {
+  uint8_t hdr[TCPCOMPACT_MAX_HDR];
+  uint16_t start_len = conn->sendCompact ? 0 : sizeof (tcp_socket_hdr_t);
+  uint16_t max_len = start_len + 1 +
+                     TCPCompact::maxEncoded(TCPCOMPACT_MAX_HDR + datalength);
 
-  if (hdr->length > recvBufferSize - sizeof (tcp_socket_hdr_t)) {
-    DEBUG4_VALUELN("TCPS: hdr.len > buf sz ", hdr->length);
-    goto ERROR_OUT;
+  if (max_len > sendBufferSize) {
+    DEBUG3_VALUELN("TCPS: msg > send buf ", max_len);
+    return TCPSOCKET_SEND_ERROR;
   }
 
-  if (tcpClient.available() < hdr->length) {
-    /*
-     * The header was received but there is not yet enough data available
-     * to read the entire packet.  The header is stored in the buffer and will
-     * be reused for the next getMsg() call.
-     */
-    partialRecv = true;
-    DEBUG5_VALUE("TCPS: Incomplete ", tcpClient.available());
-    DEBUG5_VALUELN("<", hdr->length);
-    goto NO_RESULT;
+  if (!reserveSend(conn, max_len)) {
+    return TCPSOCKET_WOULD_BLOCK;
   }
 
-  partialRecv = false;
+  TRACELOG(TCPS_TRACE_SEND, datalength,
+           address | ((uint32_t)ID << 16) | ((uint32_t)flags << 24));
 
-  /* Read the message data */
-  result = tcpClient.read(msg->data, hdr->length);
-  if (result != hdr->length) {
-    DEBUG4_VALUE("TCPS: recv < hdr.len", result);
-    DEBUG4_VALUELN("<", hdr->length);
-    goto ERROR_OUT;
+  if (conn->sendQueued == 0) {
+    conn->sendQueuedMicros = micros();
   }
 
-  DEBUG5_VALUE("TCPS: data len=", result);
-  DEBUG5_COMMAND(
-          print_hex_buffer((const char *)msg->data, hdr->length);
-  );
-  DEBUG_ENDLN();
+  if (!conn->sendCompact) {
+    tcp_socket_hdr_t *start = (tcp_socket_hdr_t *)
+                              (conn->sendQueue + conn->sendQueued);
+    start->start = TCPSOCKET_START;
+    start->version = TCPSOCKET_VERSION_COMPACT;
+    start->ID = ID - 1;
+    start->length = 0;
+    start->flags = TCPSOCKET_FLAG_VERSION_2 | TCPSOCKET_FLAG_COMPACT;
+    start->source = sourceAddress;
+    start->address = address;
+    conn->sendQueued += sizeof (tcp_socket_hdr_t);
 
-  if (SOCKET_ADDRESS_MATCH(address, hdr->address)) {
-    DEBUG5_PRINTLN("TCPS: getmsg good");
-    *retlen = lastRecvSize = hdr->length;
-    return msg->data;
+    conn->sendState.ID = start->ID;
+    conn->sendState.source = start->source;
+    conn->sendState.address = start->address;
+    conn->sendCompact = true;
+    DEBUG4_PRINTLN("TCPS: Sending compact frames");
   }
 
-  DEBUG5_VALUE("TCPS: address mismatch: ", address);
-  DEBUG5_VALUELN("!=", hdr->address);
+  uint8_t hdr_len = TCPCompact::encodeHeader(&conn->sendState, ID, flags,
+                                             sourceAddress, address, hdr);
+  conn->sendQueued += TCPCompact::encode(hdr, hdr_len, data, datalength,
+                                         conn->sendQueue + conn->sendQueued);
 
-ERROR_OUT:
+  if ((sendFlushMicros == 0) ||
+      (conn->sendQueued + TCPCompact::maxEncoded(TCPCOMPACT_MAX_HDR) + 1 >
+       sendBufferSize)) {
+    flushConnection(conn);
+  }
 
-NO_RESULT:
-  *retlen = 0;
-  return nullptr;
+  return TCPSOCKET_SEND_OK;
 }
 
-byte TCPSocket::getLength() {
-  return lastRecvSize;
-}
+/**
+ * Write as much data to a client as can be sent without blocking
+ *
+ * @return Number of bytes written
+ */
+uint16_t TCPSocket::writeClient(tcp_socket_conn_t *conn, const uint8_t *data,
+                                uint16_t length) {
+#if defined(ESP32)
+  /* WiFiClient::write() waits for buffer space, so send directly */
+  int result = send(conn->client.fd(), data, length, MSG_DONTWAIT);
+  if (result < 0) {
+    if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+      DEBUG3_VALUELN("TCPS: send error ", errno);
+    }
+    result = 0;
+  }
+#else
+  int result = conn->client.write(data, length);
+#endif
 
-void *TCPSocket::headerFromData(const void *data) {
-  return ((tcp_socket_hdr_t *)((uint8_t *)data - sizeof (tcp_socket_hdr_t)));
+  stats.bytesWritten += result;
+  if ((captureOut != nullptr) && (result > 0)) {
+    captureData(conn, TCPCAPTURE_SEND, data, result);
+  }
+  if (result < length) {
+    stats.underSends++;
+  }
+  return result;
 }
 
-socket_addr_t TCPSocket::sourceFromData(void *data) {
-  return ((tcp_socket_hdr_t *)headerFromData(data))->source;
-}
+/**
+ * Size the per-client send buffers and configure coalescing of sent messages.
+ * When coalescing, a client's buffered messages are written together once the
+ * buffer is full, the oldest message has waited flushMicros, or flush() is
+ * called.
+ *
+ * @param size        Size of the per-client send buffer, which limits both the
+ *                    largest message and the data buffered when a client
+ *                    can't keep up
+ * @param flushMicros Maximum time a message may wait to be combined with
+ *                    others, 0 to write every message immediately
+ * @return false if the size can't hold a header and data, differs from the
+ *         size of buffers provided by TCPSocketT, a client has data that
+ *         could not be written, or the buffers could not be allocated
+ */
+bool TCPSocket::setSendQueue(uint16_t size, unsigned long flushMicros) {
+  if (size <= TCPSOCKET_MAX_HDR) {
+    DEBUG2_VALUELN("TCPS: Send buf too small ", size);
+    return false;
+  }
 
-socket_addr_t TCPSocket::destFromData(void *data) {
-  return ((tcp_socket_hdr_t *)headerFromData(data))->address;
-}
+  if (!ownsStorage) {
+    /* Buffers provided by TCPSocketT have a fixed size */
+    if (size != sendBufferSize) {
+      return false;
+    }
+    sendFlushMicros = flushMicros;
+    return true;
+  }
 
-bool TCPSocket::connected() {
-  return checkClient();
-}
+  flush();
 
-void TCPSocket::printHeader(tcp_socket_hdr_t *hdr, bool dump) {
-  DEBUG3_HEXVAL("TCPS: hdr start:", hdr->start);
-  DEBUG3_VALUE(" ver:", hdr->version);
-  DEBUG3_VALUE(" id:", hdr->ID);
-  DEBUG3_VALUE(" len:", hdr->length);
-  DEBUG3_HEXVAL(" flags:", hdr->flags);
-  DEBUG3_VALUE(" source:", hdr->source);
-  DEBUG3_VALUELN(" dest:", hdr->address);
+  for (byte i = 0; i < maxClients; i++) {
+    if (connections[i].sendQueued > 0) {
+      DEBUG2_VALUELN("TCPS: Can't resize send buf, queued ", i);
+      return false;
+    }
+  }
+
+  /* Allocate every buffer first, so that failure changes nothing */
+  uint8_t **queues = new uint8_t *[maxClients];
+  for (byte i = 0; i < maxClients; i++) {
+    queues[i] = (uint8_t *)malloc(size);
+    if (queues[i] == nullptr) {
+      DEBUG_ERR("TCPS: Failed to alloc send buf");
+      while (i > 0) {
+        free(queues[--i]);
+      }
+      delete[] queues;
+      return false;
+    }
+  }
+
+  for (byte i = 0; i < maxClients; i++) {
+    free(connections[i].sendQueue);
+    connections[i].sendQueue = queues[i];
+  }
+  delete[] queues;
+  sendBufferSize = size;
+  sendFlushMicros = flushMicros;
+
+  return true;
+}
+
+/**
+ * Borrow the copy buffers used for messages that wrap the receive buffer, and
+ * for decoding compact frames, from a pool shared with other sockets.  A
+ * connection only holds a frame while a copied message is in use, so the pool
+ * can be sized for the messages outstanding across every socket rather than
+ * a buffer per client.  Frames must be at least the receive buffer size.
+ *
+ * @param pool Pool to borrow from, nullptr to use per-connection buffers
+ * @return false if the pool's frames are too small, the buffers were provided
+ *         by TCPSocketT, a view holds a copy buffer, or per-connection
+ *         buffers could not be allocated
+ */
+bool TCPSocket::setFramePool(TCPFramePool *pool) {
+  if (!ownsStorage) {
+    /* Buffers provided by TCPSocketT are always used */
+    return false;
+  }
+  if ((pool != nullptr) && (pool->frameSize() < recvBufferSize)) {
+    DEBUG2_VALUELN("TCPS: Pool frames < buf sz ", pool->frameSize());
+    return false;
+  }
+  if ((pool == nullptr) && (framePool == nullptr)) {
+    return true;
+  }
+
+  for (byte i = 0; i < maxClients; i++) {
+    if (connections[i].recvBufferHeld) {
+      DEBUG2_VALUELN("TCPS: Can't change copy buf, held ", i);
+      return false;
+    }
+  }
+
+  /* Allocate per-connection buffers first, so that failure changes nothing */
+  uint8_t **buffers = nullptr;
+  if (pool == nullptr) {
+    buffers = new uint8_t *[maxClients];
+    for (byte i = 0; i < maxClients; i++) {
+      buffers[i] = (uint8_t *)malloc(recvBufferSize);
+      if (buffers[i] == nullptr) {
+        DEBUG_ERR("TCPS: Failed to alloc copy buf");
+        while (i > 0) {
+          free(buffers[--i]);
+        }
+        delete[] buffers;
+        return false;
+      }
+    }
+  }
+
+  for (byte i = 0; i < maxClients; i++) {
+    tcp_socket_conn_t *conn = &connections[i];
+    if (framePool != nullptr) {
+      releaseCopyBuffer(conn);
+    } else {
+      free(conn->recvBuffer);
+    }
+    conn->recvBuffer = (buffers != nullptr) ? buffers[i] : nullptr;
+  }
+  delete[] buffers;
+  framePool = pool;
+
+  return true;
+}
+
+/**
+ * Make sure a connection has a copy buffer, borrowing a frame from the pool
+ * if it doesn't.
+ *
+ * @return false if no frame is available, in which case the message remains
+ *         in the receive buffer until one is
+ */
+bool TCPSocket::borrowCopyBuffer(tcp_socket_conn_t *conn) {
+  if (conn->recvBuffer != nullptr) {
+    return true;
+  }
+  if (framePool != nullptr) {
+    conn->recvBuffer = framePool->allocFrame();
+  }
+  if (conn->recvBuffer == nullptr) {
+    DEBUG5_PRINTLN("TCPS: No copy buffer");
+    TRACELOG(TCPS_TRACE_POOL_EMPTY, conn - connections, 0);
+    stats.poolEmpty++;
+    return false;
+  }
+  return true;
+}
+
+/**
+ * Return a connection's borrowed copy buffer to the pool, unless a view holds
+ * it
+ */
+void TCPSocket::releaseCopyBuffer(tcp_socket_conn_t *conn) {
+  if ((framePool != nullptr) && (conn->recvBuffer != nullptr) &&
+      !conn->recvBufferHeld) {
+    framePool->release(conn->recvBuffer);
+    conn->recvBuffer = nullptr;
+  }
+}
+
+/**
+ * Number of bytes waiting to be written to the client for an address, which
+ * callers can use to throttle before sends would block.
+ */
+uint16_t TCPSocket::queuedBytes(socket_addr_t address) {
+  tcp_socket_conn_t *conn = routeConnection(address);
+  if (conn == nullptr) {
+    return 0;
+  }
+  return conn->sendQueued;
+}
+
+/**
+ * Write as much of a client's buffered data as possible, keeping the unsent
+ * remainder at the front of the buffer.
+ *
+ * @return true if the buffer was completely written
+ */
+bool TCPSocket::flushConnection(tcp_socket_conn_t *conn) {
+  if (conn->sendQueued == 0) {
+    return true;
+  }
+
+  uint16_t result = writeClient(conn, conn->sendQueue, conn->sendQueued);
+  DEBUG5_VALUE("TCPS: Flushed ", result);
+  DEBUG5_VALUELN("/", conn->sendQueued);
+  TRACELOG(TCPS_TRACE_FLUSH, result, conn->sendQueued);
+
+  conn->sendQueued -= result;
+  if (conn->sendQueued > 0) {
+    memmove(conn->sendQueue, conn->sendQueue + result, conn->sendQueued);
+    conn->sendBlocked = true;
+    return false;
+  }
+
+  conn->sendBlocked = false;
+  return true;
+}
+
+/**
+ * Write any buffered messages to all clients
+ *
+ * @return true if all buffered data was written
+ */
+bool TCPSocket::flush() {
+  bool flushed = true;
+  for (byte i = 0; i < maxClients; i++) {
+    if (connections[i].active && !flushConnection(&connections[i])) {
+      flushed = false;
+    }
+  }
+  return flushed;
+}
+
+/**
+ * Resume writing data that previously could not be sent, and write coalesced
+ * messages that have reached the flush deadline.
+ */
+void TCPSocket::checkFlush() {
+  if (peers != nullptr) {
+    checkReliable();
+  }
+
+  unsigned long now = micros();
+  for (byte i = 0; i < maxClients; i++) {
+    tcp_socket_conn_t *conn = &connections[i];
+    if (!conn->active || (conn->sendQueued == 0)) {
+      continue;
+    }
+    if (conn->sendBlocked ||
+        (now - conn->sendQueuedMicros >= sendFlushMicros)) {
+      flushConnection(conn);
+    }
+  }
+}
+
+const byte *TCPSocket::getMsg(unsigned int *retlen) {
+  return getMsg(sourceAddress, retlen);
+}
+
+/**
+ * Read data from the connected TCP clients, which are serviced in turn with
+ * each receiving up to its weight in messages before moving to the next.
+ *
+ * @param address Socket address (not IP) to accept data for
+ * @param retlen  Data size returned
+ * @return        Pointer to the data portion of the message
+ */
+const byte *TCPSocket::getMsg(socket_addr_t address, unsigned int *retlen) {
+  tcp_socket_frame_t frame;
+  *retlen = 0;
+
+  checkFlush();
+
+  if (!checkClient()) {
+    /* No currently connected client */
+    return nullptr;
+  }
+
+  for (byte i = 0; i < maxClients; i++) {
+    tcp_socket_conn_t *conn = &connections[nextClient];
+
+    if (recvFrom(nextClient, address, &frame)) {
+      if (++conn->turnMsgs >= conn->weight) {
+        advanceClient();
+      }
+      *retlen = frame.length;
+      return frame.data;
+    }
+    advanceClient();
+  }
+
+  return nullptr;
+}
+
+/**
+ * End the current client's turn
+ */
+void TCPSocket::advanceClient() {
+  connections[nextClient].turnMsgs = 0;
+  nextClient = (nextClient + 1) % maxClients;
+}
+
+/**
+ * Pass every complete message available from the connected clients to a
+ * handler, servicing the clients in turn as getMsg() does so that a client
+ * with many messages waiting doesn't delay the others.
+ *
+ * @param address   Socket address (not IP) to accept data for
+ * @param handler   Function called with each message, the message data is
+ *                  only valid for the duration of the call
+ * @param arg       Argument passed through to the handler
+ * @param maxMsgs   Maximum number of messages to handle, 0 for no limit
+ * @param maxMicros Time after which no further messages are handled, 0 for no
+ *                  limit
+ * @return          Number of messages handled
+ */
+unsigned int TCPSocket::getMsgs(socket_addr_t address,
+                                tcp_socket_handler_t handler, void *arg,
+                                unsigned int maxMsgs,
+                                unsigned long maxMicros) {
+  tcp_socket_frame_t frame;
+  unsigned long startMicros = micros();
+  unsigned int handled = 0;
+
+  checkFlush();
+
+  if (!checkClient()) {
+    return 0;
+  }
+
+  bool received;
+  do {
+    received = false;
+    for (byte i = 0; i < maxClients; i++) {
+      tcp_socket_conn_t *conn = &connections[nextClient];
+
+      while ((conn->turnMsgs < conn->weight) &&
+             recvFrom(nextClient, address, &frame)) {
+        conn->turnMsgs++;
+        handler(&frame, arg);
+        handled++;
+        received = true;
+
+        if (((maxMsgs != 0) && (handled >= maxMsgs)) ||
+            ((maxMicros != 0) && (micros() - startMicros >= maxMicros))) {
+          /* Out of budget, the next call resumes with this client's turn */
+          if (conn->turnMsgs >= conn->weight) {
+            advanceClient();
+          }
+          return handled;
+        }
+      }
+
+      advanceClient();
+    }
+  } while (received);
+
+  return handled;
+}
+
+unsigned int TCPSocket::getMsgs(tcp_socket_handler_t handler, void *arg,
+                                unsigned int maxMsgs,
+                                unsigned long maxMicros) {
+  return getMsgs(sourceAddress, handler, arg, maxMsgs, maxMicros);
+}
+
+/**
+ * Get the next message from a client, parsing already buffered data before
+ * reading more from the network.
+ *
+ * @param hold Keep the message's data in place until it is released
+ */
+bool TCPSocket::recvFrom(byte index, socket_addr_t address,
+                         tcp_socket_frame_t *frame, bool hold) {
+  tcp_socket_conn_t *conn = &connections[index];
+  if (!conn->active) {
+    return false;
+  }
+
+  /* The last message returned from the connection is no longer in use */
+  releaseCopyBuffer(conn);
+
+  uint32_t start = timingStart();
+  conn->rateLimited = false;
+  if (!parseMsg(conn, address, frame, hold)) {
+    /* Leave data over a rate limit with the client, to slow its sending */
+    if (conn->rateLimited || (fillBuffer(conn) == 0)) {
+      return false;
+    }
+    if (!parseMsg(conn, address, frame, hold)) {
+      return false;
+    }
+  }
+
+  lastClient = index;
+  lastRecvSize = frame->length;
+  stats.msgsRecv++;
+  stats.bytesRecv += frame->length;
+  timingEnd(&stats.recvTiming, start);
+  return true;
+}
+
+/**
+ * Register the handler for messages sent to an address, replacing any existing
+ * handler for it.  The handler for SOCKET_ADDR_ANY receives messages for
+ * addresses without their own handler, and messages sent to SOCKET_ADDR_ANY
+ * are passed to every handler.  A null handler removes the address.
+ *
+ * @return false if TCPSOCKET_MAX_HANDLERS addresses already have handlers
+ */
+bool TCPSocket::setHandler(socket_addr_t address,
+                           tcp_socket_handler_t handler, void *arg) {
+  if (address == SOCKET_ADDR_ANY) {
+    anyHandler = handler;
+    anyArg = arg;
+    return true;
+  }
+
+  uint16_t index = findHandler(address);
+  tcp_socket_dispatch_t *entry = &dispatchTable[index];
+
+  if (handler != nullptr) {
+    if (entry->handler == nullptr) {
+      if (numHandlers >= TCPSOCKET_MAX_HANDLERS) {
+        DEBUG_ERR("TCPS: Too many handlers");
+        return false;
+      }
+      numHandlers++;
+    }
+    entry->address = address;
+    entry->handler = handler;
+    entry->arg = arg;
+    return true;
+  }
+
+  if (entry->handler == nullptr) {
+    return true;
+  }
+
+  /*
+   * Remove the entry and move back any later entries in the same probe
+   * sequence that could occupy its slot, so that lookups never need to skip
+   * over removed entries.
+   */
+  const uint16_t mask = DISPATCH_SIZE - 1;
+  uint16_t empty = index;
+  for (uint16_t next = (index + 1) & mask;
+       dispatchTable[next].handler != nullptr;
+       next = (next + 1) & mask) {
+    uint16_t home = dispatchIndex(dispatchTable[next].address);
+    if (((next - home) & mask) >= ((next - empty) & mask)) {
+      dispatchTable[empty] = dispatchTable[next];
+      empty = next;
+    }
+  }
+  dispatchTable[empty].handler = nullptr;
+  numHandlers--;
+  return true;
+}
+
+/**
+ * Handle all available messages with the handlers registered with setHandler(),
+ * subject to a message count or time limit
+ */
+unsigned int TCPSocket::dispatchMsgs(unsigned int maxMsgs,
+                                     unsigned long maxMicros) {
+  return getMsgs(SOCKET_ADDR_ANY, dispatchFrame, this, maxMsgs, maxMicros);
+}
+
+void TCPSocket::dispatchFrame(const tcp_socket_frame_t *frame, void *arg) {
+  TCPSocket *self = (TCPSocket *)arg;
+
+  if (frame->address == SOCKET_ADDR_ANY) {
+    for (uint16_t i = 0; i < DISPATCH_SIZE; i++) {
+      tcp_socket_dispatch_t *entry = &self->dispatchTable[i];
+      if (entry->handler != nullptr) {
+        entry->handler(frame, entry->arg);
+      }
+    }
+  } else {
+    tcp_socket_dispatch_t *entry =
+      &self->dispatchTable[self->findHandler(frame->address)];
+    if (entry->handler != nullptr) {
+      entry->handler(frame, entry->arg);
+      return;
+    }
+  }
+
+  if (self->anyHandler != nullptr) {
+    self->anyHandler(frame, self->anyArg);
+  } else if (frame->address != SOCKET_ADDR_ANY) {
+    DEBUG4_VALUELN("TCPS: No handler for ", frame->address);
+  }
+}
+
+void TCPSocket::clearHandlers() {
+  for (uint16_t i = 0; i < DISPATCH_SIZE; i++) {
+    dispatchTable[i].handler = nullptr;
+  }
+  numHandlers = 0;
+  anyHandler = nullptr;
+  anyArg = nullptr;
+}
+
+/**
+ * Find the dispatch table entry for an address, or the unused entry where it
+ * would be added
+ */
+uint16_t TCPSocket::findHandler(socket_addr_t address) {
+  const uint16_t mask = DISPATCH_SIZE - 1;
+  uint16_t index = dispatchIndex(address);
+  while ((dispatchTable[index].handler != nullptr) &&
+         (dispatchTable[index].address != address)) {
+    index = (index + 1) & mask;
+  }
+  return index;
+}
+
+bool TCPSocket::getView(tcp_socket_view_t *view) {
+  return getView(sourceAddress, view);
+}
+
+/**
+ * Receive a message as a view into the receive buffer rather than a copy.
+ * The view's data remains valid until the view is passed to releaseView(),
+ * and up to TCPSOCKET_MAX_VIEWS views per client may be outstanding.  While
+ * views are outstanding the space they occupy can't receive new data, so they
+ * should be released promptly and in roughly the order they were received.
+ *
+ * @return true if a message was received
+ */
+bool TCPSocket::getView(socket_addr_t address, tcp_socket_view_t *view) {
+  checkFlush();
+
+  if (!checkClient()) {
+    return false;
+  }
+
+  for (byte i = 0; i < maxClients; i++) {
+    byte index = nextClient;
+    tcp_socket_conn_t *conn = &connections[index];
+
+    if ((conn->viewCount < TCPSOCKET_MAX_VIEWS) &&
+        recvFrom(index, address, &view->frame, true)) {
+      if (++conn->turnMsgs >= conn->weight) {
+        advanceClient();
+      }
+      view->client = index;
+      view->slot = (conn->viewFirst + conn->viewCount - 1) %
+                   TCPSOCKET_MAX_VIEWS;
+      return true;
+    }
+    advanceClient();
+  }
+
+  return false;
+}
+
+/**
+ * Release a view, freeing its receive buffer space once all views received
+ * before it have also been released.
+ */
+void TCPSocket::releaseView(tcp_socket_view_t *view) {
+  tcp_socket_conn_t *conn = &connections[view->client];
+  conn->viewReleased[view->slot] = true;
+
+  while ((conn->viewCount > 0) && conn->viewReleased[conn->viewFirst]) {
+    if (conn->viewCopied[conn->viewFirst]) {
+      conn->recvBufferHeld = false;
+    }
+    if (conn->viewFragment[conn->viewFirst]) {
+      conn->fragHeld = false;
+    }
+    conn->viewFirst = (conn->viewFirst + 1) % TCPSOCKET_MAX_VIEWS;
+    conn->viewCount--;
+  }
+
+  if (conn->viewCount > 0) {
+    conn->ring.release(conn->viewStart[conn->viewFirst]);
+  } else {
+    conn->ring.release(conn->ring.position());
+  }
+  releaseCopyBuffer(conn);
+}
+
+/**
+ * Read available data from a client into its receive buffer with a single
+ * bulk read, plus a second read only when the free space wraps around the end
+ * of the buffer.
+ *
+ * @return Number of bytes read
+ */
+uint16_t TCPSocket::fillBuffer(tcp_socket_conn_t *conn) {
+  uint16_t total = 0;
+
+  for (byte i = 0; i < 2; i++) {
+    uint16_t space;
+    uint8_t *dst = conn->ring.writePtr(&space);
+    if (space == 0) {
+      break;
+    }
+
+    int result = conn->client.read(dst, space);
+    if (result <= 0) {
+      break;
+    }
+    conn->ring.commit(result);
+    conn->lastRecvMillis = millis();
+    if (captureOut != nullptr) {
+      captureData(conn, TCPCAPTURE_RECV, dst, result);
+    }
+    total += result;
+    stats.bytesRead += result;
+    DEBUG5_VALUELN("TCPS: Read ", result);
+    TRACELOG(TCPS_TRACE_READ, conn - connections, result);
+
+    if (result < space) {
+      break;
+    }
+  }
+
+  return total;
+}
+
+/**
+ * Parse a message from the data buffered for a single client
+ *
+ * @param hold Record the message as an outstanding view, keeping its data in
+ *             place until the view is released
+ * @return true if a message for the address was parsed into frame
+ */
+bool TCPSocket::parseMsg(tcp_socket_conn_t *conn,
+                         socket_addr_t address,
+                         tcp_socket_frame_t *frame,
+                         bool hold) {
+  TCPRingBuffer *ring = &conn->ring;
+  const uint8_t *msg;
+  bool copied;
+  bool flagged;
+  bool compressed;
+  bool stamped;
+  socket_addr_t source;
+  tcp_socket_timestamp_t timestamp;
+  tcp_socket_hdr_any_t hdr;
+  uint16_t hdr_len;
+  uint16_t msg_len;
+  int offset;
+
+NEXT_MSG:
+  if (conn->recvCompact) {
+    return parseCompact(conn, address, frame, hold);
+  }
+
+  if (ring->used() < sizeof (tcp_socket_hdr_t)) {
+    goto NO_RESULT;
+  }
+
+  /* Locate a start value, discarding any data preceding it */
+  offset = ring->find(TCPSOCKET_START);
+  if (offset < 0) {
+    /* Keep any trailing bytes that could be the beginning of a start value */
+    offset = ring->used() - (sizeof (hdr.v1.start) - 1);
+  }
+  if (offset > 0) {
+    DEBUG5_VALUELN("TCPS: Skipped ", offset);
+    TRACELOG(TCPS_TRACE_SKIPPED, conn - connections, offset);
+    stats.bytesSkipped += offset;
+    ring->consume(offset);
+  }
+
+  if (ring->used() < sizeof (tcp_socket_hdr_t)) {
+    goto NO_RESULT;
+  }
+
+  /*
+   * A header of the minimum size has been received, validate it to determine
+   * the protocol version before receiving the remainder.
+   */
+  ring->copyOut(0, &hdr, sizeof (tcp_socket_hdr_t));
+  if (!validateHeader(&hdr.v1)) {
+    DEBUG4_PRINTLN("TCPS: Recv invalid hdr");
+    TRACELOG(TCPS_TRACE_INVALID, conn - connections, 0);
+    stats.invalidHeaders++;
+    goto RESYNC;
+  }
+
+  hdr_len = headerSize(hdr.v1.version);
+  if (ring->used() < hdr_len) {
+    goto NO_RESULT;
+  }
+  ring->copyOut(0, &hdr, hdr_len);
+  DEBUG5_COMMAND(
+          printHeader(&hdr);
+  );
+
+  if (hdr.v1.version == TCPSOCKET_VERSION_COMPACT) {
+    /* The client has switched to compact frames */
+    DEBUG4_PRINTLN("TCPS: Receiving compact frames");
+    TRACELOG(TCPS_TRACE_COMPACT, conn - connections, 0);
+    conn->recvCompact = true;
+    conn->recvState.ID = hdr.v1.ID;
+    conn->recvState.source = hdr.v1.source;
+    conn->recvState.address = hdr.v1.address;
+    if (hdr.v1.flags & TCPSOCKET_FLAG_COMPACT) {
+      conn->peerCompact = true;
+    }
+    negotiatePeer(conn);
+    ring->consume(hdr_len);
+    goto NEXT_MSG;
+  }
+
+  if (hdr.v1.version == TCPSOCKET_VERSION_2) {
+    frame->length = hdr.v2.length;
+    frame->flags = hdr.v2.flags;
+  } else {
+    frame->length = hdr.v1.length;
+    frame->flags = hdr.v1.flags;
+  }
+  frame->version = hdr.v1.version;
+  frame->ID = hdr.v1.ID;
+  TRACELOG(TCPS_TRACE_HEADER, frame->length,
+           frame->version | ((uint32_t)frame->ID << 8) |
+           ((uint32_t)frame->flags << 16));
+
+  /* A version 2 header makes this and all later flags meaningful */
+  flagged = negotiated(conn) || (frame->version == TCPSOCKET_VERSION_2);
+
+  if (flagged && conn->fragHeld && (frame->flags & TCPSOCKET_FLAG_FRAGMENT)) {
+    /* Wait for the view using the reassembly buffer to be released */
+    DEBUG5_PRINTLN("TCPS: Reassembly buffer held");
+    TRACELOG(TCPS_TRACE_HELD, conn - connections, 1);
+    goto NO_RESULT;
+  }
+
+  if (frame->length > recvBufferSize - hdr_len) {
+    DEBUG4_VALUELN("TCPS: hdr.len > buf sz ", frame->length);
+    TRACELOG(TCPS_TRACE_OVERSIZED, conn - connections, frame->length);
+    stats.oversized++;
+    goto RESYNC;
+  }
+
+  msg_len = hdr_len + frame->length;
+  if (ring->used() < msg_len) {
+    /*
+     * The header was received but there is not yet enough data available
+     * for the entire packet.  The data remains buffered and the header will
+     * be parsed again on the next getMsg() call.
+     */
+    DEBUG5_VALUE("TCPS: Incomplete ", ring->used());
+    DEBUG5_VALUELN("<", msg_len);
+    TRACELOG(TCPS_TRACE_INCOMPLETE, ring->used(), msg_len);
+    stats.incomplete++;
+    goto NO_RESULT;
+  }
+  if (frame->version == TCPSOCKET_VERSION_2) {
+    negotiatePeer(conn);
+  }
+
+  /* Remove the timestamp trailer, and the message if it only carries that */
+  stamped = flagged && (frame->flags & TCPSOCKET_FLAG_TIMESTAMP);
+  if (stamped) {
+    if (frame->length < sizeof (timestamp)) {
+      DEBUG4_VALUELN("TCPS: Recv short timestamped msg ", frame->length);
+      TRACELOG(TCPS_TRACE_INVALID, conn - connections, 0);
+      stats.invalidHeaders++;
+      ring->consume(msg_len);
+      goto NEXT_MSG;
+    }
+    frame->length -= sizeof (timestamp);
+    frame->flags &= ~TCPSOCKET_FLAG_TIMESTAMP;
+    ring->copyOut(msg_len - sizeof (timestamp), &timestamp,
+                  sizeof (timestamp));
+    if (timestamp.echoDelay & TCPSOCKET_TIMESTAMP_ONLY) {
+      recvTimestamp(conn, &timestamp);
+      ring->consume(msg_len);
+      goto NEXT_MSG;
+    }
+  }
+
+  source = (hdr.v1.version == TCPSOCKET_VERSION_2) ?
+           hdr.v2.source : hdr.v1.source;
+  if (!admitMsg(conn, source)) {
+    goto NO_RESULT;
+  }
+
+  /*
+   * Return the message directly from the receive buffer unless it wraps, in
+   * which case it is copied out to be contiguous.  Compressed messages are
+   * always decompressed into the copy buffer.
+   */
+  compressed = flagged && (frame->flags & TCPSOCKET_FLAG_COMPRESSED) &&
+               (frame->length > 0);
+  msg = compressed ? nullptr : ring->contiguous(0, msg_len);
+  copied = (msg == nullptr);
+  if (copied) {
+    if (conn->recvBufferHeld) {
+      /* Wait for the view using the copy buffer to be released */
+      DEBUG5_PRINTLN("TCPS: Copy buffer held");
+      TRACELOG(TCPS_TRACE_HELD, conn - connections, 0);
+      goto NO_RESULT;
+    }
+    if (!borrowCopyBuffer(conn)) {
+      goto NO_RESULT;
+    }
+    if (!compressed) {
+      ring->copyOut(0, conn->recvBuffer, msg_len);
+    } else if (!decompressMsg(conn, hdr_len, frame)) {
+      TRACELOG(TCPS_TRACE_INVALID, conn - connections, 0);
+      stats.invalidHeaders++;
+      ring->consume(msg_len);
+      goto NEXT_MSG;
+    }
+    msg = conn->recvBuffer;
+  }
+  chargeMsg(conn, source, frame->length);
+
+  frame->data = msg + hdr_len;
+  /* The addresses end every header version */
+  frame->source = sourceFromData((void *)frame->data);
+  frame->address = destFromData((void *)frame->data);
+
+  if (stamped) {
+    recvTimestamp(conn, &timestamp);
+  }
+
+  if (finishMsg(conn, address, frame, msg_len, copied, hold)) {
+    return true;
+  }
+  goto NEXT_MSG;
+
+RESYNC:
+  /* Skip this start value and search for the next one */
+  stats.bytesSkipped++;
+  ring->consume(1);
+  goto NEXT_MSG;
+
+NO_RESULT:
+  return false;
+}
+
+/**
+ * Complete the receipt of a parsed message, consuming it from the receive
+ * buffer or holding it for a view.
+ *
+ * @param msg_len Size of the message in the receive buffer
+ * @param copied  The frame's data is in the connection's copy buffer
+ * @return true if the message is for the address and should be delivered
+ */
+bool TCPSocket::finishMsg(tcp_socket_conn_t *conn, socket_addr_t address,
+                          tcp_socket_frame_t *frame, uint16_t msg_len,
+                          bool copied, bool hold) {
+  TCPRingBuffer *ring = &conn->ring;
+  bool flagged = negotiated(conn);
+  bool deliver = SOCKET_ADDRESS_MATCH(address, frame->address);
+  if (!deliver) {
+    stats.addressMismatch++;
+  }
+
+  if ((frame->version == TCPSOCKET_VERSION_2) && (frame->length == 0) &&
+      (frame->flags & TCPSOCKET_FLAG_VERSION_2)) {
+    /* Announcement that the client accepts version 2, already negotiated */
+    deliver = false;
+  }
+
+  if (flagged && (frame->flags & TCPSOCKET_FLAG_COMPRESSED) &&
+      (frame->length == 0)) {
+    /* The client accepts compressed messages */
+    conn->peerCompress = true;
+    deliver = false;
+  }
+
+  if (flagged &&
+      (frame->flags & (TCPSOCKET_FLAG_RELIABLE | TCPSOCKET_FLAG_ACK))) {
+    /* Acknowledgements and duplicate messages are not delivered */
+    if (peers != nullptr) {
+      if (!recvReliable(conn, frame)) {
+        deliver = false;
+      }
+    } else if (frame->flags & TCPSOCKET_FLAG_ACK) {
+      deliver = false;
+    }
+  }
+
+  /* Fragments are delivered once the entire message has been received */
+  bool reassembled = false;
+  if (deliver && flagged && (frame->flags & TCPSOCKET_FLAG_FRAGMENT) &&
+      (conn->fragBuffer != nullptr)) {
+    reassembled = addFragment(conn, frame);
+    deliver = reassembled;
+  }
+
+  if (hold && deliver) {
+    byte slot = (conn->viewFirst + conn->viewCount) % TCPSOCKET_MAX_VIEWS;
+    conn->viewStart[slot] = ring->position();
+    conn->viewReleased[slot] = false;
+    conn->viewCopied[slot] = copied && !reassembled;
+    conn->viewFragment[slot] = reassembled;
+    conn->viewCount++;
+    if (reassembled) {
+      /* The message is in the reassembly buffer, not the receive buffer */
+      conn->fragHeld = true;
+      hold = false;
+    } else if (copied) {
+      /* The copy holds the data, so the receive buffer space can be freed */
+      conn->recvBufferHeld = true;
+      hold = false;
+    }
+  } else {
+    hold = false;
+  }
+  ring->consume(msg_len, hold);
+
+  DEBUG5_VALUE("TCPS: data len=", frame->length);
+  DEBUG5_COMMAND(
+          print_hex_buffer((const char *)frame->data, frame->length);
+  );
+  DEBUG_ENDLN();
+
+  /* Remember the sender's address and protocol support for replies */
+  conn->peerAddress = frame->source;
+  if (flagged && (frame->flags & TCPSOCKET_FLAG_COMPACT)) {
+    conn->peerCompact = true;
+  }
+
+  if (deliver) {
+    DEBUG5_PRINTLN("TCPS: getmsg good");
+    TRACELOG(TCPS_TRACE_RECV, frame->length,
+             frame->source | ((uint32_t)frame->address << 16));
+    return true;
+  }
+
+  DEBUG5_VALUE("TCPS: not delivered for ", address);
+  DEBUG5_VALUELN(" dest:", frame->address);
+  TRACELOG(TCPS_TRACE_NOT_DELIVERED, address, frame->address);
+  return false;
+}
+
+/**
+ * Parse the next compact frame from a client.  Frames are always decoded into
+ * the connection's copy buffer, behind a regular header so that the functions
+ * taking message data work as they do for other messages.
+ */
+bool TCPSocket::parseCompact(tcp_socket_conn_t *conn, socket_addr_t address,
+                             tcp_socket_frame_t *frame, bool hold) {
+  TCPRingBuffer *ring = &conn->ring;
+  uint8_t *msg;
+  TCPCompact compact;
+  tcp_compact_state_t state;
+  int end;
+  int len;
+  int hdr_len;
+  uint16_t data_offset;
+
+NEXT_MSG:
+  end = ring->findByte(TCPCOMPACT_DELIMITER);
+  if (end < 0) {
+    if (ring->used() > TCPCompact::maxEncoded(recvBufferSize)) {
+      /* Too long to be a frame, skip data until the next delimiter */
+      DEBUG4_VALUELN("TCPS: Skipped ", ring->used());
+      TRACELOG(TCPS_TRACE_SKIPPED, conn - connections, ring->used());
+      stats.bytesSkipped += ring->used();
+      ring->discard();
+    }
+    goto NO_RESULT;
+  }
+  if (end == 0) {
+    ring->consume(1);
+    goto NEXT_MSG;
+  }
+
+  if (conn->recvBufferHeld) {
+    /* Wait for the view using the copy buffer to be released */
+    DEBUG5_PRINTLN("TCPS: Copy buffer held");
+    TRACELOG(TCPS_TRACE_HELD, conn - connections, 0);
+    goto NO_RESULT;
+  }
+  if (!borrowCopyBuffer(conn)) {
+    goto NO_RESULT;
+  }
+  msg = conn->recvBuffer;
+
+  compact.beginDecode(msg, recvBufferSize);
+  for (uint16_t offset = 0; offset < end; ) {
+    uint16_t segment_len = end - offset;
+    const uint8_t *segment = ring->segment(offset, &segment_len);
+    if (!compact.decode(segment, segment_len)) {
+      break;
+    }
+    offset += segment_len;
+  }
+  len = compact.endDecode();
+  if (len < 0) {
+    DEBUG4_PRINTLN("TCPS: Recv invalid compact frame");
+    TRACELOG(TCPS_TRACE_INVALID, conn - connections, 0);
+    stats.invalidHeaders++;
+    goto SKIP;
+  }
+
+  state = conn->recvState;
+  hdr_len = TCPCompact::decodeHeader(&conn->recvState, msg, len,
+                                     &frame->flags);
+  if (hdr_len < 0) {
+    DEBUG4_PRINTLN("TCPS: Recv invalid compact hdr");
+    TRACELOG(TCPS_TRACE_INVALID, conn - connections, 0);
+    stats.invalidHeaders++;
+    goto SKIP;
+  }
+  if (conn->fragHeld && (frame->flags & TCPSOCKET_FLAG_FRAGMENT)) {
+    /* Decoding updated the header fields, restore them to decode again */
+    conn->recvState = state;
+    DEBUG5_PRINTLN("TCPS: Reassembly buffer held");
+    TRACELOG(TCPS_TRACE_HELD, conn - connections, 1);
+    goto NO_RESULT;
+  }
+
+  frame->length = len - hdr_len;
+  frame->version = (frame->length > TCPSOCKET_MAX_DATA_V1) ?
+                   TCPSOCKET_VERSION_2 : TCPSOCKET_VERSION;
+  frame->ID = conn->recvState.ID;
+  frame->source = conn->recvState.source;
+  frame->address = conn->recvState.address;
+
+  if (!admitMsg(conn, frame->source)) {
+    /* Decoding updated the header fields, restore them to decode again */
+    conn->recvState = state;
+    goto NO_RESULT;
+  }
+  chargeMsg(conn, frame->source, frame->length);
+
+  if (((frame->flags & TCPSOCKET_FLAG_COMPRESSED) && (frame->length > 0)) ||
+      (frame->flags & TCPSOCKET_FLAG_TIMESTAMP)) {
+    /* Compressed data and timestamps are not sent in compact frames */
+    DEBUG4_PRINTLN("TCPS: Recv unsupported compact frame");
+    TRACELOG(TCPS_TRACE_INVALID, conn - connections, 0);
+    stats.invalidHeaders++;
+    goto SKIP;
+  }
+
+  data_offset = headerSize(frame->version);
+  if (frame->length > recvBufferSize - data_offset) {
+    DEBUG4_VALUELN("TCPS: hdr.len > buf sz ", frame->length);
+    TRACELOG(TCPS_TRACE_OVERSIZED, conn - connections, frame->length);
+    stats.oversized++;
+    goto SKIP;
+  }
+  memmove(msg + data_offset, msg + hdr_len, frame->length);
+
+  if (frame->version == TCPSOCKET_VERSION_2) {
+    tcp_socket_hdr_v2_t *hdr = (tcp_socket_hdr_v2_t *)msg;
+    hdr->start = TCPSOCKET_START;
+    hdr->version = TCPSOCKET_VERSION_2;
+    hdr->ID = frame->ID;
+    hdr->flags = frame->flags;
+    hdr->reserved = 0;
+    hdr->length = frame->length;
+    hdr->source = frame->source;
+    hdr->address = frame->address;
+  } else {
+    tcp_socket_hdr_t *hdr = (tcp_socket_hdr_t *)msg;
+    hdr->start = TCPSOCKET_START;
+    hdr->version = TCPSOCKET_VERSION;
+    hdr->ID = frame->ID;
+    hdr->length = frame->length;
+    hdr->flags = frame->flags;
+    hdr->source = frame->source;
+    hdr->address = frame->address;
+  }
+  frame->data = msg + data_offset;
+
+  if (finishMsg(conn, address, frame, end + 1, true, hold)) {
+    return true;
+  }
+  goto NEXT_MSG;
+
+SKIP:
+  stats.bytesSkipped += end + 1;
+  ring->consume(end + 1);
+  goto NEXT_MSG;
+
+NO_RESULT:
+  return false;
+}
+
+byte TCPSocket::getLength() {
+  return lastRecvSize;
+}
+
+void *TCPSocket::headerFromData(const void *data) {
+  return ((tcp_socket_hdr_t *)((uint8_t *)data - sizeof (tcp_socket_hdr_t)));
+}
+
+socket_addr_t TCPSocket::sourceFromData(void *data) {
+  return ((tcp_socket_hdr_t *)headerFromData(data))->source;
+}
+
+socket_addr_t TCPSocket::destFromData(void *data) {
+  return ((tcp_socket_hdr_t *)headerFromData(data))->address;
+}
+
+bool TCPSocket::connected() {
+  return checkClient();
+}
+
+void TCPSocket::printHeader(tcp_socket_hdr_any_t *hdr, bool dump) {
+  DEBUG3_HEXVAL("TCPS: hdr start:", hdr->v1.start);
+  DEBUG3_VALUE(" ver:", hdr->v1.version);
+  DEBUG3_VALUE(" id:", hdr->v1.ID);
+  if (hdr->v1.version == TCPSOCKET_VERSION_2) {
+    DEBUG3_VALUE(" len:", hdr->v2.length);
+    DEBUG3_HEXVAL(" flags:", hdr->v2.flags);
+    DEBUG3_VALUE(" source:", hdr->v2.source);
+    DEBUG3_VALUELN(" dest:", hdr->v2.address);
+  } else {
+    DEBUG3_VALUE(" len:", hdr->v1.length);
+    DEBUG3_HEXVAL(" flags:", hdr->v1.flags);
+    DEBUG3_VALUE(" source:", hdr->v1.source);
+    DEBUG3_VALUELN(" dest:", hdr->v1.address);
+  }
 
   if (dump) {
     DEBUG5_PRINT(" hdr=");
     DEBUG5_COMMAND(
-            print_hex_buffer((const char *) hdr, sizeof(tcp_socket_hdr_t))
+            print_hex_buffer((const char *) hdr,
+                             headerSize(hdr->v1.version))
     );
     DEBUG_ENDLN();
   }
@@ -12,10 +12,20 @@
 #ifndef TCPSOCKET_H
 #define TCPSOCKET_H
 
+#include <new>
+
 #include <WiFiServer.h>
 #include <WiFiClient.h>
 
 #include "Socket.h"
+#include "TraceLog.h"
+#include "TCPRingBuffer.h"
+#include "TCPCompact.h"
+#include "TCPCompress.h"
+#include "TCPTokenBucket.h"
+#include "TCPCapture.h"
+
+class TCPFramePool;
 
 #define TCPSOCKET_START (uint32_t)0x54435053 // "TCPS"
 #define TCPSOCKET_VERSION 1
@@ -29,17 +39,414 @@ typedef struct __attribute__((__packed__)) {
   socket_addr_t address;     // 2B
 } tcp_socket_hdr_t;  // Total: 12B
 
+/*
+ * Version 2 allows messages larger than 255 bytes.  The version is in the same
+ * position as in version 1, and the addresses end the header in both so that
+ * sourceFromData() and destFromData() work with messages of either version.
+ */
+#define TCPSOCKET_VERSION_2 2
+typedef struct __attribute__((__packed__)) {
+  uint32_t      start;       // 4B
+  byte          version;     // 1B
+  byte          ID;          // 1B
+  byte          flags;       // 1B
+  byte          reserved;    // 1B
+  uint16_t      length;      // 2B
+  socket_addr_t source;      // 2B
+  socket_addr_t address;     // 2B
+} tcp_socket_hdr_v2_t;  // Total: 14B
+
+typedef union {
+  tcp_socket_hdr_t    v1;
+  tcp_socket_hdr_v2_t v2;
+} tcp_socket_hdr_any_t;
+
+#define TCPSOCKET_MAX_HDR sizeof (tcp_socket_hdr_v2_t)
+#define TCPSOCKET_MAX_DATA_V1 255
+
+/*
+ * A version 1 header with this version and no data indicates that all further
+ * data from the sender is in compact frames (see TCPCompact.h).  Its ID and
+ * addresses are the starting point for the fields left out of those frames.
+ */
+#define TCPSOCKET_VERSION_COMPACT 3
+
+/*
+ * Header flags
+ *   TCPSOCKET_FLAG_VERSION_2 - Set in version 1 headers by senders that
+ *                              accept version 2 messages
+ *   TCPSOCKET_FLAG_COMPACT   - Set by senders that accept compact frames
+ *   TCPSOCKET_FLAG_ACK       - Acknowledgement of reliable messages
+ *   TCPSOCKET_FLAG_MORE      - Fragment of a message that is followed by
+ *                              further fragments
+ *   TCPSOCKET_FLAG_CONT      - Fragment continuing a message, set on every
+ *                              fragment but the first
+ *   TCPSOCKET_FLAG_COMPRESSED - Data is compressed with TCPCompress.  A
+ *                              message with this flag and no data indicates
+ *                              that the sender accepts compressed messages.
+ *   TCPSOCKET_FLAG_TIMESTAMP - Data is followed by a timestamp trailer,
+ *                              which is included in the header's length
+ *   TCPSOCKET_FLAG_RELIABLE  - Reliable message, whose ID is its sequence
+ *                              number
+ *
+ * Clients of the original protocol may set any flags, so the flags of a
+ * client's messages are only interpreted once it has sent a version 2 or
+ * compact start header, and until then are passed through unchanged.  A
+ * client with nothing to send yet may send an empty version 2 message with
+ * TCPSOCKET_FLAG_VERSION_2 set, which is not delivered.
+ */
+#define TCPSOCKET_FLAG_VERSION_2 0x01
+#define TCPSOCKET_FLAG_COMPACT   0x02
+#define TCPSOCKET_FLAG_ACK       0x04
+#define TCPSOCKET_FLAG_MORE      0x08
+#define TCPSOCKET_FLAG_CONT      0x10
+#define TCPSOCKET_FLAG_FRAGMENT  (TCPSOCKET_FLAG_MORE | TCPSOCKET_FLAG_CONT)
+#define TCPSOCKET_FLAG_COMPRESSED 0x20
+#define TCPSOCKET_FLAG_TIMESTAMP 0x40
+#define TCPSOCKET_FLAG_RELIABLE  0x80
+
+/*
+ * Reliable delivery
+ *
+ * Reliable messages to an address are numbered in sequence, and are kept until
+ * the receiver acknowledges them so that they can be sent again on a new
+ * connection from that address.  Several messages may be outstanding at once.
+ *
+ *   Message - Flags RELIABLE, ID is the sequence number
+ *   Ack     - Flags ACK, ID is the next sequence number expected, so that all
+ *             earlier messages have been received.  A data byte of 1 requests
+ *             that all unacknowledged messages are sent again.
+ *   Sync    - Flags ACK and RELIABLE, sent before the first reliable message on
+ *             a connection.  ID is the sequence number of the next message
+ *             sent, and a data byte of 1 indicates a new sequence rather than
+ *             the continuation of the one sent on a previous connection.
+ *
+ * Sequence numbers are compared modulo 256, so the window must be smaller than
+ * 128 messages.
+ *
+ * State is kept for a limited number of addresses.  An address is forgotten
+ * when its connection closes with nothing left to acknowledge in either
+ * direction, and when every entry is in use, the least recently used address
+ * that is not connected and has no unacknowledged messages is replaced.  If
+ * there is none, reliable messages to and from new addresses are refused.
+ */
+#ifndef TCPSOCKET_RELIABLE_WINDOW
+  #define TCPSOCKET_RELIABLE_WINDOW 16
+#endif
+#define TCPSOCKET_RELIABLE_MAX_WINDOW 127
+
+#define TCPSOCKET_NO_CONN 0xFF
+
+/*
+ * Timestamps
+ *
+ * Timestamped messages end with this trailer, which is removed before the
+ * message is returned.  Each side echoes the latest timestamp it received,
+ * along with how long it held it before sending the echo, so that the other
+ * side can measure the round trip time without synchronized clocks.  Each
+ * timestamp is echoed once.  The one-way delay is measured relative to the
+ * lowest seen on the connection, so it is the delay added by queueing along
+ * the path rather than the absolute delay.
+ *
+ * The high bits of echoDelay mark a message with no data of its own that only
+ * carries the timestamp and is not delivered, and a probe that also requests
+ * such a message in reply.
+ */
+typedef struct __attribute__((__packed__)) {
+  uint32_t      sentMicros;  // 4B, sender's micros() when sent, never 0
+  uint32_t      echoMicros;  // 4B, sentMicros being echoed, 0 if none
+  uint32_t      echoDelay;   // 4B, microseconds between receiving the echoed
+                             //     message and sending this one
+} tcp_socket_timestamp_t;  // Total: 12B
+
+#define TCPSOCKET_TIMESTAMP_PROBE 0x80000000
+#define TCPSOCKET_TIMESTAMP_ONLY  0x40000000
+#define TCPSOCKET_TIMESTAMP_DELAY 0x3FFFFFFF
+
+/*
+ * Latency histogram.  Bucket 0 counts samples under TCPSOCKET_LATENCY_BASE
+ * microseconds and each following bucket samples up to twice as long as the
+ * previous, with the last counting all longer samples.  The counts are halved
+ * when one would overflow, so older samples gradually age out.
+ */
+#ifndef TCPSOCKET_LATENCY_BUCKETS
+  #define TCPSOCKET_LATENCY_BUCKETS 16
+#endif
+#define TCPSOCKET_LATENCY_BASE 64
+
+typedef struct {
+  uint16_t      buckets[TCPSOCKET_LATENCY_BUCKETS];
+  uint32_t      samples;
+  uint32_t      lastMicros;
+  uint32_t      minMicros;
+  uint32_t      maxMicros;
+  uint32_t      smoothedMicros; // Moving average weighting each sample 1/8
+} tcp_socket_histogram_t;
+
+/* Latency measured from the timestamps exchanged with a client */
+typedef struct {
+  tcp_socket_histogram_t rtt;
+  tcp_socket_histogram_t delay; // One-way delay above the lowest seen
+} tcp_socket_latency_t;
+
+/*
+ * Rate limiting of received messages, by the connection they arrive on and by
+ * their source address (see TCPTokenBucket.h).  A message over either limit is
+ * left in the receive buffer until the limit allows it, and no more is read
+ * from its connection in the meantime, so that TCP flow control slows the
+ * sender rather than messages being lost.
+ */
+#ifndef TCPSOCKET_RATE_SOURCES
+  #define TCPSOCKET_RATE_SOURCES 16
+#endif
+
+/* Rate limit state for a source address */
+typedef struct {
+  socket_addr_t  address;   // SOCKET_ADDR_INVALID if the entry is unused
+  TCPTokenBucket bucket;
+} tcp_socket_rate_source_t;
+
+/*
+ * Connections are serviced in turn, with each taking up to its weight in
+ * messages before the next is serviced
+ */
+#define TCPSOCKET_DEFAULT_WEIGHT 1
+
+/*
+ * Messages that can't be sent in a single frame are sent as a series of
+ * fragments, with the first having only TCPSOCKET_FLAG_MORE set, the last only
+ * TCPSOCKET_FLAG_CONT, and any between both.  Fragments are sent as the
+ * client accepts them.  If it stops accepting them part way through, sendMsg()
+ * returns TCPSOCKET_SEND_PARTIAL and continueSend() sends the rest from the
+ * caller's unchanged data, or abortSend() abandons the message.
+ */
+
+/* Reliable delivery state for a remote address */
+typedef struct {
+  socket_addr_t address;   // SOCKET_ADDR_INVALID if the entry is unused
+  byte          conn;      // Connection bound to, TCPSOCKET_NO_CONN if none
+
+  /*
+   * Messages sent but not acknowledged, as a 16 bit data length followed by
+   * space for a header and the data
+   */
+  uint8_t      *window;
+  uint16_t      windowUsed;
+  uint16_t      sentOffset; // Position of the next message to transmit
+  byte          ackedSeq;   // Oldest unacknowledged message
+  byte          sentSeq;    // Next message to transmit
+  byte          nextSeq;    // Sequence number of the next new message
+  bool          syncPending; // Sync must precede the next transmission
+  bool          syncReset;   // Sequence has not been sent on any connection
+
+  byte          expectedSeq; // Next message expected from the address
+  bool          recvSynced;  // expectedSeq is known
+  byte          recvUnacked; // Messages delivered since the last ack
+  bool          ackPending;
+  bool          ackGap;      // Messages were missed, request they are resent
+
+  unsigned long usedMillis;  // Last sent to or received from
+} tcp_socket_peer_t;
+
 typedef struct {
   tcp_socket_hdr_t hdr;
   byte             data[];
 } tcp_socket_msg_t;
 
-/* Calculate the total buffer size with a useable buffer of size x */
-#define TCP_BUFFER_TOTAL(x) (uint8_t)(x + sizeof (tcp_socket_hdr_t))
-#define TCP_DATA_LENGTH(x) (uint8_t)(x - sizeof (tcp_socket_hdr_t))
+/*
+ * Calculate the total buffer size with a useable buffer of size x, leaving room
+ * for the header of any protocol version.
+ */
+#define TCP_BUFFER_TOTAL(x) (uint16_t)(x + TCPSOCKET_MAX_HDR)
+#define TCP_DATA_LENGTH(x) (uint16_t)(x - TCPSOCKET_MAX_HDR)
 
 #define TCPSOCKET_PORT 4081
 
+/* Results of sendMsg() */
+#define TCPSOCKET_SEND_OK      0
+#define TCPSOCKET_WOULD_BLOCK  1  // Send buffer full, retry the message later
+#define TCPSOCKET_NO_CLIENT    2
+#define TCPSOCKET_SEND_ERROR   3
+#define TCPSOCKET_SEND_PARTIAL 4  // Fragments remain, see continueSend()
+
+/* Default maximum number of simultaneously connected clients */
+#ifndef TCPSOCKET_MAX_CLIENTS
+  #define TCPSOCKET_MAX_CLIENTS 4
+#endif
+
+/* A received message, as passed to message handlers */
+typedef struct {
+  const byte   *data;
+  uint16_t      length;
+  byte          version;
+  byte          ID;
+  byte          flags;
+  socket_addr_t source;
+  socket_addr_t address;
+} tcp_socket_frame_t;
+
+typedef void (*tcp_socket_handler_t)(const tcp_socket_frame_t *frame,
+                                     void *arg);
+
+/* Maximum number of addresses that can have their own message handler */
+#ifndef TCPSOCKET_MAX_HANDLERS
+  #define TCPSOCKET_MAX_HANDLERS 16
+#endif
+
+/* Dispatch table entry mapping a destination address to its handler */
+typedef struct {
+  socket_addr_t        address;
+  tcp_socket_handler_t handler; // nullptr if the entry is unused
+  void                *arg;
+} tcp_socket_dispatch_t;
+
+/*
+ * A received message lent directly out of a connection's receive buffer,
+ * which remains valid until it is released with releaseView()
+ */
+typedef struct {
+  tcp_socket_frame_t frame;
+  byte               client; // Connection the message was received on
+  byte               slot;   // Position in the connection's outstanding views
+} tcp_socket_view_t;
+
+/* Maximum number of outstanding views per connection */
+#ifndef TCPSOCKET_MAX_VIEWS
+  #define TCPSOCKET_MAX_VIEWS 4
+#endif
+
+/*
+ * Time spent in one of the receive or send paths.  Only recorded when built
+ * with TCPSOCKET_STATS_TIMING, in CPU cycles (nanoseconds on the host).
+ */
+typedef struct {
+  uint32_t      calls;
+  uint64_t      cycles;      // Total over all calls
+  uint32_t      maxCycles;   // Longest single call
+} tcp_socket_timing_t;
+
+/* Counters of socket activity, see getStats() */
+typedef struct {
+  /* Receiving */
+  uint32_t      msgsRecv;       // Messages returned to the caller
+  uint32_t      bytesRecv;      // Data bytes of the messages returned
+  uint32_t      bytesRead;      // Bytes read from clients
+  uint32_t      bytesSkipped;   // Bytes discarded searching for a message start
+  uint32_t      invalidHeaders; // Headers and compact frames failing validation
+  uint32_t      oversized;      // Messages larger than the receive buffer
+  uint32_t      incomplete;     // Parses waiting for the rest of a message
+  uint32_t      addressMismatch; // Messages not for the address requested
+  uint32_t      poolEmpty;      // Copies delayed waiting for a pool frame
+  uint32_t      msgsDecompressed; // Compressed messages received
+  uint32_t      rateLimited;    // Parses waiting for a rate limit to allow a
+                                // message
+
+  /* Sending */
+  uint32_t      msgsSent;       // Messages accepted by sendMsg()
+  uint32_t      bytesWritten;   // Bytes written to clients
+  uint32_t      underSends;     // Writes where the client accepted only part
+  uint32_t      sendBlocked;    // Messages refused with TCPSOCKET_WOULD_BLOCK
+  uint32_t      sendErrors;     // Messages failing with any other error
+  uint32_t      broadcastMissed; // Clients a broadcast message wasn't sent to
+  uint32_t      msgsCompressed; // Messages sent compressed
+  uint32_t      compressSaved;  // Bytes not sent due to compression
+
+  uint32_t      connects;
+  uint32_t      disconnects;    // Clients that closed their connection
+  uint32_t      idleDisconnects; // Clients dropped by the idle timeout
+  uint32_t      takeovers;      // Idle clients replaced by a waiting client
+
+  tcp_socket_timing_t recvTiming; // Receipt of each message by recvFrom()
+  tcp_socket_timing_t sendTiming; // Each sendMsg() call
+} tcp_socket_stats_t;
+
+/* Trace events, see TraceLog.h */
+#define TCPS_TRACE_CONNECT      TRACE_ID(TRACE_MODULE_TCPSOCKET, 1) // "client {a} connected"
+#define TCPS_TRACE_DISCONNECT   TRACE_ID(TRACE_MODULE_TCPSOCKET, 2) // "client {a} disconnected"
+#define TCPS_TRACE_READ         TRACE_ID(TRACE_MODULE_TCPSOCKET, 3) // "client {a} read {b}"
+#define TCPS_TRACE_SKIPPED      TRACE_ID(TRACE_MODULE_TCPSOCKET, 4) // "client {a} skipped {b}"
+#define TCPS_TRACE_INVALID      TRACE_ID(TRACE_MODULE_TCPSOCKET, 5) // "client {a} invalid hdr"
+#define TCPS_TRACE_OVERSIZED    TRACE_ID(TRACE_MODULE_TCPSOCKET, 6) // "client {a} len {b} > buf sz"
+#define TCPS_TRACE_HEADER       TRACE_ID(TRACE_MODULE_TCPSOCKET, 7) // "hdr len:{a} ver:{b0} id:{b1} flags:{b2:#x}"
+#define TCPS_TRACE_INCOMPLETE   TRACE_ID(TRACE_MODULE_TCPSOCKET, 8) // "incomplete {a}<{b}"
+#define TCPS_TRACE_HELD         TRACE_ID(TRACE_MODULE_TCPSOCKET, 9) // "client {a} buffer held, reassembly:{b}"
+#define TCPS_TRACE_RECV         TRACE_ID(TRACE_MODULE_TCPSOCKET, 10) // "recv len:{a} source:{bl} dest:{bh}"
+#define TCPS_TRACE_NOT_DELIVERED TRACE_ID(TRACE_MODULE_TCPSOCKET, 11) // "not delivered for {a} dest:{b}"
+#define TCPS_TRACE_SEND         TRACE_ID(TRACE_MODULE_TCPSOCKET, 12) // "send len:{a} dest:{bl} id:{b2} flags:{b3:#x}"
+#define TCPS_TRACE_UNDER_SENT   TRACE_ID(TRACE_MODULE_TCPSOCKET, 13) // "under sent {a}<{b}"
+#define TCPS_TRACE_BLOCKED      TRACE_ID(TRACE_MODULE_TCPSOCKET, 14) // "client {a} send blocked, queued {b}"
+#define TCPS_TRACE_FLUSH        TRACE_ID(TRACE_MODULE_TCPSOCKET, 15) // "flushed {a}/{b}"
+#define TCPS_TRACE_COMPACT      TRACE_ID(TRACE_MODULE_TCPSOCKET, 16) // "client {a} sending compact frames"
+#define TCPS_TRACE_POOL_EMPTY   TRACE_ID(TRACE_MODULE_TCPSOCKET, 17) // "client {a} waiting for pool frame"
+#define TCPS_TRACE_IDLE         TRACE_ID(TRACE_MODULE_TCPSOCKET, 18) // "client {a} idle for {b} ms"
+#define TCPS_TRACE_TAKEOVER     TRACE_ID(TRACE_MODULE_TCPSOCKET, 19) // "client {a} taken over, idle for {b} ms"
+#define TCPS_TRACE_BROADCAST    TRACE_ID(TRACE_MODULE_TCPSOCKET, 20) // "broadcast len:{a} to {b0}/{b1} clients"
+#define TCPS_TRACE_COMPRESS     TRACE_ID(TRACE_MODULE_TCPSOCKET, 21) // "compressed {a} to {b}"
+#define TCPS_TRACE_DECOMPRESS   TRACE_ID(TRACE_MODULE_TCPSOCKET, 22) // "decompressed {b} to {a}"
+#define TCPS_TRACE_RTT          TRACE_ID(TRACE_MODULE_TCPSOCKET, 23) // "client {a} rtt {b} us"
+#define TCPS_TRACE_DELAY        TRACE_ID(TRACE_MODULE_TCPSOCKET, 24) // "client {a} delay {b} us"
+#define TCPS_TRACE_RATE_LIMITED TRACE_ID(TRACE_MODULE_TCPSOCKET, 25) // "client {a} rate limited, source {b}"
+
+/* Per-client connection and receive state */
+typedef struct {
+  WiFiClient    client;
+  bool          active;      // Slot holds an accepted client
+  unsigned long lastRecvMillis; // Time data was last received from the client
+  socket_addr_t peerAddress; // Source address last received from the client
+  byte          peerVersion; // Highest protocol version the client accepts,
+                             // its flags are only used from version 2
+  bool          peerCompact; // Client accepts compact frames
+  bool          peerCompress; // Client accepts compressed messages
+  bool          recvCompact; // Client is sending compact frames
+  bool          sendCompact; // Compact frames are being sent to the client
+  tcp_compact_state_t recvState; // Fields of the last compact frame received
+  tcp_compact_state_t sendState; // Fields of the last compact frame sent
+  TCPRingBuffer ring;        // Data read from the client but not yet parsed
+  uint8_t      *recvBuffer;  // Contiguous copy of messages that wrap the ring,
+                             // nullptr while not borrowed from a frame pool
+  uint8_t      *sendQueue;   // Data waiting to be written to the client
+  uint16_t      sendQueued;
+  bool          sendBlocked; // Client did not accept all written data
+  unsigned long sendQueuedMicros; // Time the oldest queued message was added
+
+  /* Fragmented message being sent, continued by continueSend() */
+  const byte   *sendFragData; // Caller's data, nullptr if none
+  uint16_t      sendFragLength;
+  uint16_t      sendFragOffset; // Data already sent
+  socket_addr_t sendFragAddress;
+
+  /* Outstanding views, which are kept across reconnects until released */
+  uint16_t      viewStart[TCPSOCKET_MAX_VIEWS]; // Receive buffer position
+  bool          viewReleased[TCPSOCKET_MAX_VIEWS];
+  bool          viewCopied[TCPSOCKET_MAX_VIEWS]; // View is of recvBuffer
+  byte          viewFirst;   // Slot of the oldest outstanding view
+  byte          viewCount;
+  bool          recvBufferHeld; // recvBuffer is in use by a view
+
+  /* Reassembly of fragmented messages */
+  uint8_t      *fragBuffer;  // Header followed by the reassembled data
+  uint16_t      fragLength;  // Data received of the message being reassembled
+  bool          fragActive;  // A message is being reassembled
+  byte          fragID;      // ID and flags of the message's first fragment
+  byte          fragFlags;
+  bool          fragHeld;    // fragBuffer is in use by a view
+  bool          viewFragment[TCPSOCKET_MAX_VIEWS]; // View is of fragBuffer
+
+  /* Timestamps */
+  bool          peerTimestamps; // Client sends timestamped messages
+  uint32_t      echoMicros;  // Client timestamp to echo, 0 if none
+  uint32_t      echoRecvMicros; // Time that timestamp was received
+  uint32_t      delayBase;   // Lowest difference between the client's clock
+                             // and ours when a message was received
+  tcp_socket_latency_t latency;
+
+  /* Rate limiting and scheduling */
+  TCPTokenBucket rateBucket;
+  bool          rateLimited; // A message is waiting for a rate limit
+  byte          weight;      // Messages to receive on each turn
+  byte          turnMsgs;    // Messages received on the current turn
+} tcp_socket_conn_t;
+
 
 class TCPSocket : public Socket {
 
@@ -50,10 +457,12 @@ public:
   ~TCPSocket();
   TCPSocket(socket_addr_t _address,
             uint16_t _port = TCPSOCKET_PORT,
-            byte _recvBufferSize = DEFAULT_RECEIVE_BUFFER);
-  void init(socket_addr_t _address,
+            uint16_t _recvBufferSize = DEFAULT_RECEIVE_BUFFER,
+            byte _maxClients = TCPSOCKET_MAX_CLIENTS);
+  bool init(socket_addr_t _address,
             uint16_t _port = TCPSOCKET_PORT,
-            byte _recvBufferSize = DEFAULT_RECEIVE_BUFFER);
+            uint16_t _recvBufferSize = DEFAULT_RECEIVE_BUFFER,
+            byte _maxClients = TCPSOCKET_MAX_CLIENTS);
 
   /*
    * Implement functions from Socket.h
@@ -63,31 +472,362 @@ public:
   byte * initBuffer(byte * data, uint16_t data_size);
 
   void sendMsgTo(uint16_t address, const byte * data, const byte length);
+  int sendMsg(socket_addr_t address, const byte *data, uint16_t length);
 
   const byte *getMsg(unsigned int *retlen);
   const byte *getMsg(uint16_t address, unsigned int *retlen);
 
+  /* Receive messages without copying them out of the receive buffer */
+  bool getView(tcp_socket_view_t *view);
+  bool getView(socket_addr_t address, tcp_socket_view_t *view);
+  void releaseView(tcp_socket_view_t *view);
+
+  /* Handle all available messages, subject to a message count or time limit */
+  unsigned int getMsgs(tcp_socket_handler_t handler, void *arg = nullptr,
+                       unsigned int maxMsgs = 0, unsigned long maxMicros = 0);
+  unsigned int getMsgs(socket_addr_t address,
+                       tcp_socket_handler_t handler, void *arg = nullptr,
+                       unsigned int maxMsgs = 0, unsigned long maxMicros = 0);
+
+  /*
+   * Deliver messages to handlers by destination address, with a handler for
+   * SOCKET_ADDR_ANY receiving messages for all other addresses
+   */
+  bool setHandler(socket_addr_t address, tcp_socket_handler_t handler,
+                  void *arg = nullptr);
+  unsigned int dispatchMsgs(unsigned int maxMsgs = 0,
+                            unsigned long maxMicros = 0);
+
   byte getLength();
   void *headerFromData(const void *data);
   socket_addr_t sourceFromData(void *data);
   socket_addr_t destFromData(void *data);
 
   bool connected();
+  byte numClients();
+
+#if defined(TCPSOCKET_HOST)
+  /* Sleep until a client connects or sends data */
+  bool wait(int timeoutMs);
+  /* As wait(), but without looking at the send queues */
+  bool waitRecv(int timeoutMs);
+#endif
+
+  /* Send a message to every connected client, framing it only once */
+  byte broadcastMsg(const byte *data, uint16_t length);
+
+  /* Send buffering, coalescing of sent messages, and backpressure */
+  bool setSendQueue(uint16_t size, unsigned long flushMicros = 0);
+  bool flush();
+  uint16_t queuedBytes(socket_addr_t address = SOCKET_ADDR_ANY);
+
+  /* Send compact frames to clients that accept them */
+  void setCompact(bool enable) { compactEnabled = enable; }
+
+  /* Reliable delivery, acknowledged and resent after reconnects */
+  bool setReliable(byte windowMsgs = TCPSOCKET_RELIABLE_WINDOW,
+                   uint16_t windowBytes = DEFAULT_SEND_BUFFER,
+                   byte _maxPeers = TCPSOCKET_MAX_CLIENTS);
+  int sendReliable(socket_addr_t address, const byte *data, uint16_t length);
+  byte unacked(socket_addr_t address);
+
+  /* Splitting of large messages, and their reassembly when received */
+  void setFragmentSize(uint16_t size) { fragmentSize = size; }
+  bool setReassembly(uint16_t maxLength, uint8_t *storage = nullptr);
+  int continueSend(socket_addr_t address);
+  void abortSend(socket_addr_t address);
+
+  /*
+   * Compress messages of at least threshold bytes to clients that accept
+   * compressed messages, 0 to disable.  Compressed messages are always
+   * accepted from clients that have negotiated version 2.
+   */
+  bool setCompression(uint16_t threshold, uint16_t *table = nullptr);
+
+  /*
+   * Timestamping of messages sent to clients that send timestamped messages,
+   * for measuring latency.  Enabling this probes current and new clients that
+   * have negotiated version 2 to start the exchange.  Timestamps received
+   * from clients are always used.
+   */
+  void setTimestamps(bool enable);
+  bool probeLatency(socket_addr_t address = SOCKET_ADDR_ANY);
+  bool getLatency(socket_addr_t address, tcp_socket_latency_t *snapshot);
+  static void addLatency(tcp_socket_histogram_t *histogram, uint32_t micros);
+
+  /*
+   * Limits on the rate messages are received from each connection, and from
+   * each source address with state kept for up to maxSources of them.  Rates
+   * of 0 remove a limit, and a burst of 0 allows a second's worth at once.
+   */
+  void setRateLimit(uint16_t msgsPerSec, uint32_t bytesPerSec = 0,
+                    uint16_t burstMsgs = 0, uint32_t burstBytes = 0);
+  bool setSourceRateLimit(uint16_t msgsPerSec, uint32_t bytesPerSec = 0,
+                          uint16_t burstMsgs = 0, uint32_t burstBytes = 0,
+                          byte maxSources = TCPSOCKET_RATE_SOURCES);
+
+  /* Share of messages received from a client relative to other clients */
+  bool setWeight(socket_addr_t address, byte weight);
+
+  /* Record all client traffic for replay, see TCPCapture.h */
+  bool setCapture(Print *out);
+
+  /* Borrow copy buffers from a pool shared with other sockets when needed */
+  bool setFramePool(TCPFramePool *pool);
+
+  /*
+   * Recovery from clients that stop responding without disconnecting.  A
+   * client that has sent nothing for the idle timeout is disconnected, and
+   * once one has sent nothing for the takeover time a waiting client may
+   * replace it when no connection slot is free.  A client whose messages are
+   * waiting for a rate limit is not idle.  0 disables either.
+   */
+  void setIdleTimeout(unsigned long ms) { idleTimeoutMs = ms; }
+  void setTakeover(unsigned long ms) { takeoverMs = ms; }
+  void setKeepAlive(uint16_t idleSecs, uint16_t intervalSecs = 1,
+                    byte count = 3);
+
+  /* Activity counters, copied as a single snapshot */
+  void getStats(tcp_socket_stats_t *snapshot) { *snapshot = stats; }
+  void resetStats() { memset(&stats, 0, sizeof (stats)); }
+
+  static const uint16_t DEFAULT_RECEIVE_BUFFER = TCP_BUFFER_TOTAL(64);
+  static const uint16_t DEFAULT_SEND_BUFFER =
+    2 * TCP_BUFFER_TOTAL(TCPSOCKET_MAX_DATA_V1);
+
+  /* Receive ring buffers hold at least this many maximum sized messages */
+  static const byte RING_BUFFER_FRAMES = 2;
+
+  /* Dispatch table size, kept at most half full so that probes are short */
+  static const uint16_t DISPATCH_SIZE =
+    TCPRingBuffer::capacityFor(2 * TCPSOCKET_MAX_HANDLERS);
+
+protected:
+  void initStorage(socket_addr_t _address, uint16_t _port,
+                   uint16_t _recvBufferSize, uint16_t _sendBufferSize,
+                   tcp_socket_conn_t *_connections, byte _maxClients,
+                   WiFiServer *_server);
+  void shutdown();
 
 private:
   WiFiServer *tcpServer;
-  WiFiClient tcpClient;
   byte currentMsgID;
 
-  static const byte DEFAULT_RECEIVE_BUFFER = TCP_BUFFER_TOTAL(64);
-  byte recvBufferSize;
-  uint8_t *recvBuffer;
-  byte lastRecvSize;
-  bool partialRecv;
+  uint16_t recvBufferSize;
+  uint16_t lastRecvSize;
+
+  /* Connection table, serviced in weighted turns by getMsg() */
+  tcp_socket_conn_t *connections;
+  byte maxClients;
+  byte nextClient; // Next connection to check for received data
+  byte lastClient; // Connection the most recent message was received from
+  bool ownsStorage; // Connection table and buffers were allocated by init()
+
+  uint16_t sendBufferSize;
+  unsigned long sendFlushMicros; // Time to coalesce messages, 0 to disable
+  bool compactEnabled;
+
+  /* Handlers by destination address, open addressed with linear probing */
+  tcp_socket_dispatch_t dispatchTable[DISPATCH_SIZE];
+  uint16_t numHandlers;
+  tcp_socket_handler_t anyHandler;
+  void *anyArg;
+
+  /* Reliable delivery state by remote address, nullptr if not enabled */
+  tcp_socket_peer_t *peers;
+  byte maxPeers;
+  byte reliableWindow;
+  uint16_t reliableBytes;
+
+  uint16_t fragmentSize;     // Largest fragment to send, 0 for no limit
+  uint16_t reassemblySize;   // Largest reassembled message
+  uint8_t *reassemblyStorage; // Allocated reassembly buffers
+
+  TCPFramePool *framePool;   // Source of copy buffers, nullptr if each
+                             // connection has its own
+
+  uint16_t compressThreshold; // Smallest message to compress, 0 to disable
+  uint16_t *compressTable;    // Compressor's table of previous positions
+  uint16_t *compressStorage;  // Allocated compressor table
+
+  bool timestampsEnabled;
+
+  /* Receive rate limits, and source address state if limited by address */
+  tcp_rate_limit_t connRate;
+  tcp_rate_limit_t sourceRate;
+  tcp_socket_rate_source_t *rateSources;
+  byte maxRateSources;
+
+  Print *captureOut;         // Output for captured traffic, nullptr if none
+
+  unsigned long idleTimeoutMs;
+  unsigned long takeoverMs;
+  uint16_t keepAliveIdle;
+  uint16_t keepAliveInterval;
+  byte keepAliveCount;
+
+  tcp_socket_stats_t stats;
+
+  /* Timing of the receive and send paths, free unless enabled */
+  static uint32_t timingStart() {
+#if defined(TCPSOCKET_STATS_TIMING)
+    return ESP.getCycleCount();
+#else
+    return 0;
+#endif
+  }
+  static void timingEnd(tcp_socket_timing_t *timing, uint32_t start) {
+#if defined(TCPSOCKET_STATS_TIMING)
+    uint32_t cycles = ESP.getCycleCount() - start;
+    timing->calls++;
+    timing->cycles += cycles;
+    if (cycles > timing->maxCycles) {
+      timing->maxCycles = cycles;
+    }
+#endif
+  }
 
   bool checkClient();
+  void acceptClient(tcp_socket_conn_t *conn, WiFiClient client);
+  void applyKeepAlive(tcp_socket_conn_t *conn);
+  void resetConnection(tcp_socket_conn_t *conn);
+  tcp_socket_conn_t *routeConnection(socket_addr_t address);
+  uint16_t writeClient(tcp_socket_conn_t *conn, const uint8_t *data,
+                       uint16_t length);
+  bool flushConnection(tcp_socket_conn_t *conn);
+  void checkFlush();
+  uint16_t fillBuffer(tcp_socket_conn_t *conn);
+  bool borrowCopyBuffer(tcp_socket_conn_t *conn);
+  void releaseCopyBuffer(tcp_socket_conn_t *conn);
+  void advanceClient();
+  bool recvFrom(byte index, socket_addr_t address, tcp_socket_frame_t *frame,
+                bool hold = false);
+  bool parseMsg(tcp_socket_conn_t *conn, socket_addr_t address,
+                tcp_socket_frame_t *frame, bool hold);
+  bool parseCompact(tcp_socket_conn_t *conn, socket_addr_t address,
+                    tcp_socket_frame_t *frame, bool hold);
+  bool finishMsg(tcp_socket_conn_t *conn, socket_addr_t address,
+                 tcp_socket_frame_t *frame, uint16_t msg_len, bool copied,
+                 bool hold);
+  int sendFrame(tcp_socket_conn_t *conn, socket_addr_t address, byte ID,
+                byte flags, const byte *data, uint16_t datalength);
+  void fillHeader(uint8_t *msg, byte version, socket_addr_t address, byte ID,
+                  byte flags, uint16_t datalength);
+  bool reserveSend(tcp_socket_conn_t *conn, uint16_t length);
+  void queueSend(tcp_socket_conn_t *conn, const uint8_t *msg,
+                 uint16_t msg_len);
+  void commitSend(tcp_socket_conn_t *conn, uint16_t length);
+  void advertiseCompression(tcp_socket_conn_t *conn);
+  uint16_t compressFrame(tcp_socket_conn_t *conn, byte version,
+                         socket_addr_t address, byte ID, const byte *data,
+                         uint16_t datalength, bool stamp);
+  bool decompressMsg(tcp_socket_conn_t *conn, uint16_t hdr_len,
+                     tcp_socket_frame_t *frame);
+  bool sendsTimestamps(tcp_socket_conn_t *conn);
+  void fillTimestamp(tcp_socket_conn_t *conn, uint8_t *trailer, uint32_t bits);
+  bool sendTimestamp(tcp_socket_conn_t *conn, uint32_t bits);
+  void recvTimestamp(tcp_socket_conn_t *conn,
+                     const tcp_socket_timestamp_t *timestamp);
+  bool admitMsg(tcp_socket_conn_t *conn, socket_addr_t source);
+  void chargeMsg(tcp_socket_conn_t *conn, socket_addr_t source,
+                 uint16_t length);
+  tcp_socket_rate_source_t *findRateSource(socket_addr_t address,
+                                           unsigned long now);
+  void clearRateSources();
+  void captureData(tcp_socket_conn_t *conn, byte type, const uint8_t *data,
+                   uint16_t length);
+  int sendCompactMsg(tcp_socket_conn_t *conn, socket_addr_t address, byte ID,
+                     byte flags, const byte *data, uint16_t datalength);
+  uint16_t maxFragment(tcp_socket_conn_t *conn);
+  int sendFragments(tcp_socket_conn_t *conn, uint16_t fragment);
+  tcp_socket_conn_t *fragmentConnection(socket_addr_t address);
+  bool addFragment(tcp_socket_conn_t *conn, tcp_socket_frame_t *frame);
+  void negotiatePeer(tcp_socket_conn_t *conn);
+  static bool negotiated(const tcp_socket_conn_t *conn) {
+    return conn->peerVersion >= TCPSOCKET_VERSION_2;
+  }
   bool validateHeader(tcp_socket_hdr_t *hdr);
-  void printHeader(tcp_socket_hdr_t *hdr, bool dump = false);
+  static uint16_t headerSize(byte version);
+  void printHeader(tcp_socket_hdr_any_t *hdr, bool dump = false);
+
+  void clearHandlers();
+  uint16_t findHandler(socket_addr_t address);
+  /*
+   * Multiplying by an odd constant permutes the low bits, so consecutive
+   * addresses never share a home slot
+   */
+  static uint16_t dispatchIndex(socket_addr_t address) {
+    return (uint16_t)(address * 40503u) & (DISPATCH_SIZE - 1);
+  }
+  static void dispatchFrame(const tcp_socket_frame_t *frame, void *arg);
+
+  void clearReliable();
+  tcp_socket_peer_t *findPeer(socket_addr_t address, bool create);
+  void bindPeer(tcp_socket_peer_t *peer, byte index);
+  bool recvReliable(tcp_socket_conn_t *conn, const tcp_socket_frame_t *frame);
+  void recvAck(tcp_socket_peer_t *peer, byte ID, bool gap);
+  int sendControl(tcp_socket_peer_t *peer, byte ID, byte flags, byte value);
+  void sendPending(tcp_socket_peer_t *peer);
+  void checkReliable();
+};
+
+/*
+ * TCPSocket whose connection table, buffers, and server are members sized at
+ * compile time, so that it makes no heap allocations.
+ *
+ *   RecvSize   - Receive buffer size, as TCP_BUFFER_TOTAL(max data size)
+ *   MaxClients - Maximum simultaneously connected clients
+ *   SendSize   - Per-client send buffer size
+ */
+template <uint16_t RecvSize = TCPSocket::DEFAULT_RECEIVE_BUFFER,
+          byte MaxClients = TCPSOCKET_MAX_CLIENTS,
+          uint16_t SendSize = TCPSocket::DEFAULT_SEND_BUFFER>
+class TCPSocketT : public TCPSocket {
+public:
+  TCPSocketT() {}
+  ~TCPSocketT() {
+    /* Must stop clients before the member storage is destroyed */
+    shutdown();
+  }
+  TCPSocketT(socket_addr_t _address, uint16_t _port = TCPSOCKET_PORT) {
+    init(_address, _port);
+  }
+
+  /*
+   * Setup the socket on its member storage, replacing any previous setup.  As
+   * nothing is allocated this always succeeds, but returns a result as
+   * TCPSocket::init() does.
+   */
+  bool init(socket_addr_t _address, uint16_t _port = TCPSOCKET_PORT) {
+    shutdown();
+    for (byte i = 0; i < MaxClients; i++) {
+      connStorage[i].recvBuffer = recvStorage[i];
+      connStorage[i].sendQueue = sendStorage[i];
+      connStorage[i].ring.init(ringStorage[i], RING_SIZE);
+    }
+    initStorage(_address, _port, RecvSize, SendSize, connStorage, MaxClients,
+                new (serverStorage) WiFiServer(_port, MaxClients));
+    return true;
+  }
+
+private:
+  static const uint16_t RING_SIZE =
+    TCPRingBuffer::capacityFor(RING_BUFFER_FRAMES * (uint32_t)RecvSize);
+
+  static_assert(RecvSize > TCPSOCKET_MAX_HDR,
+                "TCPSocketT receive buffer is smaller than a header");
+  static_assert(RING_BUFFER_FRAMES * (uint32_t)RecvSize <=
+                TCPRingBuffer::MAX_CAPACITY,
+                "TCPSocketT receive buffer is too large");
+  static_assert(SendSize > TCPSOCKET_MAX_HDR,
+                "TCPSocketT send buffer is smaller than a header");
+  static_assert(MaxClients > 0, "TCPSocketT requires at least one client");
+
+  tcp_socket_conn_t connStorage[MaxClients];
+  uint8_t recvStorage[MaxClients][RecvSize];
+  uint8_t ringStorage[MaxClients][RING_SIZE];
+  uint8_t sendStorage[MaxClients][SendSize];
+  alignas(WiFiServer) uint8_t serverStorage[sizeof (WiFiServer)];
 };
 
 #endif // TCPSOCKET_H
\ No newline at end of file
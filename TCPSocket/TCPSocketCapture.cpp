@@ -0,0 +1,77 @@
+/*
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2018
+ *
+ * Capture of the data read from and written to clients, in the format
+ * described in TCPCapture.h.
+ */
+
+#include <WiFi.h>
+
+#ifdef DEBUG_LEVEL_TCPSOCKET
+  #define DEBUG_LEVEL DEBUG_LEVEL_TCPSOCKET
+#endif
+#ifndef DEBUG_LEVEL
+  #define DEBUG_LEVEL DEBUG_HIGH
+#endif
+#include <Debug.h>
+
+#include <Socket.h>
+#include "TCPSocket.h"
+
+/**
+ * Write all data read from and written to clients to out, with clients that
+ * are already connected treated as connecting now.  Records are written as
+ * the data is read or written, so out should be a file or other buffered
+ * output rather than a slow serial port.
+ *
+ * @param out Output for the capture, nullptr to stop capturing
+ * @return false if the capture header could not be written
+ */
+bool TCPSocket::setCapture(Print *out) {
+  captureOut = nullptr;
+  if (out == nullptr) {
+    return true;
+  }
+
+  tcp_capture_hdr_t hdr;
+  hdr.start = TCPCAPTURE_START;
+  hdr.version = TCPCAPTURE_VERSION;
+  hdr.recordSize = sizeof (tcp_capture_record_t);
+  hdr.address = sourceAddress;
+  hdr.recvBufferSize = recvBufferSize;
+  hdr.reserved = 0;
+  if (out->write((const uint8_t *)&hdr, sizeof (hdr)) != sizeof (hdr)) {
+    DEBUG_ERR("TCPS: Failed to write capture header");
+    return false;
+  }
+
+  captureOut = out;
+  for (byte i = 0; i < maxClients; i++) {
+    if (connections[i].active) {
+      captureData(&connections[i], TCPCAPTURE_CONNECT, nullptr, 0);
+    }
+  }
+  return true;
+}
+
+/**
+ * Record a read, write, connect, or disconnect for a client
+ */
+void TCPSocket::captureData(tcp_socket_conn_t *conn, byte type,
+                            const uint8_t *data, uint16_t length) {
+  tcp_capture_record_t record;
+  record.micros = micros();
+  record.client = conn - connections;
+  record.type = type;
+  record.length = length;
+
+  if ((captureOut->write((const uint8_t *)&record, sizeof (record)) !=
+       sizeof (record)) ||
+      ((length > 0) && (captureOut->write(data, length) != length))) {
+    /* A partial record would corrupt the rest of the capture */
+    DEBUG_ERR("TCPS: Capture write failed, stopping capture");
+    captureOut = nullptr;
+  }
+}
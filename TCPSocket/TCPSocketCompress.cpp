@@ -0,0 +1,174 @@
+/*
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2018
+ *
+ * Compression of large messages sent to clients that accept it, and
+ * decompression of received messages (see TCPSOCKET_FLAG_COMPRESSED in
+ * TCPSocket.h).
+ */
+
+#include <WiFi.h>
+
+#ifdef DEBUG_LEVEL_TCPSOCKET
+  #define DEBUG_LEVEL DEBUG_LEVEL_TCPSOCKET
+#endif
+#ifndef DEBUG_LEVEL
+  #define DEBUG_LEVEL DEBUG_HIGH
+#endif
+#include <Debug.h>
+
+#include <Socket.h>
+#include "TCPSocket.h"
+
+/**
+ * Compress messages of at least threshold bytes sent to clients that have
+ * indicated they accept compressed messages.  Messages are only sent
+ * compressed when that makes them smaller, and compact, reliable, and
+ * fragmented messages are never compressed.
+ *
+ * @param threshold Smallest message to compress, 0 to disable compression
+ * @param table     Compressor table of TCPCOMPRESS_TABLE_SIZE entries, or
+ *                  nullptr to allocate one
+ * @return false if the table could not be allocated
+ */
+bool TCPSocket::setCompression(uint16_t threshold, uint16_t *table) {
+  free(compressStorage);
+  compressStorage = nullptr;
+
+  if ((threshold > 0) && (table == nullptr)) {
+    table = (uint16_t *)malloc(TCPCOMPRESS_TABLE_SIZE * sizeof (uint16_t));
+    if (table == nullptr) {
+      DEBUG_ERR("TCPS: Failed to alloc compress table");
+      threshold = 0;
+    }
+    compressStorage = table;
+  }
+
+  compressTable = table;
+  compressThreshold = (table != nullptr) ? threshold : 0;
+
+  /* Let current clients know compressed messages can be sent to us */
+  for (byte i = 0; i < maxClients; i++) {
+    if (connections[i].active && negotiated(&connections[i])) {
+      advertiseCompression(&connections[i]);
+    }
+  }
+
+  return (compressThreshold == threshold);
+}
+
+/**
+ * Send an empty message flagged as compressed, indicating to the client that
+ * it may send compressed messages.  This is only sent when compression is
+ * enabled, and only to clients that have negotiated version 2, as others
+ * would receive an empty message.
+ */
+void TCPSocket::advertiseCompression(tcp_socket_conn_t *conn) {
+  if ((compressThreshold == 0) || conn->sendCompact) {
+    return;
+  }
+
+  uint8_t msg[sizeof (tcp_socket_hdr_t)];
+  if (!reserveSend(conn, sizeof (msg))) {
+    return;
+  }
+  fillHeader(msg, TCPSOCKET_VERSION, SOCKET_ADDR_ANY, currentMsgID - 1,
+             TCPSOCKET_FLAG_COMPRESSED, 0);
+  queueSend(conn, msg, sizeof (msg));
+}
+
+/**
+ * Write a compressed message into the free space of a client's send buffer,
+ * which the caller must have reserved for the uncompressed message.  The
+ * caller passes the result to commitSend() to send it.
+ *
+ * @param stamp Follow the compressed data with a timestamp
+ *
+ * @return Length of the compressed message including its header, or 0 if
+ *         compression would not make it smaller
+ */
+uint16_t TCPSocket::compressFrame(tcp_socket_conn_t *conn, byte version,
+                                  socket_addr_t address, byte ID,
+                                  const byte *data, uint16_t datalength,
+                                  bool stamp) {
+  uint16_t hdr_len = headerSize(version);
+  uint16_t trailer_len = stamp ? sizeof (tcp_socket_timestamp_t) : 0;
+  uint8_t *msg = conn->sendQueue + conn->sendQueued;
+
+  uint16_t packed = TCPCompress::compress(data, datalength, msg + hdr_len,
+                                          datalength - 1, compressTable);
+  if (packed == 0) {
+    return 0;
+  }
+
+  fillHeader(msg, version, address, ID,
+             TCPSOCKET_FLAG_COMPRESSED | (stamp ? TCPSOCKET_FLAG_TIMESTAMP : 0),
+             packed + trailer_len);
+  if (stamp) {
+    fillTimestamp(conn, msg + hdr_len + packed, 0);
+  }
+  DEBUG5_VALUE("TCPS: Compressed ", datalength);
+  DEBUG5_VALUELN(" to ", packed);
+  TRACELOG(TCPS_TRACE_COMPRESS, datalength, packed);
+  stats.msgsCompressed++;
+  stats.compressSaved += datalength - packed;
+  return hdr_len + packed + trailer_len;
+}
+
+/**
+ * Decompress a received message into the connection's copy buffer, behind a
+ * copy of its header updated for the decompressed data, so that it is
+ * returned as any other copied message.  The compressed data is read from the
+ * receive buffer where it is, so may wrap.
+ *
+ * @return false if the data is invalid or too large for the copy buffer
+ */
+bool TCPSocket::decompressMsg(tcp_socket_conn_t *conn, uint16_t hdr_len,
+                              tcp_socket_frame_t *frame) {
+  TCPRingBuffer *ring = &conn->ring;
+  uint16_t end = hdr_len + frame->length;
+  uint8_t *msg = conn->recvBuffer;
+  TCPCompress decoder;
+
+  ring->copyOut(0, msg, hdr_len);
+  decoder.beginDecompress(msg + hdr_len, recvBufferSize - hdr_len);
+
+  uint16_t offset = hdr_len;
+  while (offset < end) {
+    uint16_t len = end - offset;
+    const uint8_t *segment = ring->segment(offset, &len);
+    if (!decoder.decompress(segment, len)) {
+      break;
+    }
+    offset += len;
+  }
+
+  int length = decoder.endDecompress();
+  if ((length < 0) || (offset < end)) {
+    DEBUG4_PRINTLN("TCPS: Invalid compressed data");
+    return false;
+  }
+
+  frame->flags &= ~TCPSOCKET_FLAG_COMPRESSED;
+  if (frame->version == TCPSOCKET_VERSION_2) {
+    tcp_socket_hdr_v2_t *hdr = (tcp_socket_hdr_v2_t *)msg;
+    hdr->flags = frame->flags;
+    hdr->length = length;
+  } else {
+    if (length > TCPSOCKET_MAX_DATA_V1) {
+      DEBUG4_VALUELN("TCPS: Decompressed > v1 msg ", length);
+      return false;
+    }
+    tcp_socket_hdr_t *hdr = (tcp_socket_hdr_t *)msg;
+    hdr->flags = frame->flags;
+    hdr->length = length;
+  }
+
+  DEBUG5_VALUE("TCPS: Decompressed ", frame->length);
+  DEBUG5_VALUELN(" to ", length);
+  TRACELOG(TCPS_TRACE_DECOMPRESS, length, frame->length);
+  stats.msgsDecompressed++;
+  frame->length = length;
+  return true;
+}
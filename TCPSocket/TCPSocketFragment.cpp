@@ -0,0 +1,262 @@
+/*
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2018
+ *
+ * Fragmentation of messages too large for a single frame, and their
+ * reassembly when received (see TCPSOCKET_FLAG_MORE in TCPSocket.h).
+ */
+
+#include <WiFi.h>
+
+#ifdef DEBUG_LEVEL_TCPSOCKET
+  #define DEBUG_LEVEL DEBUG_LEVEL_TCPSOCKET
+#endif
+#ifndef DEBUG_LEVEL
+  #define DEBUG_LEVEL DEBUG_HIGH
+#endif
+#include <Debug.h>
+
+#include <Socket.h>
+#include "TCPSocket.h"
+
+/**
+ * Reassemble received fragments into messages of up to maxLength bytes.
+ * Without reassembly, or with a maxLength of 0, fragments are received as
+ * individual messages.
+ *
+ * @param storage Buffer of maxClients * TCP_BUFFER_TOTAL(maxLength) bytes to
+ *                reassemble into, or nullptr to allocate one
+ * @return false if the buffer could not be allocated
+ */
+bool TCPSocket::setReassembly(uint16_t maxLength, uint8_t *storage) {
+  bool result = true;
+
+  if (maxLength > 0xFFFF - TCPSOCKET_MAX_HDR) {
+    DEBUG2_VALUELN("TCPS: Reassembly buf too large ", maxLength);
+    return false;
+  }
+
+  for (byte i = 0; i < maxClients; i++) {
+    if (connections[i].fragHeld) {
+      DEBUG2_VALUELN("TCPS: Can't resize reassembly buf, held ", i);
+      return false;
+    }
+  }
+
+  free(reassemblyStorage);
+  reassemblyStorage = nullptr;
+
+  if ((maxLength > 0) && (storage == nullptr)) {
+    storage = (uint8_t *)malloc(maxClients *
+                                (uint32_t)TCP_BUFFER_TOTAL(maxLength));
+    if (storage == nullptr) {
+      DEBUG_ERR("TCPS: Failed to alloc reassembly buf");
+      result = false;
+    }
+    reassemblyStorage = storage;
+  }
+  if (storage == nullptr) {
+    maxLength = 0;
+  }
+
+  reassemblySize = maxLength;
+  for (byte i = 0; i < maxClients; i++) {
+    connections[i].fragActive = false;
+    connections[i].fragBuffer = (maxLength > 0) ?
+      storage + i * (uint32_t)TCP_BUFFER_TOTAL(maxLength) : nullptr;
+  }
+
+  return result;
+}
+
+/**
+ * Largest amount of data that can be sent to a client in a single frame
+ */
+uint16_t TCPSocket::maxFragment(tcp_socket_conn_t *conn) {
+  uint16_t fragment;
+  if (conn->sendCompact || (compactEnabled && conn->peerCompact)) {
+    /* Allow for the compact start header and the stuffing overhead */
+    fragment = sendBufferSize - sizeof (tcp_socket_hdr_t) - 2 -
+               TCPCOMPACT_MAX_HDR - sendBufferSize / 254 - 1;
+  } else {
+    fragment = sendBufferSize - TCPSOCKET_MAX_HDR;
+  }
+
+  if ((conn->peerVersion < TCPSOCKET_VERSION_2) &&
+      (fragment > TCPSOCKET_MAX_DATA_V1)) {
+    fragment = TCPSOCKET_MAX_DATA_V1;
+  }
+  if ((fragmentSize != 0) && (fragment > fragmentSize)) {
+    fragment = fragmentSize;
+  }
+
+  return fragment;
+}
+
+/**
+ * Send the fragments of a connection's fragmented message, starting from the
+ * first that has not been sent.  Each fragment's header is written in front
+ * of it, over the end of the previous fragment, which is restored once the
+ * fragment has been sent.
+ *
+ * @return TCPSOCKET_SEND_OK once the last fragment has been sent or buffered,
+ *         TCPSOCKET_SEND_PARTIAL if the client stopped accepting fragments
+ *         after the first, otherwise the result of sending the fragment that
+ *         failed, in which case the message is abandoned
+ */
+int TCPSocket::sendFragments(tcp_socket_conn_t *conn, uint16_t fragment) {
+  byte saved[TCPSOCKET_MAX_HDR];
+  const byte *data = conn->sendFragData;
+  uint16_t datalength = conn->sendFragLength;
+
+  while (conn->sendFragOffset < datalength) {
+    uint16_t offset = conn->sendFragOffset;
+    uint16_t length = datalength - offset;
+    byte flags = 0;
+    if (length > fragment) {
+      length = fragment;
+      flags |= TCPSOCKET_FLAG_MORE;
+    }
+    if (offset > 0) {
+      flags |= TCPSOCKET_FLAG_CONT;
+    }
+
+    byte *frag = (byte *)data + offset;
+    if (offset > 0) {
+      memcpy(saved, frag - TCPSOCKET_MAX_HDR, TCPSOCKET_MAX_HDR);
+    }
+    int result = sendFrame(conn, conn->sendFragAddress, currentMsgID, flags,
+                           frag, length);
+    if (offset > 0) {
+      memcpy(frag - TCPSOCKET_MAX_HDR, saved, TCPSOCKET_MAX_HDR);
+    }
+
+    if (result != TCPSOCKET_SEND_OK) {
+      if ((result == TCPSOCKET_WOULD_BLOCK) && (offset > 0)) {
+        DEBUG5_VALUELN("TCPS: Fragments blocked at ", offset);
+        return TCPSOCKET_SEND_PARTIAL;
+      }
+      /* Nothing was sent, or the rest of the message can't be */
+      conn->sendFragData = nullptr;
+      return result;
+    }
+
+    currentMsgID++;
+    conn->sendFragOffset += length;
+  }
+
+  conn->sendFragData = nullptr;
+  return TCPSOCKET_SEND_OK;
+}
+
+/**
+ * Connection with a partly sent fragmented message for an address
+ */
+tcp_socket_conn_t *TCPSocket::fragmentConnection(socket_addr_t address) {
+  for (byte i = 0; i < maxClients; i++) {
+    tcp_socket_conn_t *conn = &connections[i];
+    if (conn->active && (conn->sendFragData != nullptr) &&
+        (conn->sendFragAddress == address)) {
+      return conn;
+    }
+  }
+  return nullptr;
+}
+
+/**
+ * Send more of a fragmented message that sendMsg() returned
+ * TCPSOCKET_SEND_PARTIAL for.  The data passed to sendMsg() is sent from where
+ * it left off, so it must not have been changed or freed.
+ *
+ * @return TCPSOCKET_SEND_OK once the last fragment has been sent or buffered,
+ *         TCPSOCKET_SEND_PARTIAL if fragments remain, otherwise an error,
+ *         including when no fragmented message is being sent to the address
+ */
+int TCPSocket::continueSend(socket_addr_t address) {
+  checkFlush();
+  checkClient();
+
+  tcp_socket_conn_t *conn = fragmentConnection(address);
+  if (conn == nullptr) {
+    DEBUG3_VALUELN("TCPS: No fragments to continue for ", address);
+    return TCPSOCKET_SEND_ERROR;
+  }
+
+  int result = sendFragments(conn, maxFragment(conn));
+  if (result == TCPSOCKET_SEND_OK) {
+    stats.msgsSent++;
+  } else if (result != TCPSOCKET_SEND_PARTIAL) {
+    stats.sendErrors++;
+  }
+  return result;
+}
+
+/**
+ * Abandon a fragmented message that sendMsg() returned TCPSOCKET_SEND_PARTIAL
+ * for.  The client discards the fragments it has received once the next
+ * fragmented message starts.
+ */
+void TCPSocket::abortSend(socket_addr_t address) {
+  tcp_socket_conn_t *conn = fragmentConnection(address);
+  if (conn != nullptr) {
+    DEBUG3_VALUELN("TCPS: Abandoned fragments at ", conn->sendFragOffset);
+    conn->sendFragData = nullptr;
+  }
+}
+
+/**
+ * Add a received fragment to the message being reassembled for a client
+ *
+ * @return true if the message is complete, in which case frame is updated to
+ *         refer to the reassembled message
+ */
+bool TCPSocket::addFragment(tcp_socket_conn_t *conn,
+                            tcp_socket_frame_t *frame) {
+  if (!(frame->flags & TCPSOCKET_FLAG_CONT)) {
+    if (conn->fragActive) {
+      DEBUG4_VALUELN("TCPS: Abandoned fragments ", conn->fragLength);
+    }
+    conn->fragActive = true;
+    conn->fragLength = 0;
+    conn->fragID = frame->ID;
+    conn->fragFlags = frame->flags & ~TCPSOCKET_FLAG_FRAGMENT;
+  } else if (!conn->fragActive) {
+    DEBUG4_VALUELN("TCPS: Fragment without first ", frame->ID);
+    return false;
+  }
+
+  if (conn->fragLength + (uint32_t)frame->length > reassemblySize) {
+    DEBUG3_VALUELN("TCPS: Fragmented msg > reassembly buf ", reassemblySize);
+    conn->fragActive = false;
+    return false;
+  }
+  memcpy(conn->fragBuffer + TCPSOCKET_MAX_HDR + conn->fragLength,
+         frame->data, frame->length);
+  conn->fragLength += frame->length;
+
+  if (frame->flags & TCPSOCKET_FLAG_MORE) {
+    return false;
+  }
+  conn->fragActive = false;
+
+  /* Precede the message with a header, as for any other received message */
+  tcp_socket_hdr_v2_t *hdr = (tcp_socket_hdr_v2_t *)conn->fragBuffer;
+  hdr->start = TCPSOCKET_START;
+  hdr->version = TCPSOCKET_VERSION_2;
+  hdr->ID = conn->fragID;
+  hdr->flags = conn->fragFlags;
+  hdr->reserved = 0;
+  hdr->length = conn->fragLength;
+  hdr->source = frame->source;
+  hdr->address = frame->address;
+
+  frame->data = conn->fragBuffer + TCPSOCKET_MAX_HDR;
+  frame->length = conn->fragLength;
+  frame->version = TCPSOCKET_VERSION_2;
+  frame->ID = conn->fragID;
+  frame->flags = conn->fragFlags;
+
+  DEBUG5_VALUELN("TCPS: Reassembled ", frame->length);
+  return true;
+}
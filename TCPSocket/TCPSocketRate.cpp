@@ -0,0 +1,157 @@
+/*
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2018
+ *
+ * Rate limiting of received messages and the weighting of clients' turns, so
+ * that a client sending more than its share can't starve the others or the
+ * caller (see TCPSOCKET_RATE_SOURCES in TCPSocket.h).
+ */
+
+#include <WiFi.h>
+
+#ifdef DEBUG_LEVEL_TCPSOCKET
+  #define DEBUG_LEVEL DEBUG_LEVEL_TCPSOCKET
+#endif
+#ifndef DEBUG_LEVEL
+  #define DEBUG_LEVEL DEBUG_HIGH
+#endif
+#include <Debug.h>
+
+#include <Socket.h>
+#include "TCPSocket.h"
+
+/**
+ * Limit the rate messages are received from each connection.  A connection
+ * over its limit is not read from until the limit allows its next message.
+ */
+void TCPSocket::setRateLimit(uint16_t msgsPerSec, uint32_t bytesPerSec,
+                             uint16_t burstMsgs, uint32_t burstBytes) {
+  TCPTokenBucket::setLimit(&connRate, msgsPerSec, bytesPerSec, burstMsgs,
+                           burstBytes);
+
+  unsigned long now = millis();
+  for (byte i = 0; i < maxClients; i++) {
+    connections[i].rateBucket.fill(&connRate, now);
+  }
+}
+
+/**
+ * Limit the rate messages are received from each source address, regardless
+ * of the connections they arrive on.  State is kept for the maxSources
+ * addresses most recently received from, with others starting a full bucket.
+ *
+ * @return false if the address state could not be allocated
+ */
+bool TCPSocket::setSourceRateLimit(uint16_t msgsPerSec, uint32_t bytesPerSec,
+                                   uint16_t burstMsgs, uint32_t burstBytes,
+                                   byte maxSources) {
+  clearRateSources();
+  TCPTokenBucket::setLimit(&sourceRate, msgsPerSec, bytesPerSec, burstMsgs,
+                           burstBytes);
+  if (!TCPTokenBucket::limited(&sourceRate)) {
+    return true;
+  }
+
+  if (maxSources == 0) {
+    DEBUG_ERR("TCPS: Invalid rate limit sources");
+    TCPTokenBucket::setLimit(&sourceRate, 0, 0);
+    return false;
+  }
+
+  rateSources = new tcp_socket_rate_source_t[maxSources];
+  maxRateSources = maxSources;
+  for (byte i = 0; i < maxRateSources; i++) {
+    rateSources[i].address = SOCKET_ADDR_INVALID;
+  }
+  return true;
+}
+
+void TCPSocket::clearRateSources() {
+  delete[] rateSources;
+  rateSources = nullptr;
+  maxRateSources = 0;
+}
+
+/**
+ * Set the number of messages received from a client on each of its turns,
+ * which lasts until the client disconnects
+ *
+ * @return false if there is no client for the address
+ */
+bool TCPSocket::setWeight(socket_addr_t address, byte weight) {
+  tcp_socket_conn_t *conn = routeConnection(address);
+  if ((conn == nullptr) ||
+      ((address != SOCKET_ADDR_ANY) && (conn->peerAddress != address))) {
+    return false;
+  }
+  conn->weight = (weight > 0) ? weight : 1;
+  return true;
+}
+
+/**
+ * Check the rate limits for a message, without taking its tokens as it may
+ * still have to wait for a copy buffer (see chargeMsg())
+ *
+ * @return false if the message must wait for a limit
+ */
+bool TCPSocket::admitMsg(tcp_socket_conn_t *conn, socket_addr_t source) {
+  unsigned long now = millis();
+
+  bool admitted = true;
+  if (TCPTokenBucket::limited(&connRate)) {
+    admitted = conn->rateBucket.admit(&connRate, now);
+  }
+  if (admitted && (rateSources != nullptr)) {
+    admitted = findRateSource(source, now)->bucket.admit(&sourceRate, now);
+  }
+
+  if (!admitted) {
+    DEBUG5_VALUELN("TCPS: Rate limited ", source);
+    TRACELOG(TCPS_TRACE_RATE_LIMITED, conn - connections, source);
+    stats.rateLimited++;
+    conn->rateLimited = true;
+    /* The client's data is waiting in its buffer, so it isn't idle */
+    conn->lastRecvMillis = now;
+    return false;
+  }
+  return true;
+}
+
+/**
+ * Take the tokens for an admitted message once it is being received
+ */
+void TCPSocket::chargeMsg(tcp_socket_conn_t *conn, socket_addr_t source,
+                          uint16_t length) {
+  conn->rateBucket.take(&connRate, length);
+  if (rateSources != nullptr) {
+    findRateSource(source, millis())->bucket.take(&sourceRate, length);
+  }
+}
+
+/**
+ * Find the rate limit state for a source address, replacing the state of the
+ * address least recently received from if it has none
+ */
+tcp_socket_rate_source_t *TCPSocket::findRateSource(socket_addr_t address,
+                                                    unsigned long now) {
+  tcp_socket_rate_source_t *oldest = &rateSources[0];
+  for (byte i = 0; i < maxRateSources; i++) {
+    tcp_socket_rate_source_t *entry = &rateSources[i];
+    if (entry->address == address) {
+      return entry;
+    }
+    if (entry->address == SOCKET_ADDR_INVALID) {
+      /* Entries are used in order, so no later entry holds the address */
+      oldest = entry;
+      break;
+    }
+    if (now - entry->bucket.lastMillis() > now - oldest->bucket.lastMillis()) {
+      oldest = entry;
+    }
+  }
+
+  oldest->address = address;
+  oldest->bucket.fill(&sourceRate, now);
+  return oldest;
+}
@@ -0,0 +1,429 @@
+/*
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2018
+ *
+ * Reliable delivery for TCPSocket (see TCPSOCKET_FLAG_RELIABLE in TCPSocket.h).
+ *
+ * Each remote address has a window of messages that have been sent but not
+ * acknowledged.  The window is bound to the connection the address was last
+ * received from, and when the address reconnects only the messages it has not
+ * acknowledged are sent again.
+ */
+
+#include <WiFi.h>
+
+#ifdef DEBUG_LEVEL_TCPSOCKET
+  #define DEBUG_LEVEL DEBUG_LEVEL_TCPSOCKET
+#endif
+#ifndef DEBUG_LEVEL
+  #define DEBUG_LEVEL DEBUG_HIGH
+#endif
+#include <Debug.h>
+
+#include <Socket.h>
+#include "TCPSocket.h"
+
+/* Size of a message in a window, with room to write its header in place */
+#define RELIABLE_RECORD(len) (sizeof (uint16_t) + TCPSOCKET_MAX_HDR + (len))
+
+static uint16_t recordLength(const uint8_t *record) {
+  uint16_t len;
+  memcpy(&len, record, sizeof (len));
+  return len;
+}
+
+static const uint8_t *recordData(const uint8_t *record) {
+  return record + sizeof (uint16_t) + TCPSOCKET_MAX_HDR;
+}
+
+/**
+ * Enable reliable delivery for up to _maxPeers remote addresses at once,
+ * allocating a window for each.  Addresses that have nothing left to
+ * acknowledge are forgotten to make room for others.
+ *
+ * @param windowMsgs  Maximum unacknowledged messages per address
+ * @param windowBytes Size of each window, which holds a header with each
+ *                    message
+ * @return false if the window size is invalid or could not be allocated
+ */
+bool TCPSocket::setReliable(byte windowMsgs, uint16_t windowBytes,
+                            byte _maxPeers) {
+  clearReliable();
+
+  if ((windowMsgs == 0) || (windowMsgs > TCPSOCKET_RELIABLE_MAX_WINDOW) ||
+      (windowBytes <= RELIABLE_RECORD(0)) || (_maxPeers == 0)) {
+    DEBUG_ERR("TCPS: Invalid reliable window");
+    return false;
+  }
+
+  peers = new tcp_socket_peer_t[_maxPeers];
+  maxPeers = _maxPeers;
+  for (byte i = 0; i < maxPeers; i++) {
+    peers[i].address = SOCKET_ADDR_INVALID;
+    peers[i].conn = TCPSOCKET_NO_CONN;
+    peers[i].ackPending = false;
+    peers[i].window = nullptr;
+  }
+  for (byte i = 0; i < maxPeers; i++) {
+    peers[i].window = (uint8_t *)malloc(windowBytes);
+    if (peers[i].window == nullptr) {
+      DEBUG_ERR("TCPS: Failed to alloc reliable window");
+      clearReliable();
+      return false;
+    }
+  }
+  reliableWindow = windowMsgs;
+  reliableBytes = windowBytes;
+
+  return true;
+}
+
+/**
+ * Disable reliable delivery, discarding any unacknowledged messages
+ */
+void TCPSocket::clearReliable() {
+  for (byte i = 0; i < maxPeers; i++) {
+    free(peers[i].window);
+  }
+  delete[] peers;
+  peers = nullptr;
+  maxPeers = 0;
+}
+
+/**
+ * Queue a message for reliable delivery to an address.  The message is kept
+ * until the client for the address acknowledges it, including across
+ * disconnects, so it is accepted even if the client is not connected, unless
+ * no more addresses can be kept (see setReliable()).  It is only sent once the
+ * client has negotiated version 2 (see negotiatePeer()).
+ * Messages larger than TCPSOCKET_MAX_DATA_V1 require a client that accepts
+ * version 2 messages.
+ *
+ * @return TCPSOCKET_SEND_OK if the message was queued, TCPSOCKET_WOULD_BLOCK
+ *         if the address's window is full, otherwise an error
+ */
+int TCPSocket::sendReliable(socket_addr_t address, const byte *data,
+                            uint16_t length) {
+  if ((peers == nullptr) || (address == SOCKET_ADDR_ANY)) {
+    DEBUG2_PRINTLN("TCPS: Reliable send requires an address");
+    return TCPSOCKET_SEND_ERROR;
+  }
+
+  uint16_t max_len = TCPSOCKET_MAX_HDR + length;
+  if (compactEnabled) {
+    uint16_t compact_len = sizeof (tcp_socket_hdr_t) + 1 +
+                           TCPCompact::maxEncoded(TCPCOMPACT_MAX_HDR + length);
+    if (compact_len > max_len) {
+      max_len = compact_len;
+    }
+  }
+  if ((RELIABLE_RECORD(length) > reliableBytes) ||
+      (max_len > sendBufferSize)) {
+    DEBUG3_VALUELN("TCPS: msg > reliable window ", length);
+    return TCPSOCKET_SEND_ERROR;
+  }
+
+  checkFlush();
+  checkClient();
+
+  tcp_socket_peer_t *peer = findPeer(address, true);
+  if (peer == nullptr) {
+    DEBUG2_VALUELN("TCPS: No reliable state for ", address);
+    return TCPSOCKET_SEND_ERROR;
+  }
+
+  if (((byte)(peer->nextSeq - peer->ackedSeq) >= reliableWindow) ||
+      (peer->windowUsed + RELIABLE_RECORD(length) > reliableBytes)) {
+    DEBUG4_VALUELN("TCPS: reliable window full ", address);
+    return TCPSOCKET_WOULD_BLOCK;
+  }
+
+  uint8_t *record = peer->window + peer->windowUsed;
+  memcpy(record, &length, sizeof (length));
+  memcpy((uint8_t *)recordData(record), data, length);
+  peer->windowUsed += RELIABLE_RECORD(length);
+  peer->nextSeq++;
+
+  sendPending(peer);
+
+  return TCPSOCKET_SEND_OK;
+}
+
+/**
+ * Number of reliable messages to an address that have not been acknowledged
+ */
+byte TCPSocket::unacked(socket_addr_t address) {
+  if (peers == nullptr) {
+    return 0;
+  }
+  tcp_socket_peer_t *peer = findPeer(address, false);
+  if (peer == nullptr) {
+    return 0;
+  }
+  return peer->nextSeq - peer->ackedSeq;
+}
+
+/**
+ * Find the reliable delivery state for an address
+ *
+ * @param create Allocate an entry if the address has none, replacing the least
+ *               recently used address that can be forgotten if every entry is
+ *               in use, and note that the address has been used
+ */
+tcp_socket_peer_t *TCPSocket::findPeer(socket_addr_t address, bool create) {
+  unsigned long now = millis();
+  tcp_socket_peer_t *unused = nullptr;
+  tcp_socket_peer_t *stalest = nullptr;
+  for (byte i = 0; i < maxPeers; i++) {
+    if (peers[i].address == address) {
+      if (create) {
+        peers[i].usedMillis = now;
+      }
+      return &peers[i];
+    }
+    if (peers[i].address == SOCKET_ADDR_INVALID) {
+      if (unused == nullptr) {
+        unused = &peers[i];
+      }
+    } else if ((peers[i].conn == TCPSOCKET_NO_CONN) &&
+               (peers[i].ackedSeq == peers[i].nextSeq) &&
+               ((stalest == nullptr) ||
+                (now - peers[i].usedMillis > now - stalest->usedMillis))) {
+      stalest = &peers[i];
+    }
+  }
+
+  if (!create) {
+    return nullptr;
+  }
+  if (unused == nullptr) {
+    if (stalest == nullptr) {
+      return nullptr;
+    }
+    DEBUG4_VALUELN("TCPS: Reliable peer replaced ", stalest->address);
+    unused = stalest;
+  }
+
+  unused->address = address;
+  unused->conn = TCPSOCKET_NO_CONN;
+  unused->windowUsed = 0;
+  unused->sentOffset = 0;
+  unused->ackedSeq = 0;
+  unused->sentSeq = 0;
+  unused->nextSeq = 0;
+  unused->syncPending = true;
+  unused->syncReset = true;
+  unused->expectedSeq = 0;
+  unused->recvSynced = false;
+  unused->recvUnacked = 0;
+  unused->ackPending = false;
+  unused->ackGap = false;
+  unused->usedMillis = now;
+  return unused;
+}
+
+/**
+ * Bind an address to a connection, on which every unacknowledged message
+ * will be sent again following a sync.
+ */
+void TCPSocket::bindPeer(tcp_socket_peer_t *peer, byte index) {
+  DEBUG4_VALUE("TCPS: Reliable addr ", peer->address);
+  DEBUG4_VALUELN(" on client ", index);
+  peer->conn = index;
+  peer->sentSeq = peer->ackedSeq;
+  peer->sentOffset = 0;
+  peer->syncPending = true;
+}
+
+/**
+ * Handle the reliable delivery fields of a received message
+ *
+ * @return true if the message should be delivered, false for acknowledgements
+ *         and messages that were already received
+ */
+bool TCPSocket::recvReliable(tcp_socket_conn_t *conn,
+                             const tcp_socket_frame_t *frame) {
+  byte value = (frame->length > 0) ? frame->data[0] : 0;
+
+  tcp_socket_peer_t *peer = findPeer(frame->source, true);
+  if (peer == nullptr) {
+    /* Without state the message can't be acknowledged, but is delivered */
+    DEBUG2_VALUELN("TCPS: No reliable state for ", frame->source);
+    return !(frame->flags & TCPSOCKET_FLAG_ACK);
+  }
+
+  byte index = conn - connections;
+  if (peer->conn != index) {
+    bindPeer(peer, index);
+  }
+
+  if (frame->flags & TCPSOCKET_FLAG_ACK) {
+    if (frame->flags & TCPSOCKET_FLAG_RELIABLE) {
+      /*
+       * Sync, a resumed sequence continues from the messages already
+       * received unless they are unknown.
+       */
+      if (value || !peer->recvSynced) {
+        peer->expectedSeq = frame->ID;
+        peer->recvSynced = true;
+      }
+      peer->ackPending = true;
+    } else {
+      recvAck(peer, frame->ID, value);
+    }
+    sendPending(peer);
+    return false;
+  }
+
+  if (!peer->recvSynced) {
+    /* No sync was received, start from this message */
+    peer->expectedSeq = frame->ID;
+    peer->recvSynced = true;
+  }
+
+  int8_t diff = (int8_t)(frame->ID - peer->expectedSeq);
+  peer->ackPending = true;
+  if (diff != 0) {
+    if (diff > 0) {
+      DEBUG4_VALUE("TCPS: Reliable msgs missed ", (int)diff);
+      DEBUG4_VALUELN(" from ", frame->source);
+      peer->ackGap = true;
+    } else {
+      DEBUG5_VALUELN("TCPS: Reliable duplicate ", frame->ID);
+    }
+    return false;
+  }
+
+  peer->expectedSeq++;
+  peer->recvUnacked++;
+  if (peer->recvUnacked >= (reliableWindow + 1) / 2) {
+    /* Acknowledge before the sender's window could fill */
+    sendPending(peer);
+  }
+
+  return true;
+}
+
+/**
+ * Free the acknowledged messages from an address's window
+ *
+ * @param ID  Next message expected by the receiver
+ * @param gap Receiver missed messages, all unacknowledged messages must be
+ *            sent again
+ */
+void TCPSocket::recvAck(tcp_socket_peer_t *peer, byte ID, bool gap) {
+  byte acked = ID - peer->ackedSeq;
+  if (acked > (byte)(peer->nextSeq - peer->ackedSeq)) {
+    DEBUG4_VALUELN("TCPS: Invalid ack ", ID);
+    return;
+  }
+
+  uint16_t offset = 0;
+  for (byte i = 0; i < acked; i++) {
+    offset += RELIABLE_RECORD(recordLength(peer->window + offset));
+  }
+  peer->windowUsed -= offset;
+  memmove(peer->window, peer->window + offset, peer->windowUsed);
+
+  if (gap || (acked > (byte)(peer->sentSeq - peer->ackedSeq))) {
+    /* Resume from the oldest message the receiver has not acknowledged */
+    peer->sentSeq = ID;
+    peer->sentOffset = 0;
+  } else {
+    peer->sentOffset -= offset;
+  }
+  peer->ackedSeq = ID;
+
+  DEBUG5_VALUE("TCPS: Acked ", acked);
+  DEBUG5_VALUELN(" unacked ", (byte)(peer->nextSeq - peer->ackedSeq));
+}
+
+/**
+ * Send a reliable delivery control message with a single data byte
+ */
+int TCPSocket::sendControl(tcp_socket_peer_t *peer, byte ID, byte flags,
+                           byte value) {
+  byte msg[TCPSOCKET_MAX_HDR + 1];
+  msg[TCPSOCKET_MAX_HDR] = value;
+  return sendFrame(&connections[peer->conn], peer->address, ID, flags,
+                   msg + TCPSOCKET_MAX_HDR, 1);
+}
+
+/**
+ * Send any pending acknowledgement to an address, followed by the messages in
+ * its window that have not yet been sent on its connection.
+ */
+void TCPSocket::sendPending(tcp_socket_peer_t *peer) {
+  if (peer->conn == TCPSOCKET_NO_CONN) {
+    if (peer->ackedSeq == peer->nextSeq) {
+      return;
+    }
+    /*
+     * Find the connection the address has been received from, if the client
+     * has negotiated the flags that reliable messages are sent with
+     */
+    for (byte i = 0; i < maxClients; i++) {
+      if (connections[i].active && negotiated(&connections[i]) &&
+          (connections[i].peerAddress == peer->address)) {
+        bindPeer(peer, i);
+        break;
+      }
+    }
+    if (peer->conn == TCPSOCKET_NO_CONN) {
+      return;
+    }
+  }
+  tcp_socket_conn_t *conn = &connections[peer->conn];
+
+  if (peer->ackPending) {
+    if (sendControl(peer, peer->expectedSeq, TCPSOCKET_FLAG_ACK,
+                    peer->ackGap) != TCPSOCKET_SEND_OK) {
+      return;
+    }
+    peer->ackPending = false;
+    peer->ackGap = false;
+    peer->recvUnacked = 0;
+  }
+
+  if (peer->sentSeq == peer->nextSeq) {
+    return;
+  }
+
+  if (peer->syncPending) {
+    if (sendControl(peer, peer->sentSeq,
+                    TCPSOCKET_FLAG_ACK | TCPSOCKET_FLAG_RELIABLE,
+                    peer->syncReset) != TCPSOCKET_SEND_OK) {
+      return;
+    }
+    peer->syncPending = false;
+    peer->syncReset = false;
+  }
+
+  while (peer->sentSeq != peer->nextSeq) {
+    const uint8_t *record = peer->window + peer->sentOffset;
+    uint16_t length = recordLength(record);
+    int result = sendFrame(conn, peer->address, peer->sentSeq,
+                           TCPSOCKET_FLAG_RELIABLE, recordData(record),
+                           length);
+    if (result != TCPSOCKET_SEND_OK) {
+      if (result != TCPSOCKET_WOULD_BLOCK) {
+        DEBUG2_VALUELN("TCPS: Reliable msg can't be sent ", length);
+      }
+      return;
+    }
+    peer->sentSeq++;
+    peer->sentOffset += RELIABLE_RECORD(length);
+  }
+}
+
+/**
+ * Send pending acknowledgements and reliable messages for every address
+ */
+void TCPSocket::checkReliable() {
+  for (byte i = 0; i < maxPeers; i++) {
+    if (peers[i].address != SOCKET_ADDR_INVALID) {
+      sendPending(&peers[i]);
+    }
+  }
+}
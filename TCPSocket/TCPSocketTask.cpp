@@ -0,0 +1,236 @@
+/*
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2018
+ */
+
+#ifdef DEBUG_LEVEL_TCPSOCKET
+  #define DEBUG_LEVEL DEBUG_LEVEL_TCPSOCKET
+#endif
+#ifndef DEBUG_LEVEL
+  #define DEBUG_LEVEL DEBUG_HIGH
+#endif
+#include <Debug.h>
+
+#include "TCPSocketTask.h"
+
+#if defined(TCPSOCKET_HOST) || defined(ESP32)
+
+TCPSocketTask::TCPSocketTask(TCPSocket *_socket, TCPFrameQueue *_queue) {
+  socket = _socket;
+  queue = _queue;
+  isRunning = false;
+  stopping = false;
+  droppedMsgs = 0;
+#if defined(ESP32)
+  task = nullptr;
+  mutex = xSemaphoreCreateMutex();
+#endif
+}
+
+TCPSocketTask::~TCPSocketTask() {
+  stop();
+#if defined(ESP32)
+  vSemaphoreDelete(mutex);
+#endif
+}
+
+/**
+ * Start the task, after which the socket must only be used through this
+ * object until stop() is called
+ */
+bool TCPSocketTask::start() {
+  if (isRunning) {
+    return true;
+  }
+
+  stopping = false;
+  isRunning = true;
+#if defined(TCPSOCKET_HOST)
+  thread = std::thread(run, this);
+#else
+  if (xTaskCreatePinnedToCore(run, "TCPSocketTask", TCPSOCKETTASK_STACK, this,
+                              TCPSOCKETTASK_PRIORITY, &task,
+                              TCPSOCKETTASK_CORE) != pdPASS) {
+    DEBUG_ERR("TCPS: Failed to create receive task");
+    isRunning = false;
+    return false;
+  }
+#endif
+
+  DEBUG3_PRINTLN("TCPS: Receive task started");
+  return true;
+}
+
+/**
+ * Stop the task and wait for it to exit.  Messages already queued remain
+ * available.
+ */
+void TCPSocketTask::stop() {
+  if (!isRunning) {
+    return;
+  }
+
+  stopping = true;
+#if defined(TCPSOCKET_HOST)
+  thread.join();
+#else
+  while (isRunning) {
+    delay(1);
+  }
+  task = nullptr;
+#endif
+
+  DEBUG3_PRINTLN("TCPS: Receive task stopped");
+}
+
+void TCPSocketTask::run(void *arg) {
+  TCPSocketTask *self = (TCPSocketTask *)arg;
+  self->service();
+  self->isRunning = false;
+#if defined(ESP32)
+  vTaskDelete(NULL);
+#endif
+}
+
+void TCPSocketTask::queueMsg(const tcp_socket_frame_t *frame, void *arg) {
+  TCPSocketTask *self = (TCPSocketTask *)arg;
+  if (!self->queue->push(frame)) {
+    DEBUG_ERR("TCPS: Msg too large for queue");
+    self->droppedMsgs++;
+  }
+}
+
+/**
+ * Move received messages from the socket to the queue.  When the queue is full
+ * messages are left in the socket, so that a slow application pushes back on
+ * its clients rather than losing messages.
+ */
+void TCPSocketTask::service() {
+  while (!stopping) {
+    unsigned int received = 0;
+
+    lock();
+    uint16_t space = queue->space();
+    if (space > 0) {
+      received = socket->getMsgs(queueMsg, this, space);
+    }
+    unlock();
+
+    if (received == 0) {
+#if defined(TCPSOCKET_HOST)
+      if (space > 0) {
+        /* Wake as soon as data arrives, and periodically for queued sends */
+        socket->waitRecv(TCPSOCKETTASK_IDLE_MS);
+      } else {
+        std::this_thread::sleep_for(
+                std::chrono::milliseconds(TCPSOCKETTASK_IDLE_MS));
+      }
+#else
+      vTaskDelay(pdMS_TO_TICKS(TCPSOCKETTASK_IDLE_MS) > 0 ?
+                 pdMS_TO_TICKS(TCPSOCKETTASK_IDLE_MS) : 1);
+#endif
+    }
+  }
+}
+
+/**
+ * Return the oldest received message, which remains valid until
+ * releaseFrame() is called
+ */
+const tcp_socket_frame_t *TCPSocketTask::getFrame() {
+  return queue->front();
+}
+
+void TCPSocketTask::releaseFrame() {
+  queue->pop();
+}
+
+/**
+ * Pass queued messages to the handler, up to maxMsgs if non-zero
+ */
+unsigned int TCPSocketTask::getMsgs(tcp_socket_handler_t handler, void *arg,
+                                    unsigned int maxMsgs) {
+  unsigned int count = 0;
+  const tcp_socket_frame_t *frame;
+  while (((maxMsgs == 0) || (count < maxMsgs)) &&
+         ((frame = queue->front()) != nullptr)) {
+    handler(frame, arg);
+    queue->pop();
+    count++;
+  }
+  return count;
+}
+
+int TCPSocketTask::sendMsg(socket_addr_t address, const byte *data,
+                           uint16_t length) {
+  lock();
+  int result = socket->sendMsg(address, data, length);
+  unlock();
+  return result;
+}
+
+int TCPSocketTask::continueSend(socket_addr_t address) {
+  lock();
+  int result = socket->continueSend(address);
+  unlock();
+  return result;
+}
+
+void TCPSocketTask::abortSend(socket_addr_t address) {
+  lock();
+  socket->abortSend(address);
+  unlock();
+}
+
+byte TCPSocketTask::broadcastMsg(const byte *data, uint16_t length) {
+  lock();
+  byte result = socket->broadcastMsg(data, length);
+  unlock();
+  return result;
+}
+
+bool TCPSocketTask::flush() {
+  lock();
+  bool result = socket->flush();
+  unlock();
+  return result;
+}
+
+bool TCPSocketTask::connected() {
+  lock();
+  bool result = socket->connected();
+  unlock();
+  return result;
+}
+
+byte TCPSocketTask::numClients() {
+  lock();
+  byte result = socket->numClients();
+  unlock();
+  return result;
+}
+
+void TCPSocketTask::getStats(tcp_socket_stats_t *snapshot) {
+  lock();
+  socket->getStats(snapshot);
+  unlock();
+}
+
+void TCPSocketTask::lock() {
+#if defined(TCPSOCKET_HOST)
+  mutex.lock();
+#else
+  xSemaphoreTake(mutex, portMAX_DELAY);
+#endif
+}
+
+void TCPSocketTask::unlock() {
+#if defined(TCPSOCKET_HOST)
+  mutex.unlock();
+#else
+  xSemaphoreGive(mutex);
+#endif
+}
+
+#endif // TCPSOCKET_HOST || ESP32
@@ -0,0 +1,101 @@
+/*
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2018
+ *
+ * Receive task for TCPSocket.  A dedicated task (a FreeRTOS task on the ESP32,
+ * a thread on the host) reads and frames messages from the socket and passes
+ * them to the application through a TCPFrameQueue, so that receive latency
+ * doesn't depend on how long the application's loop takes.
+ *
+ * Once started the task owns the socket; the application must only use it
+ * through the functions here, which serialize access with the task.
+ */
+
+#ifndef TCPSOCKETTASK_H
+#define TCPSOCKETTASK_H
+
+#include <atomic>
+
+#if defined(TCPSOCKET_HOST)
+  #include <chrono>
+  #include <mutex>
+  #include <thread>
+#elif defined(ESP32)
+  #include <freertos/FreeRTOS.h>
+  #include <freertos/semphr.h>
+  #include <freertos/task.h>
+#endif
+
+#include "TCPSocket.h"
+#include "TCPFrameQueue.h"
+
+/* Time the task sleeps when there is no received data */
+#ifndef TCPSOCKETTASK_IDLE_MS
+  #define TCPSOCKETTASK_IDLE_MS 1
+#endif
+
+#if defined(ESP32)
+  #ifndef TCPSOCKETTASK_STACK
+    #define TCPSOCKETTASK_STACK 4096
+  #endif
+  #ifndef TCPSOCKETTASK_PRIORITY
+    #define TCPSOCKETTASK_PRIORITY 2
+  #endif
+  #ifndef TCPSOCKETTASK_CORE
+    #define TCPSOCKETTASK_CORE tskNO_AFFINITY
+  #endif
+#endif
+
+class TCPSocketTask {
+public:
+  TCPSocketTask(TCPSocket *socket, TCPFrameQueue *queue);
+  ~TCPSocketTask();
+
+  bool start();
+  void stop();
+  bool running() { return isRunning; }
+
+  /* Received messages, in the order they were received */
+  const tcp_socket_frame_t *getFrame();
+  void releaseFrame();
+  unsigned int getMsgs(tcp_socket_handler_t handler, void *arg = nullptr,
+                       unsigned int maxMsgs = 0);
+
+  /* Socket functions that may be called while the task is running */
+  int sendMsg(socket_addr_t address, const byte *data, uint16_t length);
+  int continueSend(socket_addr_t address);
+  void abortSend(socket_addr_t address);
+  byte broadcastMsg(const byte *data, uint16_t length);
+  bool flush();
+  bool connected();
+  byte numClients();
+  void getStats(tcp_socket_stats_t *snapshot);
+
+  /* Messages discarded because they didn't fit in a queue slot */
+  unsigned long dropped() { return droppedMsgs; }
+
+private:
+  TCPSocket *socket;
+  TCPFrameQueue *queue;
+  std::atomic<bool> isRunning;
+  std::atomic<bool> stopping;
+  std::atomic<unsigned long> droppedMsgs;
+
+#if defined(TCPSOCKET_HOST)
+  std::thread thread;
+  std::mutex mutex;
+#elif defined(ESP32)
+  TaskHandle_t task;
+  SemaphoreHandle_t mutex;
+#endif
+
+  void lock();
+  void unlock();
+  void service();
+
+  static void run(void *arg);
+  static void queueMsg(const tcp_socket_frame_t *frame, void *arg);
+};
+
+#endif // TCPSOCKETTASK_H
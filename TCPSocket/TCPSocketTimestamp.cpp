@@ -0,0 +1,205 @@
+/*
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2018
+ *
+ * Timestamping of messages, and the round trip time and one-way delay
+ * measured from them (see tcp_socket_timestamp_t in TCPSocket.h).
+ */
+
+#include <WiFi.h>
+
+#ifdef DEBUG_LEVEL_TCPSOCKET
+  #define DEBUG_LEVEL DEBUG_LEVEL_TCPSOCKET
+#endif
+#ifndef DEBUG_LEVEL
+  #define DEBUG_LEVEL DEBUG_HIGH
+#endif
+#include <Debug.h>
+
+#include <Socket.h>
+#include "TCPSocket.h"
+
+/**
+ * Add timestamps to messages sent to clients that send timestamped messages,
+ * probing current and future clients that have negotiated version 2 so that
+ * they learn the socket sends them.  Each timestamp adds
+ * sizeof (tcp_socket_timestamp_t) bytes to the message, which the receiver's
+ * buffer must have room for.  Messages that are broadcast or sent as compact
+ * frames are not timestamped.
+ */
+void TCPSocket::setTimestamps(bool enable) {
+  timestampsEnabled = enable;
+  if (!enable) {
+    return;
+  }
+
+  for (byte i = 0; i < maxClients; i++) {
+    if (connections[i].active && negotiated(&connections[i])) {
+      sendTimestamp(&connections[i],
+                    TCPSOCKET_TIMESTAMP_PROBE | TCPSOCKET_TIMESTAMP_ONLY);
+    }
+  }
+}
+
+/**
+ * Send a timestamp to the client for an address requesting one in reply, to
+ * measure the round trip time while no other messages are being exchanged.
+ *
+ * @return false if there is no client for the address, it hasn't negotiated
+ *         version 2, or its send buffer is full
+ */
+bool TCPSocket::probeLatency(socket_addr_t address) {
+  tcp_socket_conn_t *conn = routeConnection(address);
+  if ((conn == nullptr) ||
+      ((address != SOCKET_ADDR_ANY) && (conn->peerAddress != address)) ||
+      !negotiated(conn)) {
+    return false;
+  }
+  return sendTimestamp(conn,
+                       TCPSOCKET_TIMESTAMP_PROBE | TCPSOCKET_TIMESTAMP_ONLY);
+}
+
+/**
+ * Copy the latency measured with the client for an address, which is kept
+ * until the client disconnects
+ *
+ * @return false if there is no client for the address
+ */
+bool TCPSocket::getLatency(socket_addr_t address,
+                           tcp_socket_latency_t *snapshot) {
+  tcp_socket_conn_t *conn = routeConnection(address);
+  if ((conn == nullptr) ||
+      ((address != SOCKET_ADDR_ANY) && (conn->peerAddress != address))) {
+    return false;
+  }
+  *snapshot = conn->latency;
+  return true;
+}
+
+/**
+ * Record a latency sample in a histogram
+ */
+void TCPSocket::addLatency(tcp_socket_histogram_t *histogram,
+                           uint32_t micros) {
+  byte bucket = 0;
+  uint32_t limit = TCPSOCKET_LATENCY_BASE;
+  while ((micros >= limit) && (bucket < TCPSOCKET_LATENCY_BUCKETS - 1)) {
+    limit <<= 1;
+    bucket++;
+  }
+
+  if (histogram->buckets[bucket] == 0xFFFF) {
+    for (byte i = 0; i < TCPSOCKET_LATENCY_BUCKETS; i++) {
+      histogram->buckets[i] >>= 1;
+    }
+  }
+  histogram->buckets[bucket]++;
+
+  if (histogram->samples == 0) {
+    histogram->minMicros = micros;
+    histogram->maxMicros = micros;
+    histogram->smoothedMicros = micros;
+  } else {
+    if (micros < histogram->minMicros) {
+      histogram->minMicros = micros;
+    }
+    if (micros > histogram->maxMicros) {
+      histogram->maxMicros = micros;
+    }
+    histogram->smoothedMicros += micros / 8 - histogram->smoothedMicros / 8;
+  }
+  histogram->samples++;
+  histogram->lastMicros = micros;
+}
+
+/**
+ * Whether messages sent on a connection should carry a timestamp
+ */
+bool TCPSocket::sendsTimestamps(tcp_socket_conn_t *conn) {
+  return timestampsEnabled && conn->peerTimestamps;
+}
+
+/**
+ * Write the timestamp trailer for a message being sent, echoing the client's
+ * latest timestamp if it hasn't already been
+ *
+ * @param bits TCPSOCKET_TIMESTAMP_PROBE and TCPSOCKET_TIMESTAMP_ONLY
+ */
+void TCPSocket::fillTimestamp(tcp_socket_conn_t *conn, uint8_t *trailer,
+                              uint32_t bits) {
+  tcp_socket_timestamp_t *timestamp = (tcp_socket_timestamp_t *)trailer;
+  uint32_t now = micros();
+
+  uint32_t held = 0;
+  if (conn->echoMicros != 0) {
+    held = now - conn->echoRecvMicros;
+    if (held > TCPSOCKET_TIMESTAMP_DELAY) {
+      held = TCPSOCKET_TIMESTAMP_DELAY;
+    }
+  }
+
+  timestamp->sentMicros = (now != 0) ? now : 1;
+  timestamp->echoMicros = conn->echoMicros;
+  timestamp->echoDelay = held | bits;
+  conn->echoMicros = 0;
+}
+
+/**
+ * Send a message carrying only a timestamp
+ *
+ * @return false if the client's send buffer is full or it is being sent
+ *         compact frames
+ */
+bool TCPSocket::sendTimestamp(tcp_socket_conn_t *conn, uint32_t bits) {
+  uint8_t msg[sizeof (tcp_socket_hdr_t) + sizeof (tcp_socket_timestamp_t)];
+
+  if (conn->sendCompact || !reserveSend(conn, sizeof (msg))) {
+    return false;
+  }
+
+  fillHeader(msg, TCPSOCKET_VERSION, conn->peerAddress, currentMsgID - 1,
+             TCPSOCKET_FLAG_TIMESTAMP, sizeof (tcp_socket_timestamp_t));
+  fillTimestamp(conn, msg + sizeof (tcp_socket_hdr_t), bits);
+  queueSend(conn, msg, sizeof (msg));
+  return true;
+}
+
+/**
+ * Record the latency measured from a received timestamp, and reply to it if
+ * it is a probe
+ */
+void TCPSocket::recvTimestamp(tcp_socket_conn_t *conn,
+                              const tcp_socket_timestamp_t *timestamp) {
+  uint32_t now = micros();
+
+  /*
+   * The difference between the clocks changes only with the delay, so the
+   * lowest seen is the delay of an otherwise idle path
+   */
+  uint32_t offset = now - timestamp->sentMicros;
+  if ((conn->latency.delay.samples == 0) ||
+      ((int32_t)(offset - conn->delayBase) < 0)) {
+    conn->delayBase = offset;
+  }
+  addLatency(&conn->latency.delay, offset - conn->delayBase);
+  TRACELOG(TCPS_TRACE_DELAY, conn - connections, offset - conn->delayBase);
+
+  if (timestamp->echoMicros != 0) {
+    uint32_t rtt = now - timestamp->echoMicros -
+                   (timestamp->echoDelay & TCPSOCKET_TIMESTAMP_DELAY);
+    if ((int32_t)rtt >= 0) {
+      addLatency(&conn->latency.rtt, rtt);
+      DEBUG5_VALUELN("TCPS: RTT ", rtt);
+      TRACELOG(TCPS_TRACE_RTT, conn - connections, rtt);
+    }
+  }
+
+  conn->peerTimestamps = true;
+  conn->echoMicros = timestamp->sentMicros;
+  conn->echoRecvMicros = now;
+
+  if ((timestamp->echoDelay & TCPSOCKET_TIMESTAMP_PROBE) && timestampsEnabled) {
+    sendTimestamp(conn, TCPSOCKET_TIMESTAMP_ONLY);
+  }
+}
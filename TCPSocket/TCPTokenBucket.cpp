@@ -0,0 +1,67 @@
+/*
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2018
+ */
+
+#include "TCPTokenBucket.h"
+
+void TCPTokenBucket::setLimit(tcp_rate_limit_t *limit, uint16_t msgsPerSec,
+                              uint32_t bytesPerSec, uint16_t burstMsgs,
+                              uint32_t burstBytes) {
+  limit->msgsPerSec = msgsPerSec;
+  limit->bytesPerSec = bytesPerSec;
+  limit->burstMsgs = (burstMsgs != 0) ? burstMsgs : msgsPerSec;
+  limit->burstBytes = (burstBytes != 0) ? burstBytes : bytesPerSec;
+  if (limit->burstMsgs == 0) {
+    limit->burstMsgs = 1;
+  }
+  if (limit->burstBytes == 0) {
+    limit->burstBytes = 1;
+  }
+  if (limit->burstBytes > TCPTOKENBUCKET_MAX_BURST_BYTES) {
+    limit->burstBytes = TCPTOKENBUCKET_MAX_BURST_BYTES;
+  }
+}
+
+void TCPTokenBucket::fill(const tcp_rate_limit_t *limit,
+                          unsigned long nowMillis) {
+  msgTokens = (int32_t)limit->burstMsgs * 1000;
+  byteTokens = (int32_t)limit->burstBytes * 1000;
+  refillMillis = nowMillis;
+}
+
+bool TCPTokenBucket::admit(const tcp_rate_limit_t *limit,
+                           unsigned long nowMillis) {
+  uint32_t elapsed = nowMillis - refillMillis;
+  refillMillis = nowMillis;
+
+  if (limit->msgsPerSec != 0) {
+    int64_t tokens = msgTokens + (int64_t)limit->msgsPerSec * elapsed;
+    int64_t burst = (int64_t)limit->burstMsgs * 1000;
+    msgTokens = (tokens < burst) ? tokens : burst;
+    if (msgTokens < 1000) {
+      return false;
+    }
+  }
+
+  if (limit->bytesPerSec != 0) {
+    int64_t tokens = byteTokens + (int64_t)limit->bytesPerSec * elapsed;
+    int64_t burst = (int64_t)limit->burstBytes * 1000;
+    byteTokens = (tokens < burst) ? tokens : burst;
+    if (byteTokens <= 0) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+void TCPTokenBucket::take(const tcp_rate_limit_t *limit, uint16_t length) {
+  if (limit->msgsPerSec != 0) {
+    msgTokens -= 1000;
+  }
+  if (limit->bytesPerSec != 0) {
+    byteTokens -= (int32_t)length * 1000;
+  }
+}
@@ -0,0 +1,62 @@
+/*
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2018
+ *
+ * Token bucket limiting the rate of received messages, in both messages and
+ * bytes.  The limit is kept separately from the buckets so that one limit can
+ * be shared by the buckets of every client or address it applies to.
+ *
+ * Tokens are kept in thousandths, so that a bucket refilled every millisecond
+ * gains rate tokens per second without any division.  A message is admitted
+ * while the bucket holds a message and any bytes at all, with its bytes then
+ * taken even if that leaves the bucket in debt, so that messages larger than
+ * the burst still pass at the average rate.
+ */
+
+#ifndef TCPTOKENBUCKET_H
+#define TCPTOKENBUCKET_H
+
+#include <Arduino.h>
+
+/* Largest byte burst, which keeps the byte tokens within 31 bits */
+#define TCPTOKENBUCKET_MAX_BURST_BYTES 2000000
+
+typedef struct {
+  uint16_t msgsPerSec;  // 0 for no limit on messages
+  uint32_t bytesPerSec; // 0 for no limit on bytes
+  uint16_t burstMsgs;   // Messages that may arrive at once
+  uint32_t burstBytes;  // Bytes that may arrive at once
+} tcp_rate_limit_t;
+
+class TCPTokenBucket {
+public:
+  /*
+   * Set a limit, with a burst of 0 allowing a second's worth of messages or
+   * bytes
+   */
+  static void setLimit(tcp_rate_limit_t *limit, uint16_t msgsPerSec,
+                       uint32_t bytesPerSec, uint16_t burstMsgs = 0,
+                       uint32_t burstBytes = 0);
+  static bool limited(const tcp_rate_limit_t *limit) {
+    return (limit->msgsPerSec != 0) || (limit->bytesPerSec != 0);
+  }
+
+  /* Start with a full bucket */
+  void fill(const tcp_rate_limit_t *limit, unsigned long nowMillis);
+
+  /* Refill for the time passed and check if a message may be received */
+  bool admit(const tcp_rate_limit_t *limit, unsigned long nowMillis);
+
+  /* Take the tokens for a received message */
+  void take(const tcp_rate_limit_t *limit, uint16_t length);
+
+  unsigned long lastMillis() { return refillMillis; }
+
+private:
+  int32_t msgTokens;
+  int32_t byteTokens;
+  unsigned long refillMillis;
+};
+
+#endif // TCPTOKENBUCKET_H
@@ -0,0 +1,169 @@
+/*
+ * Example of a TCPSocket server sending periodic updates to many clients.
+ *
+ * The socket's storage is sized at compile time and updates are framed in
+ * buffers from a TCPFramePool, so nothing is allocated while running.  Build
+ * with USE_RECEIVE_TASK to receive in a separate task, and TRACELOG_ENABLED to
+ * write trace records to serial.
+ *
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2018
+ */
+
+#ifdef DEBUG_LEVEL_TCPSOCKETBROADCAST
+  #define DEBUG_LEVEL DEBUG_LEVEL_TCPSOCKETBROADCAST
+#endif
+#ifndef DEBUG_LEVEL
+  #define DEBUG_LEVEL DEBUG_HIGH
+#endif
+#include "Debug.h"
+
+#include <TCPSocket.h>
+#include <TCPSocketTask.h>
+#include <TCPFramePool.h>
+#include <WiFiBase.h>
+
+#ifndef USE_PASSWD
+  #define USE_PASSWD ""
+#endif
+#ifndef CONFIG_SSID
+  #define CONFIG_SSID "Esp32_WiFiBase"
+#endif
+#ifndef CONFIG_PASSWD
+  #define CONFIG_PASSWD "12345678"
+#endif
+
+#ifndef ADDRESS
+  #define ADDRESS 128
+#endif
+#ifndef PORT
+  #define PORT TCPSOCKET_PORT
+#endif
+
+#define DATA_SIZE 64
+
+/* Frames for messages being sent, with room for the header reserved */
+TCPFramePoolT<4, DATA_SIZE> framePool;
+
+WiFiBase *wfb;
+
+/* Socket with statically sized buffers, avoiding heap allocations */
+TCPSocketT<TCP_BUFFER_TOTAL(DATA_SIZE)> tcpSocket;
+
+#ifdef USE_RECEIVE_TASK
+/* Receive in a separate task, passing messages to loop() through a queue */
+TCPFrameQueueT<16, DATA_SIZE> recvQueue;
+TCPSocketTask recvTask(&tcpSocket, &recvQueue);
+#endif
+
+void setup() {
+  Serial.begin(115200);
+
+#ifdef TRACELOG_ENABLED
+  /* Write trace records to serial, to be decoded by tracelogdecode.py */
+  TraceLog::begin();
+  TraceLog::startDrain(&Serial);
+#endif
+
+  /* Use WiFiBase to connect to a network */
+  wfb = new WiFiBase(true);
+#ifdef USE_SSID
+  wfb->addKnownNetwork(USE_SSID, USE_PASSWD);
+#endif
+  wfb->configureAccessPoint(CONFIG_SSID, CONFIG_PASSWD);
+#ifdef CONFIG_PORTAL
+  /* The the WiFiBase to generate an access point hosting a config portal */
+  wfb->useConfigPortal(true);
+#endif
+  while (!wfb->startup()) {
+    delay(100);
+  }
+
+  DEBUG1_VALUELN("Listening on port ", PORT);
+  tcpSocket.init(ADDRESS, PORT);
+  tcpSocket.setup();
+  /* Measure the latency to clients that timestamp their messages */
+  tcpSocket.setTimestamps(true);
+  /* Keep a client sending too quickly from starving the others */
+  tcpSocket.setRateLimit(200, 32768);
+  /*
+   * Detect clients that vanish without disconnecting, and let a restarted
+   * client replace one that has gone quiet
+   */
+  tcpSocket.setKeepAlive(10);
+  tcpSocket.setTakeover(5000);
+#ifdef USE_RECEIVE_TASK
+  recvTask.start();
+#endif
+
+  DEBUG1_PRINTLN("*** TCPSocketBroadcast initialized ***")
+}
+
+void handleMsg(const tcp_socket_frame_t *frame, void *arg) {
+  DEBUG1_VALUE("* Received data ", frame->length);
+  DEBUG1_VALUE(" from ", frame->source);
+  DEBUG1_PRINT(": ");
+  print_hex_buffer((char *)frame->data, frame->length);
+  DEBUG_PRINT_END();
+}
+
+#define SEND_PERIOD 1000
+#define MAX_RECV_MICROS 5000
+unsigned long last_send_ms = 0;
+byte count = 0;
+boolean waiting;
+
+void loop() {
+  unsigned long now = millis();
+
+  /* Wait until connected */
+#ifdef USE_RECEIVE_TASK
+  if (!recvTask.connected()) {
+#else
+  if (!tcpSocket.connected()) {
+#endif
+    if (!waiting) {
+      DEBUG1_PRINTLN("Waiting for connection")
+    }
+    waiting = true;
+    delay(100);
+    return;
+  }
+  waiting = false;
+
+  byte *msg;
+  if ((now - SEND_PERIOD >= last_send_ms) &&
+      ((msg = framePool.allocMsg()) != nullptr)) {
+    msg[0] = 'T';
+    msg[1] = count++;
+    DEBUG1_VALUELN("* Sending ", count);
+
+    /* Every connected client gets the update */
+#ifdef USE_RECEIVE_TASK
+    recvTask.broadcastMsg(msg, 2);
+#else
+    tcpSocket.broadcastMsg(msg, 2);
+#endif
+    framePool.release(msg);
+
+#ifndef USE_RECEIVE_TASK
+    tcp_socket_latency_t latency;
+    if (tcpSocket.getLatency(SOCKET_ADDR_ANY, &latency) &&
+        (latency.rtt.samples > 0)) {
+      DEBUG1_VALUE("* RTT ", latency.rtt.smoothedMicros);
+      DEBUG1_VALUELN(" max ", latency.rtt.maxMicros);
+    }
+#endif
+
+    last_send_ms = now;
+  }
+
+#ifdef USE_RECEIVE_TASK
+  /* Handle every message the receive task has queued */
+  recvTask.getMsgs(handleMsg);
+#else
+  /* Handle every message that has arrived, within a time budget */
+  tcpSocket.getMsgs(handleMsg, NULL, 0, MAX_RECV_MICROS);
+#endif
+}
\ No newline at end of file
@@ -67,6 +67,13 @@ void setup() {
   DEBUG1_PRINTLN("*** TCPSocketTool initialized ***")
 }
 
+void handleMsg(const tcp_socket_frame_t *frame, void *arg) {
+  DEBUG1_VALUE("* Received data ", frame->length);
+  DEBUG1_PRINT(": ");
+  print_hex_buffer((char *)frame->data, frame->length);
+  DEBUG_PRINT_END();
+}
+
 #define SEND_PERIOD 1000
 unsigned long last_send_ms = 0;
 byte count = 0;
@@ -96,14 +103,6 @@ void loop() {
     last_send_ms = now;
   }
 
-  unsigned int retlen;
-  const byte *data = tcpSocket.getMsg(&retlen);
-  if (data != NULL) {
-    DEBUG1_VALUE("* Received data ", retlen);
-    DEBUG1_PRINT(": ");
-    print_hex_buffer((char *)data, retlen);
-    DEBUG_PRINT_END();
-  }
-
-  delay(10);
-}
\ No newline at end of file
+  /* Handle every message that has arrived, then poll again immediately */
+  tcpSocket.getMsgs(handleMsg);
+}
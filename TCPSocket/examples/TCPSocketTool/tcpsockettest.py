@@ -14,6 +14,22 @@ import argparse
 
 HEADER_FORMAT = "<IBBBBHH"
 HEADER_LEN = 12
+HEADER_FORMAT_V2 = "<IBBBBHHH"
+HEADER_LEN_V2 = 14
+
+START = 0x54435053
+VERSION_COMPACT = 3
+FLAG_VERSION_2 = 0x01
+FLAG_COMPACT = 0x02
+FLAG_ACK = 0x04
+FLAG_COMPRESSED = 0x20
+FLAG_TIMESTAMP = 0x40
+FLAG_RELIABLE = 0x80
+
+COMPACT_ID = 0x01
+COMPACT_FLAGS = 0x02
+COMPACT_SOURCE = 0x04
+COMPACT_ADDRESS = 0x08
 
 DEFAULT_IP = "192.168.4.1"
 DEFAULT_PORT = 4081
@@ -32,68 +48,209 @@ def handle_args():
                         action="store_true",
                         help="Transmit header and data separately", default=False)
 
+    parser.add_argument("-v", "--version", dest="version", type=int,
+                        choices=[1, 2],
+                        help="Protocol version to send", default=1)
+
+    parser.add_argument("-c", "--compact", dest="compact",
+                        action="store_true",
+                        help="Accept compact frames", default=False)
+
+    parser.add_argument("-r", "--reliable", dest="reliable",
+                        action="store_true",
+                        help="Send reliable messages and acknowledge received ones",
+                        default=False)
+
     return parser.parse_args()
 
 
-options = handle_args()
+def pack_header(version, id, datalen, source, dest, flags):
+    if version == 2:
+        return struct.pack(HEADER_FORMAT_V2,
+                           START,      # START
+                           2,          # VERSION
+                           id & 0xff,  # ID
+                           flags,      # Flags
+                           0,          # Reserved
+                           datalen,    # Data Length
+                           source,     # Source addr
+                           dest)       # Dest addr
+    return struct.pack(HEADER_FORMAT,
+                       START,           # START
+                       1,               # VERSION
+                       id & 0xff,       # ID
+                       datalen,         # Data Length
+                       flags | FLAG_VERSION_2,  # Flags
+                       source,          # Source addr
+                       dest)            # Dest addr
 
-print("Connecting to %s:%d" % (options.address, options.port))
 
-sock = socket.socket()
-sock.connect((options.address, options.port))
+def cobs_decode(data):
+    """Remove the byte stuffing from a compact frame"""
+    result = ""
+    pos = 0
+    while pos < len(data):
+        code = ord(data[pos])
+        result += data[pos + 1:pos + code]
+        pos += code
+        if code < 0xff and pos < len(data):
+            result += "\x00"
+    return result
 
-id = 0
-while True:
+
+def unpack_address(frame, pos):
+    value = 0
+    shift = 0
+    while True:
+        byte = ord(frame[pos])
+        value |= (byte & 0x7f) << shift
+        pos += 1
+        shift += 7
+        if byte & 0x80 == 0:
+            return (value, pos)
+
+
+def read_compact(sock, state):
+    """Read a compact frame, updating state with its header fields"""
+    data = ""
+    while True:
+        c = sock.recv(1)
+        if c == "\x00":
+            break
+        data += c
+    if len(data) == 0:
+        return None
+
+    frame = cobs_decode(data)
+    control = ord(frame[0])
+    pos = 1
+    state["id"] = (state["id"] + 1) & 0xff
+    flags = 0
+    if control & COMPACT_ID:
+        state["id"] = ord(frame[pos])
+        pos += 1
+    if control & COMPACT_FLAGS:
+        flags = ord(frame[pos])
+        pos += 1
+    if control & COMPACT_SOURCE:
+        (state["source"], pos) = unpack_address(frame, pos)
+    if control & COMPACT_ADDRESS:
+        (state["dest"], pos) = unpack_address(frame, pos)
+
+    print("Received %dB compact: '%s'" % (len(data) + 1, binascii.hexlify(data)))
+    print("Header: id:%d source:%d dest:%d flags:%d" %
+          (state["id"], state["source"], state["dest"], flags))
+    state["flags"] = flags
+    return frame[pos:]
+
+
+def send_message(sock, id, payload, flags):
+    header = pack_header(options.version, id, len(payload), 0x12, 128, flags)
     if options.fragment:
-        message = struct.pack(HEADER_FORMAT,
-                              0x54435053,  # START
-                              1,           # VERSION
-                              id,          # ID
-                              4,           # Data Length
-                              0x56,        # Flags
-                              0x12,        # Source addr
-                              128)         # Dest addr
         print("Sending header: %d:'%s'" %
-              (len(message), binascii.hexlify(message)))
-        sock.send(message)
+              (len(header), binascii.hexlify(header)))
+        sock.send(header)
 
-        message = struct.pack("BBBB",
-                              0xde, 0xad, 0xbe, 0xef)
         print("Sending data: %d:'%s'" %
-              (len(message), binascii.hexlify(message)))
-        sock.send(message)
+              (len(payload), binascii.hexlify(payload)))
+        sock.send(payload)
     else:
-        message = struct.pack(HEADER_FORMAT + "BBBB",
-                              0x54435053,  # START
-                              1,           # VERSION
-                              id,          # ID
-                              4,           # Data Length
-                              0x56,        # Flags
-                              0x12,        # Source addr
-                              128,         # Dest addr
-                              0xde, 0xad, 0xbe, 0xef)
+        message = header + payload
         print("Sending: %d:'%s'" %
               (len(message), binascii.hexlify(message)))
         sock.send(message)
 
+
+def check_reliable(sock, recv_id, flags):
+    """Acknowledge a received reliable message"""
+    if options.reliable and (flags & FLAG_RELIABLE) and not (flags & FLAG_ACK):
+        print("Acknowledging %d" % recv_id)
+        send_message(sock, recv_id + 1, "\x00", send_flags | FLAG_ACK)
+
+
+options = handle_args()
+
+print("Connecting to %s:%d" % (options.address, options.port))
+
+sock = socket.socket()
+sock.connect((options.address, options.port))
+
+send_flags = FLAG_COMPACT if options.compact else 0
+compact = None
+
+if options.version == 2 or options.compact or options.reliable:
+    # Announce version 2 support, without which the server ignores our flags
+    hello = pack_header(2, 0, 0, 0x12, 128, send_flags | FLAG_VERSION_2)
+    print("Sending hello: %d:'%s'" % (len(hello), binascii.hexlify(hello)))
+    sock.send(hello)
+
+id = 0
+if options.reliable:
+    # Start a new sequence of reliable messages
+    send_message(sock, id, "\x01", send_flags | FLAG_ACK | FLAG_RELIABLE)
+
+while True:
+    payload = struct.pack("BBBB", 0xde, 0xad, 0xbe, 0xef)
+    if options.reliable:
+        send_message(sock, id, payload, send_flags | FLAG_RELIABLE)
+    else:
+        send_message(sock, id, payload, send_flags)
+    id += 1
+
+    if compact is not None:
+        data = read_compact(sock, compact)
+        if data is not None:
+            print("Data %dB: '%s'" % (len(data), binascii.hexlify(data)))
+            check_reliable(sock, compact["id"], compact["flags"])
+        continue
+
     data = ""
 
     while len(data) < HEADER_LEN:
         data += sock.recv(1)
 
+    (start, version) = struct.unpack("<IB", data[:5])
+    if version == 2:
+        while len(data) < HEADER_LEN_V2:
+            data += sock.recv(1)
+        (start, version, recv_id, flags, reserved, datalen, sourceaddr,
+         destaddr) = \
+            struct.unpack(HEADER_FORMAT_V2, data)
+    else:
+        (start, version, recv_id, datalen, flags, sourceaddr, destaddr) = \
+            struct.unpack(HEADER_FORMAT, data)
+
     print("Received %dB: '%s'" % (len(data), binascii.hexlify(data)))
 
-    (start, version, id, datalen, sourceaddr, destaddr, flags) = \
-        struct.unpack(HEADER_FORMAT, data)
+    if version == VERSION_COMPACT:
+        # All further messages from the server are compact frames
+        print("Switching to compact frames")
+        compact = {"id": recv_id, "source": sourceaddr, "dest": destaddr}
+        data = read_compact(sock, compact)
+        if data is not None:
+            print("Data %dB: '%s'" % (len(data), binascii.hexlify(data)))
+            check_reliable(sock, compact["id"], compact["flags"])
+        continue
 
     print("Header: start:0x%x version:%d id:%d datalen:%d source:%d dest:%d flags:%d" %
-          (start, version, id, datalen, sourceaddr, destaddr, flags))
+          (start, version, recv_id, datalen, sourceaddr, destaddr, flags))
 
     data = ""
     while len(data) < datalen:
         data += sock.recv(1)
 
+    if (flags & FLAG_COMPRESSED) and datalen == 0:
+        # Capability advertised in reply to our hello, not a reply to the data
+        print("Server accepts compressed messages")
+        continue
+
+    if flags & FLAG_TIMESTAMP:
+        # Latency probe sent in reply to our hello, which we don't answer
+        print("Server sends timestamps")
+        continue
+
     print("Data %dB: '%s'" % (len(data), binascii.hexlify(data)))
+    check_reliable(sock, recv_id, flags)
 
 
 sock.close()
@@ -0,0 +1,101 @@
+/*
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2018
+ *
+ * Minimal Arduino core for building TCPSocket as a Linux host process.  Only
+ * what TCPSocket and the Debug library use is provided, with Serial output
+ * going to stdout.
+ */
+
+#ifndef HOST_ARDUINO_H
+#define HOST_ARDUINO_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <string>
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+#define HEX 16
+#define DEC 10
+
+#define F(x) (x)
+#define PROGMEM
+#define PSTR(x) (x)
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void yield();
+
+class String : public std::string {
+public:
+  String(const char *str = "") : std::string(str) {}
+  String(const std::string &str) : std::string(str) {}
+};
+
+class Print {
+public:
+  virtual ~Print() {}
+  virtual size_t write(uint8_t value) { return write(&value, 1); }
+  virtual size_t write(const uint8_t *data, size_t len) = 0;
+};
+
+class HardwareSerial : public Print {
+public:
+  void begin(unsigned long baud) {}
+  int available() { return 0; }
+  int read() { return -1; }
+  void flush() { fflush(stdout); }
+  size_t write(uint8_t value) { return fwrite(&value, 1, 1, stdout); }
+  size_t write(const uint8_t *data, size_t len) {
+    return fwrite(data, 1, len, stdout);
+  }
+
+  size_t print(const char *str) { return printf("%s", str); }
+  size_t print(const String &str) { return print(str.c_str()); }
+  size_t print(char value) { return printf("%c", value); }
+  size_t print(double value, int digits = 2) {
+    return printf("%.*f", digits, value);
+  }
+  size_t print(unsigned long value, int base = DEC);
+  size_t print(long value, int base = DEC);
+  size_t print(unsigned int value, int base = DEC) {
+    return print((unsigned long)value, base);
+  }
+  size_t print(int value, int base = DEC) { return print((long)value, base); }
+  size_t print(unsigned char value, int base = DEC) {
+    return print((unsigned long)value, base);
+  }
+  size_t print(unsigned short value, int base = DEC) {
+    return print((unsigned long)value, base);
+  }
+  size_t print(short value, int base = DEC) {
+    return print((long)value, base);
+  }
+
+  size_t println() { return printf("\n"); }
+  template <typename T> size_t println(T value) {
+    return print(value) + println();
+  }
+  template <typename T> size_t println(T value, int base) {
+    return print(value, base) + println();
+  }
+};
+
+extern HardwareSerial Serial;
+
+/* The cycle counter is approximated by a nanosecond clock */
+class EspClass {
+public:
+  uint32_t getCycleCount();
+};
+
+extern EspClass ESP;
+
+#endif // HOST_ARDUINO_H
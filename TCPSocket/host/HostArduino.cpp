@@ -0,0 +1,65 @@
+/*
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2018
+ */
+
+/* PlatformIO builds all library sources, so only compile for the host */
+#if defined(TCPSOCKET_HOST)
+
+#include <sched.h>
+#include <time.h>
+
+#include <Arduino.h>
+
+HardwareSerial Serial;
+EspClass ESP;
+
+static uint64_t monotonicMicros() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static const uint64_t startMicros = monotonicMicros();
+
+unsigned long millis() {
+  return (monotonicMicros() - startMicros) / 1000;
+}
+
+unsigned long micros() {
+  return monotonicMicros() - startMicros;
+}
+
+uint32_t EspClass::getCycleCount() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint32_t)((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+void delay(unsigned long ms) {
+  struct timespec ts;
+  ts.tv_sec = ms / 1000;
+  ts.tv_nsec = (ms % 1000) * 1000000;
+  nanosleep(&ts, nullptr);
+}
+
+void yield() {
+  sched_yield();
+}
+
+size_t HardwareSerial::print(unsigned long value, int base) {
+  switch (base) {
+    case HEX: return printf("%lX", value);
+    default: return printf("%lu", value);
+  }
+}
+
+size_t HardwareSerial::print(long value, int base) {
+  if (base != DEC) {
+    return print((unsigned long)value, base);
+  }
+  return printf("%ld", value);
+}
+
+#endif // TCPSOCKET_HOST
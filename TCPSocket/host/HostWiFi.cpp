@@ -0,0 +1,467 @@
+/*
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2018
+ *
+ * Linux implementation of the WiFiClient, WiFiServer, and WiFiUDP classes used
+ * by TCPSocket and UDPSocket, built on non-blocking sockets and epoll.
+ */
+
+/* PlatformIO builds all library sources, so only compile for the host */
+#if defined(TCPSOCKET_HOST)
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <WiFi.h>
+#include <WiFiUdp.h>
+
+WiFiClass WiFi;
+
+IPAddress WiFiClass::localIP() {
+  return IPAddress(127, 0, 0, 1);
+}
+
+String IPAddress::toString() const {
+  char buf[16];
+  snprintf(buf, sizeof (buf), "%u.%u.%u.%u",
+           (*this)[0], (*this)[1], (*this)[2], (*this)[3]);
+  return String(buf);
+}
+
+/*
+ * Shared ownership of a socket descriptor
+ */
+class WiFiClient::Handle {
+public:
+  Handle(int _fd) : fd(_fd) {}
+  ~Handle() { close(fd); }
+  int fd;
+};
+
+WiFiClient::WiFiClient() : _connected(false) {}
+
+WiFiClient::WiFiClient(int fd) : handle(new Handle(fd)), _connected(true) {
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+/**
+ * Connect to a server, blocking until the connection completes
+ */
+int WiFiClient::connect(const char *host, uint16_t port) {
+  struct addrinfo hints;
+  struct addrinfo *result;
+  char service[8];
+
+  memset(&hints, 0, sizeof (hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  snprintf(service, sizeof (service), "%u", port);
+  if (getaddrinfo(host, service, &hints, &result) != 0) {
+    return 0;
+  }
+
+  IPAddress ip(((struct sockaddr_in *)result->ai_addr)->sin_addr.s_addr);
+  freeaddrinfo(result);
+  return connect(ip, port);
+}
+
+int WiFiClient::connect(IPAddress ip, uint16_t port) {
+  stop();
+
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0) {
+    return 0;
+  }
+
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof (addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = (uint32_t)ip;
+  if (::connect(fd, (struct sockaddr *)&addr, sizeof (addr)) < 0) {
+    close(fd);
+    return 0;
+  }
+
+  *this = WiFiClient(fd);
+  return 1;
+}
+
+int WiFiClient::available() {
+  int count = 0;
+  if (!handle || (ioctl(handle->fd, FIONREAD, &count) < 0)) {
+    return 0;
+  }
+  return count;
+}
+
+int WiFiClient::read() {
+  uint8_t value;
+  if (read(&value, 1) != 1) {
+    return -1;
+  }
+  return value;
+}
+
+/**
+ * Read without blocking, returning -1 if no data is available
+ */
+int WiFiClient::read(uint8_t *buf, size_t size) {
+  if (!handle) {
+    return -1;
+  }
+
+  ssize_t result = recv(handle->fd, buf, size, MSG_DONTWAIT);
+  if (result == 0) {
+    /* Orderly shutdown by the peer */
+    _connected = false;
+    return 0;
+  }
+  if (result < 0) {
+    if ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR)) {
+      _connected = false;
+    }
+    return -1;
+  }
+  return result;
+}
+
+int WiFiClient::peek() {
+  uint8_t value;
+  if (!handle ||
+      (recv(handle->fd, &value, 1, MSG_DONTWAIT | MSG_PEEK) != 1)) {
+    return -1;
+  }
+  return value;
+}
+
+size_t WiFiClient::write(uint8_t value) {
+  return write(&value, 1);
+}
+
+/**
+ * Write without blocking, returning the number of bytes the socket accepted
+ */
+size_t WiFiClient::write(const uint8_t *buf, size_t size) {
+  if (!handle) {
+    return 0;
+  }
+
+  ssize_t result = send(handle->fd, buf, size, MSG_DONTWAIT | MSG_NOSIGNAL);
+  if (result < 0) {
+    if ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR)) {
+      _connected = false;
+    }
+    return 0;
+  }
+  return result;
+}
+
+/**
+ * As with the ESP32, a client is connected until the peer has closed the
+ * connection and all received data has been read.
+ */
+uint8_t WiFiClient::connected() {
+  if (!handle || !_connected) {
+    return false;
+  }
+
+  uint8_t value;
+  ssize_t result = recv(handle->fd, &value, 1, MSG_DONTWAIT | MSG_PEEK);
+  if (result == 0) {
+    _connected = false;
+  } else if ((result < 0) && (errno != EAGAIN) && (errno != EWOULDBLOCK) &&
+             (errno != EINTR)) {
+    _connected = false;
+  }
+  return _connected;
+}
+
+void WiFiClient::stop() {
+  handle.reset();
+  _connected = false;
+}
+
+int WiFiClient::fd() const {
+  return handle ? handle->fd : -1;
+}
+
+int WiFiClient::setNoDelay(bool nodelay) {
+  int flag = nodelay;
+  return setsockopt(fd(), IPPROTO_TCP, TCP_NODELAY, &flag, sizeof (flag));
+}
+
+IPAddress WiFiClient::remoteIP() const {
+  struct sockaddr_in addr;
+  socklen_t len = sizeof (addr);
+  if (!handle ||
+      (getpeername(handle->fd, (struct sockaddr *)&addr, &len) < 0)) {
+    return IPAddress();
+  }
+  return IPAddress(addr.sin_addr.s_addr);
+}
+
+uint16_t WiFiClient::remotePort() const {
+  struct sockaddr_in addr;
+  socklen_t len = sizeof (addr);
+  if (!handle ||
+      (getpeername(handle->fd, (struct sockaddr *)&addr, &len) < 0)) {
+    return 0;
+  }
+  return ntohs(addr.sin_port);
+}
+
+WiFiServer::WiFiServer(uint16_t _port, uint8_t max_clients) {
+  port = _port;
+  maxClients = max_clients;
+  noDelay = false;
+  listenFd = -1;
+  epollFd = -1;
+}
+
+WiFiServer::~WiFiServer() {
+  stop();
+}
+
+void WiFiServer::begin(uint16_t _port) {
+  if (_port != 0) {
+    port = _port;
+  }
+  stop();
+
+  listenFd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  if (listenFd < 0) {
+    return;
+  }
+
+  int flag = 1;
+  setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof (flag));
+
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof (addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  if ((bind(listenFd, (struct sockaddr *)&addr, sizeof (addr)) < 0) ||
+      (listen(listenFd, maxClients) < 0)) {
+    perror("WiFiServer");
+    stop();
+    return;
+  }
+
+  epollFd = epoll_create1(0);
+  struct epoll_event event;
+  event.events = EPOLLIN;
+  event.data.fd = listenFd;
+  epoll_ctl(epollFd, EPOLL_CTL_ADD, listenFd, &event);
+}
+
+/**
+ * Accept a waiting client without blocking, returning an unconnected client
+ * if there is none.
+ */
+WiFiClient WiFiServer::available() {
+  if (listenFd < 0) {
+    return WiFiClient();
+  }
+
+  int fd = accept4(listenFd, nullptr, nullptr, SOCK_NONBLOCK);
+  if (fd < 0) {
+    return WiFiClient();
+  }
+
+  WiFiClient client(fd);
+  if (noDelay) {
+    client.setNoDelay(true);
+  }
+
+  /* Closed descriptors are removed from the epoll set automatically */
+  struct epoll_event event;
+  event.events = EPOLLIN | EPOLLRDHUP;
+  event.data.fd = fd;
+  epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event);
+
+  return client;
+}
+
+bool WiFiServer::hasClient() {
+  if (listenFd < 0) {
+    return false;
+  }
+
+  struct pollfd pfd;
+  pfd.fd = listenFd;
+  pfd.events = POLLIN;
+  return poll(&pfd, 1, 0) > 0;
+}
+
+void WiFiServer::stop() {
+  if (epollFd >= 0) {
+    close(epollFd);
+    epollFd = -1;
+  }
+  if (listenFd >= 0) {
+    close(listenFd);
+    listenFd = -1;
+  }
+}
+
+/**
+ * Wait until a client is waiting to connect or an accepted client has data
+ *
+ * @param timeoutMs Maximum time to wait, -1 to wait indefinitely
+ * @return true if there may be work to do
+ */
+bool WiFiServer::wait(int timeoutMs) {
+  if (epollFd < 0) {
+    return false;
+  }
+
+  struct epoll_event events[16];
+  int result = epoll_wait(epollFd, events, 16, timeoutMs);
+  return result > 0;
+}
+
+WiFiUDP::WiFiUDP() : sockFd(-1), rxLength(0), rxOffset(0), remotePortNum(0),
+                     txLength(0), txPort(0) {}
+
+WiFiUDP::~WiFiUDP() {
+  stop();
+}
+
+uint8_t WiFiUDP::begin(uint16_t port) {
+  stop();
+
+  sockFd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+  if (sockFd < 0) {
+    return 0;
+  }
+
+  int flag = 1;
+  setsockopt(sockFd, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof (flag));
+  setsockopt(sockFd, SOL_SOCKET, SO_BROADCAST, &flag, sizeof (flag));
+
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof (addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  if (bind(sockFd, (struct sockaddr *)&addr, sizeof (addr)) < 0) {
+    perror("WiFiUDP");
+    stop();
+    return 0;
+  }
+  return 1;
+}
+
+uint8_t WiFiUDP::beginMulticast(IPAddress multicast, uint16_t port) {
+  if (!begin(port)) {
+    return 0;
+  }
+
+  struct ip_mreq mreq;
+  mreq.imr_multiaddr.s_addr = (uint32_t)multicast;
+  mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+  if (setsockopt(sockFd, IPPROTO_IP, IP_ADD_MEMBERSHIP,
+                 &mreq, sizeof (mreq)) < 0) {
+    perror("WiFiUDP multicast");
+    stop();
+    return 0;
+  }
+  return 1;
+}
+
+void WiFiUDP::stop() {
+  if (sockFd >= 0) {
+    close(sockFd);
+    sockFd = -1;
+  }
+  rxLength = rxOffset = 0;
+}
+
+int WiFiUDP::beginPacket(IPAddress ip, uint16_t port) {
+  if (sockFd < 0) {
+    return 0;
+  }
+  txIP = ip;
+  txPort = port;
+  txLength = 0;
+  return 1;
+}
+
+size_t WiFiUDP::write(const uint8_t *buf, size_t size) {
+  if (size > MAX_DATAGRAM - txLength) {
+    size = MAX_DATAGRAM - txLength;
+  }
+  memcpy(txBuffer + txLength, buf, size);
+  txLength += size;
+  return size;
+}
+
+int WiFiUDP::endPacket() {
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof (addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(txPort);
+  addr.sin_addr.s_addr = (uint32_t)txIP;
+
+  ssize_t result = sendto(sockFd, txBuffer, txLength, MSG_DONTWAIT,
+                          (struct sockaddr *)&addr, sizeof (addr));
+  txLength = 0;
+  return result >= 0;
+}
+
+/**
+ * Receive the next datagram without blocking, discarding any unread remainder
+ * of the previous one.
+ *
+ * @return size of the datagram, 0 if none is available
+ */
+int WiFiUDP::parsePacket() {
+  rxLength = rxOffset = 0;
+  if (sockFd < 0) {
+    return 0;
+  }
+
+  struct sockaddr_in addr;
+  socklen_t len = sizeof (addr);
+  ssize_t result = recvfrom(sockFd, rxBuffer, sizeof (rxBuffer), MSG_DONTWAIT,
+                            (struct sockaddr *)&addr, &len);
+  if (result <= 0) {
+    return 0;
+  }
+
+  rxLength = result;
+  remote = IPAddress(addr.sin_addr.s_addr);
+  remotePortNum = ntohs(addr.sin_port);
+  return rxLength;
+}
+
+int WiFiUDP::read() {
+  uint8_t value;
+  if (read(&value, 1) != 1) {
+    return -1;
+  }
+  return value;
+}
+
+int WiFiUDP::read(uint8_t *buf, size_t size) {
+  if (size > (size_t)available()) {
+    size = available();
+  }
+  memcpy(buf, rxBuffer + rxOffset, size);
+  rxOffset += size;
+  return size;
+}
+
+#endif // TCPSOCKET_HOST
@@ -0,0 +1,29 @@
+/*
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2018
+ */
+
+#ifndef HOST_IPADDRESS_H
+#define HOST_IPADDRESS_H
+
+#include <Arduino.h>
+
+class IPAddress {
+public:
+  IPAddress() : address(0) {}
+  IPAddress(uint32_t _address) : address(_address) {}
+  IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d)
+    : address(a | (b << 8) | (c << 16) | ((uint32_t)d << 24)) {}
+
+  operator uint32_t() const { return address; }
+  uint8_t operator[](int index) const {
+    return (address >> (8 * index)) & 0xff;
+  }
+  String toString() const;
+
+private:
+  uint32_t address; // Network byte order
+};
+
+#endif // HOST_IPADDRESS_H
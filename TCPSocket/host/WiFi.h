@@ -0,0 +1,21 @@
+/*
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2018
+ */
+
+#ifndef HOST_WIFI_H
+#define HOST_WIFI_H
+
+#include <IPAddress.h>
+#include <WiFiClient.h>
+#include <WiFiServer.h>
+
+class WiFiClass {
+public:
+  IPAddress localIP();
+};
+
+extern WiFiClass WiFi;
+
+#endif // HOST_WIFI_H
@@ -0,0 +1,52 @@
+/*
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2018
+ *
+ * Host implementation of the ESP32 WiFiClient over a non-blocking POSIX
+ * socket.  As on the ESP32, copies of a client share the same socket, which
+ * is closed when the last copy is stopped or destroyed.
+ */
+
+#ifndef HOST_WIFICLIENT_H
+#define HOST_WIFICLIENT_H
+
+#include <memory>
+
+#include <Arduino.h>
+#include <IPAddress.h>
+
+class WiFiClient {
+public:
+  WiFiClient();
+  WiFiClient(int fd);
+
+  int connect(const char *host, uint16_t port);
+  int connect(IPAddress ip, uint16_t port);
+
+  int available();
+  int read();
+  int read(uint8_t *buf, size_t size);
+  int peek();
+  size_t write(uint8_t value);
+  size_t write(const uint8_t *buf, size_t size);
+  void flush() {}
+
+  uint8_t connected();
+  operator bool() { return connected(); }
+  bool operator==(const WiFiClient &rhs) const { return handle == rhs.handle; }
+  bool operator!=(const WiFiClient &rhs) const { return handle != rhs.handle; }
+  void stop();
+
+  int fd() const;
+  int setNoDelay(bool nodelay);
+  IPAddress remoteIP() const;
+  uint16_t remotePort() const;
+
+private:
+  class Handle;
+  std::shared_ptr<Handle> handle;
+  bool _connected;
+};
+
+#endif // HOST_WIFICLIENT_H
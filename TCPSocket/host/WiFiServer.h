@@ -0,0 +1,40 @@
+/*
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2018
+ *
+ * Host implementation of the ESP32 WiFiServer.  The listening socket and every
+ * client it accepts are registered with an epoll instance so that a host
+ * process can sleep in wait() until there is work instead of polling.
+ */
+
+#ifndef HOST_WIFISERVER_H
+#define HOST_WIFISERVER_H
+
+#include <WiFiClient.h>
+
+class WiFiServer {
+public:
+  WiFiServer(uint16_t port = 80, uint8_t max_clients = 4);
+  ~WiFiServer();
+
+  void begin(uint16_t port = 0);
+  WiFiClient available();
+  bool hasClient();
+  void setNoDelay(bool nodelay) { noDelay = nodelay; }
+  void stop();
+  void end() { stop(); }
+  operator bool() { return listenFd >= 0; }
+
+  /* Wait for a connection or data from an accepted client */
+  bool wait(int timeoutMs);
+
+private:
+  uint16_t port;
+  uint8_t maxClients;
+  bool noDelay;
+  int listenFd;
+  int epollFd;
+};
+
+#endif // HOST_WIFISERVER_H
@@ -0,0 +1,58 @@
+/*
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2018
+ *
+ * Host implementation of the ESP32 WiFiUDP over a non-blocking POSIX datagram
+ * socket.  As on the ESP32, a received datagram is read in full by
+ * parsePacket() and a sent datagram is buffered until endPacket().
+ */
+
+#ifndef HOST_WIFIUDP_H
+#define HOST_WIFIUDP_H
+
+#include <Arduino.h>
+#include <IPAddress.h>
+
+class WiFiUDP {
+public:
+  WiFiUDP();
+  ~WiFiUDP();
+
+  uint8_t begin(uint16_t port);
+  uint8_t beginMulticast(IPAddress multicast, uint16_t port);
+  void stop();
+
+  int beginPacket(IPAddress ip, uint16_t port);
+  size_t write(uint8_t value) { return write(&value, 1); }
+  size_t write(const uint8_t *buf, size_t size);
+  int endPacket();
+
+  int parsePacket();
+  int available() { return rxLength - rxOffset; }
+  int read();
+  int read(uint8_t *buf, size_t size);
+  void flush() { rxOffset = rxLength; }
+  IPAddress remoteIP() const { return remote; }
+  uint16_t remotePort() const { return remotePortNum; }
+
+  int fd() const { return sockFd; }
+
+  static const size_t MAX_DATAGRAM = 1460;
+
+private:
+  int sockFd;
+
+  uint8_t rxBuffer[MAX_DATAGRAM];
+  int rxLength;
+  int rxOffset;
+  IPAddress remote;
+  uint16_t remotePortNum;
+
+  uint8_t txBuffer[MAX_DATAGRAM];
+  size_t txLength;
+  IPAddress txIP;
+  uint16_t txPort;
+};
+
+#endif // HOST_WIFIUDP_H
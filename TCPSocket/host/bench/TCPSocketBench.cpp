@@ -0,0 +1,605 @@
+/*
+ * Throughput and latency benchmark for TCPSocket.
+ *
+ * A load generator opens several connections to a TCPSocket echo server and
+ * keeps a number of messages in flight on each, measuring messages/sec,
+ * bytes/sec, and round trip latency percentiles for each payload size.  By
+ * default the server is a TCPSocket running in this process on the loopback
+ * interface, so that changes to getMsg()/sendMsg() show up directly in the
+ * numbers; -H benchmarks an external server such as tcpsocket_echo.
+ *
+ *   tcpsocket_bench [-H host] [-p port] [-c connections] [-d depth]
+ *                   [-s size,size,...] [-t seconds] [-f none|split|random]
+ *                   [-g garbage ratio] [-r] [-C]
+ *
+ * With -r the local server receives through a TCPSocketTask and echoes from a
+ * separate application loop.  -C sends compact frames and has the local server
+ * reply with them.
+ *
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2018
+ */
+
+#if defined(TCPSOCKET_HOST)
+
+#include <arpa/inet.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <TCPSocket.h>
+#include <TCPSocketTask.h>
+
+#define SERVER_ADDRESS 128
+#define MAX_DATA_SIZE 1024
+#define MAX_CLIENTS 32
+
+typedef std::chrono::steady_clock bench_clock;
+
+static size_t headerSize(uint8_t version) {
+  return (version == TCPSOCKET_VERSION_2) ? sizeof (tcp_socket_hdr_v2_t) :
+         sizeof (tcp_socket_hdr_t);
+}
+
+enum fragment_mode_t {
+  FRAGMENT_NONE,   // Each message in a single write
+  FRAGMENT_SPLIT,  // Header and data written separately
+  FRAGMENT_RANDOM  // Message written in randomly sized pieces
+};
+
+struct bench_options_t {
+  const char *host;
+  uint16_t port;
+  int connections;
+  int depth;
+  std::vector<int> sizes;
+  double seconds;
+  fragment_mode_t fragment;
+  double garbage;
+  bool receiveTask;
+  bool compact;
+};
+
+/* Framing state of a client connection */
+struct bench_conn_t {
+  bool sendCompact;
+  bool recvCompact;
+  tcp_compact_state_t sendState;
+  tcp_compact_state_t recvState;
+};
+
+struct bench_result_t {
+  uint64_t messages;
+  uint64_t bytes;
+  std::vector<uint32_t> rttMicros;
+};
+
+/*
+ * In-process echo server
+ */
+static TCPSocketT<TCP_BUFFER_TOTAL(MAX_DATA_SIZE), MAX_CLIENTS,
+                  4 * TCP_BUFFER_TOTAL(MAX_DATA_SIZE)> server;
+static byte serverBuffer[TCP_BUFFER_TOTAL(MAX_DATA_SIZE)];
+static byte *serverData;
+static std::atomic<bool> serverRunning;
+
+static void echoMsg(const tcp_socket_frame_t *frame, void *arg) {
+  memcpy(serverData, frame->data, frame->length);
+  while (serverRunning &&
+         (server.sendMsg(frame->source, serverData, frame->length) ==
+          TCPSOCKET_WOULD_BLOCK)) {
+    server.wait(1);
+    /* Keep receiving so that clients blocked on sending make progress */
+  }
+}
+
+static void runServer() {
+  while (serverRunning) {
+    server.wait(10);
+    server.getMsgs(SOCKET_ADDR_ANY, echoMsg);
+  }
+}
+
+static TCPFrameQueueT<64, MAX_DATA_SIZE> serverQueue;
+static TCPSocketTask serverTask(&server, &serverQueue);
+
+static void echoQueuedMsg(const tcp_socket_frame_t *frame, void *arg) {
+  while (serverRunning &&
+         (serverTask.sendMsg(frame->source, frame->data, frame->length) ==
+          TCPSOCKET_WOULD_BLOCK)) {
+    std::this_thread::sleep_for(std::chrono::microseconds(100));
+  }
+}
+
+static void runServerTask() {
+  serverTask.start();
+  while (serverRunning) {
+    if (serverTask.getMsgs(echoQueuedMsg) == 0) {
+      std::this_thread::sleep_for(std::chrono::microseconds(50));
+    }
+  }
+  serverTask.stop();
+}
+
+/*
+ * Load generator
+ */
+static int connectTo(const char *host, uint16_t port) {
+  struct addrinfo hints;
+  struct addrinfo *addrs;
+  char service[8];
+
+  memset(&hints, 0, sizeof (hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  snprintf(service, sizeof (service), "%u", port);
+  if (getaddrinfo(host, service, &hints, &addrs) != 0) {
+    return -1;
+  }
+
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (connect(fd, addrs->ai_addr, addrs->ai_addrlen) < 0) {
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(addrs);
+
+  if (fd >= 0) {
+    int flag = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof (flag));
+  }
+  return fd;
+}
+
+static bool writeAll(int fd, const uint8_t *data, size_t len) {
+  while (len > 0) {
+    ssize_t result = send(fd, data, len, MSG_NOSIGNAL);
+    if (result <= 0) {
+      return false;
+    }
+    data += result;
+    len -= result;
+  }
+  return true;
+}
+
+/* Build a message in the same format TCPSocket sends */
+static size_t buildMsg(uint8_t *buf, bench_conn_t *conn, socket_addr_t source,
+                       uint8_t id, const uint8_t *data, int size) {
+  if (conn->sendCompact) {
+    size_t start_len = 0;
+    if (conn->sendState.source == SOCKET_ADDR_INVALID) {
+      /* Switch to compact frames before the first */
+      tcp_socket_hdr_t *hdr = (tcp_socket_hdr_t *)buf;
+      hdr->start = TCPSOCKET_START;
+      hdr->version = TCPSOCKET_VERSION_COMPACT;
+      hdr->ID = id - 1;
+      hdr->length = 0;
+      hdr->flags = TCPSOCKET_FLAG_VERSION_2 | TCPSOCKET_FLAG_COMPACT;
+      hdr->source = source;
+      hdr->address = SERVER_ADDRESS;
+      conn->sendState.ID = hdr->ID;
+      conn->sendState.source = source;
+      conn->sendState.address = SERVER_ADDRESS;
+      start_len = sizeof (*hdr);
+    }
+
+    uint8_t hdr[TCPCOMPACT_MAX_HDR];
+    uint8_t hdr_len = TCPCompact::encodeHeader(&conn->sendState, id, 0, source,
+                                               SERVER_ADDRESS, hdr);
+    return start_len + TCPCompact::encode(hdr, hdr_len, data, size,
+                                          buf + start_len);
+  }
+
+  size_t hdr_len;
+  if (size > TCPSOCKET_MAX_DATA_V1) {
+    tcp_socket_hdr_v2_t *hdr = (tcp_socket_hdr_v2_t *)buf;
+    hdr->start = TCPSOCKET_START;
+    hdr->version = TCPSOCKET_VERSION_2;
+    hdr->ID = id;
+    hdr->flags = 0;
+    hdr->reserved = 0;
+    hdr->length = size;
+    hdr->source = source;
+    hdr->address = SERVER_ADDRESS;
+    hdr_len = sizeof (*hdr);
+  } else {
+    tcp_socket_hdr_t *hdr = (tcp_socket_hdr_t *)buf;
+    hdr->start = TCPSOCKET_START;
+    hdr->version = TCPSOCKET_VERSION;
+    hdr->ID = id;
+    hdr->length = size;
+    hdr->flags = TCPSOCKET_FLAG_VERSION_2;
+    hdr->source = source;
+    hdr->address = SERVER_ADDRESS;
+    hdr_len = sizeof (*hdr);
+  }
+  memcpy(buf + hdr_len, data, size);
+  return hdr_len + size;
+}
+
+/* Send a message, possibly preceded by garbage and split into pieces */
+static bool sendMsg(int fd, const bench_options_t *options, std::mt19937 *rng,
+                    const uint8_t *msg, size_t len) {
+  std::uniform_real_distribution<double> chance(0, 1);
+  if ((options->garbage > 0) && (chance(*rng) < options->garbage)) {
+    /* Garbage that never contains the first byte of the start value */
+    uint8_t garbage[16];
+    for (size_t i = 0; i < sizeof (garbage); i++) {
+      garbage[i] = (uint8_t)((*rng)() % 0x53);
+    }
+    size_t garbage_len = 1 + (*rng)() % (sizeof (garbage) - 1);
+    if (options->compact) {
+      /* End the garbage as a frame of its own, which will be invalid */
+      garbage[garbage_len++] = TCPCOMPACT_DELIMITER;
+    }
+    if (!writeAll(fd, garbage, garbage_len)) {
+      return false;
+    }
+  }
+
+  switch (options->fragment) {
+    case FRAGMENT_SPLIT: {
+      size_t hdr_len = options->compact ? len / 2 : headerSize(msg[4]);
+      return writeAll(fd, msg, hdr_len) &&
+             writeAll(fd, msg + hdr_len, len - hdr_len);
+    }
+    case FRAGMENT_RANDOM: {
+      size_t offset = 0;
+      while (offset < len) {
+        size_t piece = 1 + (*rng)() % (len - offset);
+        if (!writeAll(fd, msg + offset, piece)) {
+          return false;
+        }
+        offset += piece;
+      }
+      return true;
+    }
+    default:
+      return writeAll(fd, msg, len);
+  }
+}
+
+/*
+ * Read replies and return the number of complete messages, whose sizes are
+ * added to bytes.
+ */
+static int readReplies(int fd, bench_conn_t *conn, std::vector<uint8_t> *buf,
+                       uint64_t *bytes) {
+  uint8_t data[8192];
+  ssize_t result = recv(fd, data, sizeof (data), 0);
+  if (result <= 0) {
+    return -1;
+  }
+  buf->insert(buf->end(), data, data + result);
+
+  int count = 0;
+  size_t offset = 0;
+  while (true) {
+    const uint8_t *msg = buf->data() + offset;
+    size_t avail = buf->size() - offset;
+
+    if (conn->recvCompact) {
+      const uint8_t *end = (const uint8_t *)memchr(msg, TCPCOMPACT_DELIMITER,
+                                                   avail);
+      if (end == nullptr) {
+        break;
+      }
+
+      uint8_t decoded[TCPCOMPACT_MAX_HDR + MAX_DATA_SIZE];
+      TCPCompact compact;
+      byte flags;
+      compact.beginDecode(decoded, sizeof (decoded));
+      compact.decode(msg, end - msg);
+      int len = compact.endDecode();
+      int hdr_len = (len < 0) ? -1 :
+                    TCPCompact::decodeHeader(&conn->recvState, decoded, len,
+                                             &flags);
+      if (hdr_len < 0) {
+        fprintf(stderr, "Invalid compact reply\n");
+        return -1;
+      }
+
+      offset += end - msg + 1;
+      *bytes += len - hdr_len;
+      count++;
+      continue;
+    }
+
+    if (avail < sizeof (tcp_socket_hdr_t)) {
+      break;
+    }
+    size_t hdr_len = headerSize(msg[4]);
+    if (avail < hdr_len) {
+      break;
+    }
+
+    if (msg[4] == TCPSOCKET_VERSION_COMPACT) {
+      /* The server has switched to compact frames */
+      const tcp_socket_hdr_t *hdr = (const tcp_socket_hdr_t *)msg;
+      conn->recvCompact = true;
+      conn->recvState.ID = hdr->ID;
+      conn->recvState.source = hdr->source;
+      conn->recvState.address = hdr->address;
+      offset += hdr_len;
+      continue;
+    }
+
+    size_t length = (msg[4] == TCPSOCKET_VERSION_2) ?
+                    ((const tcp_socket_hdr_v2_t *)msg)->length :
+                    ((const tcp_socket_hdr_t *)msg)->length;
+    byte flags = (msg[4] == TCPSOCKET_VERSION_2) ?
+                 ((const tcp_socket_hdr_v2_t *)msg)->flags :
+                 ((const tcp_socket_hdr_t *)msg)->flags;
+    if (avail < hdr_len + length) {
+      break;
+    }
+    offset += hdr_len + length;
+    if ((flags & TCPSOCKET_FLAG_COMPRESSED) && (length == 0)) {
+      /* The server accepts compressed messages, not a reply */
+      continue;
+    }
+    if ((flags & TCPSOCKET_FLAG_TIMESTAMP) &&
+        (length >= sizeof (tcp_socket_timestamp_t))) {
+      /* The server is probing for timestamps, which the bench doesn't send */
+      tcp_socket_timestamp_t timestamp;
+      length -= sizeof (timestamp);
+      memcpy(&timestamp, msg + hdr_len + length, sizeof (timestamp));
+      if (timestamp.echoDelay & TCPSOCKET_TIMESTAMP_ONLY) {
+        continue;
+      }
+    }
+    *bytes += length;
+    count++;
+  }
+  buf->erase(buf->begin(), buf->begin() + offset);
+  return count;
+}
+
+static void runClient(const bench_options_t *options, int index, int size,
+                      bench_clock::time_point end, bench_result_t *result) {
+  int fd = connectTo(options->host, options->port);
+  if (fd < 0) {
+    perror("connect");
+    return;
+  }
+
+  std::mt19937 rng(index);
+  std::vector<uint8_t> data(size);
+  std::vector<uint8_t> msg(sizeof (tcp_socket_hdr_t) + 1 +
+                           TCPCompact::maxEncoded(TCPCOMPACT_MAX_HDR + size) +
+                           TCPSOCKET_MAX_HDR + size);
+  std::vector<uint8_t> recvBuf;
+  bench_conn_t conn;
+  conn.sendCompact = options->compact;
+  conn.recvCompact = false;
+  conn.sendState.source = SOCKET_ADDR_INVALID;
+  std::deque<bench_clock::time_point> inFlight;
+  socket_addr_t source = index + 1;
+  uint8_t id = 0;
+
+  while (true) {
+    bench_clock::time_point now = bench_clock::now();
+    bool sending = (now < end);
+    if (!sending && inFlight.empty()) {
+      break;
+    }
+
+    /* Replies come back in order, so the oldest send time matches */
+    while (sending && ((int)inFlight.size() < options->depth)) {
+      for (int i = 0; i < size; i++) {
+        data[i] = (uint8_t)(id + i);
+      }
+      size_t len = buildMsg(msg.data(), &conn, source, id++, data.data(),
+                            size);
+      if (!sendMsg(fd, options, &rng, msg.data(), len)) {
+        goto DONE;
+      }
+      inFlight.push_back(bench_clock::now());
+    }
+
+    int count = readReplies(fd, &conn, &recvBuf, &result->bytes);
+    if (count < 0) {
+      goto DONE;
+    }
+    now = bench_clock::now();
+    for (int i = 0; (i < count) && !inFlight.empty(); i++) {
+      result->rttMicros.push_back(
+              std::chrono::duration_cast<std::chrono::microseconds>(
+                      now - inFlight.front()).count());
+      inFlight.pop_front();
+      result->messages++;
+    }
+  }
+
+DONE:
+  close(fd);
+}
+
+static uint32_t percentile(std::vector<uint32_t> *values, double pct) {
+  if (values->empty()) {
+    return 0;
+  }
+  size_t index = (size_t)(pct / 100.0 * (values->size() - 1));
+  std::nth_element(values->begin(), values->begin() + index, values->end());
+  return (*values)[index];
+}
+
+static void runSize(const bench_options_t *options, int size) {
+  std::vector<bench_result_t> results(options->connections);
+  std::vector<std::thread> clients;
+
+  bench_clock::time_point start = bench_clock::now();
+  bench_clock::time_point end = start +
+          std::chrono::microseconds((uint64_t)(options->seconds * 1e6));
+  for (int i = 0; i < options->connections; i++) {
+    results[i].messages = 0;
+    results[i].bytes = 0;
+    clients.push_back(std::thread(runClient, options, i, size, end,
+                                  &results[i]));
+  }
+  for (size_t i = 0; i < clients.size(); i++) {
+    clients[i].join();
+  }
+  double elapsed = std::chrono::duration<double>(bench_clock::now() -
+                                                 start).count();
+
+  bench_result_t total;
+  total.messages = 0;
+  total.bytes = 0;
+  for (size_t i = 0; i < results.size(); i++) {
+    total.messages += results[i].messages;
+    total.bytes += results[i].bytes;
+    total.rttMicros.insert(total.rttMicros.end(),
+                           results[i].rttMicros.begin(),
+                           results[i].rttMicros.end());
+  }
+
+  printf("%6d %12.0f %10.2f %8u %8u %8u\n", size,
+         total.messages / elapsed, total.bytes / elapsed / 1e6,
+         percentile(&total.rttMicros, 50),
+         percentile(&total.rttMicros, 99),
+         percentile(&total.rttMicros, 99.9));
+  fflush(stdout);
+}
+
+static std::vector<int> parseSizes(const char *arg) {
+  std::vector<int> sizes;
+  std::string list(arg);
+  size_t start = 0;
+  while (start < list.size()) {
+    size_t end = list.find(',', start);
+    if (end == std::string::npos) {
+      end = list.size();
+    }
+    int size = atoi(list.substr(start, end - start).c_str());
+    if ((size >= 0) && (size <= MAX_DATA_SIZE)) {
+      sizes.push_back(size);
+    }
+    start = end + 1;
+  }
+  return sizes;
+}
+
+static void printTiming(const char *name, const tcp_socket_timing_t *timing) {
+  if (timing->calls == 0) {
+    return;
+  }
+  printf("# %s: calls:%u avg:%.0f max:%u\n", name, timing->calls,
+         (double)timing->cycles / timing->calls, timing->maxCycles);
+}
+
+/* Counters from the local server, to explain throughput loss */
+static void printServerStats() {
+  tcp_socket_stats_t stats;
+  server.getStats(&stats);
+
+  printf("# server recv msgs:%u bytes:%u read:%u skipped:%u invalid:%u "
+         "oversized:%u incomplete:%u mismatch:%u\n",
+         stats.msgsRecv, stats.bytesRecv, stats.bytesRead, stats.bytesSkipped,
+         stats.invalidHeaders, stats.oversized, stats.incomplete,
+         stats.addressMismatch);
+  printf("# server send msgs:%u written:%u under:%u blocked:%u errors:%u\n",
+         stats.msgsSent, stats.bytesWritten, stats.underSends,
+         stats.sendBlocked, stats.sendErrors);
+  printTiming("server recv ns", &stats.recvTiming);
+  printTiming("server send ns", &stats.sendTiming);
+}
+
+static void usage(const char *name) {
+  fprintf(stderr,
+          "usage: %s [-H host] [-p port] [-c connections] [-d depth]\n"
+          "          [-s size,size,...] [-t seconds] [-f none|split|random]\n"
+          "          [-g garbage ratio] [-r] [-C]\n", name);
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  bench_options_t options;
+  options.host = nullptr;
+  options.port = TCPSOCKET_PORT + 1000;
+  options.connections = 4;
+  options.depth = 8;
+  options.sizes = parseSizes("2,16,64,255,1024");
+  options.seconds = 2;
+  options.fragment = FRAGMENT_NONE;
+  options.garbage = 0;
+  options.receiveTask = false;
+  options.compact = false;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "H:p:c:d:s:t:f:g:rCh")) != -1) {
+    switch (opt) {
+      case 'H': options.host = optarg; break;
+      case 'p': options.port = atoi(optarg); break;
+      case 'c': options.connections = atoi(optarg); break;
+      case 'd': options.depth = std::max(1, atoi(optarg)); break;
+      case 's': options.sizes = parseSizes(optarg); break;
+      case 't': options.seconds = atof(optarg); break;
+      case 'f':
+        if (strcmp(optarg, "split") == 0) {
+          options.fragment = FRAGMENT_SPLIT;
+        } else if (strcmp(optarg, "random") == 0) {
+          options.fragment = FRAGMENT_RANDOM;
+        } else if (strcmp(optarg, "none") == 0) {
+          options.fragment = FRAGMENT_NONE;
+        } else {
+          usage(argv[0]);
+        }
+        break;
+      case 'g': options.garbage = atof(optarg); break;
+      case 'r': options.receiveTask = true; break;
+      case 'C': options.compact = true; break;
+      default: usage(argv[0]);
+    }
+  }
+
+  std::thread serverThread;
+  if (options.host == nullptr) {
+    if (options.connections > MAX_CLIENTS) {
+      fprintf(stderr, "At most %d connections to the local server\n",
+              MAX_CLIENTS);
+      return 1;
+    }
+    options.host = "127.0.0.1";
+    server.init(SERVER_ADDRESS, options.port);
+    serverData = server.initBuffer(serverBuffer, sizeof (serverBuffer));
+    server.setup();
+    server.setCompact(true);
+    serverRunning = true;
+    serverThread = std::thread(options.receiveTask ? runServerTask :
+                                                     runServer);
+  }
+
+  printf("# connections:%d depth:%d fragment:%d garbage:%.2f task:%d "
+         "compact:%d\n", options.connections, options.depth,
+         options.fragment, options.garbage, options.receiveTask,
+         options.compact);
+  printf("%6s %12s %10s %8s %8s %8s\n",
+         "size", "msgs/s", "MB/s", "p50 us", "p99 us", "p999 us");
+  for (size_t i = 0; i < options.sizes.size(); i++) {
+    runSize(&options, options.sizes[i]);
+  }
+
+  if (serverThread.joinable()) {
+    serverRunning = false;
+    serverThread.join();
+    printServerStats();
+  }
+
+  return 0;
+}
+
+#endif // TCPSOCKET_HOST
@@ -0,0 +1,110 @@
+/*
+ * Host TCPSocket server that returns every message it receives to its sender,
+ * for testing and benchmarking clients of the TCPSocket protocol.
+ *
+ *   tcpsocket_echo [port] [address] [trace file] [capture file]
+ *
+ * When built with TRACELOG_ENABLED, trace records are written to the trace
+ * file for decoding with tracelogdecode.py.  All traffic is written to the
+ * capture file for replaying with tcpsocket_replay.  A file of "-" is skipped.
+ *
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2018
+ */
+
+#include <TCPSocket.h>
+
+#define DATA_SIZE 1024
+#define MAX_CLIENTS 16
+
+/* Largest fragmented message that is reassembled and returned */
+#define MAX_MSG_SIZE (16 * DATA_SIZE)
+
+static TCPSocketT<TCP_BUFFER_TOTAL(DATA_SIZE), MAX_CLIENTS,
+                  2 * TCP_BUFFER_TOTAL(DATA_SIZE)> tcpSocket;
+static byte databuffer[TCP_BUFFER_TOTAL(MAX_MSG_SIZE)];
+static byte *send_buffer;
+
+class FilePrint : public Print {
+public:
+  FilePrint(FILE *_file) : file(_file) {}
+  size_t write(const uint8_t *data, size_t len) {
+    size_t result = fwrite(data, 1, len, file);
+    fflush(file);
+    return result;
+  }
+private:
+  FILE *file;
+};
+
+static FILE *openOutput(int argc, char **argv, int arg) {
+  if ((argc <= arg) || (strcmp(argv[arg], "-") == 0)) {
+    return nullptr;
+  }
+  FILE *file = fopen(argv[arg], "wb");
+  if (file == nullptr) {
+    perror(argv[arg]);
+    exit(1);
+  }
+  return file;
+}
+
+static void echoMsg(const tcp_socket_frame_t *frame, void *arg) {
+  memcpy(send_buffer, frame->data, frame->length);
+  int result;
+  while ((result = tcpSocket.sendMsg(frame->source, send_buffer,
+                                     frame->length)) == TCPSOCKET_WOULD_BLOCK) {
+    tcpSocket.wait(1);
+  }
+  while (result == TCPSOCKET_SEND_PARTIAL) {
+    tcpSocket.wait(1);
+    result = tcpSocket.continueSend(frame->source);
+  }
+  if (result != TCPSOCKET_SEND_OK) {
+    printf("Failed to echo %u bytes to %u: %d\n",
+           frame->length, frame->source, result);
+  }
+}
+
+int main(int argc, char **argv) {
+  uint16_t port = (argc > 1) ? atoi(argv[1]) : TCPSOCKET_PORT;
+  socket_addr_t address = (argc > 2) ? atoi(argv[2]) : 128;
+
+#if defined(TRACELOG_ENABLED)
+  FILE *traceFile = openOutput(argc, argv, 3);
+  if (traceFile != nullptr) {
+    TraceLog::begin(4096);
+    TraceLog::startDrain(new FilePrint(traceFile), 10);
+  }
+#endif
+
+  tcpSocket.init(address, port);
+  send_buffer = tcpSocket.initBuffer(databuffer, sizeof (databuffer));
+  tcpSocket.setup();
+  tcpSocket.setCompact(true);
+  tcpSocket.setReliable();
+  tcpSocket.setReassembly(MAX_MSG_SIZE);
+  /* Compress large replies to clients that accept compressed messages */
+  tcpSocket.setCompression(128);
+  /* Timestamp replies so clients can measure their latency */
+  tcpSocket.setTimestamps(true);
+  /* Let restarted clients replace connections that have gone quiet */
+  tcpSocket.setKeepAlive(10);
+  tcpSocket.setTakeover(5000);
+
+  FILE *captureFile = openOutput(argc, argv, 4);
+  if (captureFile != nullptr) {
+    tcpSocket.setCapture(new FilePrint(captureFile));
+  }
+
+  printf("Echoing TCPSocket messages for address %u on port %u\n",
+         address, port);
+
+  while (true) {
+    tcpSocket.wait(100);
+    tcpSocket.getMsgs(SOCKET_ADDR_ANY, echoMsg);
+  }
+
+  return 0;
+}
@@ -0,0 +1,43 @@
+/*
+ * Host UDPSocket node that returns every message it receives to its sender,
+ * for testing clients of the UDPSocket protocol.
+ *
+ *   udpsocket_echo [port] [address]
+ *
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2018
+ */
+
+#include <UDPSocket.h>
+
+static UDPSocket udpSocket;
+static byte databuffer[UDP_BUFFER_TOTAL(UDPSOCKET_MAX_DATA)];
+static byte *send_buffer;
+
+int main(int argc, char **argv) {
+  uint16_t port = (argc > 1) ? atoi(argv[1]) : UDPSOCKET_PORT;
+  socket_addr_t address = (argc > 2) ? atoi(argv[2]) : 128;
+
+  udpSocket.init(address, port, UDP_BUFFER_TOTAL(UDPSOCKET_MAX_DATA));
+  send_buffer = udpSocket.initBuffer(databuffer, sizeof (databuffer));
+  udpSocket.setup();
+  printf("Echoing UDPSocket messages for address %u on port %u\n",
+         address, port);
+
+  while (true) {
+    udpSocket.wait(100);
+
+    const byte *data;
+    unsigned int length;
+    while ((data = udpSocket.getMsg(SOCKET_ADDR_ANY, &length)) != NULL) {
+      memcpy(send_buffer, data, length);
+      if (udpSocket.sendMsg(udpSocket.sourceFromData((void *)data),
+                            send_buffer, length) != UDPSOCKET_SEND_OK) {
+        printf("Failed to echo %u bytes\n", length);
+      }
+    }
+  }
+
+  return 0;
+}
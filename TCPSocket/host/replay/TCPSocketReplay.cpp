@@ -0,0 +1,375 @@
+/*
+ * Replay of captured TCPSocket traffic (see TCPCapture.h).
+ *
+ * The data that clients sent in a capture is sent again to a TCPSocket running
+ * in this process on the loopback interface, one connection per captured
+ * client, opened and closed as they were in the capture.  Data is written in
+ * the same pieces as it was originally read, so the receive path sees the
+ * same message sizes, partial reads, and mix of clients as it did in the
+ * field.  The capture's sent data is only counted, as the replaying server
+ * responds to the traffic itself.
+ *
+ *   tcpsocket_replay [-p port] [-x speed] [-n repeat] [-r] capture
+ *
+ * The speed scales the capture's timing, so 2 replays twice as fast and 0
+ * replays as fast as possible.  With -r the server receives through a
+ * TCPSocketTask and handles messages from a separate application loop.
+ *
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2018
+ */
+
+#if defined(TCPSOCKET_HOST)
+
+#include <arpa/inet.h>
+#include <getopt.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <thread>
+#include <vector>
+
+#include <TCPSocket.h>
+#include <TCPSocketTask.h>
+
+#define DATA_SIZE 1024
+#define MAX_CLIENTS 32
+
+/* Largest fragmented message that is reassembled */
+#define MAX_MSG_SIZE (16 * DATA_SIZE)
+
+/* Time to wait for the server to read the last of the replayed data */
+#define DRAIN_TIMEOUT_MS 2000
+
+typedef std::chrono::steady_clock replay_clock;
+
+struct replay_options_t {
+  uint16_t port;
+  double speed;
+  int repeat;
+  bool receiveTask;
+};
+
+/* A capture loaded into memory, so that reading it doesn't limit the replay */
+struct capture_t {
+  tcp_capture_hdr_t hdr;
+  std::vector<tcp_capture_record_t> records;
+  std::vector<size_t> offsets; // Position of each record's data
+  std::vector<uint8_t> data;
+
+  uint64_t recvBytes;
+  uint64_t sendBytes;
+  int clients;
+};
+
+/*
+ * In-process server, handling messages by summing their data so that every
+ * byte of each message is read
+ */
+static TCPSocketT<TCP_BUFFER_TOTAL(DATA_SIZE), MAX_CLIENTS> server;
+static TCPFrameQueueT<64, MAX_MSG_SIZE> serverQueue;
+static TCPSocketTask serverTask(&server, &serverQueue);
+static std::atomic<bool> serverRunning;
+static std::atomic<uint32_t> replayedBytes; // Bytes written, as bytesRead
+
+static uint64_t handledMsgs;
+static uint64_t handledBytes;
+static uint32_t checksum;
+
+static void handleMsg(const tcp_socket_frame_t *frame, void *arg) {
+  for (uint16_t i = 0; i < frame->length; i++) {
+    checksum = (checksum << 1 | checksum >> 31) ^ frame->data[i];
+  }
+  handledMsgs++;
+  handledBytes += frame->length;
+}
+
+/*
+ * Receive until replaying has finished and everything written has been read,
+ * or nothing more arrives
+ */
+static void runServer(const replay_options_t *options) {
+  tcp_socket_stats_t stats;
+  replay_clock::time_point lastRead = replay_clock::now();
+  uint32_t lastBytesRead = 0;
+
+  while (true) {
+    if (options->receiveTask) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      serverTask.getMsgs(handleMsg);
+      serverTask.getStats(&stats);
+    } else {
+      server.wait(10);
+      server.getMsgs(SOCKET_ADDR_ANY, handleMsg);
+      server.getStats(&stats);
+    }
+
+    if (stats.bytesRead != lastBytesRead) {
+      lastBytesRead = stats.bytesRead;
+      lastRead = replay_clock::now();
+    }
+    if (!serverRunning &&
+        ((int32_t)(stats.bytesRead - replayedBytes) >= 0 ||
+         (replay_clock::now() - lastRead >
+          std::chrono::milliseconds(DRAIN_TIMEOUT_MS)))) {
+      break;
+    }
+  }
+}
+
+static bool loadCapture(const char *path, capture_t *capture) {
+  FILE *file = fopen(path, "rb");
+  if (file == nullptr) {
+    perror(path);
+    return false;
+  }
+
+  bool valid = (fread(&capture->hdr, sizeof (capture->hdr), 1, file) == 1) &&
+               (capture->hdr.start == TCPCAPTURE_START) &&
+               (capture->hdr.version == TCPCAPTURE_VERSION) &&
+               (capture->hdr.recordSize == sizeof (tcp_capture_record_t));
+  if (!valid) {
+    fprintf(stderr, "%s is not a TCPSocket capture\n", path);
+    fclose(file);
+    return false;
+  }
+
+  capture->recvBytes = 0;
+  capture->sendBytes = 0;
+  capture->clients = 0;
+  tcp_capture_record_t record;
+  while (fread(&record, sizeof (record), 1, file) == 1) {
+    size_t offset = capture->data.size();
+    capture->data.resize(offset + record.length);
+    if (fread(capture->data.data() + offset, 1, record.length, file) !=
+        record.length) {
+      /* The capture was cut off part way through the record */
+      capture->data.resize(offset);
+      break;
+    }
+    capture->records.push_back(record);
+    capture->offsets.push_back(offset);
+
+    switch (record.type) {
+      case TCPCAPTURE_RECV: capture->recvBytes += record.length; break;
+      case TCPCAPTURE_SEND: capture->sendBytes += record.length; break;
+      case TCPCAPTURE_CONNECT: capture->clients++; break;
+    }
+  }
+  fclose(file);
+  return true;
+}
+
+static int connectClient(uint16_t port) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0) {
+    perror("socket");
+    return -1;
+  }
+
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof (addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (connect(fd, (struct sockaddr *)&addr, sizeof (addr)) < 0) {
+    perror("connect");
+    close(fd);
+    return -1;
+  }
+
+  int nodelay = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof (nodelay));
+  return fd;
+}
+
+/* Discard whatever the server has sent, so that it is never blocked */
+static void discardReplies(int fd) {
+  uint8_t buf[1024];
+  while (recv(fd, buf, sizeof (buf), MSG_DONTWAIT) > 0) {
+  }
+}
+
+/*
+ * Send the captured client data at the capture's timing, scaled by speed,
+ * leaving the connections still open at the end of the capture in clients
+ */
+static bool replay(const replay_options_t *options, const capture_t *capture,
+                   std::map<byte, int> *clients) {
+  replay_clock::time_point start = replay_clock::now();
+  uint32_t firstMicros = capture->records.empty() ? 0 :
+                         capture->records[0].micros;
+
+  for (size_t i = 0; i < capture->records.size(); i++) {
+    const tcp_capture_record_t *record = &capture->records[i];
+
+    if (options->speed > 0) {
+      /* Relative to the first record, as micros() may wrap during a capture */
+      uint32_t offset = record->micros - firstMicros;
+      std::this_thread::sleep_until(start +
+              std::chrono::microseconds((uint64_t)(offset / options->speed)));
+    }
+
+    std::map<byte, int>::iterator client = clients->find(record->client);
+    switch (record->type) {
+      case TCPCAPTURE_CONNECT: {
+        if (client != clients->end()) {
+          close(client->second);
+        }
+        int fd = connectClient(options->port);
+        if (fd < 0) {
+          return false;
+        }
+        (*clients)[record->client] = fd;
+        break;
+      }
+
+      case TCPCAPTURE_DISCONNECT:
+        if (client != clients->end()) {
+          close(client->second);
+          clients->erase(client);
+        }
+        break;
+
+      case TCPCAPTURE_RECV: {
+        if (client == clients->end()) {
+          break;
+        }
+        const uint8_t *data = capture->data.data() + capture->offsets[i];
+        size_t sent = 0;
+        while (sent < record->length) {
+          ssize_t result = send(client->second, data + sent,
+                                record->length - sent, MSG_NOSIGNAL);
+          if (result <= 0) {
+            perror("send");
+            return false;
+          }
+          sent += result;
+        }
+        replayedBytes += record->length;
+        discardReplies(client->second);
+        break;
+      }
+    }
+  }
+
+  return true;
+}
+
+static void printTiming(const char *name, const tcp_socket_timing_t *timing) {
+  if (timing->calls == 0) {
+    return;
+  }
+  printf("# %s: calls:%u avg:%.0f max:%u\n", name, timing->calls,
+         (double)timing->cycles / timing->calls, timing->maxCycles);
+}
+
+static void usage(const char *name) {
+  fprintf(stderr,
+          "usage: %s [-p port] [-x speed] [-n repeat] [-r] capture\n", name);
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  replay_options_t options;
+  options.port = TCPSOCKET_PORT + 2000;
+  options.speed = 1;
+  options.repeat = 1;
+  options.receiveTask = false;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "p:x:n:rh")) != -1) {
+    switch (opt) {
+      case 'p': options.port = atoi(optarg); break;
+      case 'x': options.speed = atof(optarg); break;
+      case 'n': options.repeat = std::max(1, atoi(optarg)); break;
+      case 'r': options.receiveTask = true; break;
+      default: usage(argv[0]);
+    }
+  }
+  if (optind != argc - 1) {
+    usage(argv[0]);
+  }
+
+  capture_t capture;
+  if (!loadCapture(argv[optind], &capture)) {
+    return 1;
+  }
+  uint32_t duration = capture.records.empty() ? 0 :
+          capture.records.back().micros - capture.records[0].micros;
+  printf("# capture records:%zu clients:%d recv:%llu sent:%llu "
+         "duration:%.3fs address:%u buffer:%u\n",
+         capture.records.size(), capture.clients,
+         (unsigned long long)capture.recvBytes,
+         (unsigned long long)capture.sendBytes, duration / 1e6,
+         capture.hdr.address, capture.hdr.recvBufferSize);
+  if (capture.hdr.recvBufferSize > TCP_BUFFER_TOTAL(DATA_SIZE)) {
+    printf("# capture receive buffer is larger than the replay server's, "
+           "large messages will be counted as oversized\n");
+  }
+
+  server.init(capture.hdr.address, options.port);
+  server.setup();
+  server.setReassembly(MAX_MSG_SIZE);
+  if (options.receiveTask) {
+    serverTask.start();
+  }
+
+  printf("%6s %10s %12s %12s %10s\n",
+         "run", "seconds", "msgs", "msgs/s", "MB/s");
+  for (int run = 0; run < options.repeat; run++) {
+    uint64_t startMsgs = handledMsgs;
+    uint64_t startBytes = handledBytes;
+
+    serverRunning = true;
+    replay_clock::time_point start = replay_clock::now();
+    std::thread serverThread(runServer, &options);
+    std::map<byte, int> clients;
+    bool replayed = replay(&options, &capture, &clients);
+
+    /* Hold the connections open until the server has read all of the data */
+    serverRunning = false;
+    serverThread.join();
+    for (std::map<byte, int>::iterator it = clients.begin();
+         it != clients.end(); it++) {
+      close(it->second);
+    }
+    double elapsed = std::chrono::duration<double>(replay_clock::now() -
+                                                   start).count();
+    if (!replayed) {
+      return 1;
+    }
+
+    uint64_t msgs = handledMsgs - startMsgs;
+    printf("%6d %10.3f %12llu %12.0f %10.2f\n", run, elapsed,
+           (unsigned long long)msgs, msgs / elapsed,
+           (handledBytes - startBytes) / elapsed / 1e6);
+    fflush(stdout);
+  }
+
+  if (options.receiveTask) {
+    serverTask.stop();
+  }
+
+  tcp_socket_stats_t stats;
+  server.getStats(&stats);
+  printf("# server recv msgs:%u bytes:%u read:%u skipped:%u invalid:%u "
+         "oversized:%u incomplete:%u mismatch:%u\n",
+         stats.msgsRecv, stats.bytesRecv, stats.bytesRead, stats.bytesSkipped,
+         stats.invalidHeaders, stats.oversized, stats.incomplete,
+         stats.addressMismatch);
+  printTiming("server recv ns", &stats.recvTiming);
+  if (options.receiveTask) {
+    printf("# task dropped:%lu\n", serverTask.dropped());
+  }
+  printf("# checksum %08x\n", checksum);
+
+  return 0;
+}
+
+#endif // TCPSOCKET_HOST
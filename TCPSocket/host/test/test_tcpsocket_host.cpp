@@ -0,0 +1,979 @@
+/**
+ * Loopback testing of TCPSocket with the host WiFiServer and WiFiClient shims.
+ *
+ * Each test runs a TCPSocket in this process and talks to it through ordinary
+ * sockets on the loopback interface, so the receive and send paths see real
+ * partial reads and writes.  Built and run by the host build when UNITY_DIR is
+ * set (see CMakeLists.txt):
+ *   ctest --test-dir build
+ */
+
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <vector>
+
+#include <unity.h>
+
+#include <TCPSocket.h>
+
+#define ADDRESS 128
+
+/* Time allowed for data to cross the loopback interface */
+#define TIMEOUT_MS 2000
+
+/* Each test listens on its own port, so none waits for another's to close */
+static uint16_t nextPort = TCPSOCKET_PORT + 3000;
+
+/* A message read by a test client */
+struct client_msg_t {
+  byte version;
+  byte ID;
+  byte flags;
+  socket_addr_t source;
+  socket_addr_t address;
+  std::vector<uint8_t> data;
+};
+
+static int connectClient(uint16_t port, int recvBufferSize = 0) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  TEST_ASSERT_TRUE(fd >= 0);
+
+  if (recvBufferSize > 0) {
+    /* Set before connecting, so the window is sized to match */
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &recvBufferSize,
+               sizeof (recvBufferSize));
+  }
+
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof (addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  TEST_ASSERT_EQUAL(0, connect(fd, (struct sockaddr *)&addr, sizeof (addr)));
+
+  int nodelay = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof (nodelay));
+  return fd;
+}
+
+static std::vector<uint8_t> frameV1(byte ID, socket_addr_t source,
+                                    socket_addr_t address, byte flags,
+                                    const std::vector<uint8_t> &data) {
+  tcp_socket_hdr_t hdr;
+  hdr.start = TCPSOCKET_START;
+  hdr.version = TCPSOCKET_VERSION;
+  hdr.ID = ID;
+  hdr.length = data.size();
+  hdr.flags = flags;
+  hdr.source = source;
+  hdr.address = address;
+
+  std::vector<uint8_t> frame(sizeof (hdr) + data.size());
+  memcpy(frame.data(), &hdr, sizeof (hdr));
+  if (!data.empty()) {
+    memcpy(frame.data() + sizeof (hdr), data.data(), data.size());
+  }
+  return frame;
+}
+
+static std::vector<uint8_t> frameV2(byte ID, socket_addr_t source,
+                                    socket_addr_t address, byte flags,
+                                    const std::vector<uint8_t> &data) {
+  tcp_socket_hdr_v2_t hdr;
+  hdr.start = TCPSOCKET_START;
+  hdr.version = TCPSOCKET_VERSION_2;
+  hdr.ID = ID;
+  hdr.flags = flags;
+  hdr.reserved = 0;
+  hdr.length = data.size();
+  hdr.source = source;
+  hdr.address = address;
+
+  std::vector<uint8_t> frame(sizeof (hdr) + data.size());
+  memcpy(frame.data(), &hdr, sizeof (hdr));
+  if (!data.empty()) {
+    memcpy(frame.data() + sizeof (hdr), data.data(), data.size());
+  }
+  return frame;
+}
+
+static void sendData(int fd, const std::vector<uint8_t> &data) {
+  size_t sent = 0;
+  while (sent < data.size()) {
+    ssize_t result = send(fd, data.data() + sent, data.size() - sent,
+                          MSG_NOSIGNAL);
+    TEST_ASSERT_TRUE(result > 0);
+    sent += result;
+  }
+}
+
+/* Announce version 2 support, without which the socket ignores flags */
+static void sendHello(int fd, socket_addr_t source) {
+  sendData(fd, frameV2(0, source, ADDRESS, TCPSOCKET_FLAG_VERSION_2, {}));
+}
+
+/*
+ * Poll the socket as an application would, so that it resends blocked data and
+ * handles acknowledgements.  Tests only read from a client once every message
+ * it sent has been received.
+ */
+static void service(TCPSocket *server) {
+  unsigned int length;
+  TEST_ASSERT_NULL(server->getMsg(SOCKET_ADDR_ANY, &length));
+}
+
+/*
+ * Read exactly length bytes, servicing the socket while waiting
+ *
+ * @return false if the data did not arrive or the connection was closed
+ */
+static bool recvData(TCPSocket *server, int fd, uint8_t *data, size_t length) {
+  size_t got = 0;
+  for (int waited = 0; (got < length) && (waited < TIMEOUT_MS); ) {
+    ssize_t result = recv(fd, data + got, length - got, MSG_DONTWAIT);
+    if (result > 0) {
+      got += result;
+      continue;
+    }
+    if (result == 0) {
+      return false;
+    }
+    service(server);
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    poll(&pfd, 1, 1);
+    waited++;
+  }
+  return got == length;
+}
+
+static bool recvMsg(TCPSocket *server, int fd, client_msg_t *msg) {
+  uint8_t hdr[sizeof (tcp_socket_hdr_v2_t)];
+  if (!recvData(server, fd, hdr, sizeof (tcp_socket_hdr_t))) {
+    return false;
+  }
+
+  uint16_t length;
+  if (hdr[4] == TCPSOCKET_VERSION_2) {
+    if (!recvData(server, fd, hdr + sizeof (tcp_socket_hdr_t),
+                  sizeof (hdr) - sizeof (tcp_socket_hdr_t))) {
+      return false;
+    }
+    tcp_socket_hdr_v2_t *v2 = (tcp_socket_hdr_v2_t *)hdr;
+    msg->version = v2->version;
+    msg->ID = v2->ID;
+    msg->flags = v2->flags;
+    msg->source = v2->source;
+    msg->address = v2->address;
+    length = v2->length;
+  } else {
+    tcp_socket_hdr_t *v1 = (tcp_socket_hdr_t *)hdr;
+    TEST_ASSERT_EQUAL_HEX32(TCPSOCKET_START, v1->start);
+    msg->version = v1->version;
+    msg->ID = v1->ID;
+    msg->flags = v1->flags;
+    msg->source = v1->source;
+    msg->address = v1->address;
+    length = v1->length;
+  }
+
+  msg->data.resize(length);
+  return (length == 0) || recvData(server, fd, msg->data.data(), length);
+}
+
+/* Whether anything arrives for a client within waitMs */
+static bool clientIdle(TCPSocket *server, int fd, int waitMs) {
+  for (int waited = 0; waited < waitMs; waited++) {
+    service(server);
+    uint8_t byte;
+    if (recv(fd, &byte, 1, MSG_DONTWAIT | MSG_PEEK) >= 0) {
+      return false;
+    }
+    usleep(1000);
+  }
+  return true;
+}
+
+/* Whether the socket has closed a client's connection */
+static bool clientClosed(int fd) {
+  uint8_t byte;
+  struct pollfd pfd = { fd, POLLIN, 0 };
+  return (poll(&pfd, 1, TIMEOUT_MS) == 1) &&
+         (recv(fd, &byte, 1, MSG_DONTWAIT) == 0);
+}
+
+/* Poll the socket until a message for any address arrives */
+static const byte *waitMsg(TCPSocket *server, unsigned int *length) {
+  unsigned long start = millis();
+  while (millis() - start < TIMEOUT_MS) {
+    const byte *data = server->getMsg(SOCKET_ADDR_ANY, length);
+    if (data != nullptr) {
+      return data;
+    }
+    server->wait(10);
+  }
+  return nullptr;
+}
+
+/* Messages passed to handlers, recorded by source address and first byte */
+static std::vector<uint16_t> handled;
+
+static void recordMsg(const tcp_socket_frame_t *frame, void *arg) {
+  uint16_t tag = (uintptr_t)arg;
+  if (frame->length > 0) {
+    tag = (tag << 8) | frame->data[0];
+  }
+  handled.push_back(tag);
+}
+
+/* Clients are accepted, and wait() returns once they have sent data */
+void test_connect(void) {
+  uint16_t port = nextPort++;
+  TCPSocket server(ADDRESS, port);
+  server.setup();
+  byte buffer[TCP_BUFFER_TOTAL(8)];
+  byte *data = server.initBuffer(buffer, sizeof (buffer));
+
+  int a = connectClient(port);
+  sendData(a, frameV1(1, 10, ADDRESS, 0, {1, 2, 3}));
+  unsigned int length;
+  const byte *recv_data = waitMsg(&server, &length);
+  TEST_ASSERT_NOT_NULL(recv_data);
+  TEST_ASSERT_EQUAL(3, length);
+  TEST_ASSERT_EQUAL(3, recv_data[2]);
+  TEST_ASSERT_EQUAL(10, server.sourceFromData((void *)recv_data));
+  TEST_ASSERT_EQUAL(1, server.numClients());
+
+  memcpy(data, "ok", 2);
+  TEST_ASSERT_EQUAL(TCPSOCKET_SEND_OK, server.sendMsg(10, data, 2));
+  client_msg_t msg;
+  TEST_ASSERT_TRUE(recvMsg(&server, a, &msg));
+  TEST_ASSERT_EQUAL(ADDRESS, msg.source);
+  TEST_ASSERT_EQUAL(10, msg.address);
+  TEST_ASSERT_EQUAL_MEMORY("ok", msg.data.data(), 2);
+
+  /* The slot of a client that closes its connection is freed */
+  close(a);
+  unsigned long start = millis();
+  while ((server.numClients() > 0) && (millis() - start < TIMEOUT_MS)) {
+    server.wait(10);
+    server.getMsg(SOCKET_ADDR_ANY, &length);
+  }
+  TEST_ASSERT_EQUAL(0, server.numClients());
+}
+
+/* Replies are sent to the client the address was last received from */
+void test_routing(void) {
+  uint16_t port = nextPort++;
+  TCPSocket server(ADDRESS, port);
+  server.setup();
+  byte buffer[TCP_BUFFER_TOTAL(8)];
+  byte *data = server.initBuffer(buffer, sizeof (buffer));
+
+  int a = connectClient(port);
+  int b = connectClient(port);
+  sendData(a, frameV1(1, 10, ADDRESS, 0, {0xA}));
+  sendData(b, frameV1(1, 20, ADDRESS, 0, {0xB}));
+
+  unsigned int length;
+  for (int i = 0; i < 2; i++) {
+    TEST_ASSERT_NOT_NULL(waitMsg(&server, &length));
+  }
+  TEST_ASSERT_EQUAL(2, server.numClients());
+
+  data[0] = 0x20;
+  TEST_ASSERT_EQUAL(TCPSOCKET_SEND_OK, server.sendMsg(20, data, 1));
+  data[0] = 0x10;
+  TEST_ASSERT_EQUAL(TCPSOCKET_SEND_OK, server.sendMsg(10, data, 1));
+
+  client_msg_t msg;
+  TEST_ASSERT_TRUE(recvMsg(&server, a, &msg));
+  TEST_ASSERT_EQUAL(10, msg.address);
+  TEST_ASSERT_EQUAL(ADDRESS, msg.source);
+  TEST_ASSERT_EQUAL(0x10, msg.data[0]);
+  TEST_ASSERT_TRUE(recvMsg(&server, b, &msg));
+  TEST_ASSERT_EQUAL(20, msg.address);
+  TEST_ASSERT_EQUAL(0x20, msg.data[0]);
+  TEST_ASSERT_TRUE(clientIdle(&server, a, 20));
+
+  close(a);
+  close(b);
+}
+
+/* getMsgs() handles every message that has arrived, in order */
+void test_drain(void) {
+  uint16_t port = nextPort++;
+  TCPSocket server(ADDRESS, port, TCP_BUFFER_TOTAL(64));
+  server.setup();
+
+  int a = connectClient(port);
+  std::vector<uint8_t> burst;
+  for (byte i = 0; i < 20; i++) {
+    std::vector<uint8_t> frame = frameV1(i, 10, ADDRESS, 0, {i, 1, 2, 3});
+    burst.insert(burst.end(), frame.begin(), frame.end());
+  }
+  sendData(a, burst);
+
+  handled.clear();
+  for (int waited = 0; (handled.size() < 20) && (waited < TIMEOUT_MS);
+       waited += 10) {
+    server.wait(10);
+    server.getMsgs(SOCKET_ADDR_ANY, recordMsg, (void *)10);
+  }
+  TEST_ASSERT_EQUAL(20, handled.size());
+  for (uint16_t i = 0; i < 20; i++) {
+    TEST_ASSERT_EQUAL((10 << 8) | i, handled[i]);
+  }
+
+  /* A limit stops the drain, leaving the rest for the next call */
+  sendData(a, burst);
+  handled.clear();
+  for (int waited = 0; (handled.size() < 5) && (waited < TIMEOUT_MS);
+       waited += 10) {
+    server.wait(10);
+    server.getMsgs(SOCKET_ADDR_ANY, recordMsg, (void *)10, 5 - handled.size());
+  }
+  TEST_ASSERT_EQUAL(5, handled.size());
+  TEST_ASSERT_EQUAL((10 << 8) | 4, handled[4]);
+
+  close(a);
+}
+
+/* Coalesced messages wait until the flush deadline or a flush() */
+void test_send_queue(void) {
+  uint16_t port = nextPort++;
+  TCPSocket server(ADDRESS, port);
+  server.setup();
+  byte buffer[TCP_BUFFER_TOTAL(8)];
+  byte *data = server.initBuffer(buffer, sizeof (buffer));
+
+  int a = connectClient(port);
+  sendData(a, frameV1(1, 10, ADDRESS, 0, {1}));
+  unsigned int length;
+  TEST_ASSERT_NOT_NULL(waitMsg(&server, &length));
+
+  TEST_ASSERT_TRUE(server.setSendQueue(1024, 10000000));
+  for (byte i = 0; i < 3; i++) {
+    data[0] = i;
+    TEST_ASSERT_EQUAL(TCPSOCKET_SEND_OK, server.sendMsg(10, data, 1));
+  }
+  TEST_ASSERT_EQUAL(3 * (sizeof (tcp_socket_hdr_t) + 1),
+                    server.queuedBytes(10));
+  usleep(10000);
+  uint8_t peek;
+  TEST_ASSERT_TRUE(recv(a, &peek, 1, MSG_DONTWAIT | MSG_PEEK) < 0);
+  TEST_ASSERT_TRUE(server.flush());
+  client_msg_t msg;
+  for (byte i = 0; i < 3; i++) {
+    TEST_ASSERT_TRUE(recvMsg(&server, a, &msg));
+    TEST_ASSERT_EQUAL(i, msg.data[0]);
+  }
+  TEST_ASSERT_EQUAL(0, server.queuedBytes(10));
+
+  /* A short deadline writes them without a flush() */
+  TEST_ASSERT_TRUE(server.setSendQueue(1024, 1000));
+  data[0] = 3;
+  TEST_ASSERT_EQUAL(TCPSOCKET_SEND_OK, server.sendMsg(10, data, 1));
+  usleep(2000);
+  TEST_ASSERT_TRUE(recvMsg(&server, a, &msg));
+  TEST_ASSERT_EQUAL(3, msg.data[0]);
+
+  /* Buffers must have room for a header and some data */
+  TEST_ASSERT_FALSE(server.setSendQueue(TCPSOCKET_MAX_HDR));
+  TEST_ASSERT_TRUE(server.setSendQueue(TCP_BUFFER_TOTAL(1)));
+  data[0] = 4;
+  TEST_ASSERT_EQUAL(TCPSOCKET_SEND_OK, server.sendMsg(10, data, 1));
+  TEST_ASSERT_TRUE(recvMsg(&server, a, &msg));
+  TEST_ASSERT_EQUAL(4, msg.data[0]);
+
+  close(a);
+}
+
+/*
+ * Data a slow client doesn't accept is buffered and written as it reads, with
+ * sends blocking once the buffer is full
+ */
+void test_backpressure(void) {
+  uint16_t port = nextPort++;
+  TCPSocket server(ADDRESS, port);
+  server.setup();
+  byte buffer[TCP_BUFFER_TOTAL(200)];
+  byte *data = server.initBuffer(buffer, sizeof (buffer));
+
+  int a = connectClient(port, 4096);
+  sendData(a, frameV1(1, 10, ADDRESS, 0, {1}));
+  unsigned int length;
+  TEST_ASSERT_NOT_NULL(waitMsg(&server, &length));
+
+  /* Fill the client's window until sends block */
+  tcp_socket_stats_t stats;
+  server.resetStats();
+  int sent = 0;
+  int result;
+  memset(data, 0x5A, 200);
+  while (sent < 100000) {
+    data[0] = sent & 0xFF;
+    result = server.sendMsg(10, data, 200);
+    if (result != TCPSOCKET_SEND_OK) {
+      break;
+    }
+    sent++;
+  }
+  TEST_ASSERT_EQUAL(TCPSOCKET_WOULD_BLOCK, result);
+  TEST_ASSERT_TRUE(server.queuedBytes(10) > 0);
+  server.getStats(&stats);
+  TEST_ASSERT_TRUE(stats.underSends > 0);
+  TEST_ASSERT_EQUAL(1, stats.sendBlocked);
+
+  /* Everything accepted arrives once the client reads, resuming partial data */
+  client_msg_t msg;
+  for (int i = 0; i < sent; i++) {
+    TEST_ASSERT_TRUE(recvMsg(&server, a, &msg));
+    TEST_ASSERT_EQUAL(200, msg.data.size());
+    TEST_ASSERT_EQUAL(i & 0xFF, msg.data[0]);
+    TEST_ASSERT_EQUAL(0x5A, msg.data[199]);
+  }
+  TEST_ASSERT_TRUE(server.flush());
+  TEST_ASSERT_EQUAL(0, server.queuedBytes(10));
+  TEST_ASSERT_EQUAL(TCPSOCKET_SEND_OK, server.sendMsg(10, data, 200));
+  TEST_ASSERT_TRUE(recvMsg(&server, a, &msg));
+
+  close(a);
+}
+
+/*
+ * Clients of the original protocol have their flags passed through and are
+ * only sent version 1 messages, until they announce version 2 support
+ */
+void test_version_fallback(void) {
+  uint16_t port = nextPort++;
+  TCPSocket server(ADDRESS, port, TCP_BUFFER_TOTAL(400));
+  server.setup();
+  byte buffer[TCP_BUFFER_TOTAL(300)];
+  byte *data = server.initBuffer(buffer, sizeof (buffer));
+  memset(data, 0x33, 300);
+
+  int a = connectClient(port);
+  sendData(a, frameV1(7, 10, ADDRESS, 0x56, {1, 2}));
+  unsigned int length;
+  const byte *recv_data = waitMsg(&server, &length);
+  TEST_ASSERT_NOT_NULL(recv_data);
+  TEST_ASSERT_EQUAL(2, length);
+  tcp_socket_hdr_t *hdr = (tcp_socket_hdr_t *)server.headerFromData(recv_data);
+  TEST_ASSERT_EQUAL(TCPSOCKET_VERSION, hdr->version);
+  TEST_ASSERT_EQUAL_HEX8(0x56, hdr->flags);
+
+  /* Too large for a version 1 header, and not fragmented */
+  TEST_ASSERT_EQUAL(TCPSOCKET_SEND_ERROR, server.sendMsg(10, data, 300));
+  TEST_ASSERT_EQUAL(TCPSOCKET_SEND_OK, server.sendMsg(10, data, 3));
+  client_msg_t msg;
+  TEST_ASSERT_TRUE(recvMsg(&server, a, &msg));
+  TEST_ASSERT_EQUAL(TCPSOCKET_VERSION, msg.version);
+  TEST_ASSERT_EQUAL_HEX8(TCPSOCKET_FLAG_VERSION_2, msg.flags);
+  TEST_ASSERT_EQUAL(3, msg.data.size());
+  TEST_ASSERT_TRUE(clientIdle(&server, a, 20));
+
+  /* After a version 2 message, large replies use version 2 headers */
+  sendData(a, frameV2(8, 10, ADDRESS, 0, std::vector<uint8_t>(300, 0x44)));
+  recv_data = waitMsg(&server, &length);
+  TEST_ASSERT_NOT_NULL(recv_data);
+  TEST_ASSERT_EQUAL(300, length);
+  TEST_ASSERT_EQUAL(0x44, recv_data[299]);
+  TEST_ASSERT_EQUAL(TCPSOCKET_SEND_OK, server.sendMsg(10, data, 300));
+  TEST_ASSERT_TRUE(recvMsg(&server, a, &msg));
+  TEST_ASSERT_EQUAL(TCPSOCKET_VERSION_2, msg.version);
+  TEST_ASSERT_EQUAL(300, msg.data.size());
+  TEST_ASSERT_EQUAL(0x33, msg.data[299]);
+
+  /* Small replies still use version 1 headers */
+  TEST_ASSERT_EQUAL(TCPSOCKET_SEND_OK, server.sendMsg(10, data, 3));
+  TEST_ASSERT_TRUE(recvMsg(&server, a, &msg));
+  TEST_ASSERT_EQUAL(TCPSOCKET_VERSION, msg.version);
+
+  close(a);
+}
+
+/* A socket whose buffers can't be set up is left uninitialized and freeable */
+void test_invalid_size(void) {
+  TCPSocket *server = new TCPSocket(ADDRESS, nextPort++, 60000);
+  TEST_ASSERT_FALSE(server->initialized());
+  delete server;
+
+  server = new TCPSocket(ADDRESS, nextPort++, TCPSOCKET_MAX_HDR);
+  TEST_ASSERT_FALSE(server->initialized());
+  delete server;
+}
+
+/* Initializing a TCPSocketT again disconnects its clients and moves its port */
+void test_static_init(void) {
+  uint16_t port = nextPort++;
+  TCPSocketT<TCP_BUFFER_TOTAL(64), 2> server(ADDRESS, port);
+  server.setup();
+
+  int a = connectClient(port);
+  sendData(a, frameV1(1, 10, ADDRESS, 0, {1}));
+  unsigned int length;
+  TEST_ASSERT_NOT_NULL(waitMsg(&server, &length));
+
+  port = nextPort++;
+  TEST_ASSERT_TRUE(server.init(ADDRESS, port));
+  server.setup();
+  TEST_ASSERT_TRUE(clientClosed(a));
+  TEST_ASSERT_EQUAL(0, server.numClients());
+
+  int b = connectClient(port);
+  sendData(b, frameV1(2, 20, ADDRESS, 0, {2}));
+  const byte *recv_data = waitMsg(&server, &length);
+  TEST_ASSERT_NOT_NULL(recv_data);
+  TEST_ASSERT_EQUAL(2, recv_data[0]);
+
+  close(a);
+  close(b);
+}
+
+/* Messages are passed to the handler for their destination address */
+void test_dispatch(void) {
+  uint16_t port = nextPort++;
+  TCPSocket server(ADDRESS, port);
+  server.setup();
+  TEST_ASSERT_TRUE(server.setHandler(40, recordMsg, (void *)40));
+  TEST_ASSERT_TRUE(server.setHandler(41, recordMsg, (void *)41));
+  TEST_ASSERT_TRUE(server.setHandler(SOCKET_ADDR_ANY, recordMsg, (void *)99));
+
+  int a = connectClient(port);
+  sendData(a, frameV1(1, 10, 41, 0, {1}));
+  sendData(a, frameV1(2, 10, 40, 0, {2}));
+  sendData(a, frameV1(3, 10, 42, 0, {3}));
+  sendData(a, frameV1(4, 10, SOCKET_ADDR_ANY, 0, {4}));
+
+  handled.clear();
+  for (int waited = 0; (handled.size() < 6) && (waited < TIMEOUT_MS);
+       waited += 10) {
+    server.wait(10);
+    server.dispatchMsgs();
+  }
+  TEST_ASSERT_EQUAL(6, handled.size());
+  TEST_ASSERT_EQUAL((41 << 8) | 1, handled[0]);
+  TEST_ASSERT_EQUAL((40 << 8) | 2, handled[1]);
+  TEST_ASSERT_EQUAL((99 << 8) | 3, handled[2]);
+  /* A broadcast goes to every handler, in table order, then the default */
+  std::vector<uint16_t> broadcast(handled.begin() + 3, handled.end());
+  TEST_ASSERT_EQUAL((99 << 8) | 4, broadcast[2]);
+  TEST_ASSERT_TRUE(((broadcast[0] == ((40 << 8) | 4)) &&
+                    (broadcast[1] == ((41 << 8) | 4))) ||
+                   ((broadcast[0] == ((41 << 8) | 4)) &&
+                    (broadcast[1] == ((40 << 8) | 4))));
+
+  /* Removing a handler passes its messages to the default */
+  TEST_ASSERT_TRUE(server.setHandler(40, nullptr));
+  sendData(a, frameV1(5, 10, 40, 0, {5}));
+  handled.clear();
+  for (int waited = 0; handled.empty() && (waited < TIMEOUT_MS);
+       waited += 10) {
+    server.wait(10);
+    server.dispatchMsgs();
+  }
+  TEST_ASSERT_EQUAL(1, handled.size());
+  TEST_ASSERT_EQUAL((99 << 8) | 5, handled[0]);
+
+  close(a);
+}
+
+/*
+ * Reliable messages are kept until acknowledged and sent again when the
+ * address reconnects, and received reliable messages are acknowledged
+ */
+void test_reliable(void) {
+  uint16_t port = nextPort++;
+  TCPSocket server(ADDRESS, port);
+  server.setup();
+  TEST_ASSERT_TRUE(server.setReliable(4));
+  byte buffer[TCP_BUFFER_TOTAL(8)];
+  byte *data = server.initBuffer(buffer, sizeof (buffer));
+
+  /* Queued while the address is not connected */
+  for (byte i = 0; i < 3; i++) {
+    data[0] = 0x70 + i;
+    TEST_ASSERT_EQUAL(TCPSOCKET_SEND_OK, server.sendReliable(10, data, 1));
+  }
+  TEST_ASSERT_EQUAL(3, server.unacked(10));
+
+  int a = connectClient(port);
+  sendHello(a, 10);
+  sendData(a, frameV2(1, 10, ADDRESS, 0, {1}));
+  unsigned int length;
+  TEST_ASSERT_NOT_NULL(waitMsg(&server, &length));
+
+  /* A sync starting a new sequence, then the messages */
+  client_msg_t msg;
+  TEST_ASSERT_TRUE(recvMsg(&server, a, &msg));
+  TEST_ASSERT_EQUAL(TCPSOCKET_FLAG_ACK | TCPSOCKET_FLAG_RELIABLE,
+                    msg.flags & (TCPSOCKET_FLAG_ACK | TCPSOCKET_FLAG_RELIABLE));
+  TEST_ASSERT_EQUAL(0, msg.ID);
+  TEST_ASSERT_EQUAL(1, msg.data[0]);
+  for (byte i = 0; i < 3; i++) {
+    TEST_ASSERT_TRUE(recvMsg(&server, a, &msg));
+    TEST_ASSERT_TRUE(msg.flags & TCPSOCKET_FLAG_RELIABLE);
+    TEST_ASSERT_EQUAL(i, msg.ID);
+    TEST_ASSERT_EQUAL(0x70 + i, msg.data[0]);
+  }
+
+  /* Acknowledge the first two, then reconnect */
+  sendData(a, frameV2(2, 10, ADDRESS, TCPSOCKET_FLAG_ACK, {0}));
+  for (int waited = 0; (server.unacked(10) != 1) && (waited < TIMEOUT_MS);
+       waited += 10) {
+    server.wait(10);
+    server.getMsg(SOCKET_ADDR_ANY, &length);
+  }
+  TEST_ASSERT_EQUAL(1, server.unacked(10));
+  close(a);
+
+  int b = connectClient(port);
+  sendHello(b, 10);
+  sendData(b, frameV2(3, 10, ADDRESS, 0, {3}));
+  TEST_ASSERT_NOT_NULL(waitMsg(&server, &length));
+
+  /* The sync continues the sequence, and only the unacknowledged is resent */
+  TEST_ASSERT_TRUE(recvMsg(&server, b, &msg));
+  TEST_ASSERT_TRUE(msg.flags & TCPSOCKET_FLAG_ACK);
+  TEST_ASSERT_EQUAL(2, msg.ID);
+  TEST_ASSERT_EQUAL(0, msg.data[0]);
+  TEST_ASSERT_TRUE(recvMsg(&server, b, &msg));
+  TEST_ASSERT_EQUAL(2, msg.ID);
+  TEST_ASSERT_EQUAL(0x72, msg.data[0]);
+
+  /* A gap requests everything unacknowledged again */
+  sendData(b, frameV2(2, 10, ADDRESS, TCPSOCKET_FLAG_ACK, {1}));
+  TEST_ASSERT_TRUE(recvMsg(&server, b, &msg));
+  TEST_ASSERT_EQUAL(2, msg.ID);
+  TEST_ASSERT_EQUAL(0x72, msg.data[0]);
+  sendData(b, frameV2(3, 10, ADDRESS, TCPSOCKET_FLAG_ACK, {0}));
+  for (int waited = 0; (server.unacked(10) != 0) && (waited < TIMEOUT_MS);
+       waited += 10) {
+    server.wait(10);
+    server.getMsg(SOCKET_ADDR_ANY, &length);
+  }
+  TEST_ASSERT_EQUAL(0, server.unacked(10));
+
+  /* Received reliable messages are delivered once and acknowledged */
+  sendData(b, frameV2(50, 10, ADDRESS,
+                      TCPSOCKET_FLAG_ACK | TCPSOCKET_FLAG_RELIABLE, {1}));
+  sendData(b, frameV2(50, 10, ADDRESS, TCPSOCKET_FLAG_RELIABLE, {0x50}));
+  sendData(b, frameV2(50, 10, ADDRESS, TCPSOCKET_FLAG_RELIABLE, {0x50}));
+  sendData(b, frameV2(51, 10, ADDRESS, TCPSOCKET_FLAG_RELIABLE, {0x51}));
+  const byte *recv_data = waitMsg(&server, &length);
+  TEST_ASSERT_NOT_NULL(recv_data);
+  TEST_ASSERT_EQUAL(0x50, recv_data[0]);
+  recv_data = waitMsg(&server, &length);
+  TEST_ASSERT_NOT_NULL(recv_data);
+  TEST_ASSERT_EQUAL(0x51, recv_data[0]);
+  byte acked = 0;
+  while ((acked != 52) && recvMsg(&server, b, &msg)) {
+    TEST_ASSERT_EQUAL(TCPSOCKET_FLAG_ACK,
+                      msg.flags & (TCPSOCKET_FLAG_ACK |
+                                   TCPSOCKET_FLAG_RELIABLE));
+    acked = msg.ID;
+  }
+  TEST_ASSERT_EQUAL(52, acked);
+
+  close(b);
+}
+
+/* A client's reassembly of the fragmented messages it is sent */
+struct client_reassembly_t {
+  bool active;
+  std::vector<uint8_t> data;
+  std::vector<std::vector<uint8_t>> msgs;
+  int abandoned;
+};
+
+/* Read a fragment, discarding any incomplete message a first fragment ends */
+static void recvFragment(TCPSocket *server, int fd, client_reassembly_t *r) {
+  client_msg_t msg;
+  TEST_ASSERT_TRUE(recvMsg(server, fd, &msg));
+  TEST_ASSERT_TRUE(msg.flags & TCPSOCKET_FLAG_FRAGMENT);
+  if (!(msg.flags & TCPSOCKET_FLAG_CONT)) {
+    if (r->active) {
+      r->abandoned++;
+    }
+    r->active = true;
+    r->data.clear();
+  }
+  TEST_ASSERT_TRUE(r->active);
+  r->data.insert(r->data.end(), msg.data.begin(), msg.data.end());
+  if (!(msg.flags & TCPSOCKET_FLAG_MORE)) {
+    r->msgs.push_back(r->data);
+    r->active = false;
+  }
+}
+
+/* Contents of fragmented test messages, which identify their generation */
+static void fillMsg(byte *data, uint16_t length, uint16_t gen) {
+  memcpy(data, &gen, sizeof (gen));
+  for (uint16_t i = sizeof (gen); i < length; i++) {
+    data[i] = i * 7 + gen;
+  }
+}
+
+static uint16_t msgGen(const std::vector<uint8_t> &msg) {
+  uint16_t gen;
+  memcpy(&gen, msg.data(), sizeof (gen));
+  return gen;
+}
+
+static void checkMsg(const std::vector<uint8_t> &msg, uint16_t length,
+                     uint16_t gen) {
+  TEST_ASSERT_EQUAL(length, msg.size());
+  TEST_ASSERT_EQUAL(gen, msgGen(msg));
+  for (uint16_t i = sizeof (gen); i < length; i++) {
+    TEST_ASSERT_EQUAL((byte)(i * 7 + gen), msg[i]);
+  }
+}
+
+/*
+ * Send fragmented messages until one is only partly sent, with the client
+ * reading whenever a message is refused outright
+ *
+ * @return Number of messages completely sent
+ */
+static int sendUntilPartial(TCPSocket *server, int fd, byte *data,
+                            uint16_t *gen, client_reassembly_t *r) {
+  int sent = 0;
+  while (true) {
+    fillMsg(data, 1000, *gen);
+    int result = server->sendMsg(10, data, 1000);
+    if (result == TCPSOCKET_SEND_PARTIAL) {
+      return sent;
+    }
+    if (result == TCPSOCKET_WOULD_BLOCK) {
+      recvFragment(server, fd, r);
+    } else {
+      TEST_ASSERT_EQUAL(TCPSOCKET_SEND_OK, result);
+      sent++;
+      (*gen)++;
+    }
+    TEST_ASSERT_TRUE(sent < 10000);
+  }
+}
+
+/*
+ * Fragmented messages are reassembled when received, and large messages are
+ * sent as fragments, with a blocked message continued or abandoned
+ */
+void test_fragments(void) {
+  uint16_t port = nextPort++;
+  TCPSocket server(ADDRESS, port, TCP_BUFFER_TOTAL(255));
+  server.setup();
+  TEST_ASSERT_TRUE(server.setReassembly(1000));
+  static byte buffer[TCP_BUFFER_TOTAL(1000)];
+  byte *data = server.initBuffer(buffer, sizeof (buffer));
+  for (int i = 0; i < 1000; i++) {
+    data[i] = i * 7;
+  }
+
+  int a = connectClient(port, 4096);
+  sendHello(a, 10);
+  std::vector<uint8_t> part(200);
+  for (int i = 0; i < 200; i++) {
+    part[i] = i;
+  }
+  sendData(a, frameV1(1, 10, ADDRESS, TCPSOCKET_FLAG_MORE, part));
+  sendData(a, frameV1(2, 10, ADDRESS,
+                      TCPSOCKET_FLAG_MORE | TCPSOCKET_FLAG_CONT, part));
+  sendData(a, frameV1(3, 10, ADDRESS, TCPSOCKET_FLAG_CONT, {0xEE}));
+  unsigned int length;
+  const byte *recv_data = waitMsg(&server, &length);
+  TEST_ASSERT_NOT_NULL(recv_data);
+  TEST_ASSERT_EQUAL(401, length);
+  TEST_ASSERT_EQUAL(199, recv_data[399]);
+  TEST_ASSERT_EQUAL(0xEE, recv_data[400]);
+
+  /* A new first fragment abandons an incomplete message */
+  sendData(a, frameV1(4, 10, ADDRESS, TCPSOCKET_FLAG_MORE, {1, 2, 3}));
+  sendData(a, frameV1(5, 10, ADDRESS, TCPSOCKET_FLAG_MORE, {4}));
+  sendData(a, frameV1(6, 10, ADDRESS, TCPSOCKET_FLAG_CONT, {5}));
+  recv_data = waitMsg(&server, &length);
+  TEST_ASSERT_NOT_NULL(recv_data);
+  TEST_ASSERT_EQUAL(2, length);
+  TEST_ASSERT_EQUAL(4, recv_data[0]);
+
+  /* Sent as fragments of at most the fragment size */
+  server.setFragmentSize(200);
+  TEST_ASSERT_EQUAL(TCPSOCKET_SEND_OK, server.sendMsg(10, data, 1000));
+  client_msg_t msg;
+  std::vector<uint8_t> message;
+  do {
+    TEST_ASSERT_TRUE(recvMsg(&server, a, &msg));
+    TEST_ASSERT_TRUE(msg.flags & TCPSOCKET_FLAG_FRAGMENT);
+    TEST_ASSERT_EQUAL(message.empty(), !(msg.flags & TCPSOCKET_FLAG_CONT));
+    message.insert(message.end(), msg.data.begin(), msg.data.end());
+  } while (msg.flags & TCPSOCKET_FLAG_MORE);
+  TEST_ASSERT_EQUAL(1000, message.size());
+  TEST_ASSERT_EQUAL_MEMORY(data, message.data(), 1000);
+
+  /* A send blocked part way through is completed by continueSend() */
+  client_reassembly_t r = {};
+  uint16_t gen = 0;
+  unsigned int expected = sendUntilPartial(&server, a, data, &gen, &r);
+  int result;
+  while ((result = server.continueSend(10)) != TCPSOCKET_SEND_OK) {
+    TEST_ASSERT_EQUAL(TCPSOCKET_SEND_PARTIAL, result);
+    recvFragment(&server, a, &r);
+  }
+  expected++;
+  gen++;
+  while (r.msgs.size() < expected) {
+    recvFragment(&server, a, &r);
+  }
+  for (unsigned int i = 0; i < expected; i++) {
+    checkMsg(r.msgs[i], 1000, i);
+  }
+  TEST_ASSERT_EQUAL(0, r.abandoned);
+  TEST_ASSERT_EQUAL(TCPSOCKET_SEND_ERROR, server.continueSend(10));
+
+  /*
+   * Sending the next message from the same buffer abandons the blocked one,
+   * rather than sending the rest of the new contents as its fragments
+   */
+  r.msgs.clear();
+  expected = sendUntilPartial(&server, a, data, &gen, &r);
+  uint16_t abandoned = gen++;
+  fillMsg(data, 1000, gen);
+  result = server.sendMsg(10, data, 1000);
+  while (result != TCPSOCKET_SEND_OK) {
+    recvFragment(&server, a, &r);
+    if (result == TCPSOCKET_SEND_PARTIAL) {
+      result = server.continueSend(10);
+    } else {
+      TEST_ASSERT_EQUAL(TCPSOCKET_WOULD_BLOCK, result);
+      result = server.sendMsg(10, data, 1000);
+    }
+  }
+  expected++;
+  while (r.msgs.size() < expected) {
+    recvFragment(&server, a, &r);
+  }
+  TEST_ASSERT_EQUAL(1, r.abandoned);
+  for (unsigned int i = 0; i < expected; i++) {
+    TEST_ASSERT_TRUE(msgGen(r.msgs[i]) != abandoned);
+    checkMsg(r.msgs[i], 1000, msgGen(r.msgs[i]));
+  }
+  checkMsg(r.msgs[expected - 1], 1000, gen);
+
+  /* An aborted message can't be continued */
+  gen++;
+  sendUntilPartial(&server, a, data, &gen, &r);
+  server.abortSend(10);
+  TEST_ASSERT_EQUAL(TCPSOCKET_SEND_ERROR, server.continueSend(10));
+
+  close(a);
+}
+
+/*
+ * Clients that send nothing are disconnected after the idle timeout, and a
+ * waiting client takes over the slot of one that has gone quiet
+ */
+void test_idle_takeover(void) {
+  uint16_t port = nextPort++;
+  TCPSocketT<TCP_BUFFER_TOTAL(64), 1> server(ADDRESS, port);
+  server.setup();
+  tcp_socket_stats_t stats;
+  unsigned int length;
+
+  server.setIdleTimeout(100);
+  int a = connectClient(port);
+  sendData(a, frameV1(1, 10, ADDRESS, 0, {1}));
+  TEST_ASSERT_NOT_NULL(waitMsg(&server, &length));
+  usleep(150000);
+  server.getMsg(SOCKET_ADDR_ANY, &length);
+  server.getStats(&stats);
+  TEST_ASSERT_EQUAL(1, stats.idleDisconnects);
+  TEST_ASSERT_TRUE(clientClosed(a));
+  close(a);
+  server.setIdleTimeout(0);
+
+  /* With no free slot, the second client waits until the first is quiet */
+  server.setTakeover(200);
+  a = connectClient(port);
+  sendData(a, frameV1(2, 10, ADDRESS, 0, {2}));
+  TEST_ASSERT_NOT_NULL(waitMsg(&server, &length));
+  int b = connectClient(port);
+  sendData(b, frameV1(3, 20, ADDRESS, 0, {3}));
+  TEST_ASSERT_NULL(server.getMsg(SOCKET_ADDR_ANY, &length));
+  server.getStats(&stats);
+  TEST_ASSERT_EQUAL(0, stats.takeovers);
+
+  const byte *recv_data = waitMsg(&server, &length);
+  TEST_ASSERT_NOT_NULL(recv_data);
+  TEST_ASSERT_EQUAL(3, recv_data[0]);
+  TEST_ASSERT_EQUAL(20, server.sourceFromData((void *)recv_data));
+  server.getStats(&stats);
+  TEST_ASSERT_EQUAL(1, stats.takeovers);
+  TEST_ASSERT_TRUE(clientClosed(a));
+
+  close(a);
+  close(b);
+}
+
+/* A broadcast reaches every connected client */
+void test_broadcast(void) {
+  uint16_t port = nextPort++;
+  TCPSocket server(ADDRESS, port);
+  server.setup();
+  byte buffer[TCP_BUFFER_TOTAL(8)];
+  byte *data = server.initBuffer(buffer, sizeof (buffer));
+
+  int clients[3];
+  unsigned int length;
+  for (int i = 0; i < 3; i++) {
+    clients[i] = connectClient(port);
+    sendData(clients[i], frameV1(1, 10 + i, ADDRESS, 0, {1}));
+    TEST_ASSERT_NOT_NULL(waitMsg(&server, &length));
+  }
+
+  memcpy(data, "bcast", 5);
+  TEST_ASSERT_EQUAL(3, server.broadcastMsg(data, 5));
+  for (int i = 0; i < 3; i++) {
+    client_msg_t msg;
+    TEST_ASSERT_TRUE(recvMsg(&server, clients[i], &msg));
+    TEST_ASSERT_EQUAL(SOCKET_ADDR_ANY, msg.address);
+    TEST_ASSERT_EQUAL(5, msg.data.size());
+    TEST_ASSERT_EQUAL_MEMORY("bcast", msg.data.data(), 5);
+  }
+
+  /* Disconnected clients are no longer counted */
+  close(clients[1]);
+  usleep(10000);
+  TEST_ASSERT_EQUAL(2, server.broadcastMsg(data, 5));
+
+  close(clients[0]);
+  close(clients[2]);
+}
+
+void setUp(void) {
+}
+
+void tearDown(void) {
+}
+
+int main(void) {
+  UNITY_BEGIN();
+
+  RUN_TEST(test_connect);
+  RUN_TEST(test_routing);
+  RUN_TEST(test_drain);
+  RUN_TEST(test_send_queue);
+  RUN_TEST(test_backpressure);
+  RUN_TEST(test_version_fallback);
+  RUN_TEST(test_invalid_size);
+  RUN_TEST(test_static_init);
+  RUN_TEST(test_dispatch);
+  RUN_TEST(test_reliable);
+  RUN_TEST(test_fragments);
+  RUN_TEST(test_idle_takeover);
+  RUN_TEST(test_broadcast);
+  return UNITY_END();
+}
@@ -0,0 +1,427 @@
+/**
+ * Unit testing of TCPSocket's framing support
+ *
+ * To run tests with platformio:
+ *   platformio test
+ */
+
+#include <Arduino.h>
+#include <unity.h>
+
+#include "../TCPRingBuffer.h"
+#include "../TCPSocket.h"
+#include "../TCPFrameQueue.h"
+#include "../TCPFramePool.h"
+#include "../TCPCompact.h"
+#include "../TCPCompress.h"
+#include "../TCPTokenBucket.h"
+
+/* Write data into a ring buffer, wrapping as needed */
+static void ring_write(TCPRingBuffer *ring, const uint8_t *data, uint16_t len) {
+  while (len > 0) {
+    uint16_t space;
+    uint8_t *dst = ring->writePtr(&space);
+    TEST_ASSERT_TRUE(space > 0);
+    if (space > len) {
+      space = len;
+    }
+    memcpy(dst, data, space);
+    ring->commit(space);
+    data += space;
+    len -= space;
+  }
+}
+
+/* Capacity is rounded up to a power of two */
+void test_ring_capacity(void) {
+  TCPRingBuffer ring;
+  TEST_ASSERT_TRUE(ring.init(100));
+  TEST_ASSERT_EQUAL(128, ring.capacity());
+  TEST_ASSERT_EQUAL(0, ring.used());
+  TEST_ASSERT_EQUAL(128, ring.space());
+}
+
+/* Byte scanning finds the first match at every alignment */
+void test_scan_byte(void) {
+  uint8_t data[37];
+  memset(data, 0xAA, sizeof (data));
+  TEST_ASSERT_EQUAL(-1, TCPRingBuffer::scanByte(data, sizeof (data), 0x53));
+
+  for (uint16_t i = 0; i < sizeof (data); i++) {
+    for (uint16_t start = 0; start <= i && start < 4; start++) {
+      memset(data, 0xAA, sizeof (data));
+      data[i] = 0x53;
+      TEST_ASSERT_EQUAL(i - start,
+                        TCPRingBuffer::scanByte(data + start,
+                                                sizeof (data) - start, 0x53));
+    }
+  }
+}
+
+/* The start word is found after garbage and across the end of the buffer */
+void test_ring_find_wrapped(void) {
+  TCPRingBuffer ring;
+  TEST_ASSERT_TRUE(ring.init(32));
+
+  uint8_t garbage[32];
+  memset(garbage, 0x53, sizeof (garbage));
+
+  /* Position the read pointer so that the start word straddles the end */
+  for (uint16_t skip = 20; skip < 32; skip++) {
+    ring.clear();
+    ring_write(&ring, garbage, skip);
+    ring.consume(skip);
+
+    uint32_t start = TCPSOCKET_START;
+    ring_write(&ring, garbage, 3);
+    ring_write(&ring, (uint8_t *)&start, sizeof (start));
+    TEST_ASSERT_EQUAL(3, ring.find(TCPSOCKET_START));
+
+    uint32_t copy;
+    ring.copyOut(3, &copy, sizeof (copy));
+    TEST_ASSERT_EQUAL_HEX32(TCPSOCKET_START, copy);
+  }
+}
+
+/* A partial start word is not matched */
+void test_ring_find_partial(void) {
+  TCPRingBuffer ring;
+  TEST_ASSERT_TRUE(ring.init(16));
+
+  uint32_t start = TCPSOCKET_START;
+  ring_write(&ring, (uint8_t *)&start, sizeof (start) - 1);
+  TEST_ASSERT_EQUAL(-1, ring.find(TCPSOCKET_START));
+
+  ring_write(&ring, (uint8_t *)&start + sizeof (start) - 1, 1);
+  TEST_ASSERT_EQUAL(0, ring.find(TCPSOCKET_START));
+}
+
+/* Held data keeps its space until released */
+void test_ring_hold(void) {
+  TCPRingBuffer ring;
+  TEST_ASSERT_TRUE(ring.init(16));
+
+  uint8_t data[8] = {1, 2, 3, 4, 5, 6, 7, 8};
+  ring_write(&ring, data, sizeof (data));
+
+  uint16_t held = ring.position();
+  ring.consume(4, true);
+  TEST_ASSERT_TRUE(ring.holding());
+  TEST_ASSERT_EQUAL(4, ring.used());
+  TEST_ASSERT_EQUAL(8, ring.space());
+
+  /* Data consumed while holding stays held as well */
+  ring.consume(2);
+  TEST_ASSERT_EQUAL(8, ring.space());
+
+  ring.release(held + 4);
+  TEST_ASSERT_EQUAL(12, ring.space());
+  ring.release(ring.position());
+  TEST_ASSERT_FALSE(ring.holding());
+  TEST_ASSERT_EQUAL(14, ring.space());
+}
+
+/* Queued frames are copies, returned in order until the queue is full */
+void test_frame_queue() {
+  TCPFrameQueueT<4, 8> queue;
+  uint8_t data[9] = { 0, 1, 2, 3, 4, 5, 6, 7, 8 };
+  tcp_socket_frame_t frame;
+  memset(&frame, 0, sizeof (frame));
+  frame.data = data;
+
+  TEST_ASSERT_NULL(queue.front());
+  TEST_ASSERT_EQUAL(4, queue.space());
+
+  /* Data that doesn't fit in a slot is refused */
+  frame.length = 9;
+  TEST_ASSERT_FALSE(queue.push(&frame));
+
+  for (byte i = 0; i < 4; i++) {
+    frame.length = i + 1;
+    frame.source = i;
+    data[0] = 0xA0 + i;
+    TEST_ASSERT_TRUE(queue.push(&frame));
+  }
+  TEST_ASSERT_EQUAL(0, queue.space());
+  TEST_ASSERT_FALSE(queue.push(&frame));
+
+  /* Slots wrap once the oldest have been popped */
+  for (byte i = 0; i < 6; i++) {
+    const tcp_socket_frame_t *front = queue.front();
+    TEST_ASSERT_NOT_NULL(front);
+    TEST_ASSERT_EQUAL(i + 1, front->length);
+    TEST_ASSERT_EQUAL(i, front->source);
+    TEST_ASSERT_EQUAL(0xA0 + i, front->data[0]);
+    TEST_ASSERT_TRUE(front->data != data);
+    queue.pop();
+
+    if (i < 2) {
+      frame.length = i + 5;
+      frame.source = i + 4;
+      data[0] = 0xA4 + i;
+      TEST_ASSERT_TRUE(queue.push(&frame));
+    }
+  }
+  TEST_ASSERT_EQUAL(0, queue.available());
+  TEST_ASSERT_NULL(queue.front());
+}
+
+/* Frames are lent out until the pool is empty and can be reused once released */
+void test_frame_pool() {
+  TCPFramePoolT<40, 8> pool;
+  uint8_t *frames[40];
+
+  TEST_ASSERT_EQUAL(40, pool.available());
+  TEST_ASSERT_EQUAL(8, pool.dataSize());
+
+  /* Frames span more than one word of the free map */
+  for (byte i = 0; i < 40; i++) {
+    frames[i] = pool.allocFrame();
+    TEST_ASSERT_NOT_NULL(frames[i]);
+    for (byte j = 0; j < i; j++) {
+      TEST_ASSERT_TRUE(frames[i] != frames[j]);
+    }
+  }
+  TEST_ASSERT_NULL(pool.allocFrame());
+  TEST_ASSERT_EQUAL(0, pool.lowWater());
+
+  /* A frame is released by its message data, and only once */
+  TEST_ASSERT_TRUE(pool.release(frames[33] + TCPSOCKET_MAX_HDR));
+  TEST_ASSERT_FALSE(pool.release(frames[33]));
+  TEST_ASSERT_EQUAL(1, pool.available());
+
+  byte *msg = pool.allocMsg();
+  TEST_ASSERT_TRUE(msg == frames[33] + TCPSOCKET_MAX_HDR);
+
+  /* Pointers outside of the pool are refused */
+  uint8_t other[TCP_BUFFER_TOTAL(8)];
+  TEST_ASSERT_FALSE(pool.release(other));
+
+  for (byte i = 0; i < 40; i++) {
+    TEST_ASSERT_TRUE(pool.release(frames[i]));
+  }
+  TEST_ASSERT_EQUAL(40, pool.available());
+  TEST_ASSERT_EQUAL(0, pool.lowWater());
+
+  /* Invalid sizes */
+  TCPFramePool invalid;
+  TEST_ASSERT_FALSE(invalid.init(0, TCP_BUFFER_TOTAL(8)));
+  TEST_ASSERT_FALSE(invalid.init(TCPFRAMEPOOL_MAX_FRAMES + 1,
+                                 TCP_BUFFER_TOTAL(8)));
+  TEST_ASSERT_FALSE(invalid.init(4, TCPSOCKET_MAX_HDR));
+  TEST_ASSERT_TRUE(invalid.init(4, TCP_BUFFER_TOTAL(8)));
+  TEST_ASSERT_EQUAL(4, invalid.available());
+}
+
+/* Byte stuffed frames contain no zeros and decode to the original data */
+void test_compact_stuffing() {
+  const uint16_t lengths[] = { 0, 1, 253, 254, 255, 600 };
+  static uint8_t data[600];
+  static uint8_t encoded[TCPCompact::maxEncoded(4 + 600) + 1];
+  static uint8_t decoded[4 + 600];
+  const uint8_t hdr[4] = { 0x80, 0, 7, 0 };
+
+  for (uint16_t i = 0; i < sizeof (data); i++) {
+    data[i] = (i % 97 == 0) ? 0 : (uint8_t)i;
+  }
+
+  for (byte t = 0; t < sizeof (lengths) / sizeof (lengths[0]); t++) {
+    uint16_t len = lengths[t];
+    uint16_t encodedLen = TCPCompact::encode(hdr, sizeof (hdr), data, len,
+                                             encoded);
+    TEST_ASSERT_TRUE(encodedLen <= TCPCompact::maxEncoded(4 + len) + 1);
+    TEST_ASSERT_EQUAL(TCPCOMPACT_DELIMITER, encoded[encodedLen - 1]);
+    for (uint16_t i = 0; i < encodedLen - 1; i++) {
+      TEST_ASSERT_TRUE(encoded[i] != TCPCOMPACT_DELIMITER);
+    }
+
+    /* Decode in two pieces, as for a frame that wraps the ring buffer */
+    TCPCompact compact;
+    uint16_t split = (encodedLen - 1) / 3;
+    compact.beginDecode(decoded, sizeof (decoded));
+    TEST_ASSERT_TRUE(compact.decode(encoded, split));
+    TEST_ASSERT_TRUE(compact.decode(encoded + split, encodedLen - 1 - split));
+    TEST_ASSERT_EQUAL(4 + len, compact.endDecode());
+    TEST_ASSERT_EQUAL_MEMORY(hdr, decoded, 4);
+    if (len > 0) {
+      TEST_ASSERT_EQUAL_MEMORY(data, decoded + 4, len);
+    }
+
+    /* Output that is too small is rejected */
+    compact.beginDecode(decoded, 4 + len - 1);
+    compact.decode(encoded, encodedLen - 1);
+    TEST_ASSERT_EQUAL(-1, compact.endDecode());
+  }
+}
+
+/* Header fields matching the previous frame are left out */
+void test_compact_header() {
+  tcp_compact_state_t send = { 0, 128, 10 };
+  tcp_compact_state_t recv = send;
+  uint8_t hdr[TCPCOMPACT_MAX_HDR];
+  byte flags;
+
+  TEST_ASSERT_EQUAL(1, TCPCompact::encodeHeader(&send, 1, 0, 128, 10, hdr));
+  TEST_ASSERT_EQUAL(1, TCPCompact::decodeHeader(&recv, hdr, 1, &flags));
+  TEST_ASSERT_EQUAL(1, recv.ID);
+  TEST_ASSERT_EQUAL(0, flags);
+
+  TEST_ASSERT_EQUAL(TCPCOMPACT_MAX_HDR,
+                    TCPCompact::encodeHeader(&send, 9, 0x20, 0xFFFF, 40000,
+                                             hdr));
+  TEST_ASSERT_EQUAL(-1, TCPCompact::decodeHeader(&recv, hdr, 5, &flags));
+  TEST_ASSERT_EQUAL(1, recv.ID);
+  TEST_ASSERT_EQUAL(TCPCOMPACT_MAX_HDR,
+                    TCPCompact::decodeHeader(&recv, hdr, TCPCOMPACT_MAX_HDR,
+                                             &flags));
+  TEST_ASSERT_EQUAL(9, recv.ID);
+  TEST_ASSERT_EQUAL(0x20, flags);
+  TEST_ASSERT_EQUAL(0xFFFF, recv.source);
+  TEST_ASSERT_EQUAL(40000, recv.address);
+
+  /* Control bytes without the marker are invalid */
+  hdr[0] = 0x01;
+  TEST_ASSERT_EQUAL(-1, TCPCompact::decodeHeader(&recv, hdr, 2, &flags));
+}
+
+/* Compressed data decompresses to the original, even when split in pieces */
+void test_compress() {
+  static uint8_t data[1000];
+  static uint8_t packed[1000];
+  static uint8_t unpacked[1000];
+  static uint16_t table[TCPCOMPRESS_TABLE_SIZE];
+
+  /* Pixels of a few repeated colors */
+  for (uint16_t i = 0; i < sizeof (data); i++) {
+    data[i] = ((i / 3) % 50 < 25) ? (i % 3) * 40 : 0xFF;
+  }
+  uint16_t len = TCPCompress::compress(data, sizeof (data), packed,
+                                       sizeof (packed), table);
+  TEST_ASSERT_TRUE((len > 0) && (len < sizeof (data) / 4));
+
+  for (uint16_t split = 0; split <= len; split += 7) {
+    TCPCompress decoder;
+    decoder.beginDecompress(unpacked, sizeof (unpacked));
+    TEST_ASSERT_TRUE(decoder.decompress(packed, split));
+    TEST_ASSERT_TRUE(decoder.decompress(packed + split, len - split));
+    TEST_ASSERT_EQUAL(sizeof (data), decoder.endDecompress());
+    TEST_ASSERT_EQUAL_MEMORY(data, unpacked, sizeof (data));
+  }
+
+  /* Data that doesn't compress is refused rather than expanded */
+  uint32_t value = 1;
+  for (uint16_t i = 0; i < sizeof (data); i++) {
+    value = value * 1103515245 + 12345;
+    data[i] = value >> 24;
+  }
+  TEST_ASSERT_EQUAL(0, TCPCompress::compress(data, sizeof (data), packed,
+                                             sizeof (data) - 1, table));
+
+  /* Output larger than the buffer, and references before the start */
+  TCPCompress decoder;
+  const uint8_t run[] = { 0x00, 0x55, 0xE0, 0xFF, 0x00 };
+  decoder.beginDecompress(unpacked, 100);
+  TEST_ASSERT_FALSE(decoder.decompress(run, sizeof (run)));
+  decoder.beginDecompress(unpacked, sizeof (unpacked));
+  TEST_ASSERT_TRUE(decoder.decompress(run, sizeof (run)));
+  TEST_ASSERT_EQUAL(1 + 9 + 255, decoder.endDecompress());
+  TEST_ASSERT_EQUAL(0x55, unpacked[264]);
+
+  const uint8_t invalid[] = { 0x00, 0x55, 0x20, 0x01 };
+  decoder.beginDecompress(unpacked, sizeof (unpacked));
+  TEST_ASSERT_FALSE(decoder.decompress(invalid, sizeof (invalid)));
+
+  /* Ending part way through a token */
+  decoder.beginDecompress(unpacked, sizeof (unpacked));
+  TEST_ASSERT_TRUE(decoder.decompress(run, 3));
+  TEST_ASSERT_EQUAL(-1, decoder.endDecompress());
+}
+
+void test_latency_histogram() {
+  tcp_socket_histogram_t histogram;
+  memset(&histogram, 0, sizeof (histogram));
+
+  TCPSocket::addLatency(&histogram, 100);
+  TEST_ASSERT_EQUAL(1, histogram.samples);
+  TEST_ASSERT_EQUAL(100, histogram.minMicros);
+  TEST_ASSERT_EQUAL(100, histogram.maxMicros);
+  TEST_ASSERT_EQUAL(100, histogram.smoothedMicros);
+  TEST_ASSERT_EQUAL(1, histogram.buckets[1]);
+
+  TCPSocket::addLatency(&histogram, 10);
+  TCPSocket::addLatency(&histogram, 2000);
+  TCPSocket::addLatency(&histogram, 0xFFFFFFFF);
+  TEST_ASSERT_EQUAL(1, histogram.buckets[0]);
+  TEST_ASSERT_EQUAL(1, histogram.buckets[5]);
+  TEST_ASSERT_EQUAL(1, histogram.buckets[TCPSOCKET_LATENCY_BUCKETS - 1]);
+  TEST_ASSERT_EQUAL(4, histogram.samples);
+  TEST_ASSERT_EQUAL(10, histogram.minMicros);
+  TEST_ASSERT_EQUAL(0xFFFFFFFF, histogram.maxMicros);
+  TEST_ASSERT_EQUAL(0xFFFFFFFF, histogram.lastMicros);
+
+  /* A full bucket halves all of them */
+  histogram.buckets[1] = 0xFFFF;
+  TCPSocket::addLatency(&histogram, 100);
+  TEST_ASSERT_EQUAL(0x8000, histogram.buckets[1]);
+  TEST_ASSERT_EQUAL(0, histogram.buckets[0]);
+  TEST_ASSERT_EQUAL(0, histogram.buckets[5]);
+}
+
+void test_token_bucket() {
+  tcp_rate_limit_t limit;
+  TCPTokenBucket bucket;
+
+  /* 10 messages per second with a burst of 2 */
+  TCPTokenBucket::setLimit(&limit, 10, 0, 2);
+  TEST_ASSERT_TRUE(TCPTokenBucket::limited(&limit));
+  bucket.fill(&limit, 1000);
+  for (int i = 0; i < 2; i++) {
+    TEST_ASSERT_TRUE(bucket.admit(&limit, 1000));
+    bucket.take(&limit, 50);
+  }
+  TEST_ASSERT_FALSE(bucket.admit(&limit, 1000));
+  TEST_ASSERT_FALSE(bucket.admit(&limit, 1099));
+  TEST_ASSERT_TRUE(bucket.admit(&limit, 1100));
+  bucket.take(&limit, 50);
+
+  /* Refilling stops at the burst */
+  TEST_ASSERT_TRUE(bucket.admit(&limit, 60000));
+  bucket.take(&limit, 50);
+  bucket.take(&limit, 50);
+  TEST_ASSERT_FALSE(bucket.admit(&limit, 60000));
+
+  /* A message larger than the byte burst passes, leaving the bucket in debt */
+  TCPTokenBucket::setLimit(&limit, 0, 1000, 0, 100);
+  bucket.fill(&limit, 0);
+  TEST_ASSERT_TRUE(bucket.admit(&limit, 0));
+  bucket.take(&limit, 300);
+  TEST_ASSERT_FALSE(bucket.admit(&limit, 150));
+  TEST_ASSERT_FALSE(bucket.admit(&limit, 200));
+  TEST_ASSERT_TRUE(bucket.admit(&limit, 201));
+
+  TCPTokenBucket::setLimit(&limit, 0, 0);
+  TEST_ASSERT_FALSE(TCPTokenBucket::limited(&limit));
+  TEST_ASSERT_TRUE(bucket.admit(&limit, 0));
+}
+
+void setup() {
+  UNITY_BEGIN();
+
+  RUN_TEST(test_ring_capacity);
+  RUN_TEST(test_scan_byte);
+  RUN_TEST(test_ring_find_wrapped);
+  RUN_TEST(test_ring_find_partial);
+  RUN_TEST(test_ring_hold);
+  RUN_TEST(test_frame_queue);
+  RUN_TEST(test_frame_pool);
+  RUN_TEST(test_compact_stuffing);
+  RUN_TEST(test_compact_header);
+  RUN_TEST(test_compress);
+  RUN_TEST(test_latency_histogram);
+  RUN_TEST(test_token_bucket);
+  UNITY_END();
+}
+
+void loop() {
+  UNITY_END(); // stop unit testing
+}
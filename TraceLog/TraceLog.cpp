@@ -0,0 +1,243 @@
+/*
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2018
+ */
+
+#include <Arduino.h>
+
+#if defined(TCPSOCKET_HOST)
+  #include <thread>
+#elif defined(ESP32)
+  #include <freertos/FreeRTOS.h>
+  #include <freertos/task.h>
+#endif
+
+#include "TraceLog.h"
+
+trace_slot_t *TraceLog::buffer = nullptr;
+uint16_t TraceLog::mask = 0;
+bool TraceLog::ownsStorage = false;
+std::atomic<uint32_t> TraceLog::head(0);
+uint32_t TraceLog::tail = 0;
+uint32_t TraceLog::droppedRecords = 0;
+
+Print *TraceLog::drainOut = nullptr;
+unsigned long TraceLog::drainPeriodMs = 0;
+std::atomic<bool> TraceLog::draining(false);
+
+#if defined(TCPSOCKET_HOST)
+static std::thread drainThread;
+#endif
+
+/**
+ * Start recording events
+ *
+ * @param records Size of the ring buffer, which must be a power of two
+ * @param storage Buffer of that many slots, or nullptr to allocate one
+ * @return false if the size is invalid or the buffer could not be allocated
+ */
+bool TraceLog::begin(uint16_t records, trace_slot_t *storage) {
+  if ((records == 0) || ((records & (records - 1)) != 0)) {
+    return false;
+  }
+
+  end();
+
+  if (storage == nullptr) {
+    storage = (trace_slot_t *)malloc(records * sizeof (trace_slot_t));
+    if (storage == nullptr) {
+      return false;
+    }
+    ownsStorage = true;
+  }
+  for (uint16_t i = 0; i < records; i++) {
+    storage[i].sequence.store(0, std::memory_order_relaxed);
+  }
+
+  head.store(0);
+  tail = 0;
+  droppedRecords = 0;
+  mask = records - 1;
+  buffer = storage;
+  return true;
+}
+
+/**
+ * Stop recording events, discarding any that have not been drained
+ */
+void TraceLog::end() {
+  stopDrain();
+  if (ownsStorage) {
+    free(buffer);
+    ownsStorage = false;
+  }
+  buffer = nullptr;
+}
+
+/**
+ * Number of records waiting to be drained
+ */
+uint16_t TraceLog::pending() {
+  if (buffer == nullptr) {
+    return 0;
+  }
+  uint32_t count = head.load() - tail;
+  return (count > (uint32_t)mask + 1) ? mask + 1 : count;
+}
+
+/**
+ * Write out the oldest records, preceded by a record of how many were lost if
+ * the buffer was overrun since the last drain.  Records are copied out of the
+ * ring buffer before being written so that events logged while writing are
+ * not lost, and each is checked against its sequence after being copied so
+ * that one overwritten or still being written is never written out.  Only one
+ * caller may drain at a time.
+ *
+ * @return Number of records written
+ */
+uint16_t TraceLog::drain(Print *out, uint16_t maxRecords) {
+  trace_record_t batch[TRACELOG_BATCH];
+  uint16_t total = 0;
+
+  if (buffer == nullptr) {
+    return 0;
+  }
+
+  const uint32_t capacity = (uint32_t)mask + 1;
+  bool uncommitted = false;
+  while (!uncommitted && ((maxRecords == 0) || (total < maxRecords))) {
+    uint16_t count = 0;
+    uint32_t lost = 0;
+
+    uint32_t current = head.load(std::memory_order_acquire);
+    if (current - tail > capacity) {
+      lost = current - tail - capacity;
+      tail = current - capacity;
+    }
+    uint32_t available = current - tail;
+    if ((available == 0) && (lost == 0)) {
+      break;
+    }
+
+    uint16_t limit = TRACELOG_BATCH - 1;
+    if ((maxRecords != 0) && (maxRecords - total < limit)) {
+      limit = maxRecords - total;
+    }
+    if (available > limit) {
+      available = limit;
+    }
+
+    /* Slot 0 is left for an overrun record */
+    uint32_t copied;
+    for (copied = 0; copied < available; copied++) {
+      uint32_t index = tail + copied;
+      trace_slot_t *slot = &buffer[index & mask];
+      uint32_t sequence = slot->sequence.load(std::memory_order_acquire);
+      batch[count + 1] = slot->record;
+      std::atomic_thread_fence(std::memory_order_acquire);
+
+      if ((sequence == index + 1) &&
+          (slot->sequence.load(std::memory_order_relaxed) == sequence)) {
+        count++;
+      } else if (head.load(std::memory_order_acquire) - index > capacity) {
+        /* Overwritten by a newer record before or while being copied */
+        lost++;
+      } else {
+        /* Still being written, it and later records wait for the next drain */
+        uncommitted = true;
+        break;
+      }
+    }
+    tail += copied;
+
+    uint16_t first = 1;
+    if (lost > 0) {
+      droppedRecords += lost;
+      first--;
+      /* Timestamped with the first record kept, to stay in order */
+      batch[first].micros = (count > 0) ? batch[first + 1].micros : micros();
+      batch[first].event = TRACE_OVERRUN;
+      batch[first].a = (lost > 0xFFFF) ? 0xFFFF : lost;
+      batch[first].b = lost;
+      count++;
+    }
+
+    writeBatch(out, &batch[first], count);
+    total += count;
+  }
+
+  return total;
+}
+
+void TraceLog::writeBatch(Print *out, const trace_record_t *records,
+                          uint16_t count) {
+  if (count == 0) {
+    return;
+  }
+
+  trace_batch_hdr_t hdr;
+  hdr.start = TRACELOG_START;
+  hdr.version = TRACELOG_VERSION;
+  hdr.size = sizeof (trace_record_t);
+  hdr.count = count;
+  out->write((const uint8_t *)&hdr, sizeof (hdr));
+  out->write((const uint8_t *)records, count * sizeof (trace_record_t));
+}
+
+/**
+ * Start a low priority task that periodically drains the buffer, so that
+ * records are written out while the application is otherwise idle
+ */
+bool TraceLog::startDrain(Print *out, unsigned long periodMs) {
+  if (draining.load()) {
+    return false;
+  }
+
+  drainOut = out;
+  drainPeriodMs = periodMs;
+  draining.store(true);
+
+#if defined(TCPSOCKET_HOST)
+  drainThread = std::thread(runDrain, nullptr);
+  return true;
+#elif defined(ESP32)
+  if (xTaskCreate(runDrain, "tracelog", TRACELOG_TASK_STACK, nullptr,
+                  tskIDLE_PRIORITY + 1, nullptr) != pdPASS) {
+    draining.store(false);
+    return false;
+  }
+  return true;
+#else
+  draining.store(false);
+  return false;
+#endif
+}
+
+/**
+ * Stop the drain task, after which records are only written by drain()
+ */
+void TraceLog::stopDrain() {
+  if (!draining.load()) {
+    return;
+  }
+  draining.store(false);
+
+#if defined(TCPSOCKET_HOST)
+  drainThread.join();
+#elif defined(ESP32)
+  /* The task exits after its current sleep */
+  delay(drainPeriodMs + 1);
+#endif
+}
+
+void TraceLog::runDrain(void *arg) {
+  while (draining.load()) {
+    drain(drainOut);
+    delay(drainPeriodMs);
+  }
+
+#if defined(ESP32) && !defined(TCPSOCKET_HOST)
+  vTaskDelete(nullptr);
+#endif
+}
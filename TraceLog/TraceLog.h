@@ -0,0 +1,141 @@
+/*
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2018
+ *
+ * Deferred binary logging.  Rather than formatting text and writing it to
+ * Serial as it happens, events are recorded as small fixed size binary records
+ * (event ID, timestamp, and two arguments) in a RAM ring buffer.  The buffer
+ * is written out later, either in the background by a low priority task or on
+ * demand, and decoded on a host by tracelogdecode.py.  Recording an event only
+ * costs a few stores, so tracing can be left on under real load without
+ * changing the timing being investigated.
+ *
+ * Events are logged with the TRACELOG() macro, which compiles to nothing
+ * unless TRACELOG_ENABLED is defined.  Each library defines its events in its
+ * header as:
+ *
+ *   #define NAME TRACE_ID(TRACE_MODULE_x, n) // "format"
+ *
+ * where the format may refer to the arguments as {a} and {b}, or to the
+ * bytes of b as {b0}..{b3} and its 16 bit halves as {bl} and {bh}.  The
+ * decoder reads the event names and formats from those definitions.
+ */
+
+#ifndef TRACELOG_H
+#define TRACELOG_H
+
+#include <Arduino.h>
+#include <atomic>
+
+#if defined(TRACELOG_ENABLED)
+  #define TRACELOG(event, a, b) TraceLog::log(event, a, b)
+#else
+  #define TRACELOG(event, a, b)
+#endif
+
+/* Event IDs hold the logging module in their high byte */
+#define TRACE_ID(module, event) (uint16_t)(((module) << 8) | (event))
+
+#define TRACE_MODULE_TRACELOG  0
+#define TRACE_MODULE_TCPSOCKET 1
+#define TRACE_MODULE_WIFIBASE  2
+
+#define TRACE_OVERRUN TRACE_ID(TRACE_MODULE_TRACELOG, 1) // "{a} records lost"
+
+typedef struct __attribute__((__packed__)) {
+  uint32_t micros;   // 4B
+  uint16_t event;    // 2B
+  uint16_t a;        // 2B
+  uint32_t b;        // 4B
+} trace_record_t;  // Total: 12B
+
+/*
+ * A record in the ring buffer.  The sequence is set once the record has been
+ * completely written, so that a record still being written by another task or
+ * core is never drained.
+ */
+typedef struct {
+  trace_record_t        record;
+  std::atomic<uint32_t> sequence; // Index of the record + 1, 0 while writing
+} trace_slot_t;
+
+/*
+ * Records are written out in batches, each preceded by this header so that the
+ * decoder can find them amongst other serial output
+ */
+#define TRACELOG_START (uint32_t)0x474C5254 // "TRLG"
+#define TRACELOG_VERSION 1
+typedef struct __attribute__((__packed__)) {
+  uint32_t start;    // 4B
+  byte     version;  // 1B
+  byte     size;     // 1B, size of each record
+  uint16_t count;    // 2B, number of records that follow
+} trace_batch_hdr_t;  // Total: 8B
+
+/* Default number of records in the ring buffer */
+#ifndef TRACELOG_RECORDS
+  #define TRACELOG_RECORDS 256
+#endif
+
+/* Largest number of records written in a batch */
+#ifndef TRACELOG_BATCH
+  #define TRACELOG_BATCH 32
+#endif
+
+#if defined(ESP32)
+  #ifndef TRACELOG_TASK_STACK
+    #define TRACELOG_TASK_STACK 2048
+  #endif
+#endif
+
+class TraceLog {
+public:
+  static bool begin(uint16_t records = TRACELOG_RECORDS,
+                    trace_slot_t *storage = nullptr);
+  static void end();
+
+  /* Record an event, overwriting the oldest record if the buffer is full */
+  static void log(uint16_t event, uint16_t a = 0, uint32_t b = 0) {
+    if (buffer == nullptr) {
+      return;
+    }
+    uint32_t index = head.fetch_add(1, std::memory_order_relaxed);
+    trace_slot_t *slot = &buffer[index & mask];
+    slot->sequence.store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    slot->record.micros = micros();
+    slot->record.event = event;
+    slot->record.a = a;
+    slot->record.b = b;
+    slot->sequence.store(index + 1, std::memory_order_release);
+  }
+
+  /* Write out and remove up to maxRecords of the oldest records, 0 for all */
+  static uint16_t drain(Print *out, uint16_t maxRecords = 0);
+
+  /* Drain the buffer from a low priority task */
+  static bool startDrain(Print *out, unsigned long periodMs = 100);
+  static void stopDrain();
+
+  static uint16_t pending();
+  static uint32_t dropped() { return droppedRecords; }
+
+private:
+  static trace_slot_t *buffer;
+  static uint16_t mask;
+  static bool ownsStorage;
+  static std::atomic<uint32_t> head; // Index of the next record reserved
+  static uint32_t tail;              // Index of the next record drained
+  static uint32_t droppedRecords;
+
+  static Print *drainOut;
+  static unsigned long drainPeriodMs;
+  static std::atomic<bool> draining;
+
+  static void writeBatch(Print *out, const trace_record_t *records,
+                         uint16_t count);
+  static void runDrain(void *arg);
+};
+
+#endif // TRACELOG_H
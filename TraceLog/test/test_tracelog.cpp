@@ -0,0 +1,160 @@
+/**
+ * Unit testing of TraceLog's buffering and draining of records
+ *
+ * To run tests with platformio:
+ *   platformio test
+ */
+
+#include <Arduino.h>
+#include <unity.h>
+
+#include "../TraceLog.h"
+
+/* Print that captures the drained output */
+class BufferPrint : public Print {
+public:
+  uint8_t data[2048];
+  size_t length = 0;
+
+  size_t write(uint8_t c) {
+    return write(&c, 1);
+  }
+  size_t write(const uint8_t *buffer, size_t size) {
+    if (length + size > sizeof (data)) {
+      size = sizeof (data) - length;
+    }
+    memcpy(data + length, buffer, size);
+    length += size;
+    return size;
+  }
+};
+
+#define TEST_EVENT TRACE_ID(TRACE_MODULE_TRACELOG, 2)
+
+/* The buffer size must be a power of two */
+void test_begin(void) {
+  TEST_ASSERT_FALSE(TraceLog::begin(0));
+  TEST_ASSERT_FALSE(TraceLog::begin(100));
+  TEST_ASSERT_TRUE(TraceLog::begin(64));
+  TEST_ASSERT_EQUAL(0, TraceLog::pending());
+  TraceLog::end();
+}
+
+/* Records are drained in order, in batches with a header */
+void test_drain(void) {
+  BufferPrint out;
+  TEST_ASSERT_TRUE(TraceLog::begin(64));
+  for (uint16_t i = 0; i < 10; i++) {
+    TraceLog::log(TEST_EVENT, i, i * 1000);
+  }
+  TEST_ASSERT_EQUAL(10, TraceLog::pending());
+
+  TEST_ASSERT_EQUAL(10, TraceLog::drain(&out));
+  TEST_ASSERT_EQUAL(0, TraceLog::pending());
+  TEST_ASSERT_EQUAL(sizeof (trace_batch_hdr_t) + 10 * sizeof (trace_record_t),
+                    out.length);
+
+  trace_batch_hdr_t *hdr = (trace_batch_hdr_t *)out.data;
+  TEST_ASSERT_EQUAL(TRACELOG_START, hdr->start);
+  TEST_ASSERT_EQUAL(sizeof (trace_record_t), hdr->size);
+  TEST_ASSERT_EQUAL(10, hdr->count);
+
+  trace_record_t *records = (trace_record_t *)(out.data + sizeof (*hdr));
+  for (uint16_t i = 0; i < 10; i++) {
+    TEST_ASSERT_EQUAL(TEST_EVENT, records[i].event);
+    TEST_ASSERT_EQUAL(i, records[i].a);
+    TEST_ASSERT_EQUAL(i * 1000, records[i].b);
+  }
+
+  /* Nothing further to drain */
+  TEST_ASSERT_EQUAL(0, TraceLog::drain(&out));
+  TraceLog::end();
+}
+
+/* Overwritten records are reported by an overrun record */
+void test_overrun(void) {
+  BufferPrint out;
+  TEST_ASSERT_TRUE(TraceLog::begin(64));
+  for (uint16_t i = 0; i < 100; i++) {
+    TraceLog::log(TEST_EVENT, i);
+  }
+  TEST_ASSERT_EQUAL(64, TraceLog::pending());
+
+  TEST_ASSERT_EQUAL(65, TraceLog::drain(&out));
+  TEST_ASSERT_EQUAL(36, TraceLog::dropped());
+
+  trace_record_t *records =
+    (trace_record_t *)(out.data + sizeof (trace_batch_hdr_t));
+  TEST_ASSERT_EQUAL(TRACE_OVERRUN, records[0].event);
+  TEST_ASSERT_EQUAL(36, records[0].a);
+  TEST_ASSERT_EQUAL(36, records[1].a);
+  TraceLog::end();
+}
+
+/* Print that checks drained records are intact and in order as written */
+class CheckPrint : public Print {
+public:
+  uint32_t records = 0;
+  uint32_t lost = 0;
+  uint32_t torn = 0;
+  uint32_t unordered = 0;
+  uint32_t next = 0;
+
+  size_t write(uint8_t c) {
+    return write(&c, 1);
+  }
+  size_t write(const uint8_t *buffer, size_t size) {
+    if (size == sizeof (trace_batch_hdr_t)) {
+      return size;
+    }
+    const trace_record_t *record = (const trace_record_t *)buffer;
+    for (size_t i = 0; i < size / sizeof (trace_record_t); i++, record++) {
+      if (record->event == TRACE_OVERRUN) {
+        lost += record->b;
+        continue;
+      }
+      if (record->b != (uint32_t)record->a * 0x10001) {
+        torn++;
+      }
+      if (record->b < next) {
+        unordered++;
+      }
+      next = record->b;
+      records++;
+    }
+    return size;
+  }
+};
+
+/* Records drained while others are being logged are never partly written */
+void test_concurrent_drain(void) {
+  const uint16_t logged = 20000;
+  CheckPrint out;
+  TEST_ASSERT_TRUE(TraceLog::begin(64));
+  TEST_ASSERT_TRUE(TraceLog::startDrain(&out, 0));
+  for (uint16_t i = 0; i < logged; i++) {
+    TraceLog::log(TEST_EVENT, i, (uint32_t)i * 0x10001);
+  }
+  TraceLog::stopDrain();
+  TraceLog::drain(&out);
+
+  TEST_ASSERT_EQUAL(0, out.torn);
+  TEST_ASSERT_EQUAL(0, out.unordered);
+  TEST_ASSERT_EQUAL(logged, out.records + out.lost);
+  TEST_ASSERT_EQUAL(out.lost, TraceLog::dropped());
+  TraceLog::end();
+}
+
+void setup() {
+  UNITY_BEGIN();
+
+  RUN_TEST(test_begin);
+  RUN_TEST(test_drain);
+  RUN_TEST(test_overrun);
+  RUN_TEST(test_concurrent_drain);
+  UNITY_END();
+}
+
+void loop() {
+  UNITY_END(); // stop unit testing
+}
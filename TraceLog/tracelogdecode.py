@@ -0,0 +1,182 @@
+#!/usr/bin/python
+#
+# Decode TraceLog records, from a file or directly from a serial port.  Event
+# names and formats are read from the TRACE_ID() definitions in the headers of
+# the libraries that log them.
+#
+#   tracelogdecode.py capture.bin
+#   tracelogdecode.py -s /dev/ttyUSB0 -b 115200
+#
+# Author: Adam Phelps
+# License: MIT
+# Copyright: 2018
+
+from __future__ import print_function
+
+import argparse
+import os
+import re
+import struct
+import sys
+
+
+BATCH_FORMAT = "<IBBH"
+BATCH_LEN = 8
+RECORD_FORMAT = "<IHHI"
+RECORD_LEN = 12
+
+START = struct.pack("<I", 0x474C5254)
+VERSION = 1
+
+LIB_DIR = os.path.join(os.path.dirname(os.path.abspath(__file__)), "..")
+DEFAULT_HEADERS = [
+    os.path.join(LIB_DIR, "TraceLog", "TraceLog.h"),
+    os.path.join(LIB_DIR, "TCPSocket", "TCPSocket.h"),
+    os.path.join(LIB_DIR, "WiFiBase", "WiFiBase.h"),
+]
+
+MODULE_RE = re.compile(r"#define\s+TRACE_MODULE_(\w+)\s+(\d+)")
+EVENT_RE = re.compile(
+    r"#define\s+(\w+)\s+TRACE_ID\(TRACE_MODULE_(\w+),\s*(\d+)\)\s*//\s*\"(.*)\"")
+
+
+def handle_args():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("input", nargs="?",
+                        help="File of captured output to decode")
+
+    parser.add_argument("-s", "--serial", dest="serial",
+                        help="Serial port to read from")
+
+    parser.add_argument("-b", "--baud", dest="baud", type=int,
+                        help="Serial port baud rate", default=115200)
+
+    parser.add_argument("-H", "--header", dest="headers", action="append",
+                        help="Header defining trace events, may be repeated",
+                        default=[])
+
+    args = parser.parse_args()
+    if (args.input is None) == (args.serial is None):
+        parser.error("Specify either an input file or a serial port")
+    if not args.headers:
+        args.headers = DEFAULT_HEADERS
+    return args
+
+
+def load_events(headers):
+    """Map event IDs to their name and format from the header definitions"""
+    modules = {}
+    definitions = []
+    for header in headers:
+        if not os.path.exists(header):
+            continue
+        with open(header) as f:
+            for line in f:
+                match = MODULE_RE.search(line)
+                if match:
+                    modules[match.group(1)] = int(match.group(2))
+                match = EVENT_RE.search(line)
+                if match:
+                    definitions.append(match.groups())
+
+    events = {}
+    for (name, module, number, fmt) in definitions:
+        if module in modules:
+            events[(modules[module] << 8) | int(number)] = (module, name, fmt)
+    return events
+
+
+def format_record(events, event, a, b):
+    if event not in events:
+        return ("UNKNOWN", "0x%04x" % event, "a:%d b:%d" % (a, b))
+    (module, name, fmt) = events[event]
+    fields = {
+        "a": a,
+        "b": b,
+        "b0": b & 0xff,
+        "b1": (b >> 8) & 0xff,
+        "b2": (b >> 16) & 0xff,
+        "b3": (b >> 24) & 0xff,
+        "bl": b & 0xffff,
+        "bh": (b >> 16) & 0xffff,
+    }
+    try:
+        text = fmt.format(**fields)
+    except (KeyError, ValueError, IndexError):
+        text = "%s (a:%d b:%d)" % (fmt, a, b)
+    return (module, name, text)
+
+
+class Decoder(object):
+    def __init__(self, events):
+        self.events = events
+        self.data = b""
+        self.last = None
+        self.base = 0
+
+    def feed(self, data):
+        """Decode every complete batch in the data received so far"""
+        self.data += data
+        while True:
+            pos = self.data.find(START)
+            if pos < 0:
+                # Keep any trailing bytes that could begin a batch
+                self.data = self.data[-(len(START) - 1):]
+                return
+            self.data = self.data[pos:]
+            if len(self.data) < BATCH_LEN:
+                return
+
+            (start, version, size, count) = struct.unpack(
+                BATCH_FORMAT, self.data[:BATCH_LEN])
+            if version != VERSION or size != RECORD_LEN:
+                self.data = self.data[1:]
+                continue
+
+            end = BATCH_LEN + count * RECORD_LEN
+            if len(self.data) < end:
+                return
+            for i in range(count):
+                offset = BATCH_LEN + i * RECORD_LEN
+                self.record(*struct.unpack(
+                    RECORD_FORMAT, self.data[offset:offset + RECORD_LEN]))
+            self.data = self.data[end:]
+
+    def record(self, micros, event, a, b):
+        # Timestamps are 32 bit microseconds, which wrap every ~71 minutes
+        if self.last is not None and micros < self.last and \
+                self.last - micros > 0x80000000:
+            self.base += 0x100000000
+        delta = 0
+        if self.last is not None:
+            delta = ((micros - self.last + 0x80000000) & 0xffffffff) - \
+                0x80000000
+        self.last = micros
+
+        (module, name, text) = format_record(self.events, event, a, b)
+        print("%14.6f %+9d %-10s %-26s %s" %
+              ((self.base + micros) / 1e6, delta, module, name, text))
+        sys.stdout.flush()
+
+
+def main():
+    args = handle_args()
+    events = load_events(args.headers)
+    decoder = Decoder(events)
+
+    if args.serial:
+        import serial
+        port = serial.Serial(args.serial, args.baud)
+        while True:
+            decoder.feed(port.read(max(1, port.in_waiting)))
+    else:
+        with open(args.input, "rb") as f:
+            while True:
+                data = f.read(4096)
+                if not data:
+                    break
+                decoder.feed(data)
+
+
+if __name__ == "__main__":
+    main()
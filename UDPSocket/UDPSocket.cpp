@@ -0,0 +1,371 @@
+/*
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2018
+ */
+
+#include <WiFi.h>
+#include <WiFiUdp.h>
+#if defined(TCPSOCKET_HOST)
+  #include <poll.h>
+#endif
+
+#ifdef DEBUG_LEVEL_UDPSOCKET
+  #define DEBUG_LEVEL DEBUG_LEVEL_UDPSOCKET
+#endif
+#ifndef DEBUG_LEVEL
+  #define DEBUG_LEVEL DEBUG_HIGH
+#endif
+#include <Debug.h>
+
+#include <Socket.h>
+#include "UDPSocket.h"
+
+UDPSocket::UDPSocket() {
+  recvBuffer = nullptr;
+  started = false;
+}
+
+UDPSocket::~UDPSocket() {
+  udp.stop();
+  free(recvBuffer);
+}
+
+UDPSocket::UDPSocket(socket_addr_t _address,
+                     uint16_t _port,
+                     uint16_t _recvBufferSize) {
+  recvBuffer = nullptr;
+  init(_address, _port, _recvBufferSize);
+}
+
+/**
+ * Allocate the receive buffer, the socket is opened by setup()
+ */
+void UDPSocket::init(socket_addr_t _address,
+                     uint16_t _port,
+                     uint16_t _recvBufferSize) {
+  sourceAddress = _address;
+  port = _port;
+  currentMsgID = 0;
+  lastRecvSize = 0;
+  started = false;
+
+  free(recvBuffer);
+  recvBufferSize = _recvBufferSize;
+  recvBuffer = (uint8_t *)malloc(recvBufferSize);
+
+  broadcastIP = IPAddress(255, 255, 255, 255);
+  multicast = false;
+  dropStale = false;
+
+  for (byte i = 0; i < UDPSOCKET_MAX_PEERS; i++) {
+    peers[i].address = SOCKET_ADDR_INVALID;
+  }
+  nextPeer = 0;
+
+  DEBUG3_VALUE("UDPS: Using ", WiFi.localIP().toString());
+  DEBUG3_VALUELN(":", port);
+}
+
+void UDPSocket::setup() {
+  if (multicast) {
+    started = udp.beginMulticast(multicastIP, port);
+  } else {
+    started = udp.begin(port);
+  }
+  if (!started) {
+    DEBUG_ERR("UDPS: Failed to open socket");
+  }
+}
+
+boolean UDPSocket::initialized() {
+  return (recvBuffer != nullptr);
+}
+
+/**
+ * Setup the send buffer, which takes an input buffer and sets the buffer
+ * for data to allow for the initial packet header.  As with TCPSocket, the
+ * Socket API's send_data_size is limited to 255 for larger buffers.
+ *
+ * @return The data portion of the buffer, nullptr if the buffer is too small
+ *         for a header
+ */
+byte *UDPSocket::initBuffer(byte *data, uint16_t data_size) {
+  if (data_size < sizeof (udp_socket_hdr_t)) {
+    DEBUG_ERR("UDPS: Send buf smaller than hdr");
+    send_data_size = 0;
+    send_buffer = nullptr;
+    return nullptr;
+  }
+
+  uint16_t size = UDP_DATA_LENGTH(data_size);
+  send_data_size = (size > 0xFF) ? 0xFF : size;
+  send_buffer = data + sizeof (udp_socket_hdr_t);
+  return send_buffer;
+}
+
+#if defined(TCPSOCKET_HOST)
+/**
+ * Wait for a datagram to be received
+ *
+ * @param timeoutMs Maximum time to wait, -1 to wait indefinitely
+ * @return true if there may be data to receive
+ */
+bool UDPSocket::wait(int timeoutMs) {
+  struct pollfd pfd;
+  pfd.fd = udp.fd();
+  pfd.events = POLLIN;
+  return poll(&pfd, 1, timeoutMs) > 0;
+}
+#endif
+
+/**
+ * Send messages for an address directly to a node.  Other addresses may still
+ * be learned from messages received from the node.
+ *
+ * @return false if every peer entry is set
+ */
+bool UDPSocket::setPeer(socket_addr_t address, IPAddress ip,
+                        uint16_t peerPort) {
+  udp_socket_peer_t *peer = learnPeer(address);
+  if (peer == nullptr) {
+    DEBUG_ERR("UDPS: Too many peers");
+    return false;
+  }
+  peer->ip = ip;
+  peer->port = peerPort;
+  peer->fixed = true;
+  return true;
+}
+
+/**
+ * Join a multicast group, to which messages without a known destination are
+ * then sent.
+ *
+ * @return false if the socket was open and could not be reopened
+ */
+bool UDPSocket::setMulticast(IPAddress group) {
+  multicastIP = group;
+  multicast = true;
+  if (started) {
+    /* Reopen the socket to join the group */
+    udp.stop();
+    setup();
+    return started;
+  }
+  return true;
+}
+
+/**
+ * Find the peer entry for an address
+ */
+udp_socket_peer_t *UDPSocket::findPeer(socket_addr_t address) {
+  for (byte i = 0; i < UDPSOCKET_MAX_PEERS; i++) {
+    if (peers[i].address == address) {
+      return &peers[i];
+    }
+  }
+  return nullptr;
+}
+
+/**
+ * Find or create the peer entry for an address, replacing a learned entry if
+ * the table is full.
+ *
+ * @return nullptr if every entry was set by setPeer()
+ */
+udp_socket_peer_t *UDPSocket::learnPeer(socket_addr_t address) {
+  udp_socket_peer_t *peer = findPeer(address);
+  if (peer != nullptr) {
+    return peer;
+  }
+
+  peer = findPeer(SOCKET_ADDR_INVALID);
+  if (peer == nullptr) {
+    for (byte i = 0; i < UDPSOCKET_MAX_PEERS; i++) {
+      byte index = nextPeer;
+      nextPeer = (nextPeer + 1) % UDPSOCKET_MAX_PEERS;
+      if (!peers[index].fixed) {
+        peer = &peers[index];
+        break;
+      }
+    }
+    if (peer == nullptr) {
+      return nullptr;
+    }
+  }
+
+  peer->address = address;
+  peer->fixed = false;
+  peer->received = false;
+  return peer;
+}
+
+void UDPSocket::sendMsgTo(socket_addr_t address,
+                          const byte *data,
+                          const byte datalength) {
+  sendMsg(address, data, datalength);
+}
+
+/**
+ * Send a message as a single datagram.  As with TCPSocket the message data
+ * must be preceded by space for the header, as setup by initBuffer().
+ *
+ * @return UDPSOCKET_SEND_OK if the message was sent, otherwise an error
+ */
+int UDPSocket::sendMsg(socket_addr_t address,
+                       const byte *data,
+                       uint16_t datalength) {
+  if (!started) {
+    DEBUG3_PRINTLN("UDPS: send without socket");
+    return UDPSOCKET_SEND_ERROR;
+  }
+  if (datalength > UDPSOCKET_MAX_DATA) {
+    DEBUG3_VALUELN("UDPS: msg > datagram ", datalength);
+    return UDPSOCKET_SEND_ERROR;
+  }
+
+  udp_socket_hdr_t *hdr =
+    (udp_socket_hdr_t *)(data - sizeof (udp_socket_hdr_t));
+  hdr->start = UDPSOCKET_START;
+  hdr->version = UDPSOCKET_VERSION;
+  hdr->ID = currentMsgID++;
+  hdr->flags = 0;
+  hdr->reserved = 0;
+  hdr->length = datalength;
+  hdr->source = sourceAddress;
+  hdr->address = address;
+
+  IPAddress ip = multicast ? multicastIP : broadcastIP;
+  uint16_t dest_port = port;
+  if (address != SOCKET_ADDR_ANY) {
+    udp_socket_peer_t *peer = findPeer(address);
+    if (peer != nullptr) {
+      ip = peer->ip;
+      dest_port = peer->port;
+    }
+  }
+
+  DEBUG5_VALUE("UDPS: Sending ", datalength);
+  DEBUG5_VALUE(" to ", ip.toString());
+  DEBUG5_VALUELN(":", dest_port);
+
+  uint16_t msg_len = sizeof (udp_socket_hdr_t) + datalength;
+  if (!udp.beginPacket(ip, dest_port) ||
+      (udp.write((const uint8_t *)hdr, msg_len) != msg_len) ||
+      !udp.endPacket()) {
+    DEBUG3_PRINTLN("UDPS: send failed");
+    return UDPSOCKET_SEND_ERROR;
+  }
+
+  return UDPSOCKET_SEND_OK;
+}
+
+/**
+ * Check that a datagram holds a single complete message
+ */
+bool UDPSocket::validateHeader(const udp_socket_hdr_t *hdr, int size) {
+  return (size >= (int)sizeof (udp_socket_hdr_t)) &&
+         (hdr->start == UDPSOCKET_START) &&
+         (hdr->version == UDPSOCKET_VERSION) &&
+         ((int)hdr->length == size - (int)sizeof (udp_socket_hdr_t));
+}
+
+/**
+ * A message is stale if its ID is not newer than the last from its sender, but
+ * is close enough that the sender is unlikely to have restarted.
+ */
+bool UDPSocket::isStale(byte lastID, byte ID) {
+  byte behind = lastID - ID;
+  return behind < UDPSOCKET_STALE_WINDOW;
+}
+
+const byte *UDPSocket::getMsg(unsigned int *retlen) {
+  return getMsg(sourceAddress, retlen);
+}
+
+/**
+ * Receive the next available message for an address
+ *
+ * @param address Socket address (not IP) to accept data for
+ * @param retlen  Data size returned
+ * @return        Pointer to the data portion of the message
+ */
+const byte *UDPSocket::getMsg(socket_addr_t address, unsigned int *retlen) {
+  *retlen = 0;
+  if (!started) {
+    return nullptr;
+  }
+
+  int size;
+  while ((size = udp.parsePacket()) > 0) {
+    if (size > recvBufferSize) {
+      DEBUG4_VALUELN("UDPS: datagram > buf sz ", size);
+      udp.flush();
+      continue;
+    }
+
+    size = udp.read(recvBuffer, size);
+    udp_socket_hdr_t *hdr = (udp_socket_hdr_t *)recvBuffer;
+    if (!validateHeader(hdr, size)) {
+      DEBUG4_VALUELN("UDPS: Recv invalid datagram ", size);
+      continue;
+    }
+
+    if (hdr->source == sourceAddress) {
+      /* Our own broadcast or multicast message */
+      continue;
+    }
+
+    /* Remember where the sender is for replies */
+    udp_socket_peer_t *peer = learnPeer(hdr->source);
+    if (peer != nullptr) {
+      if (!peer->fixed) {
+        peer->ip = udp.remoteIP();
+        peer->port = udp.remotePort();
+      }
+      if (dropStale && peer->received && isStale(peer->lastID, hdr->ID)) {
+        DEBUG5_VALUE("UDPS: Stale msg ", hdr->ID);
+        DEBUG5_VALUELN(" last ", peer->lastID);
+        continue;
+      }
+      peer->lastID = hdr->ID;
+      peer->received = true;
+    }
+
+    if (!SOCKET_ADDRESS_MATCH(address, hdr->address)) {
+      DEBUG5_VALUE("UDPS: address mismatch: ", address);
+      DEBUG5_VALUELN("!=", hdr->address);
+      continue;
+    }
+
+    DEBUG5_VALUE("UDPS: data len=", hdr->length);
+    DEBUG5_COMMAND(
+            print_hex_buffer((const char *)recvBuffer +
+                             sizeof (udp_socket_hdr_t), hdr->length);
+    );
+    DEBUG_ENDLN();
+
+    lastRecvSize = hdr->length;
+    *retlen = hdr->length;
+    return recvBuffer + sizeof (udp_socket_hdr_t);
+  }
+
+  return nullptr;
+}
+
+byte UDPSocket::getLength() {
+  return lastRecvSize;
+}
+
+void *UDPSocket::headerFromData(const void *data) {
+  return ((udp_socket_hdr_t *)((uint8_t *)data - sizeof (udp_socket_hdr_t)));
+}
+
+socket_addr_t UDPSocket::sourceFromData(void *data) {
+  return ((udp_socket_hdr_t *)headerFromData(data))->source;
+}
+
+socket_addr_t UDPSocket::destFromData(void *data) {
+  return ((udp_socket_hdr_t *)headerFromData(data))->address;
+}
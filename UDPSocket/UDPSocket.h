@@ -0,0 +1,157 @@
+/*
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2018
+ *
+ * This class provides a Socket API wrapper for UDP, as TCPSocket does for TCP.
+ * (See https://github.com/AMPWorks/ArduinoLibs/blob/master/Socket/Socket.h)
+ *
+ * Each message is a single datagram, so a lost message never delays those
+ * after it.  Messages can be sent to a single node, broadcast, or sent to a
+ * multicast group, and messages older than one already received from the same
+ * sender can optionally be dropped so that only the freshest data is used.
+ */
+
+#ifndef UDPSOCKET_H
+#define UDPSOCKET_H
+
+#include <WiFiUdp.h>
+
+#include "Socket.h"
+
+/*
+ * The header has the same layout as a TCPSocket version 2 header, with the
+ * addresses ending it so that sourceFromData() and destFromData() only need
+ * the message data.
+ */
+#define UDPSOCKET_START (uint32_t)0x55445053 // "UDPS"
+#define UDPSOCKET_VERSION 1
+typedef struct __attribute__((__packed__)) {
+  uint32_t      start;       // 4B
+  byte          version;     // 1B
+  byte          ID;          // 1B
+  byte          flags;       // 1B
+  byte          reserved;    // 1B
+  uint16_t      length;      // 2B
+  socket_addr_t source;      // 2B
+  socket_addr_t address;     // 2B
+} udp_socket_hdr_t;  // Total: 14B
+
+/*
+ * Calculate the total buffer size with a useable buffer of size x, leaving room
+ * for the header.
+ */
+#define UDP_BUFFER_TOTAL(x) (uint16_t)(x + sizeof (udp_socket_hdr_t))
+#define UDP_DATA_LENGTH(x) (uint16_t)(x - sizeof (udp_socket_hdr_t))
+
+#define UDPSOCKET_PORT 4082
+
+/* Largest message that fits a datagram without IP fragmentation */
+#define UDPSOCKET_MAX_DATA UDP_DATA_LENGTH(1472)
+
+/* Results of sendMsg() */
+#define UDPSOCKET_SEND_OK    0
+#define UDPSOCKET_SEND_ERROR 3
+
+/* Number of remote addresses whose IP address and last message are tracked */
+#ifndef UDPSOCKET_MAX_PEERS
+  #define UDPSOCKET_MAX_PEERS 8
+#endif
+
+/*
+ * When dropping stale messages, a message whose ID is less than this far behind
+ * the last one from its sender is dropped.  Messages further behind are taken
+ * to be from a sender that has restarted.
+ */
+#ifndef UDPSOCKET_STALE_WINDOW
+  #define UDPSOCKET_STALE_WINDOW 32
+#endif
+
+/* Remote address and the most recent message received from it */
+typedef struct {
+  socket_addr_t address;   // SOCKET_ADDR_INVALID if the entry is unused
+  IPAddress     ip;
+  uint16_t      port;
+  bool          fixed;     // Set by setPeer() rather than learned
+  bool          received;  // lastID is valid
+  byte          lastID;
+} udp_socket_peer_t;
+
+class UDPSocket : public Socket {
+
+public:
+
+  /* UDP specific functions */
+  UDPSocket();
+  ~UDPSocket();
+  UDPSocket(socket_addr_t _address,
+            uint16_t _port = UDPSOCKET_PORT,
+            uint16_t _recvBufferSize = DEFAULT_RECEIVE_BUFFER);
+  void init(socket_addr_t _address,
+            uint16_t _port = UDPSOCKET_PORT,
+            uint16_t _recvBufferSize = DEFAULT_RECEIVE_BUFFER);
+
+  /*
+   * Implement functions from Socket.h
+   */
+  void setup();
+  boolean initialized();
+  byte * initBuffer(byte * data, uint16_t data_size);
+
+  void sendMsgTo(uint16_t address, const byte * data, const byte length);
+  int sendMsg(socket_addr_t address, const byte *data, uint16_t length);
+
+  const byte *getMsg(unsigned int *retlen);
+  const byte *getMsg(uint16_t address, unsigned int *retlen);
+
+  byte getLength();
+  void *headerFromData(const void *data);
+  socket_addr_t sourceFromData(void *data);
+  socket_addr_t destFromData(void *data);
+
+  /*
+   * Destinations.  Messages to an address are sent directly to the node it
+   * was last received from or that was set with setPeer(), and all others are
+   * sent to the multicast group if one is set, or are otherwise broadcast.
+   */
+  bool setPeer(socket_addr_t address, IPAddress ip,
+               uint16_t peerPort = UDPSOCKET_PORT);
+  void setBroadcast(IPAddress ip) { broadcastIP = ip; }
+  bool setMulticast(IPAddress group);
+
+  /* Drop messages older than one already received from the same sender */
+  void setDropStale(bool enable) { dropStale = enable; }
+
+#if defined(TCPSOCKET_HOST)
+  /* Sleep until a datagram is received */
+  bool wait(int timeoutMs);
+#endif
+
+  static bool validateHeader(const udp_socket_hdr_t *hdr, int size);
+  static bool isStale(byte lastID, byte ID);
+
+  static const uint16_t DEFAULT_RECEIVE_BUFFER = UDP_BUFFER_TOTAL(512);
+
+private:
+  WiFiUDP udp;
+  bool started;
+  uint16_t port;
+  byte currentMsgID;
+
+  uint8_t *recvBuffer;
+  uint16_t recvBufferSize;
+  uint16_t lastRecvSize;
+
+  IPAddress broadcastIP;
+  IPAddress multicastIP;
+  bool multicast;
+  bool dropStale;
+
+  udp_socket_peer_t peers[UDPSOCKET_MAX_PEERS];
+  byte nextPeer; // Learned entry to replace when the table is full
+
+  udp_socket_peer_t *findPeer(socket_addr_t address);
+  udp_socket_peer_t *learnPeer(socket_addr_t address);
+};
+
+#endif // UDPSOCKET_H
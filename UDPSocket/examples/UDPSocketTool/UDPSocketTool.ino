@@ -0,0 +1,107 @@
+/*
+ * Example of a minimal UDPSocket node, broadcasting a message periodically and
+ * printing those received from other nodes
+ *
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2018
+ */
+
+#ifdef DEBUG_LEVEL_UDPSOCKETTOOL
+  #define DEBUG_LEVEL DEBUG_LEVEL_UDPSOCKETTOOL
+#endif
+#ifndef DEBUG_LEVEL
+  #define DEBUG_LEVEL DEBUG_HIGH
+#endif
+#include "Debug.h"
+
+#include <UDPSocket.h>
+#include <WiFiBase.h>
+
+#ifndef USE_PASSWD
+  #define USE_PASSWD ""
+#endif
+#ifndef CONFIG_SSID
+  #define CONFIG_SSID "Esp32_WiFiBase"
+#endif
+#ifndef CONFIG_PASSWD
+  #define CONFIG_PASSWD "12345678"
+#endif
+
+#ifndef ADDRESS
+  #define ADDRESS 128
+#endif
+#ifndef PORT
+  #define PORT UDPSOCKET_PORT
+#endif
+
+#define DATA_SIZE 64
+#define SEND_BUFFER_SIZE UDP_BUFFER_TOTAL(DATA_SIZE)
+byte databuffer[SEND_BUFFER_SIZE];
+byte *send_buffer;
+
+WiFiBase *wfb;
+
+UDPSocket udpSocket;
+
+void setup() {
+  Serial.begin(115200);
+
+  /* Use WiFiBase to connect to a network */
+  wfb = new WiFiBase(true);
+#ifdef USE_SSID
+  wfb->addKnownNetwork(USE_SSID, USE_PASSWD);
+#endif
+  wfb->configureAccessPoint(CONFIG_SSID, CONFIG_PASSWD);
+#ifdef CONFIG_PORTAL
+  /* The the WiFiBase to generate an access point hosting a config portal */
+  wfb->useConfigPortal(true);
+#endif
+  while (!wfb->startup()) {
+    delay(100);
+  }
+
+  DEBUG1_VALUELN("Using port ", PORT);
+  udpSocket.init(ADDRESS, PORT);
+  send_buffer = udpSocket.initBuffer(databuffer, SEND_BUFFER_SIZE);
+#ifdef MULTICAST_GROUP
+  /* Send to a multicast group rather than broadcasting, eg 239,0,0,1 */
+  udpSocket.setMulticast(IPAddress(MULTICAST_GROUP));
+#endif
+  /* Only use the most recent message from each node */
+  udpSocket.setDropStale(true);
+  udpSocket.setup();
+
+  DEBUG1_PRINTLN("*** UDPSocketTool initialized ***")
+}
+
+#define SEND_PERIOD 1000
+unsigned long last_send_ms = 0;
+byte count = 0;
+
+void loop() {
+  unsigned long now = millis();
+
+  if (now - SEND_PERIOD >= last_send_ms) {
+    send_buffer[0] = 'U';
+    send_buffer[1] = count++;
+    DEBUG1_VALUELN("* Sending ", count);
+
+    udpSocket.sendMsgTo(SOCKET_ADDR_ANY, send_buffer, 2);
+
+    last_send_ms = now;
+  }
+
+  /* Handle every message that has arrived */
+  const byte *data;
+  unsigned int length;
+  while ((data = udpSocket.getMsg(SOCKET_ADDR_ANY, &length)) != NULL) {
+    DEBUG1_VALUE("* Received data ", length);
+    DEBUG1_VALUE(" from ", udpSocket.sourceFromData((void *)data));
+    DEBUG1_PRINT(": ");
+    print_hex_buffer((char *)data, length);
+    DEBUG_PRINT_END();
+  }
+
+  delay(10);
+}
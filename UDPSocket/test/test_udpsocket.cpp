@@ -0,0 +1,94 @@
+/**
+ * Unit testing of UDPSocket's message validation
+ *
+ * To run tests with platformio:
+ *   platformio test
+ */
+
+#include <Arduino.h>
+#include <unity.h>
+
+#include "../UDPSocket.h"
+
+static void fill_header(udp_socket_hdr_t *hdr, uint16_t length) {
+  hdr->start = UDPSOCKET_START;
+  hdr->version = UDPSOCKET_VERSION;
+  hdr->ID = 0;
+  hdr->flags = 0;
+  hdr->reserved = 0;
+  hdr->length = length;
+  hdr->source = 1;
+  hdr->address = 2;
+}
+
+/* A datagram must hold exactly one complete message */
+void test_validate_header(void) {
+  uint8_t buffer[UDP_BUFFER_TOTAL(16)];
+  udp_socket_hdr_t *hdr = (udp_socket_hdr_t *)buffer;
+
+  fill_header(hdr, 16);
+  TEST_ASSERT_TRUE(UDPSocket::validateHeader(hdr, sizeof (buffer)));
+
+  /* Truncated or padded datagrams */
+  TEST_ASSERT_FALSE(UDPSocket::validateHeader(hdr, sizeof (buffer) - 1));
+  TEST_ASSERT_FALSE(UDPSocket::validateHeader(hdr, sizeof (buffer) + 1));
+  TEST_ASSERT_FALSE(UDPSocket::validateHeader(hdr,
+                                              sizeof (udp_socket_hdr_t) - 1));
+
+  /* Empty messages are valid */
+  fill_header(hdr, 0);
+  TEST_ASSERT_TRUE(UDPSocket::validateHeader(hdr,
+                                             sizeof (udp_socket_hdr_t)));
+
+  fill_header(hdr, 16);
+  hdr->start = 0x54435053;
+  TEST_ASSERT_FALSE(UDPSocket::validateHeader(hdr, sizeof (buffer)));
+
+  fill_header(hdr, 16);
+  hdr->version = UDPSOCKET_VERSION + 1;
+  TEST_ASSERT_FALSE(UDPSocket::validateHeader(hdr, sizeof (buffer)));
+}
+
+/* Messages not newer than the last are stale, unless far enough behind */
+void test_stale(void) {
+  TEST_ASSERT_TRUE(UDPSocket::isStale(10, 10));
+  TEST_ASSERT_TRUE(UDPSocket::isStale(10, 9));
+  TEST_ASSERT_FALSE(UDPSocket::isStale(10, 11));
+
+  /* Wrapping of the message ID */
+  TEST_ASSERT_FALSE(UDPSocket::isStale(255, 0));
+  TEST_ASSERT_TRUE(UDPSocket::isStale(0, 255));
+
+  /* A sender that has restarted */
+  TEST_ASSERT_TRUE(UDPSocket::isStale(100, 100 - UDPSOCKET_STALE_WINDOW + 1));
+  TEST_ASSERT_FALSE(UDPSocket::isStale(100, 100 - UDPSOCKET_STALE_WINDOW));
+}
+
+/* Buffer sizes beyond what send_data_size can hold are limited, not truncated */
+void test_init_buffer(void) {
+  static byte buffer[UDP_BUFFER_TOTAL(1024)];
+  UDPSocket socket;
+
+  TEST_ASSERT_EQUAL_PTR(buffer + sizeof (udp_socket_hdr_t),
+                        socket.initBuffer(buffer, UDP_BUFFER_TOTAL(16)));
+  TEST_ASSERT_EQUAL(16, socket.send_data_size);
+
+  TEST_ASSERT_EQUAL_PTR(buffer + sizeof (udp_socket_hdr_t),
+                        socket.initBuffer(buffer, sizeof (buffer)));
+  TEST_ASSERT_EQUAL(255, socket.send_data_size);
+
+  TEST_ASSERT_NULL(socket.initBuffer(buffer, sizeof (udp_socket_hdr_t) - 1));
+}
+
+void setup() {
+  UNITY_BEGIN();
+
+  RUN_TEST(test_validate_header);
+  RUN_TEST(test_stale);
+  RUN_TEST(test_init_buffer);
+  UNITY_END();
+}
+
+void loop() {
+  UNITY_END(); // stop unit testing
+}
@@ -305,14 +305,17 @@ bool WiFiBase::_connectWait() {
     status = WiFi.status();
     if (status == WL_CONNECTED) {
       DEBUG4_PRINTLN("WFB: connect succeeded");
+      TRACELOG(WFB_TRACE_CONNECTED, 0, millis() - start);
       return true;
     }
     if (status == WL_CONNECT_FAILED) {
       DEBUG4_VALUELN("WFB: connect failed ", status);
+      TRACELOG(WFB_TRACE_CONNECT_FAILED, status, millis() - start);
       return false;
     }
     if (millis() - start > _connectionTimeoutMs) {
       DEBUG4_PRINTLN("WFB: connect timeout")
+      TRACELOG(WFB_TRACE_CONNECT_TIMEOUT, 0, millis() - start);
       esp_wifi_disconnect();
       return false;
     }
@@ -354,6 +357,7 @@ bool WiFiBase::_connectToNetwork() {
     if (_knownNetworks[index].ssid[index] == '\0') {
       /* This indicates to try the ssid stored via the Esp SDK */
       DEBUG3_PRINTLN("WFB: attempting stored network");
+      TRACELOG(WFB_TRACE_CONNECT, index, 0);
       WiFi.begin();
       if (_connectWait()) {
         _setConnected(index);
@@ -366,6 +370,7 @@ bool WiFiBase::_connectToNetwork() {
     /* Iterate over remaining networks and attempt connections */
     for (; index < _numKnownNetworks; index++) {
       DEBUG3_VALUELN("WFB: Connect ", _knownNetworks[index].ssid);
+      TRACELOG(WFB_TRACE_CONNECT, index, 0);
       WiFi.begin(_knownNetworks[index].ssid, _knownNetworks[index].passwd);
       if (_connectWait()) {
         _setConnected(index);
@@ -414,6 +419,7 @@ bool WiFiBase::_startupConfigPortal() {
   }
 
   _setConnected(index);
+  TRACELOG(WFB_TRACE_PORTAL, index, 0);
 
   return true;
 }
@@ -428,6 +434,7 @@ bool WiFiBase::_startupAccessPoint() {
 
     WiFi.softAP(_APSsid, _APPasswd);
     DEBUG3_VALUELN("WFB: AP IP:", WiFi.softAPIP());
+    TRACELOG(WFB_TRACE_ACCESS_POINT, 0, 0);
 
     _accessPointActive = true;
   }
@@ -30,6 +30,18 @@
 
 #include <WiFiManager.h>
 
+#include "TraceLog.h"
+
+/* Trace events, see TraceLog.h */
+#define WFB_TRACE_CONNECT        TRACE_ID(TRACE_MODULE_WIFIBASE, 1) // "connecting to network {a}"
+#define WFB_TRACE_CONNECTED      TRACE_ID(TRACE_MODULE_WIFIBASE, 2) // "connected after {b} ms"
+#define WFB_TRACE_CONNECT_FAILED TRACE_ID(TRACE_MODULE_WIFIBASE, 3) // "connect failed status:{a} after {b} ms"
+#define WFB_TRACE_CONNECT_TIMEOUT TRACE_ID(TRACE_MODULE_WIFIBASE, 4) // "connect timed out after {b} ms"
+#define WFB_TRACE_PORTAL         TRACE_ID(TRACE_MODULE_WIFIBASE, 5) // "config portal connected to network {a}"
+#define WFB_TRACE_ACCESS_POINT   TRACE_ID(TRACE_MODULE_WIFIBASE, 6) // "access point started"
+#define WFB_TRACE_NETWORK        TRACE_ID(TRACE_MODULE_WIFIBASE, 7) // "/network result:{a} took {b} ms"
+#define WFB_TRACE_SCAN           TRACE_ID(TRACE_MODULE_WIFIBASE, 8) // "scan found {a} networks in {b} ms"
+
 struct network {
   char *ssid;
   char *passwd;
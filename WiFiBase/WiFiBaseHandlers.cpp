@@ -136,6 +136,7 @@ void WiFiBase::_handleNetwork() {
     response += "false";
   }
   elapsed = millis() - elapsed;
+  TRACELOG(WFB_TRACE_NETWORK, result, elapsed);
   response += ",\"ssid\":\"";
   response += ssid;
   response += "\",\"local_IP\":\"";
@@ -157,6 +158,7 @@ void WiFiBase::_handleScan() {
   int networks = WiFi.scanNetworks();
 
   DEBUG4_VALUELN("WFB: /scan elapsed ", millis() - start);
+  TRACELOG(WFB_TRACE_SCAN, networks, millis() - start);
 
   String response = "{\"count\":";
   response += networks;